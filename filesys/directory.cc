@@ -11,9 +11,10 @@
 //	we use ReadFrom/WriteBack to fetch the contents of the directory
 //	from disk, and to write back any modifications back to disk.
 //
-//	Also, this implementation has the restriction that the size
-//	of the directory cannot expand.  In other words, once all the
-//	entries in the directory are used, no more files can be created.
+//	MP4: the table is an open-addressed hash table keyed by file
+//	name, with linear probing, so lookups do not scan the whole
+//	directory.  When it gets 3/4 full it doubles in size; the file
+//	system then grows the directory file to match (see FileSize).
 //
 // Copyright (c) 1992-1993 The Regents of the University of California.
 // All rights reserved.  See copyright.h for copyright notice and limitation
@@ -25,6 +26,8 @@
 #include "filehdr.h"
 #include "utility.h"
 
+#include <stdarg.h>  // MP4: Listing::Printf
+
 //----------------------------------------------------------------------
 // Directory::Directory
 // 	Initialize a directory; initially, the directory is completely
@@ -44,6 +47,11 @@ Directory::Directory(int size) {
     tableSize = size;
     for (int i = 0; i < tableSize; i++)
         table[i].inUse = FALSE;
+    // MP4 start
+    numInUse = 0;
+    onDisk = NULL;
+    onDiskSize = 0;
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -53,6 +61,7 @@ Directory::Directory(int size) {
 
 Directory::~Directory() {
     delete[] table;
+    delete[] onDisk;  // MP4
 }
 
 //----------------------------------------------------------------------
@@ -63,20 +72,61 @@ Directory::~Directory() {
 //----------------------------------------------------------------------
 
 void Directory::FetchFrom(OpenFile *file) {
+    // MP4: the directory may have grown; size the table to the file
+    int size = file->Length() / sizeof(DirectoryEntry);
+
+    if (size != tableSize) {
+        delete[] table;
+        tableSize = size;
+        table = new DirectoryEntry[tableSize];
+    }
     (void)file->ReadAt((char *)table, tableSize * sizeof(DirectoryEntry), 0);
+    numInUse = 0;
+    for (int i = 0; i < tableSize; i++)
+        if (table[i].inUse)
+            numInUse++;
+    SaveOnDisk();
 }
 
 //----------------------------------------------------------------------
 // Directory::WriteBack
 // 	Write any modifications to the directory back to disk
 //
+//	MP4: if we know what is on disk, only the sectors holding changed
+//	entries are written -- normally the one that was added or removed.
+//
 //	"file" -- file to contain the new directory contents
 //----------------------------------------------------------------------
 
 void Directory::WriteBack(OpenFile *file) {
+    // MP4 start
+    if (onDisk != NULL && onDiskSize == tableSize) {
+        (void)file->WriteChanged((char *)table, (char *)onDisk,
+                                 tableSize * sizeof(DirectoryEntry), 0);
+        return;
+    }
     (void)file->WriteAt((char *)table, tableSize * sizeof(DirectoryEntry), 0);
+    SaveOnDisk();
+    // MP4 end
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Directory::SaveOnDisk
+// 	Remember the current table as the contents of the directory file,
+//	for WriteBack to compare against.
+//----------------------------------------------------------------------
+
+void Directory::SaveOnDisk() {
+    if (onDiskSize != tableSize) {
+        delete[] onDisk;
+        onDiskSize = tableSize;
+        onDisk = new DirectoryEntry[onDiskSize];
+    }
+    memcpy(onDisk, table, tableSize * sizeof(DirectoryEntry));
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Directory::FindIndex
 // 	Look up file name in directory, and return its location in the table of
@@ -86,12 +136,98 @@ void Directory::WriteBack(OpenFile *file) {
 //----------------------------------------------------------------------
 
 int Directory::FindIndex(char *name) {
-    for (int i = 0; i < tableSize; i++)
-        if (table[i].inUse && !strncmp(table[i].name, name, FileNameMaxLen))
+    // MP4: probe from the name's home slot up to the first free slot
+    for (int n = 0, i = Hash(name); n < tableSize; n++, i = (i + 1) % tableSize) {
+        if (!table[i].inUse)
+            break;
+        if (!strncmp(table[i].name, name, FileNameMaxLen))
             return i;
+    }
     return -1;  // name not in directory
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// HashName
+// 	Hash the part of a file name that is significant in a directory
+//	(the first FileNameMaxLen characters).
+//----------------------------------------------------------------------
+
+static unsigned int HashName(char *name) {
+    unsigned int h = 0;
+
+    for (int i = 0; i < FileNameMaxLen && name[i] != '\0'; i++)
+        h = h * 31 + (unsigned char)name[i];
+    return h;
+}
+
+//----------------------------------------------------------------------
+// Directory::Hash
+// 	Return the home slot of "name" in the table.
+//----------------------------------------------------------------------
+
+int Directory::Hash(char *name) {
+    return HashName(name) % tableSize;
+}
+
+//----------------------------------------------------------------------
+// Directory::Grow
+// 	Double the size of the table, rehashing every entry into it.
+//----------------------------------------------------------------------
+
+void Directory::Grow() {
+    DirectoryEntry *oldTable = table;
+    int oldSize = tableSize;
+
+    tableSize = oldSize * 2;
+    table = new DirectoryEntry[tableSize];
+    memset(table, 0, sizeof(DirectoryEntry) * tableSize);
+    for (int i = 0; i < oldSize; i++) {
+        if (oldTable[i].inUse) {
+            int j = Hash(oldTable[i].name);
+            while (table[j].inUse)
+                j = (j + 1) % tableSize;
+            table[j] = oldTable[i];
+        }
+    }
+    delete[] oldTable;
+}
+
+//----------------------------------------------------------------------
+// Directory::AddEntry
+// 	Put a new name in the table, growing it first if it would become
+//	more than 3/4 full.  Return FALSE if the name is already there.
+//----------------------------------------------------------------------
+
+bool Directory::AddEntry(char *name, int newSector, bool isDir) {
+    int i;
+
+    if (FindIndex(name) != -1)
+        return FALSE;
+    if ((numInUse + 1) * 4 > tableSize * 3)
+        Grow();
+
+    for (i = Hash(name); table[i].inUse; i = (i + 1) % tableSize)
+        ;
+    table[i].inUse = TRUE;
+    table[i].isDir = isDir;
+    strncpy(table[i].name, name, FileNameMaxLen);
+    table[i].sector = newSector;
+    numInUse++;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// Directory::FileSize
+// 	Return how many bytes the directory occupies on disk; the
+//	directory file must be at least this long before WriteBack.
+//----------------------------------------------------------------------
+
+int Directory::FileSize() {
+    return tableSize * sizeof(DirectoryEntry);
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Directory::Find
 // 	Look up file name in directory, and return the disk sector number
@@ -120,43 +256,19 @@ bool Directory::IsDir(char *name) {
 //----------------------------------------------------------------------
 // Directory::Add
 // 	Add a file into the directory.  Return TRUE if successful;
-//	return FALSE if the file name is already in the directory, or if
-//	the directory is completely full, and has no more space for
-//	additional file names.
+//	return FALSE if the file name is already in the directory.
 //
 //	"name" -- the name of the file being added
 //	"newSector" -- the disk sector containing the added file's header
 //----------------------------------------------------------------------
 
 bool Directory::Add(char *name, int newSector) {
-    if (FindIndex(name) != -1)
-        return FALSE;
-
-    for (int i = 0; i < tableSize; i++)
-        if (!table[i].inUse) {
-            table[i].inUse = TRUE;
-            table[i].isDir = FALSE;
-            strncpy(table[i].name, name, FileNameMaxLen);
-            table[i].sector = newSector;
-            return TRUE;
-        }
-    return FALSE;  // no space.  Fix when we have extensible files.
+    return AddEntry(name, newSector, FALSE);  // MP4: the table grows as needed
 }
 
 // MP4 start
 bool Directory::AddDirectory(char *name, int newSector) {
-    if (FindIndex(name) != -1)
-        return FALSE;
-
-    for (int i = 0; i < tableSize; i++)
-        if (!table[i].inUse) {
-            table[i].inUse = TRUE;
-            table[i].isDir = TRUE;
-            strncpy(table[i].name, name, FileNameMaxLen);
-            table[i].sector = newSector;
-            return TRUE;
-        }
-    return FALSE;
+    return AddEntry(name, newSector, TRUE);
 }
 // MP4 end
 
@@ -174,14 +286,106 @@ bool Directory::Remove(char *name) {
     if (i == -1)
         return FALSE;  // name not in directory
     table[i].inUse = FALSE;
+    numInUse--;
+
+    // MP4: close the hole, so later probes do not stop short: move
+    // back each following entry whose home slot is not between the
+    // hole and where the entry sits now
+    for (int j = (i + 1) % tableSize; table[j].inUse; j = (j + 1) % tableSize) {
+        int k = Hash(table[j].name);
+        bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            table[i] = table[j];
+            table[j].inUse = FALSE;
+            i = j;
+        }
+    }
     return TRUE;
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Directory::LockTree
+// 	Take the write lock of each directory below this one, a parent
+//	before its children, so that no other thread is left inside the
+//	tree.  The sectors of the locks taken are appended to "locked",
+//	for the caller to release.  The caller holds this directory's
+//	lock.
+//
+//	"locks" -- the directory locks, named by header sector
+//	"locked" -- the locks taken so far
+//----------------------------------------------------------------------
+
+void Directory::LockTree(RWLockTable *locks, ::List<int> *locked) {
+    Directory *directory = new Directory(tableSize);
+    OpenFile *dirFile;
+
+    for (int i = 0; i < tableSize; i++) {
+        if (table[i].inUse && table[i].isDir) {
+            locks->Acquire(table[i].sector, TRUE);
+            locked->Append(table[i].sector);
+            dirFile = new OpenFile(table[i].sector);
+            directory->FetchFrom(dirFile);
+            directory->LockTree(locks, locked);
+            delete dirFile;
+        }
+    }
+    delete directory;
+}
+
+//----------------------------------------------------------------------
+// Directory::Defragment
+// 	Relocate each file in this directory and, depth first, in the
+//	directories below it, the directory files included.  A
+//	subdirectory's read lock is held while it is done, after the
+//	caller's on this one, so nothing being moved can be removed.
+//	Return the number of files moved.
+//
+//	"locks" -- the directory locks, named by header sector
+//	"before", "after" -- totals for FileSystem::Defragment's report
+//----------------------------------------------------------------------
+
+int Directory::Defragment(RWLockTable *locks, FragmentStats *before,
+                          FragmentStats *after) {
+    Directory *directory = new Directory(tableSize);
+    OpenFile *file;
+    int moved = 0;
+
+    for (int i = 0; i < tableSize; i++) {
+        if (!table[i].inUse)
+            continue;
+        if (table[i].isDir)
+            locks->Acquire(table[i].sector, FALSE);
+        file = new OpenFile(table[i].sector);
+        if (file->Defragment(before, after))
+            moved++;
+        if (table[i].isDir) {
+            directory->FetchFrom(file);
+            moved += directory->Defragment(locks, before, after);
+            locks->Release(table[i].sector, FALSE);
+        }
+        delete file;
+    }
+    delete directory;
+    return moved;
+}
+// MP4 end
+
+//----------------------------------------------------------------------
+// Directory::RecursiveRemove
+// 	Free everything below this directory: each file's data and
+//	header, and each subdirectory, removed the same way first.
+//
+//	MP4: the caller normally has "freeMap" deferring its clears, so
+//	the sectors of the whole tree are freed together at the end (see
+//	PersistentBitmap::ClearDeferred).  The freed headers are not
+//	written back; their sectors are free.
+//----------------------------------------------------------------------
+
 void Directory::RecursiveRemove(PersistentBitmap *freeMap) {
     Directory *directory = new Directory(tableSize);
     OpenFile *dirFile;
     FileHeader *fileHdr = new FileHeader;
-    bool success = FALSE;
 
     for (int i = 0; i < tableSize; i++) {
         if (table[i].inUse) {
@@ -189,14 +393,13 @@ void Directory::RecursiveRemove(PersistentBitmap *freeMap) {
                 dirFile = new OpenFile(table[i].sector);
                 directory->FetchFrom(dirFile);
                 directory->RecursiveRemove(freeMap);
-
-                fileHdr->FetchFrom(table[i].sector);
-                fileHdr->Deallocate(freeMap);
-                freeMap->Clear(table[i].sector);
-                fileHdr->WriteBack(table[i].sector);
-                freeMap->WriteBack(dirFile);
                 delete dirFile;
             }
+            // MP4: a plain file's sectors are freed too
+            fileHdr->FetchFrom(table[i].sector);
+            fileHdr->Deallocate(freeMap);
+            freeMap->Clear(table[i].sector);
+            FileHeader::Invalidate(table[i].sector);  // MP4
             table[i].inUse = FALSE;
         }
     }
@@ -207,30 +410,41 @@ void Directory::RecursiveRemove(PersistentBitmap *freeMap) {
 //----------------------------------------------------------------------
 // Directory::List
 // 	List all the file names in the directory.
+//
+//	"out" -- where the listing is gathered
 //----------------------------------------------------------------------
 
-void Directory::List() {
+void Directory::List(Listing *out) {
     for (int i = 0; i < tableSize; i++) {
         if (table[i].inUse)
-            printf("%s\n", table[i].name);
+            out->Add(table[i].name, 0);
     }
 }
 
-void Directory::RecursiveList(int indents) {
+// MP4 start
+//----------------------------------------------------------------------
+// Directory::RecursiveList
+// 	List the files in the directory, each subdirectory followed by
+//	its own files, one level of indent further in.
+//
+//	"out" -- where the listing is gathered
+//	"indents" -- the depth of this directory
+//----------------------------------------------------------------------
+
+void Directory::RecursiveList(Listing *out, int indents) {
     Directory *directory = new Directory(tableSize);
     OpenFile *dirFile;
+    char line[FileNameMaxLen + 5];  // "[D] " and the name
 
     for (int i = 0; i < tableSize; i++) {
         if (table[i].inUse) {
-            for (int j = 0; j < indents; j++) {
-                printf("  ");
-            }
-            printf("[%c] %s\n", table[i].isDir ? 'D' : 'F', table[i].name);
+            sprintf(line, "[%c] %s", table[i].isDir ? 'D' : 'F', table[i].name);
+            out->Add(line, indents);
 
             if (table[i].isDir) {
                 dirFile = new OpenFile(table[i].sector);
                 directory->FetchFrom(dirFile);
-                directory->RecursiveList(indents + 1);
+                directory->RecursiveList(out, indents + 1);
                 delete dirFile;
             }
         }
@@ -238,32 +452,224 @@ void Directory::RecursiveList(int indents) {
     delete directory;
 }
 
+//----------------------------------------------------------------------
+// Listing::Listing
+// 	Initialize an empty listing.
+//----------------------------------------------------------------------
+
+Listing::Listing(int flushAt) {
+    size = (flushAt > 0) ? flushAt + 256 : 256;
+    buffer = new char[size];
+    length = 0;
+    this->flushAt = flushAt;
+}
+
+Listing::~Listing() {
+    delete[] buffer;
+}
+
+//----------------------------------------------------------------------
+// Listing::Add
+// 	Add "text" as a line of the listing, indented two spaces for
+//	each of "indents", doubling the buffer when it fills.
+//----------------------------------------------------------------------
+
+void Listing::Add(char *text, int indents) {
+    Reserve(2 * indents + strlen(text) + 1);
+    for (int j = 0; j < indents; j++) {
+        buffer[length++] = ' ';
+        buffer[length++] = ' ';
+    }
+    memcpy(buffer + length, text, strlen(text));
+    length += strlen(text);
+    buffer[length++] = '\n';
+    Added();
+}
+
+//----------------------------------------------------------------------
+// Listing::Printf
+// 	Add text formatted as by printf; one call makes at most a line.
+//----------------------------------------------------------------------
+
+void Listing::Printf(const char *format, ...) {
+    char line[256];
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    n = min(n, (int)sizeof(line) - 1);
+    Reserve(n);
+    memcpy(buffer + length, line, n);
+    length += n;
+    Added();
+}
+
+//----------------------------------------------------------------------
+// Listing::AddBytes
+// 	Add "numBytes" bytes of file data as they are, except that a byte
+//	that is not printable is added as a backslash and its hex value.
+//----------------------------------------------------------------------
+
+void Listing::AddBytes(char *data, int numBytes) {
+    Reserve(3 * numBytes);  // "\ff" at worst
+    for (int j = 0; j < numBytes; j++) {
+        if ('\040' <= data[j] && data[j] <= '\176')  // isprint(data[j])
+            buffer[length++] = data[j];
+        else
+            length += sprintf(buffer + length, "\\%x", (unsigned char)data[j]);
+    }
+    Added();
+}
+
+//----------------------------------------------------------------------
+// Listing::Reserve
+// 	Make room for "bytes" more, doubling the buffer until it fits.
+//----------------------------------------------------------------------
+
+void Listing::Reserve(int bytes) {
+    int needed = length + bytes + 1;  // sprintf adds a '\0'
+
+    if (needed > size) {
+        while (size < needed)
+            size *= 2;
+        char *bigger = new char[size];
+        memcpy(bigger, buffer, length);
+        delete[] buffer;
+        buffer = bigger;
+    }
+}
+
+//----------------------------------------------------------------------
+// Listing::Added
+// 	Write out what has gathered, if it is "flushAt" bytes or more.
+//----------------------------------------------------------------------
+
+void Listing::Added() {
+    if (flushAt > 0 && length >= flushAt)
+        Write();
+}
+
+//----------------------------------------------------------------------
+// Listing::Write
+// 	Write the whole listing to standard output at once, and start
+//	over with an empty one.
+//----------------------------------------------------------------------
+
+void Listing::Write() {
+    fwrite(buffer, 1, length, stdout);
+    fflush(stdout);
+    length = 0;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Directory::Print
 // 	List all the file names in the directory, their FileHeader locations,
 //	and the contents of each file.  For debugging.
+//
+//	MP4: the output goes to "out"; the contents of the files are left
+//	out unless "contents" is set.
 //----------------------------------------------------------------------
 
-void Directory::Print() {
+void Directory::Print(Listing *out, bool contents) {
     FileHeader *hdr = new FileHeader;
     Directory *directory = new Directory(tableSize);
     OpenFile *dirFile;
 
-    printf("Directory contents:\n");
+    out->Printf("Directory contents:\n");
     for (int i = 0; i < tableSize; i++)
         if (table[i].inUse) {
-            printf("Name: %s, Sector: %d\n", table[i].name, table[i].sector);
+            out->Printf("Name: %s, Sector: %d\n", table[i].name, table[i].sector);
             hdr->FetchFrom(table[i].sector);
-            hdr->Print();
+            hdr->Print(out, contents);
 
             if (table[i].isDir) {
                 dirFile = new OpenFile(table[i].sector);
                 directory->FetchFrom(dirFile);
-                directory->Print();
+                directory->Print(out, contents);
                 delete dirFile;
             }
         }
-    printf("\n");
+    out->Printf("\n");
     delete directory;
     delete hdr;
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// NameCache::NameCache
+// 	Initialize an empty name lookup cache.
+//----------------------------------------------------------------------
+
+NameCache::NameCache() {
+    Clear();
+}
+
+//----------------------------------------------------------------------
+// NameCache::Hash
+// 	Return the slot for <dirSector, name>.  Names are compared the
+//	way Directory::FindIndex does, so only the first FileNameMaxLen
+//	characters count.
+//----------------------------------------------------------------------
+
+int NameCache::Hash(int dirSector, char *name) {
+    return (HashName(name) ^ (unsigned int)dirSector) % NumNameCacheEntries;
+}
+
+//----------------------------------------------------------------------
+// NameCache::Lookup
+// 	Look up "name" in the directory whose header is at "dirSector".
+//	Return FALSE if the answer is not cached; otherwise return TRUE
+//	and set "sector" to the file header sector, or -1 if the name is
+//	known to be absent.
+//----------------------------------------------------------------------
+
+bool NameCache::Lookup(int dirSector, char *name, int *sector) {
+    Entry *e = &table[Hash(dirSector, name)];
+
+    if (e->valid && e->dirSector == dirSector && !strncmp(e->name, name, FileNameMaxLen)) {
+        *sector = e->sector;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+//----------------------------------------------------------------------
+// NameCache::Enter
+// 	Record the result of looking up "name" in the directory at
+//	"dirSector"; -1 records that the name is not there.
+//----------------------------------------------------------------------
+
+void NameCache::Enter(int dirSector, char *name, int sector) {
+    Entry *e = &table[Hash(dirSector, name)];
+
+    e->valid = TRUE;
+    e->dirSector = dirSector;
+    strncpy(e->name, name, FileNameMaxLen);
+    e->name[FileNameMaxLen] = '\0';
+    e->sector = sector;
+}
+
+//----------------------------------------------------------------------
+// NameCache::Purge
+// 	Forget every name cached for the directory at "dirSector", for
+//	instance because the directory itself has been removed.
+//----------------------------------------------------------------------
+
+void NameCache::Purge(int dirSector) {
+    for (int i = 0; i < NumNameCacheEntries; i++)
+        if (table[i].valid && table[i].dirSector == dirSector)
+            table[i].valid = FALSE;
+}
+
+//----------------------------------------------------------------------
+// NameCache::Clear
+// 	Forget every cached name.
+//----------------------------------------------------------------------
+
+void NameCache::Clear() {
+    for (int i = 0; i < NumNameCacheEntries; i++)
+        table[i].valid = FALSE;
+}
+// MP4 end
@@ -19,6 +19,9 @@
 
 #include "openfile.h"
 #include "pbitmap.h"
+#include "synch.h"
+
+struct FragmentStats;  // MP4: see filehdr.h
 
 #define FileNameMaxLen 9  // for simplicity, we assume \
                          // file names are <= 9 characters long
@@ -42,6 +45,38 @@ class DirectoryEntry {
 };
 // MP4 end
 
+// MP4 start
+// The output of a directory listing, gathered in memory as it is
+// made, so that all of it is written out with a single call.  Output
+// too big to keep whole, like the file system dump, is written out
+// each time "flushAt" bytes have gathered.
+
+const int DumpBufferSize = 64 * 1024;  // what the dump gathers at once
+
+class Listing {
+   public:
+    Listing(int flushAt = 0);  // 0: only write when told to
+    ~Listing();
+
+    void Add(char *text, int indents);  // Add a line of "text", after
+                                        //  "indents" levels of indent
+    void Printf(const char *format, ...);   // Add formatted text,
+                                            //  with no newline added
+    void AddBytes(char *data, int numBytes);  // Add raw data, with the
+                                              //  unprintable bytes as \xx
+    void Write();  // Write everything added to standard output
+
+   private:
+    char *buffer;  // the text so far
+    int length;    // bytes of it in use
+    int size;      // bytes allocated
+    int flushAt;   // length at which to Write, or 0
+
+    void Reserve(int bytes);  // grow for "bytes" more
+    void Added();             // Write, if there is enough
+};
+// MP4 end
+
 // The following class defines a UNIX-like "directory".  Each entry in
 // the directory describes a file, and where to find it on disk.
 //
@@ -69,19 +104,34 @@ class Directory {
 
     bool Remove(char *name);  // Remove a file from the directory
 
-    void List();   // Print the names of all the files
-                   //  in the directory
-    void Print();  // Verbose print of the contents
+    void List(Listing *out);   // Add the names of all the files
+                               //  in the directory to "out"
+    void Print(Listing *out, bool contents = TRUE);
+                   // Verbose print of the contents
                    //  of the directory -- all the file
-                   //  names and their contents.
+                   //  names and their contents --
+                   //  to "out"; MP4: the headers alone
+                   //  unless "contents"
 
     bool IsDir(char *name);
 
     bool AddDirectory(char *name, int newSector);
 
     void RecursiveRemove(PersistentBitmap *freeMap);
+    void LockTree(RWLockTable *locks, ::List<int> *locked);
+                             // MP4: write-lock every directory below
+                             //  this one, top down, noting each in
+                             //  "locked"
+    int Defragment(RWLockTable *locks, FragmentStats *before,
+                   FragmentStats *after);
+                             // MP4: relocate every file below this
+                             //  one, read-locking each directory
 
-    void RecursiveList(int indents);
+    void RecursiveList(Listing *out, int indents);
+                             // MP4: add this directory and the ones
+                             //  below it to "out", indented
+
+    int FileSize();  // MP4: bytes needed on disk by WriteBack
 
    private:
     /*
@@ -97,6 +147,53 @@ class Directory {
 
     int FindIndex(char *name);  // Find the index into the directory
                                 //  table corresponding to "name"
+
+    // MP4 start
+    int numInUse;               // Number of entries in use
+    int Hash(char *name);       // Home slot of "name"
+    void Grow();                // Double tableSize and rehash
+    bool AddEntry(char *name, int newSector, bool isDir);
+    DirectoryEntry *onDisk;     // table as last read or written, so
+                                //  WriteBack only writes changed
+                                //  sectors; NULL if unknown
+    int onDiskSize;             // number of entries in onDisk
+    void SaveOnDisk();          // remember the table as on disk
+    // MP4 end
+};
+
+// MP4 start
+#define NumNameCacheEntries 128  // slots in the name lookup cache
+
+// The following class caches the result of looking a name up in a
+// directory: <directory header sector, name> -> file header sector.
+// A sector of -1 is a "negative" entry, recording that the name is
+// known not to be in the directory.  The cache is direct-mapped by a
+// hash of the key; a new entry simply replaces whatever was in its
+// slot.  The file system must keep it coherent with the directories
+// on disk.
+
+class NameCache {
+   public:
+    NameCache();  // Initialize an empty cache
+
+    bool Lookup(int dirSector, char *name, int *sector);
+    // If <dirSector, name> is cached,
+    // return TRUE and its sector
+    void Enter(int dirSector, char *name, int sector);
+    // Remember <dirSector, name> -> sector
+    void Purge(int dirSector);  // Forget every name in a directory
+    void Clear();               // Forget everything
+
+   private:
+    struct Entry {
+        bool valid;
+        int dirSector;
+        char name[FileNameMaxLen + 1];
+        int sector;
+    } table[NumNameCacheEntries];
+
+    int Hash(int dirSector, char *name);
 };
+// MP4 end
 
 #endif  // DIRECTORY_H
@@ -28,6 +28,7 @@
 #include "debug.h"
 #include "main.h"
 #include "synchdisk.h"
+#include "directory.h"  // MP4: Listing, for Print
 
 IndexBlock::IndexBlock(int level) : level(level) {
     // if (debug->IsEnabled('f'))
@@ -46,13 +47,129 @@ IndexBlock::~IndexBlock() {
     if (level != 0) {
         ASSERT(nextIndexBlocks != NULL);
         for (int i = 0; i < levelSectors; i++) {
-            ASSERT(nextIndexBlocks[i] != NULL);
-            delete nextIndexBlocks[i];
+            if (nextIndexBlocks[i] != NULL)  // MP4: may never have been loaded
+                delete nextIndexBlocks[i];
         }
         delete[] nextIndexBlocks;
     }
 }
-bool IndexBlock::Allocate(PersistentBitmap *freeMap, int remSize) {
+// MP4 start
+//----------------------------------------------------------------------
+// IndexBlock::ChildSize
+//	Return the number of file bytes covered by the "i"th pointer.
+//----------------------------------------------------------------------
+int IndexBlock::ChildSize(int i) {
+    if (i == levelSectors - 1 && numBytes % sizePerPointer[level])
+        return numBytes % sizePerPointer[level];
+    return sizePerPointer[level];
+}
+//----------------------------------------------------------------------
+// IndexBlock::GetChild
+//	Return the "i"th lower-level index block, reading it from disk
+//	the first time it is needed, or NULL if that part of the file is
+//	a hole.
+//----------------------------------------------------------------------
+IndexBlock *IndexBlock::GetChild(int i) {
+    ASSERT(level != 0 && i >= 0 && i < levelSectors);
+    if (nextSectors[i] == -1)
+        return NULL;  // a hole, see FillHoles
+    if (nextIndexBlocks[i] == NULL) {
+        // MP4: fill it in before publishing it, and keep the first copy
+        // if another reader of the header loaded it while we waited
+        IndexBlock *block = new IndexBlock(level - 1);
+        block->FetchFrom(nextSectors[i], ChildSize(i));
+        if (nextIndexBlocks[i] == NULL)
+            nextIndexBlocks[i] = block;
+        else
+            delete block;
+    }
+    return nextIndexBlocks[i];
+}
+
+//----------------------------------------------------------------------
+// IndexBlock::InitHoles
+//	Initialize an index block covering "remSize" bytes of a sparse
+//	file, with nothing allocated below it yet.
+//----------------------------------------------------------------------
+void IndexBlock::InitHoles(int remSize) {
+    numBytes = remSize;
+    numSectors = divRoundUp(remSize, SectorSize);
+    levelSectors = divRoundUp(remSize, sizePerPointer[level]);
+    memset(nextSectors, -1, sizeof(nextSectors));
+    if (level != 0) {
+        nextIndexBlocks = new IndexBlock *[NumSectorInt];
+        memset(nextIndexBlocks, 0, sizeof(IndexBlock *) * NumSectorInt);
+    }
+}
+
+//----------------------------------------------------------------------
+// IndexBlock::FillHoles
+//	Allocate every data sector of bytes "from" up to "to" (relative to
+//	this block) that is still a hole, and the index blocks above them.
+//	The caller has checked that the disk has room.
+//----------------------------------------------------------------------
+void IndexBlock::FillHoles(PersistentBitmap *freeMap, int from, int to) {
+    for (int i = from / sizePerPointer[level]; i < levelSectors && i * sizePerPointer[level] < to; i++) {
+        if (nextSectors[i] == -1) {
+            nextSectors[i] = freeMap->FindAndSet();
+            ASSERT(nextSectors[i] >= 0);
+            if (level != 0) {
+                nextIndexBlocks[i] = new IndexBlock(level - 1);
+                nextIndexBlocks[i]->InitHoles(ChildSize(i));
+            }
+        }
+        if (level != 0) {
+            int base = i * sizePerPointer[level];
+            GetChild(i)->FillHoles(freeMap, max(from - base, 0), min(to - base, ChildSize(i)));
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// IndexBlock::PunchHoles
+//	Free every data sector of bytes "from" up to "to" (relative to
+//	this block), leaving holes.  The index blocks stay, even if
+//	nothing is left under them.
+//----------------------------------------------------------------------
+void IndexBlock::PunchHoles(PersistentBitmap *freeMap, int from, int to) {
+    for (int i = from / sizePerPointer[level]; i < levelSectors && i * sizePerPointer[level] < to; i++) {
+        if (nextSectors[i] == -1)
+            continue;  // already a hole
+        if (level == 0) {
+            ASSERT(freeMap->Test(nextSectors[i]));
+            freeMap->Clear(nextSectors[i]);
+            nextSectors[i] = -1;
+        } else {
+            int base = i * sizePerPointer[level];
+            GetChild(i)->PunchHoles(freeMap, max(from - base, 0), min(to - base, ChildSize(i)));
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// IndexBlock::Unshare
+//	Move every data sector of bytes "from" up to "to" (relative to
+//	this block) that is shared with another file to a sector of its
+//	own.  The caller has checked that the disk has room.
+//----------------------------------------------------------------------
+void IndexBlock::Unshare(PersistentBitmap *freeMap, int from, int to) {
+    for (int i = from / sizePerPointer[level]; i < levelSectors && i * sizePerPointer[level] < to; i++) {
+        if (nextSectors[i] == -1)
+            continue;  // a hole
+        if (level == 0) {
+            if (freeMap->IsShared(nextSectors[i])) {
+                freeMap->Clear(nextSectors[i]);  // one owner fewer
+                nextSectors[i] = freeMap->FindAndSet();
+                ASSERT(nextSectors[i] >= 0);
+            }
+        } else {
+            int base = i * sizePerPointer[level];
+            GetChild(i)->Unshare(freeMap, max(from - base, 0), min(to - base, ChildSize(i)));
+        }
+    }
+}
+// MP4 end
+bool IndexBlock::Allocate(PersistentBitmap *freeMap, int remSize, int **source) {
     // if (debug->IsEnabled('f'))
     //     printf("IndexBlock::Allocate(%x, %d)\n", freeMap, remSize);
 
@@ -68,9 +185,14 @@ bool IndexBlock::Allocate(PersistentBitmap *freeMap, int remSize) {
     //     printf("levelSectors: %d\n", levelSectors);
     // }
 
+    // MP4: data sectors come from "source" when it is given
     for (int i = 0; i < levelSectors; i++) {
-        nextSectors[i] = freeMap->FindAndSet();
-        ASSERT(freeMap->Test((int)nextSectors[i]));
+        if (level == 0 && source != NULL)
+            nextSectors[i] = *(*source)++;
+        else
+            nextSectors[i] = freeMap->FindAndSet();
+        // MP4: holes in "source" stay holes
+        ASSERT((level == 0 && source != NULL && nextSectors[i] == -1) || freeMap->Test((int)nextSectors[i]));
     }
 
     if (level != 0) {
@@ -78,23 +200,40 @@ bool IndexBlock::Allocate(PersistentBitmap *freeMap, int remSize) {
         memset(nextIndexBlocks, 0, sizeof(IndexBlock *) * NumSectorInt);
         for (int i = 0; i < levelSectors; i++) {
             nextIndexBlocks[i] = new IndexBlock(level - 1);
-            if (!nextIndexBlocks[i]->Allocate(freeMap, ((i == levelSectors - 1 && numBytes % sizePerPointer[level]) ? remSize % sizePerPointer[level] : sizePerPointer[level])))
+            if (!nextIndexBlocks[i]->Allocate(freeMap, ChildSize(i), source))
                 return FALSE;
         }
     }
     return TRUE;
 }
+// MP4 start
+void IndexBlock::DeallocateIndex(PersistentBitmap *freeMap) {
+    // free the index sectors below this block, leaving the data alone
+    if (level != 0) {
+        for (int i = 0; i < levelSectors; i++) {
+            if (nextSectors[i] == -1)
+                continue;  // a hole
+            GetChild(i)->DeallocateIndex(freeMap);
+            ASSERT(freeMap->Test((int)nextSectors[i]));
+            freeMap->Clear((int)nextSectors[i]);
+        }
+    }
+}
+// MP4 end
 void IndexBlock::Deallocate(PersistentBitmap *freeMap) {
     // if (debug->IsEnabled('f'))
     //     printf("IndexBlock::Deallocate(%x)\n", freeMap);
 
     if (level != 0) {
         for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i]->Deallocate(freeMap);
+            if (nextSectors[i] != -1)  // MP4: skip holes
+                GetChild(i)->Deallocate(freeMap);
         }
     }
 
     for (int i = 0; i < levelSectors; i++) {
+        if (nextSectors[i] == -1)
+            continue;  // MP4: a hole
         ASSERT(freeMap->Test((int)nextSectors[i]));
         freeMap->Clear((int)nextSectors[i]);
     }
@@ -108,13 +247,10 @@ void IndexBlock::FetchFrom(int sector, int remSize) {
     levelSectors = divRoundUp(remSize, sizePerPointer[level]);
     kernel->synchDisk->ReadSector(sector, (char *)nextSectors);
 
+    // MP4: lower levels are read on demand, see GetChild
     if (level != 0) {
         nextIndexBlocks = new IndexBlock *[NumSectorInt];
         memset(nextIndexBlocks, 0, sizeof(IndexBlock *) * NumSectorInt);
-        for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i] = new IndexBlock(level - 1);
-            nextIndexBlocks[i]->FetchFrom(nextSectors[i], (i == levelSectors - 1 && numBytes % sizePerPointer[level] ? remSize % sizePerPointer[level] : sizePerPointer[level]));
-        }
     }
 }
 void IndexBlock::WriteBack(int sector) {
@@ -139,41 +275,53 @@ int IndexBlock::ByteToSector(int offset) {
     ASSERT(offset < levelSectors * sizePerPointer[level]);
 
     if (level == 0) {
-        return nextSectors[offset / sizePerPointer[level]];
+        return nextSectors[offset / sizePerPointer[level]];  // MP4: -1 for a hole
     } else {
         int levelSector = offset / sizePerPointer[level];
-        return nextIndexBlocks[levelSector]->ByteToSector(offset - levelSector * sizePerPointer[level]);
+        IndexBlock *child = GetChild(levelSector);
+        if (child == NULL)
+            return -1;  // MP4: inside a hole
+        return child->ByteToSector(offset - levelSector * sizePerPointer[level]);
     }
 }
-void IndexBlock::PrintSectors() {
-    for (int i = 0; i < levelSectors; i++)
-        printf("%d ", nextSectors[i]);
+// MP4 start
+//----------------------------------------------------------------------
+// IndexBlock::MapSectors
+//	Fill in "sectors" with the disk sectors of "count" consecutive
+//	file sectors, counted from the start of this block, from "first"
+//	on; -1 for holes.  Each child on the way is visited once, for all
+//	the sectors under it.
+//----------------------------------------------------------------------
+void IndexBlock::MapSectors(int first, int count, int *sectors) {
+    int perChild = sizePerPointer[level] / SectorSize;
 
-    if (level != 0) {
-        for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i]->PrintSectors();
-        }
+    if (level == 0) {
+        memcpy(sectors, &nextSectors[first], count * sizeof(int));
+        return;
     }
-}
-void IndexBlock::PrintContents() {
-    int i, k, j;
-    char *data = new char[SectorSize];
+    while (count > 0) {
+        int i = first / perChild;
+        int n = min(count, (i + 1) * perChild - first);
+        IndexBlock *child = GetChild(i);
 
-    for (i = k = 0; i < levelSectors; i++) {
-        kernel->synchDisk->ReadSector(nextSectors[i], data);
-        for (j = 0; (j < SectorSize) && (k < numBytes); j++, k++) {
-            if ('\040' <= data[j] && data[j] <= '\176')  // isprint(data[j])
-                printf("%c", data[j]);
-            else
-                printf("\\%x", (unsigned char)data[j]);
-        }
-        printf("\n");
+        if (child == NULL)
+            memset(sectors, -1, n * sizeof(int));  // inside a hole
+        else
+            child->MapSectors(first - i * perChild, n, sectors);
+        first += n;
+        count -= n;
+        sectors += n;
     }
-    delete[] data;
+}
+// MP4 end
+void IndexBlock::PrintSectors(Listing *out) {
+    for (int i = 0; i < levelSectors; i++)
+        out->Printf("%d ", nextSectors[i]);
 
     if (level != 0) {
         for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i]->PrintContents();
+            if (nextSectors[i] != -1)  // MP4: skip holes
+                GetChild(i)->PrintSectors(out);
         }
     }
 }
@@ -181,7 +329,8 @@ int IndexBlock::GetIndexBlockSize() {
     int ret = SectorSize;
     if (level != 0) {
         for (int i = 0; i < levelSectors; i++) {
-            ret += nextIndexBlocks[i]->GetIndexBlockSize();
+            if (nextSectors[i] != -1)  // MP4: holes take no space
+                ret += GetChild(i)->GetIndexBlockSize();
         }
     }
     return ret;
@@ -205,6 +354,14 @@ FileHeader::FileHeader() {
     level = LDirect;
     levelSectors = -1;
     nextIndexBlocks = NULL;
+    sectorMap = NULL;
+    inlineMode = FALSE;
+    compressed = FALSE;
+    shared = FALSE;
+    extentMode = FALSE;
+    numExtents = 0;
+    refCount = 0;
+    cacheSector = -1;
     // MP4 end
 }
 
@@ -223,23 +380,125 @@ FileHeader::~FileHeader() {
     if (level != LDirect) {
         ASSERT(nextIndexBlocks != NULL);
         for (int i = 0; i < levelSectors; i++) {
-            ASSERT(nextIndexBlocks[i] != NULL);
-            delete nextIndexBlocks[i];
+            if (nextIndexBlocks[i] != NULL)  // may never have been loaded
+                delete nextIndexBlocks[i];
         }
         delete[] nextIndexBlocks;
     }
+    DropSectorMap();
     // MP4 end
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// FileHeader::GetIndexBlock
+//	Return the "i"th top-level index block, reading it from disk
+//	the first time it is needed.  Opening a file therefore costs a
+//	single sector read; lookups go through SectorMap, and the tree
+//	is only loaded here to be changed or freed.  Return NULL if
+//	that part of a sparse file is a hole.
+//----------------------------------------------------------------------
+IndexBlock *FileHeader::GetIndexBlock(int i) {
+    ASSERT(level != LDirect && i >= 0 && i < levelSectors);
+    if (dataSectors[i] == -1)
+        return NULL;
+    if (nextIndexBlocks[i] == NULL) {
+        // MP4: fill it in before publishing it, and keep the first copy
+        // if another reader of the header loaded it while we waited
+        IndexBlock *block = new IndexBlock(level - 1);
+        block->FetchFrom(dataSectors[i], ChildSize(i));
+        if (nextIndexBlocks[i] == NULL)
+            nextIndexBlocks[i] = block;
+        else
+            delete block;
+    }
+    return nextIndexBlocks[i];
+}
+
+//----------------------------------------------------------------------
+// FileHeader::SectorMap
+//	Return the disk sectors of the file sectors under the "i"th
+//	top-level pointer, as one flat array (-1 for holes), built the
+//	first time that part of the file is used.  Lookups then index an
+//	array instead of chasing pointers down the tree.
+//
+//	The index blocks under the pointer are read into a tree of our
+//	own, which is thrown away once the array is filled in, so a
+//	large file read through keeps one int per sector in memory, not
+//	a tree of small objects.  A subtree already loaded (by FillHoles,
+//	say) is up to date, and is used instead.
+//----------------------------------------------------------------------
+int *FileHeader::SectorMap(int i) {
+    ASSERT(level != LDirect && i >= 0 && i < levelSectors);
+    if (sectorMap == NULL) {
+        sectorMap = new int *[NumPointers];
+        memset(sectorMap, 0, sizeof(int *) * NumPointers);
+    }
+    if (sectorMap[i] == NULL) {
+        int n = divRoundUp(ChildSize(i), SectorSize);
+        int *map = new int[n];
+
+        if (dataSectors[i] == -1) {
+            memset(map, -1, n * sizeof(int));  // a hole
+        } else if (nextIndexBlocks[i] != NULL) {
+            nextIndexBlocks[i]->MapSectors(0, n, map);
+        } else {
+            IndexBlock *block = new IndexBlock(level - 1);
+            block->FetchFrom(dataSectors[i], ChildSize(i));
+            block->MapSectors(0, n, map);
+            delete block;
+        }
+        // as in GetIndexBlock, keep the first copy if another reader
+        // built it while we waited for the disk
+        if (sectorMap[i] == NULL)
+            sectorMap[i] = map;
+        else
+            delete[] map;
+    }
+    return sectorMap[i];
+}
+
+//----------------------------------------------------------------------
+// FileHeader::DropSectorMap
+//	Forget the flat sector arrays, whenever the index tree is laid
+//	out again or changed; they are built again as they are needed.
+//	Only called with the file locked against readers.
+//----------------------------------------------------------------------
+void FileHeader::DropSectorMap() {
+    if (sectorMap == NULL)
+        return;
+    for (int i = 0; i < NumPointers; i++)
+        delete[] sectorMap[i];
+    delete[] sectorMap;
+    sectorMap = NULL;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::ChildSize
+//	Return the number of allocated bytes covered by the "i"th
+//	top-level pointer.  The index tree is laid out over all
+//	numSectors sectors, including those preallocated past the end
+//	of the file.
+//----------------------------------------------------------------------
+int FileHeader::ChildSize(int i) {
+    int size = numSectors * SectorSize;
+    if (i == levelSectors - 1 && size % sizePerPointer[level])
+        return size % sizePerPointer[level];
+    return sizePerPointer[level];
+}
+// MP4 end
+
 void FileHeader::InitLevel() {
     // MP4 start
-    if (numBytes <= MaxDirectBytes) {
+    DropSectorMap();  // the tree is about to be laid out again
+    int size = numSectors * SectorSize;  // the tree covers preallocated sectors too
+    if (size <= MaxDirectBytes) {
         level = LDirect;
-    } else if (numBytes <= MaxSingleIndirectBytes) {
+    } else if (size <= MaxSingleIndirectBytes) {
         level = LSingle;
-    } else if (numBytes <= MaxDoubleIndirectBytes) {
+    } else if (size <= MaxDoubleIndirectBytes) {
         level = LDouble;
-    } else if (numBytes <= MaxTripleIndirectBytes) {
+    } else if (size <= MaxTripleIndirectBytes) {
         level = LTriple;
     } else {
         ASSERT((FALSE));  // Not supported file size;
@@ -247,6 +506,181 @@ void FileHeader::InitLevel() {
     // MP4 end
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// The in-core header cache.  Every OpenFile on the same file shares
+// one FileHeader, which stays cached (with its loaded index blocks)
+// after the last close, until the slot is needed for another header.
+// A lock keeps two threads from loading the same header, or taking
+// the same slot, while one of them waits for the disk.
+//----------------------------------------------------------------------
+
+static FileHeader *headerCache[NumCachedHeaders];
+static int headerCacheHand = 0;  // where to look for a slot to reuse
+static Lock *headerCacheLock = NULL;  // made on first use
+
+static void LockHeaderCache() {
+    if (headerCacheLock == NULL)
+        headerCacheLock = new Lock("header cache");
+    headerCacheLock->Acquire();
+}
+
+//----------------------------------------------------------------------
+// FileHeader::Acquire
+// 	Return the in-core header for the file whose header is stored at
+//	"sectorNumber", reading it from disk only if it is not cached.
+//	The caller must hand it back with Release, not delete it.
+//
+//	"sectorNumber" -- the disk sector containing the file header
+//----------------------------------------------------------------------
+
+FileHeader *FileHeader::Acquire(int sectorNumber) {
+    FileHeader *hdr;
+    int slot = -1;
+
+    LockHeaderCache();
+    for (int i = 0; i < NumCachedHeaders; i++) {
+        hdr = headerCache[i];
+        if (hdr != NULL && hdr->cacheSector == sectorNumber) {
+            hdr->refCount++;
+            headerCacheLock->Release();
+            return hdr;
+        }
+    }
+
+    // look for an empty or unused slot, starting past the last one taken
+    for (int i = 0; i < NumCachedHeaders && slot == -1; i++) {
+        int j = (headerCacheHand + i) % NumCachedHeaders;
+        if (headerCache[j] == NULL || headerCache[j]->refCount == 0)
+            slot = j;
+    }
+
+    hdr = new FileHeader;
+    hdr->FetchFrom(sectorNumber);
+    hdr->refCount = 1;
+    if (slot != -1) {  // otherwise every slot is busy, don't cache
+        delete headerCache[slot];
+        headerCache[slot] = hdr;
+        hdr->cacheSector = sectorNumber;
+        headerCacheHand = (slot + 1) % NumCachedHeaders;
+    }
+    headerCacheLock->Release();
+    return hdr;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::Release
+// 	Drop a reference obtained from Acquire.  Headers that are no
+//	longer in the cache are deleted with their last reference.
+//
+//	"hdr" -- the header returned by Acquire
+//----------------------------------------------------------------------
+
+void FileHeader::Release(FileHeader *hdr) {
+    LockHeaderCache();
+    ASSERT(hdr->refCount > 0);
+    hdr->refCount--;
+    if (hdr->refCount == 0 && hdr->cacheSector == -1)
+        delete hdr;
+    headerCacheLock->Release();
+}
+
+//----------------------------------------------------------------------
+// FileHeader::Invalidate
+// 	Drop the cached header for "sectorNumber", because the header on
+//	disk has been rewritten or freed behind its back.  Holders of the
+//	old copy keep it until they release it.
+//
+//	"sectorNumber" -- the disk sector containing the file header
+//----------------------------------------------------------------------
+
+void FileHeader::Invalidate(int sectorNumber) {
+    LockHeaderCache();
+    for (int i = 0; i < NumCachedHeaders; i++) {
+        FileHeader *hdr = headerCache[i];
+        if (hdr != NULL && hdr->cacheSector == sectorNumber) {
+            headerCache[i] = NULL;
+            hdr->cacheSector = -1;
+            if (hdr->refCount == 0)
+                delete hdr;
+            break;
+        }
+    }
+    headerCacheLock->Release();
+}
+
+//----------------------------------------------------------------------
+// FileHeader::AllocateExtents
+// 	Try to lay out the file's data as at most NumExtents runs of
+//	contiguous sectors, taking the first free run each time.
+//	Return FALSE, leaving the free map as it was, if the free space
+//	is too fragmented for that.
+//
+//	"freeMap" is the bit map of free disk sectors
+//----------------------------------------------------------------------
+
+bool FileHeader::AllocateExtents(PersistentBitmap *freeMap) {
+    int remaining = numSectors;
+    int start, length;
+
+    extentMode = TRUE;
+    numExtents = 0;
+    if (numSectors > 0) {
+        // a single run is best, if there is one long enough anywhere
+        start = freeMap->FindAndSetRange(numSectors);
+        if (start != -1) {
+            dataSectors[0] = start;
+            dataSectors[1] = numSectors;
+            extentFirst[0] = 0;
+            numExtents = 1;
+            remaining = 0;
+        }
+    }
+    while (remaining > 0) {
+        if (numExtents == NumExtents) {
+            // too fragmented, give the runs back
+            for (int i = 0; i < numExtents; i++)
+                for (int j = 0; j < dataSectors[2 * i + 1]; j++)
+                    freeMap->Clear(dataSectors[2 * i] + j);
+            memset(dataSectors, -1, sizeof(dataSectors));
+            extentMode = FALSE;
+            numExtents = 0;
+            return FALSE;
+        }
+        start = freeMap->FindAndSetRun(remaining, &length);
+        ASSERT(start >= 0);  // we checked that there was enough free space
+        dataSectors[2 * numExtents] = start;
+        dataSectors[2 * numExtents + 1] = length;
+        extentFirst[numExtents] = numSectors - remaining;
+        numExtents++;
+        remaining -= length;
+    }
+    level = LDirect;
+    levelSectors = 0;
+    DEBUG(dbgFile, "Allocated " << numSectors << " sectors in " << numExtents << " extents");
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::InitExtents
+// 	Recompute the in-core extent table (numExtents and extentFirst)
+//	from the (start, length) pairs read from disk.
+//----------------------------------------------------------------------
+
+void FileHeader::InitExtents() {
+    int first = 0;
+
+    level = LDirect;
+    levelSectors = 0;
+    for (numExtents = 0; first < numSectors; numExtents++) {
+        ASSERT(numExtents < NumExtents);
+        extentFirst[numExtents] = first;
+        first += dataSectors[2 * numExtents + 1];
+    }
+    ASSERT(first == numSectors);
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // FileHeader::Allocate
 // 	Initialize a fresh file header for a newly created file.
@@ -275,9 +709,28 @@ bool FileHeader::Allocate(PersistentBitmap *freeMap, int fileSize) {
     //     ASSERT(dataSectors[i] >= 0);
     // }
 
+    if (AllocateExtents(freeMap))
+        return TRUE;
+    return AllocateIndex(freeMap, NULL);
+    // MP4 end
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// FileHeader::AllocateIndex
+// 	Lay out the file with direct pointers or a tree of index blocks,
+//	depending on its size.  Index sectors are taken from the free
+//	map; so are data sectors, unless "source" is given, in which case
+//	they are taken in order from the list it points to.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"source" is a cursor into a list of data sectors, or NULL
+//----------------------------------------------------------------------
+
+bool FileHeader::AllocateIndex(PersistentBitmap *freeMap, int **source) {
     InitLevel();
 
-    levelSectors = divRoundUp(fileSize, sizePerPointer[level]);
+    levelSectors = divRoundUp(numSectors * SectorSize, sizePerPointer[level]);
     // if (debug->IsEnabled('f')) {
     //     printf("level: %d\n", level);
     //     printf("sizePerPointer: %d\n", sizePerPointer[level]);
@@ -285,8 +738,11 @@ bool FileHeader::Allocate(PersistentBitmap *freeMap, int fileSize) {
     // }
 
     for (int i = 0; i < levelSectors; i++) {
-        dataSectors[i] = freeMap->FindAndSet();
-        ASSERT(dataSectors[i] >= 0);
+        if (level == LDirect && source != NULL)
+            dataSectors[i] = *(*source)++;  // may be a hole
+        else
+            dataSectors[i] = freeMap->FindAndSet();
+        ASSERT(dataSectors[i] >= 0 || (level == LDirect && source != NULL));
     }
 
     if (level != LDirect) {
@@ -294,14 +750,654 @@ bool FileHeader::Allocate(PersistentBitmap *freeMap, int fileSize) {
         memset(nextIndexBlocks, 0, sizeof(IndexBlock *) * NumPointers);
         for (int i = 0; i < levelSectors; i++) {
             nextIndexBlocks[i] = new IndexBlock(level - 1);
-            if (!nextIndexBlocks[i]->Allocate(freeMap, ((i == levelSectors - 1 && fileSize % sizePerPointer[level]) ? fileSize % sizePerPointer[level] : sizePerPointer[level])))
+            if (!nextIndexBlocks[i]->Allocate(freeMap, ChildSize(i), source))
                 return FALSE;
         }
     }
-    // MP4 end
     return TRUE;
 }
 
+//----------------------------------------------------------------------
+// FileHeader::IndexSectors
+// 	Return how many index block sectors the indexed layout of a file
+//	of "size" bytes needs.  An index block at level l covers
+//	sizePerPointer[l + 1] bytes.
+//----------------------------------------------------------------------
+
+int FileHeader::IndexSectors(int size) {
+    int count = 0;
+
+    for (int l = 0; l < 3 && size > maxLevelBytes[l]; l++)
+        count += divRoundUp(size, sizePerPointer[l + 1]);
+    return count;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::DeallocateIndex
+// 	Free the index block sectors of an indexed file, and drop the
+//	in-core index blocks, keeping the data sectors allocated.  The
+//	header is left in direct form with no pointers, ready to be laid
+//	out again.
+//
+//	"freeMap" is the bit map of free disk sectors
+//----------------------------------------------------------------------
+
+void FileHeader::DeallocateIndex(PersistentBitmap *freeMap) {
+    DropSectorMap();
+    if (!extentMode && level != LDirect) {
+        for (int i = 0; i < levelSectors; i++) {
+            if (dataSectors[i] == -1)
+                continue;  // a hole
+            GetIndexBlock(i)->DeallocateIndex(freeMap);
+            ASSERT(freeMap->Test((int)dataSectors[i]));
+            freeMap->Clear((int)dataSectors[i]);
+            delete nextIndexBlocks[i];
+        }
+        delete[] nextIndexBlocks;
+        nextIndexBlocks = NULL;
+    }
+    level = LDirect;
+    levelSectors = 0;
+    extentMode = FALSE;
+    numExtents = 0;
+    memset(dataSectors, -1, sizeof(dataSectors));
+}
+
+//----------------------------------------------------------------------
+// FileHeader::BuildExtents
+// 	Describe the data sectors in "list" as extents, if they form at
+//	most NumExtents runs.  Return FALSE, changing nothing, otherwise,
+//	or if the file has holes.
+//
+//	"list" holds the numSectors data sectors of the file, in order,
+//	with -1 for holes
+//----------------------------------------------------------------------
+
+bool FileHeader::BuildExtents(int *list) {
+    int runs = 0;
+
+    for (int i = 0; i < numSectors; i++) {
+        if (list[i] == -1)
+            return FALSE;  // extents cannot describe holes
+        if (i == 0 || list[i] != list[i - 1] + 1)
+            runs++;
+    }
+    if (runs > NumExtents)
+        return FALSE;
+
+    numExtents = 0;
+    for (int i = 0; i < numSectors; i++) {
+        if (i == 0 || list[i] != list[i - 1] + 1) {
+            dataSectors[2 * numExtents] = list[i];
+            dataSectors[2 * numExtents + 1] = 0;
+            extentFirst[numExtents] = i;
+            numExtents++;
+        }
+        dataSectors[2 * numExtents - 1]++;
+    }
+    extentMode = TRUE;
+    level = LDirect;
+    levelSectors = 0;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::AppendExtents
+// 	Add "count" sectors to the end of an extent file: first the free
+//	sectors right after its last extent, then the first free runs
+//	anywhere.  Return FALSE if the file runs out of extents first; the
+//	sectors added so far stay part of the file.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"count" is the number of sectors to add
+//----------------------------------------------------------------------
+
+bool FileHeader::AppendExtents(PersistentBitmap *freeMap, int count) {
+    int start, length;
+
+    ASSERT(extentMode);
+    if (numExtents > 0) {
+        int next = dataSectors[2 * numExtents - 2] + dataSectors[2 * numExtents - 1];
+        while (count > 0 && next < NumSectors && !freeMap->Test(next)) {
+            freeMap->Mark(next++);
+            dataSectors[2 * numExtents - 1]++;
+            numSectors++;
+            count--;
+        }
+    }
+    while (count > 0) {
+        if (numExtents == NumExtents)
+            return FALSE;
+        start = freeMap->FindAndSetRun(count, &length);
+        ASSERT(start >= 0);  // the caller checked that there was enough space
+        dataSectors[2 * numExtents] = start;
+        dataSectors[2 * numExtents + 1] = length;
+        extentFirst[numExtents] = numSectors;
+        numExtents++;
+        numSectors += length;
+        count -= length;
+    }
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::Extend
+// 	Grow the file to "newSize" bytes.  Sectors are allocated
+//	GrowSectors at a time, so a file written by many small appends
+//	only goes to the free map once per batch; the extra sectors stay
+//	with the file, past its end, until they are written or the file
+//	is removed.  New sectors are taken right after the current last
+//	one when those are free, so the file stays contiguous.
+//
+//	An inline file just grows while it fits in the header; after that
+//	its data moves out to the first of its new sectors.
+//	An extent file is simply given more extents.  If it has none left,
+//	or the file is indexed, the existing data stays where it is and
+//	only the pointers describing it are rebuilt: into extents if
+//	possible and an index tree otherwise.
+//	The caller must write the header back.
+//
+//	Return FALSE, changing nothing, if the disk is too full.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"newSize" is the new length of the file
+//----------------------------------------------------------------------
+
+bool FileHeader::Extend(PersistentBitmap *freeMap, int newSize) {
+    int newSectors = divRoundUp(newSize, SectorSize);
+    int allocSectors;
+    int *list, *cursor;
+    int next = -1;
+    char inlined[SectorSize];
+    bool built;
+
+    if (newSize <= numBytes)
+        return TRUE;  // files never shrink
+    if (inlineMode && newSize <= InlineBytes) {
+        numBytes = newSize;  // still fits in the header
+        return TRUE;
+    }
+    if (newSectors <= numSectors) {
+        numBytes = newSize;  // fits in the sectors we already have
+        return TRUE;
+    }
+    if (newSize > MaxFileSize)
+        return FALSE;
+    if (compressed)
+        return ExtendCompressed(freeMap, newSize);
+
+    // preallocate a whole batch, unless the disk is too full for it
+    allocSectors = divRoundUp(newSectors, GrowSectors) * GrowSectors;
+    if (allocSectors * SectorSize > MaxFileSize ||
+        freeMap->NumClear() < allocSectors - numSectors + IndexSectors(allocSectors * SectorSize))
+        allocSectors = newSectors;
+    if (freeMap->NumClear() < newSectors - numSectors + IndexSectors(newSectors * SectorSize))
+        return FALSE;
+
+    DEBUG(dbgFile, "Extending file from " << numBytes << " to " << newSize << " bytes, " << allocSectors << " sectors");
+    if (inlineMode) {
+        // move the data out of the header, into the first new sector
+        memset(inlined, 0, SectorSize);
+        memcpy(inlined, dataSectors, numBytes);
+        memset(dataSectors, -1, sizeof(dataSectors));
+    }
+    numBytes = newSize;
+    if (extentMode && AppendExtents(freeMap, allocSectors - numSectors))
+        return TRUE;
+
+    list = new int[allocSectors];
+    MapSectors(0, numSectors, list);
+    if (numSectors > 0)
+        next = list[numSectors - 1] + 1;
+    for (int i = numSectors; i < allocSectors; i++) {
+        if (next > 0 && next < NumSectors && !freeMap->Test(next)) {
+            freeMap->Mark(next);
+            list[i] = next;
+        } else {
+            list[i] = freeMap->FindAndSet();
+        }
+        ASSERT(list[i] >= 0);
+        next = list[i] + 1;
+    }
+
+    DeallocateIndex(freeMap);
+    numSectors = allocSectors;
+    if (!BuildExtents(list)) {
+        cursor = list;
+        built = AllocateIndex(freeMap, &cursor);
+        ASSERT(built);  // room for the index was checked for above
+    }
+    delete[] list;
+    if (inlineMode) {
+        inlineMode = FALSE;
+        kernel->synchDisk->WriteSector(ByteToSector(0), inlined);
+    }
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::ExtendCompressed
+// 	Extend for a compressed file: it grows by whole chunks, which are
+//	holes until written, and stays indexed.  The data of an inline
+//	file moves out into a first chunk of its own, stored uncompressed
+//	(every sector of it allocated) until it is next written.
+//
+//	Return FALSE, changing nothing, if the disk is too full.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"newSize" is the new length of the file
+//----------------------------------------------------------------------
+
+bool FileHeader::ExtendCompressed(PersistentBitmap *freeMap, int newSize) {
+    int newSectors = divRoundUp(newSize, ChunkBytes) * ChunkSectors;
+    int *list, *cursor;
+    char *inlined = NULL;
+    bool built;
+
+    if (freeMap->NumClear() < IndexSectors(newSectors * SectorSize) + (inlineMode ? ChunkSectors : 0))
+        return FALSE;
+
+    DEBUG(dbgFile, "Extending compressed file from " << numBytes << " to " << newSize << " bytes");
+    list = new int[newSectors];
+    for (int i = 0; i < newSectors; i++)
+        list[i] = -1;
+    if (inlineMode) {
+        inlined = new char[ChunkBytes];
+        memset(inlined, 0, ChunkBytes);
+        memcpy(inlined, dataSectors, numBytes);
+        for (int i = 0; i < ChunkSectors; i++) {
+            list[i] = freeMap->FindAndSet();
+            ASSERT(list[i] >= 0);
+        }
+    } else {
+        MapSectors(0, numSectors, list);
+    }
+
+    DeallocateIndex(freeMap);
+    numBytes = newSize;
+    numSectors = newSectors;
+    cursor = list;
+    built = AllocateIndex(freeMap, &cursor);
+    ASSERT(built);  // room for the index was checked for above
+    if (inlineMode) {
+        inlineMode = FALSE;
+        kernel->synchDisk->WriteSectors(list, ChunkSectors, inlined);
+        delete[] inlined;
+    }
+    delete[] list;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::AllocateSparse
+// 	Initialize a fresh file header for a file of "fileSize" bytes
+//	that is all holes: no data or index sectors are allocated yet, so
+//	creating a file of any size takes constant time and no space.
+//	Holes read back as zeros; FillHoles allocates them when they are
+//	first written.  A file of at most InlineBytes is kept inline in
+//	the header instead.  Return FALSE if the file is too big.
+//
+//	"fileSize" is the length of the new file
+//	"compress" -- store the file in compressed chunks
+//----------------------------------------------------------------------
+
+bool FileHeader::AllocateSparse(int fileSize, bool compress) {
+    if (fileSize > MaxFileSize)
+        return FALSE;
+    compressed = compress;
+    if (fileSize <= InlineBytes) {
+        // small enough to live in the header, zero filled
+        numBytes = fileSize;
+        numSectors = 0;
+        inlineMode = TRUE;
+        level = LDirect;
+        levelSectors = 0;
+        memset(dataSectors, 0, sizeof(dataSectors));
+        return TRUE;
+    }
+    numBytes = fileSize;
+    numSectors = divRoundUp(fileSize, compress ? ChunkBytes : SectorSize);
+    if (compress)
+        numSectors *= ChunkSectors;  // whole chunks
+    extentMode = FALSE;
+    numExtents = 0;
+    InitLevel();
+    levelSectors = divRoundUp(numSectors * SectorSize, sizePerPointer[level]);
+    memset(dataSectors, -1, sizeof(dataSectors));
+    if (level != LDirect) {
+        nextIndexBlocks = new IndexBlock *[NumPointers];
+        memset(nextIndexBlocks, 0, sizeof(IndexBlock *) * NumPointers);
+    }
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::FillHoles
+// 	Allocate the holes among the sectors holding bytes "from" up to
+//	"to" of a sparse file, with the index blocks they need.  The
+//	caller must write the header back.
+//
+//	Return FALSE, changing nothing, if the disk is too full.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"from", "to" -- the bytes about to be written
+//----------------------------------------------------------------------
+
+bool FileHeader::FillHoles(PersistentBitmap *freeMap, int from, int to) {
+    int holes = 0;
+
+    if (inlineMode || extentMode || from >= to)
+        return TRUE;  // inline and extent files have no holes
+    for (int i = from / SectorSize; i < divRoundUp(to, SectorSize); i++)
+        if (ByteToSector(i * SectorSize) == -1)
+            holes++;
+    if (holes == 0)
+        return TRUE;
+    // at most one new index block per level for each NumSectorInt sectors
+    if (freeMap->NumClear() < holes + 3 * (divRoundUp(holes, NumSectorInt) + 1))
+        return FALSE;
+
+    DEBUG(dbgFile, "Filling " << holes << " holes for bytes " << from << " to " << to);
+    DropSectorMap();
+    for (int i = from / sizePerPointer[level]; i < levelSectors && i * sizePerPointer[level] < to; i++) {
+        if (dataSectors[i] == -1) {
+            dataSectors[i] = freeMap->FindAndSet();
+            ASSERT(dataSectors[i] >= 0);
+            if (level != LDirect) {
+                nextIndexBlocks[i] = new IndexBlock(level - 1);
+                nextIndexBlocks[i]->InitHoles(ChildSize(i));
+            }
+        }
+        if (level != LDirect) {
+            int base = i * sizePerPointer[level];
+            GetIndexBlock(i)->FillHoles(freeMap, max(from - base, 0), min(to - base, ChildSize(i)));
+        }
+    }
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::PunchHoles
+// 	Free the data sectors holding bytes "from" up to "to" of an
+//	indexed file, which then read as zeros.  Used for the tail of a
+//	compressed chunk that has shrunk.  Index blocks are kept.  The
+//	caller must write the header back.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"from", "to" -- the bytes to free, on sector boundaries
+//----------------------------------------------------------------------
+
+void FileHeader::PunchHoles(PersistentBitmap *freeMap, int from, int to) {
+    ASSERT(!inlineMode && !extentMode);
+    DEBUG(dbgFile, "Punching holes for bytes " << from << " to " << to);
+    DropSectorMap();
+    for (int i = from / sizePerPointer[level]; i < levelSectors && i * sizePerPointer[level] < to; i++) {
+        if (dataSectors[i] == -1)
+            continue;  // already a hole
+        if (level == LDirect) {
+            ASSERT(freeMap->Test(dataSectors[i]));
+            freeMap->Clear(dataSectors[i]);
+            dataSectors[i] = -1;
+        } else {
+            int base = i * sizePerPointer[level];
+            GetIndexBlock(i)->PunchHoles(freeMap, max(from - base, 0), min(to - base, ChildSize(i)));
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// FileHeader::Share
+// 	Initialize a fresh file header as a clone of "source": the same
+//	length and layout, and the same data sectors, each given one more
+//	owner in the free map.  Nothing is copied; the data of an inline
+//	file, which lives in the header, is the exception.  Both headers
+//	are marked shared.  The caller must write both back.
+//
+//	Return FALSE if the free map has no share counts, a sector already
+//	has too many owners, or there is no room for the index blocks; the
+//	caller must then revert the free map.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"source" is the header of the file to be cloned
+//----------------------------------------------------------------------
+
+bool FileHeader::Share(PersistentBitmap *freeMap, FileHeader *source) {
+    int *list, *cursor;
+    bool success = TRUE;
+
+    numBytes = source->numBytes;
+    compressed = source->compressed;
+    if (source->inlineMode) {
+        numSectors = 0;
+        inlineMode = TRUE;
+        level = LDirect;
+        levelSectors = 0;
+        memcpy(dataSectors, source->dataSectors, sizeof(dataSectors));
+        return TRUE;
+    }
+    numSectors = source->numSectors;
+    list = new int[numSectors];
+    source->MapSectors(0, numSectors, list);
+    for (int i = 0; i < numSectors && success; i++)
+        if (list[i] != -1)
+            success = freeMap->Share(list[i]);
+    // the same layout, but with index blocks of its own
+    if (success && (compressed || !BuildExtents(list))) {
+        if (freeMap->NumClear() < IndexSectors(numSectors * SectorSize)) {
+            success = FALSE;
+        } else {
+            cursor = list;
+            success = AllocateIndex(freeMap, &cursor);
+        }
+    }
+    delete[] list;
+    if (success) {
+        DEBUG(dbgFile, "Sharing " << numSectors << " sectors with a clone");
+        shared = source->shared = TRUE;
+        kernel->stats->numSharedSectors += numSectors;
+    }
+    return success;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::Unshare
+// 	Give the sectors holding bytes "from" up to "to" that are still
+//	shared with another file new sectors of the file's own, letting go
+//	of the old ones, so the write about to go there does not show
+//	through in the other file.  Their data is not copied: the caller
+//	writes every byte of them.  Indexed files have the pointers
+//	changed in place; extent files are laid out again, as extents if
+//	they still fit and as an index tree otherwise.  The caller must
+//	write the header back.
+//
+//	Return FALSE, changing nothing, if the disk is too full.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"from", "to" -- the bytes about to be written
+//----------------------------------------------------------------------
+
+bool FileHeader::Unshare(PersistentBitmap *freeMap, int from, int to) {
+    int first = from / SectorSize, count = divRoundUp(to, SectorSize) - first;
+    int moved = 0, *list, *cursor;
+    bool built;
+
+    if (!shared || inlineMode || from >= to)
+        return TRUE;
+    list = new int[count];
+    MapSectors(first, count, list);
+    for (int i = 0; i < count; i++)
+        if (list[i] != -1 && freeMap->IsShared(list[i]))
+            moved++;
+    delete[] list;
+    if (moved == 0)
+        return TRUE;
+    if (freeMap->NumClear() < moved + (extentMode ? IndexSectors(numSectors * SectorSize) : 0))
+        return FALSE;
+
+    DEBUG(dbgFile, "Unsharing " << moved << " sectors for bytes " << from << " to " << to);
+    kernel->stats->numUnsharedSectors += moved;
+    DropSectorMap();
+    if (extentMode) {
+        list = new int[numSectors];
+        MapSectors(0, numSectors, list);
+        for (int i = first; i < first + count; i++) {
+            if (freeMap->IsShared(list[i])) {
+                freeMap->Clear(list[i]);  // one owner fewer
+                list[i] = freeMap->FindAndSet();
+                ASSERT(list[i] >= 0);
+            }
+        }
+        DeallocateIndex(freeMap);
+        if (!BuildExtents(list)) {
+            cursor = list;
+            built = AllocateIndex(freeMap, &cursor);
+            ASSERT(built);  // room for the index was checked for above
+        }
+        delete[] list;
+    } else {
+        for (int i = from / sizePerPointer[level]; i < levelSectors && i * sizePerPointer[level] < to; i++) {
+            if (dataSectors[i] == -1)
+                continue;  // a hole
+            if (level == LDirect) {
+                if (freeMap->IsShared(dataSectors[i])) {
+                    freeMap->Clear(dataSectors[i]);
+                    dataSectors[i] = freeMap->FindAndSet();
+                    ASSERT(dataSectors[i] >= 0);
+                }
+            } else {
+                int base = i * sizePerPointer[level];
+                GetIndexBlock(i)->Unshare(freeMap, max(from - base, 0), min(to - base, ChildSize(i)));
+            }
+        }
+    }
+    return TRUE;
+}
+// MP4 end
+
+// MP4 start
+//----------------------------------------------------------------------
+// FileHeader::CopyToRun
+// 	The first half of relocating a scattered file: mark one run of
+//	free sectors, found from the free map's goal onwards, and copy
+//	the data into it, MaxReadRun sectors at a time.  The copies are
+//	written straight to disk, so none is pinned by a transaction.
+//	The header still points at the old sectors; SwitchToRun moves it
+//	over.
+//
+//	Return the run's first sector, or -1, changing nothing, if the
+//	file is inline, sparse, compressed, shared with a clone (moving
+//	it would copy the shared sectors) or already in one run without
+//	index blocks, or if the disk has no free run long enough.
+//
+//	"freeMap" is the bit map of free disk sectors
+//----------------------------------------------------------------------
+
+int FileHeader::CopyToRun(PersistentBitmap *freeMap) {
+    int *list;
+    char *buffer;
+    int runs = 0, start, n;
+
+    if (inlineMode || numSectors == 0 || compressed || shared)
+        return -1;  // no data sectors, or must stay as it is
+    list = new int[numSectors];
+    MapSectors(0, numSectors, list);
+    for (int i = 0; i < numSectors; i++) {
+        if (list[i] == -1) {  // a hole: sparse files stay as they are
+            delete[] list;
+            return -1;
+        }
+        if (i == 0 || list[i] != list[i - 1] + 1)
+            runs++;
+    }
+    if (runs == 1 && (extentMode || level == LDirect)) {
+        delete[] list;
+        return -1;  // nothing to gather
+    }
+    start = freeMap->FindAndSetRange(numSectors);
+    if (start == -1) {
+        delete[] list;
+        return -1;
+    }
+
+    buffer = new char[MaxReadRun * SectorSize];
+    for (int i = 0; i < numSectors; i += n) {
+        n = min(MaxReadRun, numSectors - i);
+        kernel->synchDisk->ReadSectors(&list[i], n, buffer);
+        kernel->synchDisk->WriteThrough(start + i, n, buffer);
+    }
+    delete[] buffer;
+    delete[] list;
+    return start;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::SwitchToRun
+// 	The second half of relocating a file: free the old data sectors
+//	and any index blocks, and rebuild the header as the single extent
+//	CopyToRun copied the data into.
+//
+//	"freeMap" is the bit map of free disk sectors
+//	"start" is the run's first sector, as CopyToRun returned it
+//----------------------------------------------------------------------
+
+void FileHeader::SwitchToRun(PersistentBitmap *freeMap, int start) {
+    int *list = new int[numSectors];
+    bool built;
+
+    MapSectors(0, numSectors, list);
+    for (int i = 0; i < numSectors; i++) {
+        ASSERT(freeMap->Test(list[i]));  // ought to be marked!
+        freeMap->Clear(list[i]);
+        list[i] = start + i;
+    }
+    DeallocateIndex(freeMap);
+    built = BuildExtents(list);  // one run, so always fits
+    ASSERT(built);
+    delete[] list;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::Measure
+// 	Add this file to "stats": its data sectors, the runs of
+//	contiguous sectors they make, its index block sectors, and the
+//	time the disk would spend seeking to read it front to back,
+//	starting at the header.
+//
+//	"sector" is the disk sector containing the file header
+//	"stats" is where the totals are kept
+//----------------------------------------------------------------------
+
+void FileHeader::Measure(int sector, FragmentStats *stats) {
+    int track = sector / SectorsPerTrack;
+    int runs = 0, prev = -1, sec;
+    int *list;
+
+    stats->files++;
+    if (inlineMode)
+        return;  // read with the header
+    list = new int[numSectors];
+    MapSectors(0, numSectors, list);
+    for (int i = 0; i < numSectors; i++) {
+        sec = list[i];
+        if (sec == -1)
+            continue;  // a hole takes no disk space
+        if (prev == -1 || sec != prev + 1) {
+            runs++;
+            stats->seekTicks += (double) abs(sec / SectorsPerTrack - track) * SeekTime;
+            track = sec / SectorsPerTrack;
+        }
+        stats->sectors++;
+        prev = sec;
+    }
+    delete[] list;
+    stats->runs += runs;
+    if (runs > 1)
+        stats->fragmented++;
+    if (!extentMode && level != LDirect)
+        stats->indexSectors += IndexSectors(numSectors * SectorSize);
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // FileHeader::Deallocate
 // 	De-allocate all the space allocated for data blocks for this file.
@@ -319,12 +1415,26 @@ void FileHeader::Deallocate(PersistentBitmap *freeMap) {
     //     freeMap->Clear((int)dataSectors[i]);
     // }
 
+    if (inlineMode)
+        return;  // no data sectors
+    if (extentMode) {
+        for (int i = 0; i < numExtents; i++) {
+            for (int j = 0; j < dataSectors[2 * i + 1]; j++) {
+                ASSERT(freeMap->Test(dataSectors[2 * i] + j));  // ought to be marked!
+                freeMap->Clear(dataSectors[2 * i] + j);
+            }
+        }
+        return;
+    }
     if (level != LDirect) {
         for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i]->Deallocate(freeMap);
+            if (dataSectors[i] != -1)  // skip holes
+                GetIndexBlock(i)->Deallocate(freeMap);
         }
     }
     for (int i = 0; i < levelSectors; i++) {
+        if (dataSectors[i] == -1)
+            continue;  // a hole
         ASSERT(freeMap->Test((int)dataSectors[i]));  // ought to be marked!
         freeMap->Clear((int)dataSectors[i]);
     }
@@ -359,16 +1469,30 @@ void FileHeader::FetchFrom(int sector) {
     memcpy(&dataSectors, buf + offset, sizeof(dataSectors));
     offset += sizeof(dataSectors);
 
+    compressed = (numSectors & CompressFlag) != 0;
+    shared = (numSectors & SharedFlag) != 0;
+    numSectors &= ~(CompressFlag | SharedFlag);
+    if (numSectors & InlineFlag) {
+        numSectors = 0;
+        inlineMode = TRUE;
+        level = LDirect;
+        levelSectors = 0;
+        return;
+    }
+    if (numSectors & ExtentFlag) {
+        numSectors &= ~ExtentFlag;
+        extentMode = TRUE;
+        InitExtents();
+        return;
+    }
+
     InitLevel();
 
-    levelSectors = divRoundUp(numBytes, sizePerPointer[level]);
+    levelSectors = divRoundUp(numSectors * SectorSize, sizePerPointer[level]);
     if (level != LDirect) {
+        // index blocks are read on demand, see GetIndexBlock
         nextIndexBlocks = new IndexBlock *[NumPointers];
         memset(nextIndexBlocks, 0, sizeof(IndexBlock *) * NumPointers);
-        for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i] = new IndexBlock(level - 1);
-            nextIndexBlocks[i]->FetchFrom(dataSectors[i], (i == levelSectors - 1 && numBytes % sizePerPointer[level] ? numBytes % sizePerPointer[level] : sizePerPointer[level]));
-        }
     }
     // MP4 end
 }
@@ -397,13 +1521,22 @@ void FileHeader::WriteBack(int sector) {
     */
     char buf[FileHeaderDiskSize];
     int offset = 0;
+    int diskSectors = extentMode ? (numSectors | ExtentFlag) : numSectors;
+    if (inlineMode)
+        diskSectors = InlineFlag;
+    if (compressed)
+        diskSectors |= CompressFlag;
+    if (shared)
+        diskSectors |= SharedFlag;
     memcpy(buf + offset, &numBytes, sizeof(numBytes));
     offset += sizeof(numBytes);
-    memcpy(buf + offset, &numSectors, sizeof(numSectors));
-    offset += sizeof(numSectors);
+    memcpy(buf + offset, &diskSectors, sizeof(diskSectors));
+    offset += sizeof(diskSectors);
     memcpy(buf + offset, &dataSectors, sizeof(dataSectors));
     offset += sizeof(dataSectors);
     kernel->synchDisk->WriteSector(sector, buf);
+    if (cacheSector != sector)
+        Invalidate(sector);  // a cached copy of this header is now stale
 
     if (level != LDirect) {
         for (int i = 0; i < levelSectors; i++) {
@@ -433,16 +1566,87 @@ int FileHeader::ByteToSector(int offset) {
     // return (dataSectors[offset / SectorSize]);
 
     int sec = -1;
-    if (level == LDirect) {
-        sec = dataSectors[offset / sizePerPointer[level]];
+    ASSERT(!inlineMode);  // inline data has no sectors
+    if (extentMode) {
+        int fileSector = offset / SectorSize;
+        int e = FindExtent(fileSector);
+        sec = dataSectors[2 * e] + (fileSector - extentFirst[e]);
+    } else if (level == LDirect) {
+        sec = dataSectors[offset / sizePerPointer[level]];  // -1 for a hole
     } else {
         int levelSector = offset / sizePerPointer[level];
-        sec = nextIndexBlocks[levelSector]->ByteToSector(offset - levelSector * sizePerPointer[level]);
+        sec = SectorMap(levelSector)[(offset - levelSector * sizePerPointer[level]) / SectorSize];
     }
     return sec;
     // MP4 end
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// FileHeader::FindExtent
+// 	Return the extent holding file sector "fileSector": a binary
+//	search for the last extent starting at or before it.
+//----------------------------------------------------------------------
+
+int FileHeader::FindExtent(int fileSector) {
+    int lo = 0, hi = numExtents - 1;
+
+    ASSERT(extentMode && fileSector < numSectors);
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (extentFirst[mid] <= fileSector)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+//----------------------------------------------------------------------
+// FileHeader::MapSectors
+// 	Translate "count" consecutive file sectors, from "first" on, to
+//	the disk sectors holding them, into "sectors" (-1 for holes).
+//	Where ByteToSector looks up one sector, this copies a whole run
+//	out of the flat SectorMap of each top-level pointer the range
+//	covers, so reading a file in order costs O(1) per sector.  In an
+//	extent file, each extent is expanded in turn.
+//
+//	"first" -- the first file sector wanted
+//	"count" -- how many; first + count is at most the file's sectors
+//	"sectors" -- where the disk sector numbers go
+//----------------------------------------------------------------------
+
+void FileHeader::MapSectors(int first, int count, int *sectors) {
+    if (count <= 0)
+        return;  // e.g. Extend of an inline file
+    ASSERT(!inlineMode);  // inline data has no sectors
+    ASSERT(first >= 0 && first + count <= numSectors);
+    if (extentMode) {
+        for (int e = FindExtent(first); count > 0; e++) {
+            int n = min(count, extentFirst[e] + dataSectors[2 * e + 1] - first);
+            for (int i = 0; i < n; i++)
+                sectors[i] = dataSectors[2 * e] + (first - extentFirst[e]) + i;
+            first += n;
+            count -= n;
+            sectors += n;
+        }
+    } else if (level == LDirect) {
+        memcpy(sectors, &dataSectors[first], count * sizeof(int));
+    } else {
+        int perChild = sizePerPointer[level] / SectorSize;
+        while (count > 0) {
+            int i = first / perChild;
+            int n = min(count, (i + 1) * perChild - first);
+
+            memcpy(sectors, &SectorMap(i)[first - i * perChild], n * sizeof(int));
+            first += n;
+            count -= n;
+            sectors += n;
+        }
+    }
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // FileHeader::FileLength
 // 	Return the number of bytes in the file.
@@ -456,41 +1660,73 @@ int FileHeader::FileLength() {
 // FileHeader::Print
 // 	Print the contents of the file header, and the contents of all
 //	the data blocks pointed to by the file header.
+//
+//	MP4: everything goes to "out", a buffer written out in large
+//	pieces.  The data is read in order, DumpRunSectors file sectors
+//	at a time through MapSectors and ReadSectors, so each physically
+//	contiguous run is one disk request.  Each sector's data is a line;
+//	a hole reads as zeros.  With "contents" clear, only the header
+//	and the sectors it points to are printed.
 //----------------------------------------------------------------------
 
-void FileHeader::Print() {
+void FileHeader::Print(Listing *out, bool contents) {
     // MP4 start
     // if (debug->IsEnabled('f'))
     //     printf("FileHeader::Print()\n");
 
-    int i, j, k;
-    char *data = new char[SectorSize];
+    int i, n, run, first;
 
-    printf("FileHeader contents.  File size: %d.  File blocks:\n", numBytes);
-    for (i = 0; i < levelSectors; i++)
-        printf("%d ", dataSectors[i]);
-    if (level != LDirect) {
-        for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i]->PrintSectors();
+    out->Printf("FileHeader contents.  File size: %d.  File blocks:\n", numBytes);
+    if (inlineMode) {
+        out->Printf("(inline)\n");
+        if (contents) {
+            out->Printf("File contents:\n");
+            out->AddBytes(InlineData(), numBytes);
+            out->Printf("\n");
         }
+        return;
     }
-    printf("\nFile contents:\n");
-    for (i = k = 0; i < levelSectors; i++) {
-        kernel->synchDisk->ReadSector(dataSectors[i], data);
-        for (j = 0; (j < SectorSize) && (k < numBytes); j++, k++) {
-            if ('\040' <= data[j] && data[j] <= '\176')  // isprint(data[j])
-                printf("%c", data[j]);
-            else
-                printf("\\%x", (unsigned char)data[j]);
+    if (extentMode) {
+        for (i = 0; i < numSectors; i++)
+            out->Printf("%d ", ByteToSector(i * SectorSize));
+    } else {
+        for (i = 0; i < levelSectors; i++)
+            out->Printf("%d ", dataSectors[i]);
+        if (level != LDirect) {
+            for (i = 0; i < levelSectors; i++) {
+                if (dataSectors[i] != -1)  // skip holes
+                    GetIndexBlock(i)->PrintSectors(out);
+            }
         }
-        printf("\n");
     }
-    delete[] data;
-    if (level != LDirect) {
-        for (int i = 0; i < levelSectors; i++) {
-            nextIndexBlocks[i]->PrintContents();
+    out->Printf("\n");
+    if (!contents)
+        return;
+
+    int sectors[DumpRunSectors];
+    char *data = new char[DumpRunSectors * SectorSize];
+
+    out->Printf("File contents:\n");
+    for (first = 0; first < numSectors; first += n) {
+        n = min(DumpRunSectors, numSectors - first);
+        MapSectors(first, n, sectors);
+        for (i = 0; i < n; i += run) {
+            run = 1;
+            if (sectors[i] == -1) {
+                memset(&data[i * SectorSize], 0, SectorSize);
+                continue;
+            }
+            while (i + run < n && sectors[i + run] != -1)
+                run++;
+            kernel->synchDisk->ReadSectors(&sectors[i], run, &data[i * SectorSize]);
+        }
+        for (i = 0; i < n; i++) {
+            out->AddBytes(&data[i * SectorSize],
+                          min(SectorSize, numBytes - (first + i) * SectorSize));
+            out->Printf("\n");
         }
     }
+    delete[] data;
     // MP4 end
 }
 
@@ -498,7 +1734,8 @@ int FileHeader::GetHeaderSize() {
     int ret = SectorSize;
     if (level != LDirect) {
         for (int i = 0; i < levelSectors; i++) {
-            ret += nextIndexBlocks[i]->GetIndexBlockSize();
+            if (dataSectors[i] != -1)  // MP4: holes take no space
+                ret += GetIndexBlock(i)->GetIndexBlockSize();
         }
     }
     return ret;
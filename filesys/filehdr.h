@@ -18,29 +18,69 @@
 #include "pbitmap.h"
 
 // MP4 start
+// The layout follows from SectorSize.  With bigger sectors the deeper
+// index levels would reach past the end of the disk (and overflow an
+// int), so each reach is capped at the size of the disk; a capped
+// level is never needed, since the one below it already covers the disk.
+const double DiskBytes = ((double) NumSectors * SectorSize);
+#define CapToDisk(bytes) ((int) min((double) (bytes), DiskBytes))
+
 const int NumSectorInt = (SectorSize / sizeof(int));
 const int NumPointers = ((SectorSize - 2 * sizeof(int)) / sizeof(int));
-const int MaxDirectBytes = (NumPointers * SectorSize);
-const int MaxSingleIndirectBytes = (NumPointers * NumSectorInt * SectorSize);
-const int MaxDoubleIndirectBytes = (NumPointers * NumSectorInt * NumSectorInt * SectorSize);
-const int MaxTripleIndirectBytes = (NumPointers * NumSectorInt * NumSectorInt * NumSectorInt * SectorSize);
+const int MaxDirectBytes = CapToDisk((double) NumPointers * SectorSize);
+const int MaxSingleIndirectBytes = CapToDisk((double) NumPointers * NumSectorInt * SectorSize);
+const int MaxDoubleIndirectBytes = CapToDisk((double) NumPointers * NumSectorInt * NumSectorInt * SectorSize);
+const int MaxTripleIndirectBytes = CapToDisk((double) NumPointers * NumSectorInt * NumSectorInt * NumSectorInt * SectorSize);
 const int MaxFileSize = (MaxTripleIndirectBytes);
 const int FileHeaderDiskSize = (sizeof(int) + sizeof(int) + NumPointers * SectorSize);
-const int sizePerPointer[4] = {SectorSize, NumSectorInt *SectorSize, NumSectorInt *NumSectorInt *SectorSize, NumSectorInt *NumSectorInt *NumSectorInt *SectorSize};
+const int sizePerPointer[4] = {SectorSize, CapToDisk((double) NumSectorInt * SectorSize), CapToDisk((double) NumSectorInt * NumSectorInt * SectorSize), CapToDisk((double) NumSectorInt * NumSectorInt * NumSectorInt * SectorSize)};
+const int maxLevelBytes[4] = {MaxDirectBytes, MaxSingleIndirectBytes, MaxDoubleIndirectBytes, MaxTripleIndirectBytes};
+const int NumExtents = (NumPointers / 2);  // (start, length) pairs in an extent header
+const int ExtentFlag = (1 << 30);          // set in the on-disk numSectors of an extent header
+const int InlineFlag = (1 << 29);          // set in the on-disk numSectors of an inline header
+const int CompressFlag = (1 << 28);        // set in the on-disk numSectors of a compressed file
+const int SharedFlag = (1 << 27);          // set in the on-disk numSectors of a cloned file
+const int ChunkSectors = 16;               // a compressed file is stored in chunks of this many
+const int ChunkBytes = (ChunkSectors * SectorSize);  //  sectors, see OpenFile::ReadChunk
+const int InlineBytes = (NumPointers * sizeof(int));  // data that fits in place of the pointers
+const int NumCachedHeaders = 32;           // headers kept in the in-core header cache
+const int GrowSectors = 8;                 // a growing file is given sectors in batches of this many
+const int DumpRunSectors = 32;             // data sectors Print reads with one ReadSectors
 // Mp4 end
 
+class Listing;  // MP4: see directory.h
+
+// MP4 start
+// How scattered a set of files is on disk, as added up by
+// FileHeader::Measure (see FileSystem::Defragment).
+struct FragmentStats {
+    int files;          // files measured
+    int fragmented;     // of them, those in more than one run
+    int sectors;        // their data sectors
+    int runs;           // runs of contiguous data sectors
+    int indexSectors;   // index block sectors
+    double seekTicks;   // seek time to read each file front to back,
+                        //  starting at its header
+};
+// MP4 end
+
 // MP4 Start
 class IndexBlock {
    public:
     IndexBlock(int level);
     ~IndexBlock();
-    bool Allocate(PersistentBitmap *freeMap, int remSize);
+    bool Allocate(PersistentBitmap *freeMap, int remSize, int **source);
     void Deallocate(PersistentBitmap *freeMap);
+    void DeallocateIndex(PersistentBitmap *freeMap);
+    void InitHoles(int remSize);                                  // MP4: sparse
+    void FillHoles(PersistentBitmap *freeMap, int from, int to);  // MP4: sparse
+    void PunchHoles(PersistentBitmap *freeMap, int from, int to); // MP4: compressed
+    void Unshare(PersistentBitmap *freeMap, int from, int to);    // MP4: cloned
     void FetchFrom(int sector, int remSize);
     void WriteBack(int sector);
     int ByteToSector(int offset);
-    void PrintSectors();
-    void PrintContents();
+    void MapSectors(int first, int count, int *sectors);  // MP4
+    void PrintSectors(Listing *out);
     int GetIndexBlockSize();
 
    private:
@@ -49,7 +89,9 @@ class IndexBlock {
     int numSectors;
     int levelSectors;
     int nextSectors[NumSectorInt];
-    IndexBlock **nextIndexBlocks;
+    IndexBlock **nextIndexBlocks;  // NULL entries not loaded yet
+    int ChildSize(int i);
+    IndexBlock *GetChild(int i);
 };
 // MP4 end
 
@@ -67,6 +109,31 @@ class IndexBlock {
 // There is no constructor; rather the file header can be initialized
 // by allocating blocks for the file (if it is a new file), or by
 // reading it from disk.
+//
+// MP4: whenever a file's data fits in at most NumExtents contiguous
+// runs of sectors, the header is kept in "extent" form instead:
+// dataSectors[] holds (startSector, length) pairs and no index blocks
+// are used.  ExtentFlag in the on-disk numSectors tells the two apart.
+//
+// MP4: a file of at most InlineBytes bytes keeps its data in the header
+// sector itself, in place of dataSectors[] (InlineFlag), and has no
+// data sectors at all; it is moved out to sectors when it grows past
+// that.
+//
+// MP4: files can be sparse.  A -1 pointer, in the header or in an index
+// block, is a hole: the bytes under it read as zeros and take no disk
+// space until they are first written.
+//
+// MP4: a file can be created compressed (CompressFlag).  Its data is
+// kept in chunks of ChunkSectors file sectors; a chunk that compresses
+// well only needs its first few sectors, and the rest are holes (see
+// OpenFile::ReadChunk).  A compressed file is always indexed, never in
+// extent form, so that holes can be made in it again.
+//
+// MP4: a clone of a file starts out with the same data sectors (see
+// FileSystem::Clone); the free map counts their owners.  Both headers
+// are marked shared (SharedFlag), and a write to one of them first
+// moves the sectors it covers that are still shared to new ones.
 
 class FileHeader {
    public:
@@ -79,6 +146,28 @@ class FileHeader {
                                                             //  on disk for the file data
     void Deallocate(PersistentBitmap *bitMap);              // De-allocate this file's
                                                             //  data blocks
+    bool Extend(PersistentBitmap *bitMap, int newSize);     // MP4: grow the file,
+                                                            //  allocating new blocks
+    bool AllocateSparse(int fileSize, bool compress = FALSE);
+                                                            // MP4: initialize a
+                                                            //  header with no blocks
+    bool FillHoles(PersistentBitmap *bitMap, int from, int to);
+                                                            // MP4: allocate the holes
+                                                            //  a write will cover
+    void PunchHoles(PersistentBitmap *bitMap, int from, int to);
+                                                            // MP4: free the sectors
+                                                            //  of a byte range
+    int CopyToRun(PersistentBitmap *bitMap);                // MP4: copy the data
+                                                            //  into one run
+    void SwitchToRun(PersistentBitmap *bitMap, int start);  // MP4: and point
+                                                            //  the header at it
+    bool Share(PersistentBitmap *bitMap, FileHeader *source);
+                                                            // MP4: initialize a
+                                                            //  clone of "source"
+    bool Unshare(PersistentBitmap *bitMap, int from, int to);
+                                                            // MP4: copy on write
+    void Measure(int sectorNumber, FragmentStats *stats);   // MP4: add up how
+                                                            //  scattered it is
 
     void FetchFrom(int sectorNumber);  // Initialize file header from disk
     void WriteBack(int sectorNumber);  // Write modifications to file header
@@ -87,14 +176,38 @@ class FileHeader {
     int ByteToSector(int offset);  // Convert a byte offset into the file
                                    // to the disk sector containing
                                    // the byte
+    void MapSectors(int first, int count, int *sectors);
+                                   // MP4: ByteToSector for "count"
+                                   // file sectors from "first" on,
+                                   // in one walk down the tree
 
     int FileLength();  // Return the length of the file
                        // in bytes
 
-    void Print();  // Print the contents of the file.
+    void Print(Listing *out, bool contents = TRUE);
+                   // Print the contents of the file.
+                   // MP4: to "out", the header alone
+                   // unless "contents"; the data is
+                   // read DumpRunSectors at a time
 
     int GetHeaderSize();
 
+    // MP4 start
+    bool IsInline() { return inlineMode; }  // data kept in the header?
+    char *InlineData() { return (char *)dataSectors; }
+    bool IsCompressed() { return compressed; }  // stored in chunks?
+    bool IsShared() { return shared; }  // sectors shared with a clone?
+    // MP4 end
+
+    // MP4 start
+    static FileHeader *Acquire(int sectorNumber);  // Share the cached header
+                                                   //  stored at sectorNumber
+    static void Release(FileHeader *hdr);          // Drop a reference from
+                                                   //  Acquire
+    static void Invalidate(int sectorNumber);      // Forget the cached copy,
+                                                   //  e.g. when it is removed
+    // MP4 end
+
    private:
     /*
             MP4 hint:
@@ -105,8 +218,8 @@ class FileHeader {
             In order to implement a data structure, you will need to add some "in-core" data
             to maintain data structure.
 
-            Disk Part - numBytes, numSectors, dataSectors occupy exactly 128 bytes and will be
-            written to a sector on disk.
+            Disk Part - numBytes, numSectors, dataSectors occupy exactly one sector (SectorSize
+            bytes) and will be written to a sector on disk.
             In-core part - none
 
     */
@@ -114,6 +227,8 @@ class FileHeader {
     // MP4 start
     int numBytes;                  // Number of bytes in the file
     int numSectors;                // Number of data sectors in the file
+                                   // (MP4: including any preallocated
+                                   // past the end of the file)
     int dataSectors[NumPointers];  // Disk sector numbers for each data
                                    // block in the file
     void InitLevel();
@@ -123,7 +238,33 @@ class FileHeader {
            LTriple
     } level;
     int levelSectors;
-    IndexBlock **nextIndexBlocks;
+    IndexBlock **nextIndexBlocks;  // NULL entries not loaded yet
+    IndexBlock *GetIndexBlock(int i);
+    int ChildSize(int i);
+    int **sectorMap;               // for each top-level pointer, the
+                                   //  disk sectors under it, in one
+                                   //  array; NULL entries not built yet
+    int *SectorMap(int i);
+    void DropSectorMap();          // forget it, when the tree changes
+
+    bool inlineMode;               // dataSectors holds the file's data
+    bool compressed;               // data is stored in compressed chunks
+    bool shared;                   // cloned, or the source of a clone
+    bool ExtendCompressed(PersistentBitmap *freeMap, int newSize);
+    bool extentMode;               // dataSectors holds extents
+    int numExtents;                // number of extents in use
+    int extentFirst[NumExtents];   // file sector at which each extent starts
+    bool AllocateExtents(PersistentBitmap *freeMap);
+    bool AllocateIndex(PersistentBitmap *freeMap, int **source);
+    void DeallocateIndex(PersistentBitmap *freeMap);
+    bool BuildExtents(int *list);
+    void InitExtents();              // rebuild numExtents and extentFirst
+    int FindExtent(int fileSector);  // the extent holding a file sector
+    bool AppendExtents(PersistentBitmap *freeMap, int count);
+    static int IndexSectors(int size);
+
+    int refCount;     // number of Acquire calls not yet released
+    int cacheSector;  // sector this header is cached as, -1 if not cached
     // MP4 end
 };
 
@@ -19,7 +19,14 @@
 //	on bootup.
 //
 //	The file system assumes that the bitmap and directory files are
-//	kept "open" continuously while Nachos is running.
+//	kept "open" continuously while Nachos is running.  MP4: the bitmap
+//	itself is also kept in memory, instead of being read for every
+//	operation.
+//
+//	MP4: sectors are allocated by block group (see pbitmap.h).  A
+//	file's header, index blocks and data go in its directory's
+//	group, or the nearest one after it with room, and each new
+//	directory goes in the emptiest group, to keep seeks short.
 //
 //	For those operations (such as Create, Remove) that modify the
 //	directory and/or bitmap, if the operation succeeds, the changes
@@ -31,6 +38,12 @@
 // 	Our implementation at this point has the following restrictions:
 //
 //	   there is no synchronization for concurrent accesses
+//	    MP4: no longer true -- each directory, and each open file's
+//	    header, has a reader/writer lock, and the free map a lock of
+//	    its own.  Locks are taken in the order directories (top down,
+//	    see Parser), file header, free map, so there is no deadlock;
+//	    the free map and directory files, written under the free map
+//	    lock, are only written by whoever holds it.
 //	   files have a fixed size, set when the file is created
 //	   files cannot be bigger than about 3KB in size
 //	   there is no hierarchical directory structure, and only a limited
@@ -38,6 +51,9 @@
 //	   there is no attempt to make the system robust to failures
 //	    (if Nachos exits in the middle of an operation that modifies
 //	    the file system, it may corrupt the disk)
+//	    MP4: no longer true for metadata -- Create, CreateDirectory,
+//	    Remove, RecursiveRemove and file growth are transactions,
+//	    logged to a journal and replayed at boot (see SynchDisk)
 //
 // Copyright (c) 1992-1993 The Regents of the University of California.
 // All rights reserved.  See copyright.h for copyright notice and limitation
@@ -51,7 +67,10 @@
 #include "directory.h"
 #include "disk.h"
 #include "filehdr.h"
+#include "main.h"
 #include "pbitmap.h"
+#include "synch.h"
+#include "synchdisk.h"
 
 // Sectors containing the file headers for the bitmap of free sectors,
 // and the directory of files.  These file headers are placed in well-known
@@ -59,15 +78,35 @@
 #define FreeMapSector 0
 #define DirectorySector 1
 
-// Initial file sizes for the bitmap and directory; until the file system
-// supports extensible files, the directory size sets the maximum number
-// of files that can be loaded onto the disk.
+// MP4: the metadata journal lives in a fixed region right after them,
+// and the superblock right after that.
+#define JournalSector 2
+#define JournalSectors 256
+#define SuperblockSector (JournalSector + JournalSectors)
+
+// MP4: with checksums, their region follows the superblock.
+#define ChecksumSector (SuperblockSector + (int)SuperblockSectors)
+
+// Initial file sizes for the bitmap and directory.  MP4: directories
+// start with NumDirEntries slots and grow as files are added.
 #define FreeMapFileSize (NumSectors / BitsInByte)
+// MP4: the number of shared sectors, then a count for each
+#define ShareMapFileSize (sizeof(int) + MaxSharedSectors * sizeof(ShareCount))
 // MP4 start
 #define NumDirEntries 64
 // MP4 end
 #define DirectoryFileSize (sizeof(DirectoryEntry) * NumDirEntries)
 
+// MP4: a process's descriptor table starts this big, and doubles.
+// Descriptors below FirstFileDescriptor are the console's
+// (SysConsoleInput and SysConsoleOutput), and are never handed out.
+#define InitDescriptors 8
+#define FirstFileDescriptor 2
+
+// MP4: metadata updates only reach the buffer cache; after this many
+// operations, Sync writes them (and everything else cached) to disk.
+#define SyncInterval 32
+
 //----------------------------------------------------------------------
 // FileSystem::FileSystem
 // 	Initialize the file system.  If format = TRUE, the disk has
@@ -78,16 +117,31 @@
 //	If format = FALSE, we just have to open the files
 //	representing the bitmap and the directory.
 //
+//	MP4: a third file holds the share counts of the sectors of cloned
+//	files; formatting makes it, and the superblock says where it is.
+//
 //	"format" -- should we initialize the disk?
+//	"checksums" -- MP4: when formatting, checksum every sector
 //----------------------------------------------------------------------
 
-FileSystem::FileSystem(bool format) {
+FileSystem::FileSystem(bool format, bool checksums) {
     DEBUG(dbgFile, "Initializing the file system.");
+    nameCache = new NameCache();  // MP4
+    opsSinceSync = 0;             // MP4
+    syncDeferred = FALSE;
+    kernelFiles = new FileDescriptorTable();  // MP4
+    dirLocks = new RWLockTable("directory");  // MP4
+    freeMapLock = new Lock("free map");       // MP4
+    numSpareDirectories = 0;                  // MP4
+    compressNew = FALSE;                      // MP4
     if (format) {
-        PersistentBitmap *freeMap = new PersistentBitmap(NumSectors);
+        freeMap = new PersistentBitmap(NumSectors);  // MP4: kept resident
         Directory *directory = new Directory(NumDirEntries);
         FileHeader *mapHdr = new FileHeader;
         FileHeader *dirHdr = new FileHeader;
+        FileHeader *shareHdr = new FileHeader;  // MP4
+        int shareSector;
+        bool allocated;
 
         DEBUG(dbgFile, "Formatting the file system.");
 
@@ -95,12 +149,27 @@ FileSystem::FileSystem(bool format) {
         // (make sure no one else grabs these!)
         freeMap->Mark(FreeMapSector);
         freeMap->Mark(DirectorySector);
+        for (int i = 0; i < JournalSectors; i++)  // MP4
+            freeMap->Mark(JournalSector + i);
+        for (int i = 0; i < (int)SuperblockSectors; i++)
+            freeMap->Mark(SuperblockSector + i);
+        if (checksums) {  // MP4
+            for (int i = 0; i < ChecksumRegionSectors; i++)
+                freeMap->Mark(ChecksumSector + i);
+            kernel->synchDisk->SetChecksums(ChecksumSector, FALSE);
+        }
+        kernel->synchDisk->SetJournal(JournalSector, JournalSectors);
+        kernel->synchDisk->FormatJournal();
 
         // Second, allocate space for the data blocks containing the contents
         // of the directory and bitmap files.  There better be enough space!
 
         ASSERT(mapHdr->Allocate(freeMap, FreeMapFileSize));
         ASSERT(dirHdr->Allocate(freeMap, DirectoryFileSize));
+        shareSector = freeMap->FindAndSet();  // MP4
+        ASSERT(shareSector >= 0);
+        allocated = shareHdr->Allocate(freeMap, ShareMapFileSize);
+        ASSERT(allocated);
 
         // Flush the bitmap and directory FileHeaders back to disk
         // We need to do this before we can "Open" the file, since open
@@ -110,6 +179,7 @@ FileSystem::FileSystem(bool format) {
         DEBUG(dbgFile, "Writing headers back to disk.");
         mapHdr->WriteBack(FreeMapSector);
         dirHdr->WriteBack(DirectorySector);
+        shareHdr->WriteBack(shareSector);  // MP4
 
         // OK to open the bitmap and directory files now
         // The file system operations assume these two files are left open
@@ -117,6 +187,8 @@ FileSystem::FileSystem(bool format) {
 
         freeMapFile = new OpenFile(FreeMapSector);
         directoryFile = new OpenFile(DirectorySector);
+        shareMapFile = new OpenFile(shareSector);  // MP4
+        freeMap->AttachShares(shareMapFile, TRUE);
 
         // Once we have the files "open", we can write the initial version
         // of each file back to disk.  The directory at this point is completely
@@ -128,19 +200,88 @@ FileSystem::FileSystem(bool format) {
         freeMap->WriteBack(freeMapFile);  // flush changes to disk
         directory->WriteBack(directoryFile);
 
+        // MP4: describe the new file system, mounted
+        superblock.magic = SuperblockMagic;
+        superblock.sectorSize = SectorSize;
+        superblock.numSectors = NumSectors;
+        superblock.freeMapSector = FreeMapSector;
+        superblock.directorySector = DirectorySector;
+        superblock.journalSector = JournalSector;
+        superblock.journalSectors = JournalSectors;
+        superblock.checksumSector = checksums ? ChecksumSector : 0;
+        superblock.checksumSectors = checksums ? ChecksumRegionSectors : 0;
+        superblock.shareMapSector = shareSector;
+        WriteSuperblock(FALSE);
+
         if (debug->IsEnabled('f')) {
+            Listing out;  // MP4
+
             freeMap->Print();
-            directory->Print();
+            directory->Print(&out);
+            out.Write();
         }
-        delete freeMap;
         delete directory;
         delete mapHdr;
         delete dirHdr;
+        delete shareHdr;
     } else {
+        // MP4: the superblock says where the journal is, if there is one
+        bool described = ReadSuperblock();
+        if (described) {
+            ASSERT(superblock.sectorSize == SectorSize &&
+                   superblock.numSectors == NumSectors);
+            ASSERT(superblock.freeMapSector == FreeMapSector &&
+                   superblock.directorySector == DirectorySector);
+            kernel->synchDisk->SetJournal(superblock.journalSector,
+                                          superblock.journalSectors);
+        } else {
+            kernel->synchDisk->SetJournal(JournalSector, JournalSectors);
+        }
+
+        // MP4: checksums, if the disk was formatted with them, before
+        // the replay writes anything; their region is only up to date
+        // after a clean unmount
+        if (described && superblock.checksumSectors > 0) {
+            ASSERT(superblock.checksumSectors == ChecksumRegionSectors);
+            kernel->synchDisk->SetChecksums(superblock.checksumSector,
+                                            superblock.clean);
+        }
+
+        // MP4: first replay whatever the journal holds, so the bitmap
+        // and directories we open are consistent
+        int replayed = kernel->synchDisk->Recover();
+        if (replayed < 0) {
+            DEBUG(dbgFile, "No journal on this disk, journaling disabled.");
+            kernel->synchDisk->SetJournal(JournalSector, 0);
+        } else {
+            DEBUG(dbgFile, "Replayed " << replayed << " journal records.");
+        }
+
         // if we are not formatting the disk, just open the files representing
         // the bitmap and directory; these are left open while Nachos is running
         freeMapFile = new OpenFile(FreeMapSector);
         directoryFile = new OpenFile(DirectorySector);
+
+        // MP4: after a clean unmount, with nothing replayed, the
+        // superblock's summary of the free map is still right
+        if (described && superblock.clean && replayed <= 0) {
+            DEBUG(dbgFile, "Clean file system, free map summary loaded.");
+            freeMap = new PersistentBitmap(freeMapFile, NumSectors,
+                                           superblock.groupClear);
+            freeMap->SetGoal(superblock.freeGoal);
+        } else {
+            freeMap = new PersistentBitmap(freeMapFile, NumSectors);
+        }
+        // MP4: disks formatted before clones have no share counts,
+        // and cannot clone files
+        shareMapFile = NULL;
+        if (described && superblock.shareMapSector > 0 &&
+            superblock.shareMapSector < NumSectors) {
+            shareMapFile = new OpenFile(superblock.shareMapSector);
+            freeMap->AttachShares(shareMapFile, FALSE);
+        }
+        if (described)
+            WriteSuperblock(FALSE);  // mounted until we say otherwise
     }
 }
 
@@ -149,35 +290,268 @@ FileSystem::FileSystem(bool format) {
 // FileSystem::~FileSystem
 //----------------------------------------------------------------------
 FileSystem::~FileSystem() {
+    delete kernelFiles;  // MP4
+    if (superblock.magic == SuperblockMagic)
+        WriteSuperblock(TRUE);  // MP4: a clean unmount
+    delete freeMap;  // MP4: already written back by every operation
     delete freeMapFile;
     delete directoryFile;
+    delete shareMapFile;  // MP4
+    delete nameCache;
+    Sync();  // MP4
+    delete dirLocks;  // MP4
+    delete freeMapLock;
+    while (numSpareDirectories > 0)
+        delete spareDirectories[--numSpareDirectories];
 }
 
-void Parser(OpenFile *directoryFile, Directory *&directory, OpenFile *&dirFile, char *&token, int &sector, char *name) {
-    DEBUG(dbgFile, "Parser(" << name << ")");
-    char *next;
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::Sync
+// 	Write every update still held in the buffer cache -- headers,
+//	directories and free map sectors from any number of operations,
+//	merged into contiguous runs -- to disk.  No DEBUG here: this also
+//	runs from ~FileSystem, after the debug object is gone.
+//----------------------------------------------------------------------
 
-    dirFile = directoryFile;
+void FileSystem::Sync() {
+    kernel->synchDisk->Flush();
+    opsSinceSync = 0;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::Snapshot
+// 	Save the disk image to the UNIX file "snapshotFile" (see
+//	SynchDisk::Snapshot), with the superblock marked clean, as if we
+//	had unmounted: a disk restored from it then trusts its summary
+//	instead of rebuilding it.  We are still mounted afterwards.
+//	Return FALSE if the image can't be saved.
+//----------------------------------------------------------------------
+
+bool FileSystem::Snapshot(char *snapshotFile) {
+    bool saved;
+
+    if (superblock.magic == SuperblockMagic)
+        WriteSuperblock(TRUE);  // Syncs everything else first
+    else
+        Sync();
+    saved = kernel->synchDisk->Snapshot(snapshotFile);
+    if (superblock.magic == SuperblockMagic)
+        WriteSuperblock(FALSE);
+    return saved;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::ReadSuperblock
+// 	Fetch the superblock.  Return FALSE, and forget it, if the disk was
+//	formatted before there was one.
+//----------------------------------------------------------------------
 
-    directory = new Directory(NumDirEntries);
+bool FileSystem::ReadSuperblock() {
+    char buffer[SuperblockSectors * SectorSize];
+
+    for (int i = 0; i < (int)SuperblockSectors; i++)
+        kernel->synchDisk->ReadSector(SuperblockSector + i, &buffer[i * SectorSize]);
+    bcopy(buffer, (char *)&superblock, sizeof(Superblock));
+    if (superblock.magic != SuperblockMagic) {
+        superblock.magic = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::WriteSuperblock
+// 	Bring the free map summary in the superblock up to date, and
+//	write it to disk right away.  Marking it "clean" says everything
+//	else is on disk too, so that is written first.  No DEBUG here:
+//	this also runs from ~FileSystem.
+//----------------------------------------------------------------------
+
+void FileSystem::WriteSuperblock(bool clean) {
+    char buffer[SuperblockSectors * SectorSize];
+
+    ASSERT(freeMap->NumGroups() == NumFreeGroups);
+    if (clean)
+        Sync();
+    superblock.clean = clean;
+    superblock.freeGoal = freeMap->Goal();
+    for (int g = 0; g < NumFreeGroups; g++)
+        superblock.groupClear[g] = freeMap->GroupClear(g);
+
+    memset(buffer, 0, sizeof(buffer));
+    bcopy((char *)&superblock, buffer, sizeof(Superblock));
+    for (int i = 0; i < (int)SuperblockSectors; i++)
+        kernel->synchDisk->WriteSector(SuperblockSector + i, &buffer[i * SectorSize]);
+    Sync();
+}
+
+//----------------------------------------------------------------------
+// FileSystem::MetadataUpdated
+// 	Count an operation that changed headers, directories or the free
+//	map, and Sync once SyncInterval of them have piled up.  Call it
+//	after the operation's EndTransaction; inside a transaction still
+//	open (an enclosing one, or another thread's), the Sync waits for
+//	the next operation, since pinned sectors cannot go home yet.
+//----------------------------------------------------------------------
+
+void FileSystem::MetadataUpdated() {
+    if (++opsSinceSync >= SyncInterval && !syncDeferred &&
+        !kernel->synchDisk->InTransaction())
+        Sync();
+}
+
+//----------------------------------------------------------------------
+// FileSystem::DeferSync
+// 	Stop, or resume, the Sync that MetadataUpdated does every
+//	SyncInterval operations, so that a batch of operations stays in
+//	the buffer cache (which still writes back what it has to evict)
+//	and reaches the disk together.  Resuming Syncs at once.
+//
+//	"defer" -- TRUE as the batch starts, FALSE when it is over
+//----------------------------------------------------------------------
+
+void FileSystem::DeferSync(bool defer) {
+    syncDeferred = defer;
+    if (!defer)
+        Sync();
+}
+// MP4 end
+
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::GetDirectory, PutDirectory
+// 	Hand out a Directory for one operation, and take it back, so that
+//	path lookups reuse a few tables instead of allocating one each
+//	time.  A returned directory's contents are unspecified; it must
+//	be read with FetchFrom.  No thread switch can happen in either,
+//	so the spares need no lock.
+//----------------------------------------------------------------------
+
+Directory *FileSystem::GetDirectory() {
+    if (numSpareDirectories > 0)
+        return spareDirectories[--numSpareDirectories];
+    return new Directory(NumDirEntries);
+}
+
+void FileSystem::PutDirectory(Directory *directory) {
+    if (numSpareDirectories < NumSpareDirectories)
+        spareDirectories[numSpareDirectories++] = directory;
+    else
+        delete directory;
+}
+
+//----------------------------------------------------------------------
+// PathComponent, LastComponent
+// 	Copy the next component of "path" into "component" -- at most
+//	FileNameMaxLen characters, all a directory compares -- and return
+//	what follows it; "component" is left empty at the end of the path.
+//	LastComponent tells whether "rest", returned by PathComponent,
+//	holds no further component.
+//----------------------------------------------------------------------
+
+static const char *PathComponent(const char *path, char *component) {
+    int n = 0;
+
+    while (*path == '/')
+        path++;
+    for (; *path != '\0' && *path != '/'; path++) {
+        if (n < FileNameMaxLen)
+            component[n++] = *path;
+    }
+    component[n] = '\0';
+    return path;
+}
+
+static bool LastComponent(const char *rest) {
+    while (*rest == '/')
+        rest++;
+    return *rest == '\0';
+}
+
+//----------------------------------------------------------------------
+// FileSystem::LoadDirectory
+// 	Read the directory whose header is at "dirSector" into
+//	"directory", opening it as "dirFile".  The previous "dirFile" is
+//	closed unless it is the root directory, which is always open.
+//----------------------------------------------------------------------
+
+void FileSystem::LoadDirectory(Directory *directory, OpenFile *&dirFile, int dirSector) {
+    if (dirFile != directoryFile)
+        delete dirFile;
+    if (dirSector == DirectorySector)
+        dirFile = directoryFile;
+    else
+        dirFile = new OpenFile(dirSector);
     directory->FetchFrom(dirFile);
+}
+
+//----------------------------------------------------------------------
+// FileSystem::Parser
+// 	Walk the absolute path "name".  On return, "token" (which must
+//	have room for FileNameMaxLen + 1 characters) is the last
+//	component looked up, "sector" is its file header sector (-1 if it
+//	does not exist), and "dirSector" is the directory it was looked
+//	up in.  "token" is empty if "name" has no components.
+//
+//	Each component is first looked up in the name cache, so a
+//	directory is only read when it holds a name not cached yet.
+//	If "fetchParent" is set, "directory" and "dirFile" are always
+//	left holding the directory at "dirSector", for callers that go
+//	on to change it; otherwise their contents are unspecified.
+//
+//	The directories are locked hand over hand: each one is locked
+//	for reading before the lock on its parent is let go, so the
+//	path cannot change under us, and operations in different
+//	directories go on at once.  The caller is left holding the lock
+//	on "dirSector", and must release it.  Return TRUE if "token" is
+//	the last component of the path; the lock is then held in write
+//	mode if "exclusive" is set.  Otherwise a directory on the way
+//	does not exist, and the lock is held for reading.
+//
+//	With "startSector", "name" is taken relative to that directory
+//	instead of the root.  The caller already holds its lock, for
+//	writing; it is neither taken nor let go here, and "dirSector" may
+//	come back as the start itself.
+//
+//	The caller gives "directory" back with PutDirectory.
+//----------------------------------------------------------------------
+
+bool FileSystem::Parser(const char *name, Directory *&directory, OpenFile *&dirFile, int &dirSector, char *token, int &sector, bool fetchParent, bool exclusive, int startSector) {
+    DEBUG(dbgFile, "Parser(" << name << ")");
+    const char *rest;       // the path after "token"
+    int loadedSector = -1;  // directory now held in "directory"
 
-    token = strtok(name, "/");
-    if (token != NULL) {
-        next = strtok(NULL, "/");
-        sector = directory->Find(token);
-        while (next != NULL && sector != -1) {
-            if (dirFile != directoryFile)
-                delete dirFile;
-            dirFile = new OpenFile(sector);
-            directory->FetchFrom(dirFile);
-
-            token = next;
-            next = strtok(NULL, "/");
+    dirFile = directoryFile;
+    dirSector = (startSector >= 0) ? startSector : DirectorySector;
+    directory = GetDirectory();
+
+    rest = PathComponent(name, token);
+    if (startSector < 0)
+        dirLocks->Acquire(dirSector, exclusive && LastComponent(rest));
+    while (token[0] != '\0') {
+        if (!nameCache->Lookup(dirSector, token, &sector)) {
+            if (loadedSector != dirSector) {
+                LoadDirectory(directory, dirFile, dirSector);
+                loadedSector = dirSector;
+            }
             sector = directory->Find(token);
+            nameCache->Enter(dirSector, token, sector);
         }
+        if (LastComponent(rest) || sector == -1)
+            break;
+        rest = PathComponent(rest, token);
+        dirLocks->Acquire(sector, exclusive && LastComponent(rest));
+        if (dirSector != startSector)
+            dirLocks->Release(dirSector, FALSE);
+        dirSector = sector;
     }
+
+    if (fetchParent && loadedSector != dirSector)
+        LoadDirectory(directory, dirFile, dirSector);
+    return LastComponent(rest);
 }
+// MP4 end
 
 //----------------------------------------------------------------------
 // FileSystem::Create
@@ -189,6 +563,8 @@ void Parser(OpenFile *directoryFile, Directory *&directory, OpenFile *&dirFile,
 //	  Make sure the file doesn't already exist
 //        Allocate a sector for the file header
 // 	  Allocate space on disk for the data blocks for the file
+//	    (MP4: no longer -- the file starts out as one big hole,
+//	    and sectors are allocated as they are written)
 //	  Add the name to the directory
 //	  Store the new file header on disk
 //	  Flush the changes to the bitmap and the directory back to disk
@@ -199,10 +575,13 @@ void Parser(OpenFile *directoryFile, Directory *&directory, OpenFile *&dirFile,
 //   		file is already in directory
 //	 	no free space for file header
 //	 	no free entry for file in directory
-//	 	no free space for data blocks for the file
+//	 	the file is too big (MP4)
+//	 	a directory on the path does not exist (MP4)
 //
-// 	Note that this implementation assumes there is no concurrent access
-//	to the file system!
+// 	MP4: the directory is locked for writing (see Parser), and the
+//	free map from the first allocation until it is written back or
+//	reverted, so concurrent operations do not see each other's
+//	half-done changes.
 //
 //	"name" -- name of file to be created
 //	"initialSize" -- size of file to be created
@@ -210,25 +589,24 @@ void Parser(OpenFile *directoryFile, Directory *&directory, OpenFile *&dirFile,
 
 bool FileSystem::Create(char *name, int initialSize) {
     DEBUG(dbgFile, "Create(" << name << ", " << initialSize << ")");
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
+    kernel->synchDisk->BeginTransaction();  // MP4
 
     Directory *directory;
-    PersistentBitmap *freeMap;
     FileHeader *hdr;
     OpenFile *dirFile;
-    char *token;
-    int sector;
-    bool success;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector, dirSector;
+    bool success, last;
 
     DEBUG(dbgFile, "Creating file " << name << " size " << initialSize);
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    last = Parser(name, directory, dirFile, dirSector, token, sector, TRUE, TRUE);
 
-    if (sector != -1)
-        success = FALSE;  // file is already in directory
+    if (sector != -1 || !last)
+        success = FALSE;  // file is already in directory, or no directory
     else {
-        freeMap = new PersistentBitmap(freeMapFile, NumSectors);
+        freeMapLock->Acquire();          // MP4
+        freeMap->SetGoal(dirSector);     // MP4: in its directory's group
         sector = freeMap->FindAndSet();  // find a sector to hold the file header
         if (sector == -1)
             success = FALSE;  // no free block for file header
@@ -236,49 +614,57 @@ bool FileSystem::Create(char *name, int initialSize) {
             success = FALSE;  // no space in directory
         else {
             hdr = new FileHeader;
-            if (!hdr->Allocate(freeMap, initialSize))
-                success = FALSE;  // no space on disk for data
+            if (!hdr->AllocateSparse(initialSize, compressNew))
+                success = FALSE;  // MP4: too big; data gets space when written
+            else if (!dirFile->Extend(freeMap, directory->FileSize()))
+                success = FALSE;  // MP4: no space to grow the directory
             else {
                 success = TRUE;
                 // everthing worked, flush all changes back to disk
                 hdr->WriteBack(sector);
                 directory->WriteBack(dirFile);
                 freeMap->WriteBack(freeMapFile);
+                nameCache->Enter(dirSector, token, sector);  // MP4
             }
             delete hdr;
         }
-        delete freeMap;
+        if (!success)
+            freeMap->Revert();  // MP4: undo the allocations
+        freeMapLock->Release();
     }
 
+    dirLocks->Release(dirSector, last);  // MP4
     if (dirFile != directoryFile)
         delete dirFile;
-    delete directory;
-    delete duplicate;
+    PutDirectory(directory);
+    kernel->synchDisk->EndTransaction();  // MP4: commit the updates
+    if (success)
+        MetadataUpdated();  // MP4: once it is committed
     return success;
 }
 
 // MP4 start
 bool FileSystem::CreateDirectory(char *name) {
     DEBUG(dbgFile, "CreateDirectory(" << name << ")");
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
+    kernel->synchDisk->BeginTransaction();
 
     Directory *directory;
-    PersistentBitmap *freeMap;
     FileHeader *hdr;
     OpenFile *dirFile;
-    char *token;
-    int sector;
-    bool success;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector, dirSector;
+    bool success, last;
 
     DEBUG(dbgFile, "Creating Directory " << name);
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    last = Parser(name, directory, dirFile, dirSector, token, sector, TRUE, TRUE);
 
-    if (sector != -1)
+    if (sector != -1 || !last)
         success = FALSE;
     else {
-        freeMap = new PersistentBitmap(freeMapFile, NumSectors);
+        freeMapLock->Acquire();
+        // spread directories over the groups; their files follow them
+        freeMap->SetGoal(freeMap->SpreadGroup(dirSector / SectorsPerGroup) * SectorsPerGroup);
         sector = freeMap->FindAndSet();
         if (sector == -1)
             success = FALSE;
@@ -288,6 +674,8 @@ bool FileSystem::CreateDirectory(char *name) {
             hdr = new FileHeader;
             if (!hdr->Allocate(freeMap, DirectoryFileSize))
                 success = FALSE;
+            else if (!dirFile->Extend(freeMap, directory->FileSize()))
+                success = FALSE;
             else {
                 success = TRUE;
                 hdr->WriteBack(sector);
@@ -298,19 +686,25 @@ bool FileSystem::CreateDirectory(char *name) {
 
                 directory->WriteBack(dirFile);
                 freeMap->WriteBack(freeMapFile);
+                nameCache->Enter(dirSector, token, sector);
 
                 delete newDirFile;
                 delete newDir;
             }
             delete hdr;
         }
-        delete freeMap;
+        if (!success)
+            freeMap->Revert();  // MP4: undo the allocations
+        freeMapLock->Release();
     }
 
+    dirLocks->Release(dirSector, last);
     if (dirFile != directoryFile)
         delete dirFile;
-    delete directory;
-    delete duplicate;
+    PutDirectory(directory);
+    kernel->synchDisk->EndTransaction();
+    if (success)
+        MetadataUpdated();
     return success;
 }
 // MP4 end
@@ -322,66 +716,630 @@ bool FileSystem::CreateDirectory(char *name) {
 //	  Find the location of the file's header, using the directory
 //	  Bring the header into memory
 //
+//	MP4: with "checkDir", the directory holding the file is read even
+//	if the name cache knows the file, to find out from its entry
+//	whether the file is a directory; the OpenFile is marked if so.
+//
 //	"name" -- the text name of the file to be opened
+//	"checkDir" -- find out whether it is a directory
 //----------------------------------------------------------------------
 
-OpenFile *FileSystem::Open(char *name) {
+OpenFile *FileSystem::Open(char *name, bool checkDir) {
     DEBUG(dbgFile, "Open(" << name << ")");
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
 
     Directory *directory;
     OpenFile *openFile = NULL;
     OpenFile *dirFile;
-    char *token;
-    int sector;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector = DirectorySector, dirSector;  // MP4: "/" is the root
 
     DEBUG(dbgFile, "Opening file" << name);
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    Parser(name, directory, dirFile, dirSector, token, sector, checkDir, FALSE);
 
-    if (sector >= 0)
+    if (sector >= 0) {
         openFile = new OpenFile(sector);  // name was found in directory
+        if (checkDir && (token[0] == '\0' || directory->IsDir(token)))
+            openFile->MarkDirectory();  // MP4
+    }
 
+    dirLocks->Release(dirSector, FALSE);  // MP4
     if (dirFile != directoryFile)
         delete dirFile;
-    delete directory;
-    delete duplicate;
+    PutDirectory(directory);
     return openFile;  // return NULL if not found
 }
 
-// MP4 Start
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::ExtendFile
+// 	Grow an open file to "newLength" bytes, allocating its new sectors
+//	from the resident free map and flushing the header and free map.
+//	Called by OpenFile::WriteAt for writes past the end of the file.
+//	Return FALSE if the disk is full.
+//
+//	"file" -- the file to be grown
+//	"newLength" -- the length the file should have
+//----------------------------------------------------------------------
+
+bool FileSystem::ExtendFile(OpenFile *file, int newLength) {
+    bool success;
+
+    ASSERT(file != freeMapFile);  // the bitmap never changes size
+    kernel->synchDisk->BeginTransaction();
+    freeMapLock->Acquire();
+    success = file->Extend(freeMap, newLength);
+    if (success) {
+        freeMap->WriteBack(freeMapFile);
+    } else {
+        freeMap->Revert();
+    }
+    freeMapLock->Release();
+    kernel->synchDisk->EndTransaction();
+    if (success)
+        MetadataUpdated();
+    return success;
+}
+// MP4 end
+
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::FillHoles
+// 	Give disk space to the holes of a sparse file that the bytes
+//	"from" up to "to" fall in, flushing the header and free map.
+//	Called by OpenFile::WriteAt before it writes into a hole.
+//	Return FALSE if the disk is full.
+//
+//	"file" -- the file about to be written
+//	"from", "to" -- the bytes about to be written
+//----------------------------------------------------------------------
+
+bool FileSystem::FillHoles(OpenFile *file, int from, int to) {
+    bool success;
+
+    kernel->synchDisk->BeginTransaction();
+    freeMapLock->Acquire();
+    success = file->FillHoles(freeMap, from, to);
+    if (success) {
+        freeMap->WriteBack(freeMapFile);
+    } else {
+        freeMap->Revert();
+    }
+    freeMapLock->Release();
+    kernel->synchDisk->EndTransaction();
+    if (success)
+        MetadataUpdated();
+    return success;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::PunchHoles
+// 	Free the sectors of a compressed file holding bytes "from" up to
+//	"to", flushing the header and free map.  Called by
+//	OpenFile::WriteChunk when a chunk gets smaller.
+//
+//	"file" -- the file being written
+//	"from", "to" -- the bytes no longer needed
+//----------------------------------------------------------------------
+
+void FileSystem::PunchHoles(OpenFile *file, int from, int to) {
+    kernel->synchDisk->BeginTransaction();
+    freeMapLock->Acquire();
+    file->PunchHoles(freeMap, from, to);
+    freeMap->WriteBack(freeMapFile);
+    freeMapLock->Release();
+    kernel->synchDisk->EndTransaction();
+    MetadataUpdated();
+}
+// MP4 end
+
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::Clone
+// 	Make a new file "to" with the contents of the file "from", in
+//	constant time and space: the clone is given the same data sectors,
+//	and each is copied only when one of the two files first writes it
+//	(see FileHeader::Share and FileHeader::Unshare).  The source is
+//	looked up, and its directory let go, before the new file's
+//	directory is locked, so the two can be in the same directory.
+//
+//	Return TRUE if the clone was made; FALSE if "from" is not a file,
+//	"to" already exists or its directory does not, or the disk cannot
+//	hold the clone's header or share its sectors.
+//
+//	"from" -- the file to be cloned
+//	"to" -- the name of the new file
+//----------------------------------------------------------------------
+
+bool FileSystem::Clone(char *from, char *to) {
+    DEBUG(dbgFile, "Clone(" << from << ", " << to << ")");
+
+    Directory *directory;
+    OpenFile *dirFile, *source = NULL;
+    char token[FileNameMaxLen + 1];
+    int sector, dirSector;
+    bool success;
+
+    Parser(from, directory, dirFile, dirSector, token, sector, FALSE, FALSE);
+    if (sector >= 0 && !directory->IsDir(token))
+        source = new OpenFile(sector);
+    dirLocks->Release(dirSector, FALSE);
+    if (dirFile != directoryFile)
+        delete dirFile;
+    PutDirectory(directory);
+    if (source == NULL)
+        return FALSE;  // no such file, or a directory
+
+    success = source->Clone(to);
+    delete source;
+    return success;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::CreateClone
+// 	The rest of Clone, called by OpenFile::Clone with the source's
+//	header locked: like Create, but the new header is a clone of
+//	"source", which is written back marked shared.
+//
+//	"name" -- the name of the new file
+//	"source" -- the header of the file to be cloned
+//	"sourceSector" -- where that header lives
+//----------------------------------------------------------------------
+
+bool FileSystem::CreateClone(char *name, FileHeader *source, int sourceSector) {
+    kernel->synchDisk->BeginTransaction();
+
+    Directory *directory;
+    FileHeader *hdr;
+    OpenFile *dirFile;
+    char token[FileNameMaxLen + 1];
+    int sector, dirSector;
+    bool success, last;
+
+    last = Parser(name, directory, dirFile, dirSector, token, sector, TRUE, TRUE);
+
+    if (sector != -1 || !last)
+        success = FALSE;  // file is already in directory, or no directory
+    else {
+        freeMapLock->Acquire();
+        freeMap->SetGoal(dirSector);
+        sector = freeMap->FindAndSet();
+        if (sector == -1)
+            success = FALSE;  // no free block for file header
+        else if (!directory->Add(token, sector))
+            success = FALSE;  // no space in directory
+        else {
+            hdr = new FileHeader;
+            if (!hdr->Share(freeMap, source))
+                success = FALSE;  // no share counts to spare
+            else if (!dirFile->Extend(freeMap, directory->FileSize()))
+                success = FALSE;  // no space to grow the directory
+            else {
+                success = TRUE;
+                hdr->WriteBack(sector);
+                source->WriteBack(sourceSector);  // now marked shared
+                directory->WriteBack(dirFile);
+                freeMap->WriteBack(freeMapFile);
+                nameCache->Enter(dirSector, token, sector);
+            }
+            delete hdr;
+        }
+        if (!success)
+            freeMap->Revert();
+        freeMapLock->Release();
+    }
+
+    dirLocks->Release(dirSector, last);
+    if (dirFile != directoryFile)
+        delete dirFile;
+    PutDirectory(directory);
+    kernel->synchDisk->EndTransaction();
+    if (success)
+        MetadataUpdated();
+    return success;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::AnyShared
+// 	Return TRUE if any of the "count" disk sectors in "sectors" (-1
+//	for a hole) is shared by more than one file.  A quick look,
+//	without the free map lock, to save UnshareSectors a transaction
+//	when there is nothing to unshare; UnshareSectors looks again.
+//----------------------------------------------------------------------
+
+bool FileSystem::AnyShared(int *sectors, int count) {
+    for (int i = 0; i < count; i++)
+        if (sectors[i] != -1 && freeMap->IsShared(sectors[i]))
+            return TRUE;
+    return FALSE;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::UnshareSectors
+// 	Give the sectors of an open file holding bytes "from" up to "to"
+//	that it still shares with a clone sectors of its own, flushing the
+//	header and free map.  Called by OpenFile::WriteAt before it writes
+//	to a file that has been cloned.  Return FALSE if the disk is full.
+//
+//	"file" -- the file about to be written
+//	"from", "to" -- the bytes about to be written
+//----------------------------------------------------------------------
+
+bool FileSystem::UnshareSectors(OpenFile *file, int from, int to) {
+    bool success;
+
+    kernel->synchDisk->BeginTransaction();
+    freeMapLock->Acquire();
+    success = file->Unshare(freeMap, from, to);
+    if (success) {
+        freeMap->WriteBack(freeMapFile);
+    } else {
+        freeMap->Revert();
+    }
+    freeMapLock->Release();
+    kernel->synchDisk->EndTransaction();
+    if (success)
+        MetadataUpdated();
+    return success;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::RelocateFile
+// 	Move an open file's data into one run of sectors near its header,
+//	freeing the old sectors, and flush the header and free map.
+//	Called by OpenFile::Defragment, which holds the header lock.
+//	Return FALSE if the file was left where it was.
+//
+//	The data is copied, and written home, before the transaction is
+//	opened, so that only the header and the free map are journalled
+//	however big the file is.  The free map lock is held throughout,
+//	so the run marked by the copy cannot reach the disk, or be
+//	handed out, before the switch.
+//
+//	"file" -- the file to be moved
+//----------------------------------------------------------------------
+
+bool FileSystem::RelocateFile(OpenFile *file) {
+    int start;
+
+    ASSERT(file != freeMapFile);  // its sectors are fixed at format time
+    freeMapLock->Acquire();
+    start = file->CopyToRun(freeMap);
+    if (start != -1) {
+        kernel->synchDisk->BeginTransaction();
+        file->SwitchToRun(freeMap, start);
+        freeMap->WriteBack(freeMapFile);
+        kernel->synchDisk->EndTransaction();
+    }
+    freeMapLock->Release();
+    if (start == -1)
+        return FALSE;
+    MetadataUpdated();
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// PrintFragmentation
+// 	Print one line of FileSystem::Defragment's report.
+//----------------------------------------------------------------------
+
+static void PrintFragmentation(const char *when, FragmentStats *stats) {
+    printf("Defragment: %s: %d files, %d fragmented, %d data sectors in %d runs, "
+           "%d index sectors, %.0f seek ticks\n",
+           when, stats->files, stats->fragmented, stats->sectors, stats->runs,
+           stats->indexSectors, stats->seekTicks);
+}
+
+//----------------------------------------------------------------------
+// FileSystem::Defragment
+// 	Walk the whole directory tree and relocate each file whose data
+//	is in more than one run, or behind index blocks, into a single
+//	extent in its own block group.  The file system stays in use
+//	meanwhile: each file is locked only while it is being moved, and
+//	each directory is read-locked while its entries are visited.
+//	Print how scattered the files were before and after, and the
+//	time the disk would spend seeking to read all of them, each from
+//	its header to its end.
+//----------------------------------------------------------------------
+
+void FileSystem::Defragment() {
+    Directory *directory = new Directory(NumDirEntries);
+    FragmentStats before, after;
+    int moved = 0;
+
+    memset(&before, 0, sizeof(before));
+    memset(&after, 0, sizeof(after));
+    dirLocks->Acquire(DirectorySector, FALSE);
+    if (directoryFile->Defragment(&before, &after))
+        moved++;
+    directory->FetchFrom(directoryFile);
+    moved += directory->Defragment(dirLocks, &before, &after);
+    dirLocks->Release(DirectorySector, FALSE);
+    delete directory;
+
+    PrintFragmentation("before", &before);
+    PrintFragmentation("after", &after);
+    printf("Defragment: %d files moved\n", moved);
+}
+// MP4 end
+
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::Descriptors
+// 	Return the descriptor table of the running process, or the
+//	kernel's own for threads without an address space.
+//----------------------------------------------------------------------
+
+FileDescriptorTable *FileSystem::Descriptors() {
+    Thread *thread = kernel->currentThread;
+
+    if (thread != NULL && thread->space != NULL)
+        return thread->space->files;
+    return kernelFiles;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::OpenAFile/WriteFile/ReadFile/CloseFile
+// 	The system call interface: open a file and return a descriptor
+//	for it in the running process's table (-1 if it does not exist),
+//	read or write through a descriptor, and close it.  Bad
+//	descriptors return -1.
+//
+//	WriteFileAt and ReadFileAt move data at a given position instead
+//	of the seek position, which stays where it is; SeekFile sets it.
+//	SyncFile writes what the file has in the buffer cache to disk.
+//----------------------------------------------------------------------
+
 OpenFileId FileSystem::OpenAFile(char *name) {
-    OpenFileId id = 0;
-    fileDescriptorTable[id] = Open(name);
-    return id;
+    OpenFile *file = Open(name, TRUE);  // ReadDirectory wants to know
+
+    if (file == NULL)
+        return -1;
+    return Descriptors()->Add(file);
 }
 
 int FileSystem::WriteFile(char *buffer, int size, OpenFileId id) {
-    if (id != 0)
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL)
         return -1;
-    int retVal = fileDescriptorTable[id]->Write(buffer, size);
+    int retVal = file->Write(buffer, size);
     if (retVal < 0)
         return -1;
     return retVal;
 }
 
 int FileSystem::ReadFile(char *buffer, int size, OpenFileId id) {
-    if (id != 0)
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL)
+        return -1;
+    int retVal = file->Read(buffer, size);
+    if (retVal < 0)
+        return -1;
+    return retVal;
+}
+
+int FileSystem::WriteFileAt(char *buffer, int size, int position, OpenFileId id) {
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL || position < 0)
         return -1;
-    int retVal = fileDescriptorTable[id]->Read(buffer, size);
+    int retVal = file->WriteAt(buffer, size, position);
     if (retVal < 0)
         return -1;
     return retVal;
 }
 
+int FileSystem::ReadFileAt(char *buffer, int size, int position, OpenFileId id) {
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL || position < 0)
+        return -1;
+    int retVal = file->ReadAt(buffer, size, position);
+    if (retVal < 0)
+        return -1;
+    return retVal;
+}
+
+int FileSystem::SeekFile(int position, OpenFileId id) {
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL || position < 0)
+        return -1;
+    file->Seek(position);
+    return 1;
+}
+
+int FileSystem::TellFile(OpenFileId id) {
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL)
+        return -1;
+    return file->Tell();
+}
+
+int FileSystem::MapFileAt(int *sectors, int max, int size, int position, OpenFileId id) {
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL || position < 0)
+        return 0;
+    return file->MapRange(sectors, max, size, position);
+}
+
+int FileSystem::SyncFile(OpenFileId id) {
+    OpenFile *file = Descriptors()->Get(id);
+
+    if (file == NULL)
+        return -1;
+    kernel->synchDisk->FlushFile(file->HeaderSector());
+    return 1;
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::ReadDirectory
+// 	Read the entries in use from the directory open as "id", from
+//	its seek position on, into "entries", until "count" of them are
+//	found or the directory ends.  The directory is read a batch of
+//	entries at a time, and the seek position is left just past the
+//	last one read, so the next call carries on from there.
+//	Return the number of entries found, 0 at the end of the
+//	directory, or -1 if "id" is bad or is not a directory.
+//----------------------------------------------------------------------
+
+int FileSystem::ReadDirectory(DirectoryEntry *entries, int count, OpenFileId id) {
+    OpenFile *file = Descriptors()->Get(id);
+    int found = 0, wanted, read;
+
+    if (file == NULL || count < 0 || !file->IsDirectory())
+        return -1;
+
+    dirLocks->Acquire(file->HeaderSector(), FALSE);
+    while (found < count) {
+        wanted = count - found;
+        read = file->Read((char *)(entries + found), wanted * sizeof(DirectoryEntry));
+        read = (read < 0) ? 0 : read / sizeof(DirectoryEntry);
+
+        // keep the entries in use, packed at the front
+        for (int i = found, end = found + read; i < end; i++) {
+            if (entries[i].inUse) {
+                entries[found] = entries[i];
+                entries[found].name[FileNameMaxLen] = '\0';
+                found++;
+            }
+        }
+        if (read < wanted)
+            break;  // the end of the directory
+    }
+    dirLocks->Release(file->HeaderSector(), FALSE);
+    return found;
+}
+// MP4 end
+
 int FileSystem::CloseFile(OpenFileId id) {
-    if (id != 0 || fileDescriptorTable[id] == NULL)
+    OpenFile *file = Descriptors()->Remove(id);
+
+    if (file == NULL)
         return -1;
-    delete fileDescriptorTable[id];
-    fileDescriptorTable[id] = NULL;
+    delete file;
     return 1;
 }
+
+//----------------------------------------------------------------------
+// FileDescriptorTable::FileDescriptorTable
+// 	Initialize an empty table of InitDescriptors descriptors, all free.
+//----------------------------------------------------------------------
+
+FileDescriptorTable::FileDescriptorTable() {
+    size = 0;
+    table = NULL;
+    nextFree = NULL;
+    freeList = -1;
+    Grow();
+}
+
+//----------------------------------------------------------------------
+// FileDescriptorTable::~FileDescriptorTable
+// 	Close whatever the process left open.
+//----------------------------------------------------------------------
+
+FileDescriptorTable::~FileDescriptorTable() {
+    for (int i = 0; i < size; i++)
+        delete table[i];
+    delete[] table;
+    delete[] nextFree;
+}
+
+//----------------------------------------------------------------------
+// FileDescriptorTable::Grow
+// 	Double the size of the table.  The new descriptors go on the
+//	free list lowest first, so they are handed out in order; the
+//	console's are left off it.
+//----------------------------------------------------------------------
+
+void FileDescriptorTable::Grow() {
+    int newSize = (size == 0) ? InitDescriptors : 2 * size;
+    OpenFile **newTable = new OpenFile *[newSize];
+    int *newNext = new int[newSize];
+
+    for (int i = 0; i < size; i++) {
+        newTable[i] = table[i];
+        newNext[i] = nextFree[i];
+    }
+    for (int i = newSize - 1; i >= size; i--) {
+        newTable[i] = NULL;
+        newNext[i] = -1;
+        if (i >= FirstFileDescriptor) {
+            newNext[i] = freeList;
+            freeList = i;
+        }
+    }
+    delete[] table;
+    delete[] nextFree;
+    table = newTable;
+    nextFree = newNext;
+    size = newSize;
+}
+
+//----------------------------------------------------------------------
+// FileDescriptorTable::Add
+// 	Take a descriptor off the free list for "file", growing the
+//	table if none is free, and return it.
+//----------------------------------------------------------------------
+
+OpenFileId FileDescriptorTable::Add(OpenFile *file) {
+    OpenFileId id;
+
+    ASSERT(file != NULL);
+    if (freeList == -1)
+        Grow();
+    id = freeList;
+    freeList = nextFree[id];
+    table[id] = file;
+    return id;
+}
+
+//----------------------------------------------------------------------
+// FileDescriptorTable::Get
+// 	Return the file open as "id", or NULL if there is none (as for
+//	the console's descriptors).
+//----------------------------------------------------------------------
+
+OpenFile *FileDescriptorTable::Get(OpenFileId id) {
+    if (id < FirstFileDescriptor || id >= size)
+        return NULL;
+    return table[id];
+}
+
+//----------------------------------------------------------------------
+// FileDescriptorTable::Remove
+// 	Put "id" back on the free list and return the file that was open
+//	as it, for the caller to close.  Return NULL if "id" was not open.
+//----------------------------------------------------------------------
+
+OpenFile *FileDescriptorTable::Remove(OpenFileId id) {
+    OpenFile *file = Get(id);
+
+    if (file == NULL)
+        return NULL;
+    table[id] = NULL;
+    nextFree[id] = freeList;
+    freeList = id;
+    return file;
+}
+
+//----------------------------------------------------------------------
+// FileDescriptorTable::IsEmpty
+// 	Return TRUE if no descriptor is open.
+//----------------------------------------------------------------------
+
+bool FileDescriptorTable::IsEmpty() {
+    for (int i = 0; i < size; i++)
+        if (table[i] != NULL)
+            return FALSE;
+    return TRUE;
+}
 // MP4 end
 
 //----------------------------------------------------------------------
@@ -401,72 +1359,274 @@ int FileSystem::CloseFile(OpenFileId id) {
 // MP4 start
 bool FileSystem::Remove(char *name) {
     DEBUG(dbgFile, "Remove(" << name << ")");
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
+    kernel->synchDisk->BeginTransaction();
 
     Directory *directory;
-    PersistentBitmap *freeMap;
     FileHeader *fileHdr;
     OpenFile *dirFile;
-    char *token;
-    int sector;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector, dirSector;
+    bool last, isDir;
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    last = Parser(name, directory, dirFile, dirSector, token, sector, TRUE, TRUE);
 
     if (sector == -1) {
-        delete directory;
+        dirLocks->Release(dirSector, last);
+        PutDirectory(directory);
+        kernel->synchDisk->EndTransaction();
         return FALSE;  // file not found
     }
+    isDir = directory->IsDir(token);
+    if (isDir)
+        dirLocks->Acquire(sector, TRUE);  // wait for anyone inside it
     fileHdr = new FileHeader;
     fileHdr->FetchFrom(sector);
 
-    freeMap = new PersistentBitmap(freeMapFile, NumSectors);
-
+    freeMapLock->Acquire();
     fileHdr->Deallocate(freeMap);  // remove data blocks
     freeMap->Clear(sector);        // remove header block
+    FileHeader::Invalidate(sector);
     directory->Remove(token);
+    nameCache->Enter(dirSector, token, -1);
+    nameCache->Purge(sector);  // in case it was a directory
 
     freeMap->WriteBack(freeMapFile);  // flush to disk
     directory->WriteBack(dirFile);    // flush to disk
+    freeMapLock->Release();
 
+    if (isDir)
+        dirLocks->Release(sector, TRUE);
+    dirLocks->Release(dirSector, last);
     if (dirFile != directoryFile)
         delete dirFile;
     delete fileHdr;
-    delete directory;
-    delete freeMap;
-    delete duplicate;
+    PutDirectory(directory);
+    kernel->synchDisk->EndTransaction();
+    MetadataUpdated();
     return TRUE;
 }
 // MP4 end
 
 // MP4 start
+//----------------------------------------------------------------------
+// FileSystem::LockCommonDirectory
+// 	Find the deepest directory that the parent directories of both
+//	paths lie in, lock it for writing -- reached hand over hand from
+//	the root, like Parser -- and return its sector, setting
+//	"fromRest" and "toRest" to what is left of each path below it.
+//	Return -1, holding no lock, if a directory on the way is missing.
+//
+//	While it is held no other operation can start in that part of
+//	the tree, and the ones already inside only lock further down, so
+//	Rename can then lock both parents (see Parser's "startSector").
+//----------------------------------------------------------------------
+
+int FileSystem::LockCommonDirectory(const char *from, const char *to,
+                                    const char **fromRest, const char **toRest) {
+    char fromPart[FileNameMaxLen + 1], toPart[FileNameMaxLen + 1];
+    char token[FileNameMaxLen + 1], *prefix;
+    const char *nextFrom, *nextTo;
+    Directory *directory;
+    OpenFile *dirFile;
+    int sector, dirSector;
+    bool last, isDir;
+
+    // the directories both paths go through; not their last components
+    *fromRest = from;
+    *toRest = to;
+    for (;;) {
+        nextFrom = PathComponent(*fromRest, fromPart);
+        nextTo = PathComponent(*toRest, toPart);
+        if (LastComponent(nextFrom) || LastComponent(nextTo) || strcmp(fromPart, toPart) != 0)
+            break;
+        *fromRest = nextFrom;
+        *toRest = nextTo;
+    }
+    if (*fromRest == from) {
+        dirLocks->Acquire(DirectorySector, TRUE);
+        return DirectorySector;
+    }
+
+    prefix = new char[*fromRest - from + 1];
+    strncpy(prefix, from, *fromRest - from);
+    prefix[*fromRest - from] = '\0';
+    last = Parser(prefix, directory, dirFile, dirSector, token, sector, TRUE, FALSE);
+    isDir = last && sector != -1 && directory->IsDir(token);
+    if (isDir)
+        dirLocks->Acquire(sector, TRUE);
+    dirLocks->Release(dirSector, FALSE);
+    if (dirFile != directoryFile)
+        delete dirFile;
+    PutDirectory(directory);
+    delete[] prefix;
+    return isDir ? sector : -1;
+}
+
+//----------------------------------------------------------------------
+// FileSystem::Rename
+// 	Give a file or directory a new name, possibly in another
+//	directory, by moving its directory entry: the header, and the
+//	data, stay where they are.  Both directories change in one
+//	transaction, so after a crash the file is under exactly one of
+//	the two names.  An existing file named "to" is replaced, and its
+//	space freed, in the same transaction.
+//
+//	The directory both paths lie in is locked first (see
+//	LockCommonDirectory), then the two parent directories below it.
+//
+//	Return FALSE if "from" does not exist, a directory on the way to
+//	"to" does not, "to" is an existing directory (or "from" is one and
+//	"to" exists), or "to" lies inside "from".
+//
+//	"from" -- the current name
+//	"to" -- the new name
+//----------------------------------------------------------------------
+
+bool FileSystem::Rename(char *from, char *to) {
+    DEBUG(dbgFile, "Rename(" << from << ", " << to << ")");
+
+    Directory *fromDir, *toDir = NULL;
+    OpenFile *fromFile, *toFile = NULL;
+    char fromToken[FileNameMaxLen + 1], toToken[FileNameMaxLen + 1];
+    char part[FileNameMaxLen + 1];
+    const char *fromRest, *toRest, *next;
+    int common, sector = -1, target = -1, fromSector, toSector;
+    bool success, fromLast, last, isDir;
+
+    kernel->synchDisk->BeginTransaction();
+    common = LockCommonDirectory(from, to, &fromRest, &toRest);
+    if (common == -1) {
+        kernel->synchDisk->EndTransaction();
+        return FALSE;
+    }
+
+    fromLast = Parser(fromRest, fromDir, fromFile, fromSector, fromToken, sector, TRUE, TRUE, common);
+    isDir = fromLast && sector != -1 && fromDir->IsDir(fromToken);
+
+    // "to" inside "from": its parent is "from", or below it
+    next = PathComponent(toRest, part);
+    if (!fromLast || sector == -1 || fromToken[0] == '\0' || part[0] == '\0' ||
+        (fromSector == common && !LastComponent(next) &&
+         strncmp(part, fromToken, FileNameMaxLen) == 0)) {
+        toSector = -1;  // nothing to move, or nowhere to move it
+    } else if (fromSector == common && LastComponent(next)) {
+        toDir = fromDir;  // both in the same directory
+        toFile = fromFile;
+        toSector = fromSector;
+        strncpy(toToken, part, FileNameMaxLen + 1);
+        target = toDir->Find(toToken);
+    } else {
+        last = Parser(toRest, toDir, toFile, toSector, toToken, target, TRUE, TRUE, common);
+        if (!last || toToken[0] == '\0') {
+            dirLocks->Release(toSector, last);
+            if (toFile != directoryFile)
+                delete toFile;
+            PutDirectory(toDir);
+            toDir = NULL;
+            toSector = -1;
+        }
+    }
+
+    if (toSector == -1) {
+        success = FALSE;
+    } else if (toSector == fromSector && strncmp(toToken, fromToken, FileNameMaxLen) == 0) {
+        success = TRUE;  // the same name: nothing to do
+    } else if (target != -1 && (isDir || toDir->IsDir(toToken))) {
+        success = FALSE;  // only a file can replace a file
+    } else {
+        freeMapLock->Acquire();
+        if (target != -1)
+            toDir->Remove(toToken);
+        fromDir->Remove(fromToken);
+        if (isDir)
+            success = toDir->AddDirectory(toToken, sector);
+        else
+            success = toDir->Add(toToken, sector);
+        if (success && !toFile->Extend(freeMap, toDir->FileSize()))
+            success = FALSE;  // no space to grow the directory
+        if (success) {
+            if (target != -1) {
+                // the file replaced, freed as by Remove
+                FileHeader *targetHdr = new FileHeader;
+                targetHdr->FetchFrom(target);
+                targetHdr->Deallocate(freeMap);
+                freeMap->Clear(target);
+                FileHeader::Invalidate(target);
+                delete targetHdr;
+            }
+            toDir->WriteBack(toFile);
+            if (toDir != fromDir)
+                fromDir->WriteBack(fromFile);
+            freeMap->WriteBack(freeMapFile);
+            nameCache->Enter(fromSector, fromToken, -1);
+            nameCache->Enter(toSector, toToken, sector);
+        } else {
+            freeMap->Revert();  // nothing was written
+        }
+        freeMapLock->Release();
+    }
+
+    if (toDir != NULL && toDir != fromDir) {
+        if (toSector != common)
+            dirLocks->Release(toSector, TRUE);
+        if (toFile != directoryFile)
+            delete toFile;
+        PutDirectory(toDir);
+    }
+    if (fromSector != common)
+        dirLocks->Release(fromSector, fromLast);
+    if (fromFile != directoryFile)
+        delete fromFile;
+    PutDirectory(fromDir);
+    dirLocks->Release(common, TRUE);
+    kernel->synchDisk->EndTransaction();
+    if (success)
+        MetadataUpdated();
+    return success;
+}
+
 bool FileSystem::RecursiveRemove(char *name) {
     DEBUG(dbgFile, "RecursiveRemove(" << name << ")");
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
+    kernel->synchDisk->BeginTransaction();
 
     Directory *directory;
-    PersistentBitmap *freeMap;
     FileHeader *fileHdr;
     OpenFile *dirFile;
-    char *token;
-    int sector;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector, dirSector;
+    bool last;
+    OpenFile *subDirFile = NULL;
+    Directory *subDir = NULL;
+    ::List<int> *locked = new ::List<int>;
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    last = Parser(name, directory, dirFile, dirSector, token, sector, TRUE, TRUE);
 
     if (sector == -1) {
-        delete directory;
+        dirLocks->Release(dirSector, last);
+        delete locked;
+        PutDirectory(directory);
+        kernel->synchDisk->EndTransaction();
         return FALSE;  // file not found
     }
 
-    freeMap = new PersistentBitmap(freeMapFile, NumSectors);
-
+    // lock the whole tree first, so that nobody is left inside it; the
+    // free map lock comes after every directory lock
     if (directory->IsDir(token)) {
-        OpenFile *subDirFile = new OpenFile(sector);
-        Directory *subDir = new Directory(NumDirEntries);
+        dirLocks->Acquire(sector, TRUE);
+        locked->Append(sector);
+        subDirFile = new OpenFile(sector);
+        subDir = new Directory(NumDirEntries);
         subDir->FetchFrom(subDirFile);
+        subDir->LockTree(dirLocks, locked);
+    }
 
+    // MP4: collect the sectors of the whole tree, and free them at once
+    freeMapLock->Acquire();
+    freeMap->DeferClears();
+    if (subDir != NULL) {
         subDir->RecursiveRemove(freeMap);
+        delete subDir;  // MP4
+        delete subDirFile;
     }
 
     fileHdr = new FileHeader;
@@ -474,17 +1634,25 @@ bool FileSystem::RecursiveRemove(char *name) {
 
     fileHdr->Deallocate(freeMap);
     freeMap->Clear(sector);
+    freeMap->ClearDeferred();
+    FileHeader::Invalidate(sector);
     directory->Remove(token);
+    nameCache->Clear();  // a whole subtree may have gone
 
     freeMap->WriteBack(freeMapFile);
     directory->WriteBack(dirFile);
+    freeMapLock->Release();
 
+    while (!locked->IsEmpty())
+        dirLocks->Release(locked->RemoveFront(), TRUE);
+    delete locked;
+    dirLocks->Release(dirSector, last);
     if (dirFile != directoryFile)
         delete dirFile;
     delete fileHdr;
-    delete freeMap;
-    delete directory;
-    delete duplicate;
+    PutDirectory(directory);
+    kernel->synchDisk->EndTransaction();
+    MetadataUpdated();
     return TRUE;
 }
 // MP4 end
@@ -496,57 +1664,65 @@ bool FileSystem::RecursiveRemove(char *name) {
 
 void FileSystem::List(char *name) {
     DEBUG(dbgFile, "List(" << name << ")");
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
 
     Directory *directory;
     OpenFile *dirFile;
-    char *token;
-    int sector;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector, dirSector;
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    Parser(name, directory, dirFile, dirSector, token, sector, TRUE, FALSE);
 
-    if (token != NULL) {
+    if (token[0] != '\0') {
+        dirLocks->Acquire(sector, FALSE);  // MP4: hand over hand
+        dirLocks->Release(dirSector, FALSE);
+        dirSector = sector;
         if (dirFile != directoryFile)
             delete dirFile;
         dirFile = new OpenFile(sector);
         directory->FetchFrom(dirFile);
     }
 
-    directory->List();
+    Listing out;  // MP4: written once the locks are released
+
+    directory->List(&out);
+    dirLocks->Release(dirSector, FALSE);  // MP4
 
     if (dirFile != directoryFile)
         delete dirFile;
-    delete directory;
-    delete duplicate;
+    PutDirectory(directory);
+    out.Write();  // MP4
 }
 
 // MP4 start
 void FileSystem::RecursiveList(char *name) {
     DEBUG(dbgFile, "RecursiveList(" << name << ")");
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
 
     Directory *directory;
     OpenFile *dirFile;
-    char *token;
-    int sector;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector, dirSector;
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    Parser(name, directory, dirFile, dirSector, token, sector, TRUE, FALSE);
 
-    if (token != NULL) {
+    if (token[0] != '\0') {
+        dirLocks->Acquire(sector, FALSE);  // MP4: hand over hand
+        dirLocks->Release(dirSector, FALSE);
+        dirSector = sector;
         if (dirFile != directoryFile)
             delete dirFile;
         dirFile = new OpenFile(sector);
         directory->FetchFrom(dirFile);
     }
 
-    directory->RecursiveList(0);
+    Listing out;  // written once the locks are released
+
+    directory->RecursiveList(&out, 0);
+    dirLocks->Release(dirSector, FALSE);
 
     if (dirFile != directoryFile)
         delete dirFile;
-    delete directory;
-    delete duplicate;
+    PutDirectory(directory);
+    out.Write();
 }
 // MP4 end
 
@@ -558,33 +1734,93 @@ void FileSystem::RecursiveList(char *name) {
 //	  for each file in the directory,
 //	      the contents of the file header
 //	      the data in the file
+//
+//	MP4: the output is gathered DumpBufferSize bytes at a time and
+//	written out in one piece.  Given a "path", only that file, or
+//	that directory and everything below it, is printed; without
+//	"contents", the data of the files is left out.
 //----------------------------------------------------------------------
 
-void FileSystem::Print() {
+void FileSystem::Print(char *path, bool contents) {
+    Listing out(DumpBufferSize);  // MP4
+
+    if (path != NULL) {
+        PrintPath(path, contents, &out);
+        out.Write();
+        return;
+    }
+
     FileHeader *bitHdr = new FileHeader;
     FileHeader *dirHdr = new FileHeader;
-    PersistentBitmap *freeMap = new PersistentBitmap(freeMapFile, NumSectors);
     Directory *directory = new Directory(NumDirEntries);
 
-    printf("Bit map file header:\n");
+    out.Printf("Bit map file header:\n");
     bitHdr->FetchFrom(FreeMapSector);
-    bitHdr->Print();
+    bitHdr->Print(&out, contents);
 
-    printf("Directory file header:\n");
+    out.Printf("Directory file header:\n");
     dirHdr->FetchFrom(DirectorySector);
-    dirHdr->Print();
+    dirHdr->Print(&out, contents);
 
+    out.Write();  // the bitmap prints itself
     freeMap->Print();
 
     directory->FetchFrom(directoryFile);
-    directory->Print();
+    directory->Print(&out, contents);
+    out.Write();
 
     delete bitHdr;
     delete dirHdr;
-    delete freeMap;
     delete directory;
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// FileSystem::PrintPath
+// 	Print the header of the file or directory "path" to "out", then
+//	the file's data if "contents" is set, or everything below the
+//	directory as Directory::Print does.  The directory holding it
+//	stays locked for reading meanwhile.
+//----------------------------------------------------------------------
+
+void FileSystem::PrintPath(char *path, bool contents, Listing *out) {
+    Directory *directory;
+    OpenFile *dirFile;
+    char token[FileNameMaxLen + 1];
+    int sector = DirectorySector, dirSector;
+    bool isDir = TRUE;  // "/" is the root directory
+
+    Parser(path, directory, dirFile, dirSector, token, sector, TRUE, FALSE);
+    if (token[0] != '\0' && sector != -1)
+        isDir = directory->IsDir(token);
+
+    if (sector == -1) {
+        out->Printf("%s: not found\n", path);
+    } else {
+        FileHeader *hdr = new FileHeader;
+
+        out->Printf("Name: %s, Sector: %d\n", path, sector);
+        hdr->FetchFrom(sector);
+        hdr->Print(out, contents);
+        if (isDir) {
+            Directory *below = new Directory(NumDirEntries);
+            OpenFile *belowFile = new OpenFile(sector);
+
+            below->FetchFrom(belowFile);
+            below->Print(out, contents);
+            delete belowFile;
+            delete below;
+        }
+        delete hdr;
+    }
+    dirLocks->Release(dirSector, FALSE);
+
+    if (dirFile != directoryFile)
+        delete dirFile;
+    PutDirectory(directory);
+}
+// MP4 end
+
 // int FileSystem::GetHeaderSize() {
 //     Directory *directory = new Directory(NumDirEntries);
 //     directory->FetchFrom(directoryFile);
@@ -594,25 +1830,25 @@ void FileSystem::Print() {
 // }
 
 void FileSystem::PrintFileHdrSize(char *name) {
-    char *duplicate = new char[256];
-    strcpy(duplicate, name);
-
     Directory *directory;
     OpenFile *dirFile;
     FileHeader *hdr = new FileHeader;
-    char *token;
-    int sector;
+    char token[FileNameMaxLen + 1];  // MP4: the last path component
+    int sector, dirSector;
 
-    Parser(directoryFile, directory, dirFile, token, sector, duplicate);
+    Parser(name, directory, dirFile, dirSector, token, sector, FALSE, FALSE);
 
     hdr->FetchFrom(sector);
     printf("Header Size: %d\n", hdr->GetHeaderSize());
+    // MP4: inline files need no data sector, so one read gets it all
+    if (hdr->IsInline())
+        printf("Data inline in the header: %d bytes, saving 1 data sector\n", hdr->FileLength());
+    dirLocks->Release(dirSector, FALSE);  // MP4
 
     if (dirFile != directoryFile)
         delete dirFile;
     delete hdr;
-    delete directory;
-    delete duplicate;
+    PutDirectory(directory);
 }
 
 #endif  // FILESYS_STUB
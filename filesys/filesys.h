@@ -113,15 +113,123 @@ class FileSystem {
     }
     // MP1 end
 
+    // MP4 start
+    int WriteFileAt(char *buffer, int size, int position, OpenFileId id) {
+        if (id < 0 || id >= 20 || position < 0)
+            return -1;
+        if (fileDescriptorTable[id] == NULL)
+            return -1;
+        int retVal = fileDescriptorTable[id]->WriteAt(buffer, size, position);
+        if (retVal < 0)
+            return -1;
+        return retVal;
+    }
+
+    int ReadFileAt(char *buffer, int size, int position, OpenFileId id) {
+        if (id < 0 || id >= 20 || position < 0)
+            return -1;
+        if (fileDescriptorTable[id] == NULL)
+            return -1;
+        int retVal = fileDescriptorTable[id]->ReadAt(buffer, size, position);
+        if (retVal < 0)
+            retVal = -1;
+        return retVal;
+    }
+
+    int SeekFile(int position, OpenFileId id) {
+        if (id < 0 || id >= 20 || position < 0)
+            return -1;
+        if (fileDescriptorTable[id] == NULL)
+            return -1;
+        fileDescriptorTable[id]->Seek(position);
+        return 1;
+    }
+    // MP4 end
+
     bool Remove(char *name) { return Unlink(name) == 0; }
 
     OpenFile *fileDescriptorTable[20];
 };
 
 #else  // FILESYS
+#include "pbitmap.h"
+
+class Directory;
+class DirectoryEntry;
+class Listing;
+class NameCache;
+
+const int NumSpareDirectories = 8;  // MP4: Directory objects kept for reuse
+class Lock;
+class RWLockTable;
+class FileHeader;
+
+// MP4 start
+// The superblock records how the disk is laid out, and a summary of
+// the free map: its clear sectors per group, and where allocation was
+// going to look next.  While the file system is mounted the superblock
+// is marked unclean; it is marked clean again, with an up to date
+// summary, only once everything else has reached the disk on a clean
+// shutdown.  So a clean superblock's summary can be trusted, and
+// mounting skips counting the free map.
+
+#define SuperblockMagic 0x53555052  // "SUPR"
+#define NumFreeGroups divRoundUp(NumSectors, SectorsPerGroup)
+
+class Superblock {
+   public:
+    int magic;            // SuperblockMagic, if there is a superblock
+    int sectorSize;       // geometry the disk was formatted with
+    int numSectors;
+    int freeMapSector;    // header of the free map file
+    int directorySector;  // header of the root directory
+    int journalSector;    // first sector of the journal
+    int journalSectors;   // size of the journal
+    int clean;            // was the file system unmounted cleanly?
+    int freeGoal;         // where the free map would allocate next
+    int groupClear[NumFreeGroups];  // clear sectors in each group
+    int checksumSector;   // first sector of the checksum region
+    int checksumSectors;  // its size, 0 if sectors are not checksummed
+    int shareMapSector;   // header of the share count file, 0 if none
+};
+
+// sectors the superblock takes up
+#define SuperblockSectors divRoundUp(sizeof(Superblock), SectorSize)
+// MP4 end
+
+// MP4 start
+// The open file descriptors of one process (of the kernel, for threads
+// with no address space).  Each descriptor is an OpenFile of its own,
+// with its own seek position; OpenFiles of the same file share one
+// cached FileHeader (see FileHeader::Acquire), which serves as the
+// system-wide open file table.  The table doubles when it fills, and
+// free descriptors are kept on a list, so Add is O(1).
+
+class FileDescriptorTable {
+   public:
+    FileDescriptorTable();   // an empty table
+    ~FileDescriptorTable();  // close every descriptor still open
+
+    OpenFileId Add(OpenFile *file);    // a descriptor for "file"
+    OpenFile *Get(OpenFileId id);      // the file behind "id", or NULL
+    OpenFile *Remove(OpenFileId id);   // free "id"; return its file,
+                                       // or NULL if it was not open
+    bool IsEmpty();                    // no descriptor is open
+
+   private:
+    OpenFile **table;  // open file of each descriptor, NULL if free
+    int *nextFree;     // next descriptor on the free list, or -1
+    int size;          // number of descriptors in the table
+    int freeList;      // first free descriptor, or -1 if full
+
+    void Grow();  // double the table, freeing the new descriptors
+};
+// MP4 end
+
 class FileSystem {
    public:
-    FileSystem(bool format);  // Initialize the file system.
+    FileSystem(bool format, bool checksums = FALSE);
+                              // Initialize the file system.
                               // Must be called *after* "synchDisk"
                               // has been initialized.
                               // If "format", there is nothing on
@@ -133,7 +241,9 @@ class FileSystem {
     bool Create(char *name, int initialSize);
     // Create a file (UNIX creat)
 
-    OpenFile *Open(char *name);  // Open a file (UNIX open)
+    OpenFile *Open(char *name, bool checkDir = FALSE);
+                                 // Open a file (UNIX open); MP4: with
+                                 //  "checkDir", mark directories
 
     // MP4 Start
     OpenFileId OpenAFile(char *name);
@@ -143,13 +253,38 @@ class FileSystem {
     int ReadFile(char *buffer, int size, OpenFileId id);
 
     int CloseFile(OpenFileId id);
+
+    int WriteFileAt(char *buffer, int size, int position, OpenFileId id);
+    // Like WriteFile/ReadFile, but at byte
+    int ReadFileAt(char *buffer, int size, int position, OpenFileId id);
+    // "position", leaving the seek position
+
+    int SeekFile(int position, OpenFileId id);
+
+    int TellFile(OpenFileId id);
+    // The seek position, or -1
+
+    int MapFileAt(int *sectors, int max, int size, int position, OpenFileId id);
+    // The disk sectors a ReadFileAt
+    // would read, at most "max"
+
+    int SyncFile(OpenFileId id);
+    // Write the file's cached sectors to disk
+
+    int ReadDirectory(DirectoryEntry *entries, int count, OpenFileId id);
+    // The next "count" entries in use of
+    // the directory open as "id"
     // MP4 End
 
     bool Remove(char *name);  // Delete a file (UNIX unlink)
 
     void List(char *name);
 
-    void Print();  // List all the files and their contents
+    void Print(char *path = NULL, bool contents = TRUE);
+                   // List all the files and their contents;
+                   // MP4: or only the file or directory
+                   // "path", and without the contents
+                   // of files unless "contents"
 
     void PrintFileHdrSize(char *name);
 
@@ -159,12 +294,88 @@ class FileSystem {
 
     void RecursiveList(char *name);
 
+    bool ExtendFile(OpenFile *file, int newLength);  // MP4: grow a file
+                                                     //  written past its end
+    bool FillHoles(OpenFile *file, int from, int to);  // MP4: allocate holes
+                                                       //  about to be written
+    void PunchHoles(OpenFile *file, int from, int to);  // MP4: free sectors a
+                                                        //  compressed file no
+                                                        //  longer needs
+    bool Clone(char *from, char *to);  // MP4: make "to" a copy of "from"
+                                       //  sharing its sectors
+    bool Rename(char *from, char *to);  // MP4: move a file or directory
+                                        //  to a new name (UNIX rename)
+    bool CreateClone(char *name, FileHeader *source, int sourceSector);
+                                       // MP4: Clone, with the source's
+                                       //  header locked
+    bool UnshareSectors(OpenFile *file, int from, int to);
+                                       // MP4: copy on write; give the
+                                       //  shared sectors about to be
+                                       //  written sectors of their own
+    bool AnyShared(int *sectors, int count);  // MP4: is one of them
+                                              //  shared?
+    void CompressNewFiles(bool compress) { compressNew = compress; }
+                                       // MP4: create files compressed?
+    bool RelocateFile(OpenFile *file);  // MP4: gather a file's data into
+                                        //  one run, see Defragment
+    void Defragment();  // MP4: relocate every fragmented file, and
+                        //  report how scattered they were
+    void Sync();  // MP4: write all cached updates to disk
+    bool Snapshot(char *snapshotFile);  // MP4: save the disk, cleanly
+                                        //  unmounted, to snapshotFile
+    void DeferSync(bool defer);  // MP4: hold the periodic Sync back,
+                                 //  for a batch of operations; Sync
+                                 //  once it is over
+
    private:
     OpenFile *freeMapFile;    // Bit map of free disk blocks,
                               // represented as a file
     OpenFile *directoryFile;  // "Root" directory -- list of
                               // file names, represented as a file
-    OpenFile *fileDescriptorTable[1];
+    OpenFile *shareMapFile;   // MP4: owners of shared sectors, see
+                              // PersistentBitmap::Share; NULL if none
+
+    // MP4 start
+    FileDescriptorTable *kernelFiles;  // descriptors of threads that
+                                       // have no address space
+
+    FileDescriptorTable *Descriptors();  // the current process's table
+
+    PersistentBitmap *freeMap;  // the free map, read once at boot and
+                                // kept up to date; a failed operation
+                                // reverts it to the copy on disk
+    NameCache *nameCache;       // <directory, name> -> sector lookups
+    int opsSinceSync;      // metadata operations not yet synced
+    bool syncDeferred;     // DeferSync is holding the Sync back
+    Superblock superblock;      // as last read or written; magic is
+                                // 0 on a disk formatted without one
+
+    void MetadataUpdated();  // count one, Sync now and then
+    bool ReadSuperblock();   // fetch it; FALSE if there is none
+    void WriteSuperblock(bool clean);  // update it, and write it out
+
+    void LoadDirectory(Directory *directory, OpenFile *&dirFile, int dirSector);
+    bool Parser(const char *name, Directory *&directory, OpenFile *&dirFile,
+                int &dirSector, char *token, int &sector, bool fetchParent,
+                bool exclusive, int startSector = -1);
+    int LockCommonDirectory(const char *from, const char *to,
+                            const char **fromRest, const char **toRest);
+    void PrintPath(char *path, bool contents, Listing *out);
+                                // Print for one file or directory
+
+    Directory *spareDirectories[NumSpareDirectories];
+    int numSpareDirectories;    // Directory objects to hand out again,
+                                //  instead of allocating each time
+    Directory *GetDirectory();  // a spare one, or a new one
+    void PutDirectory(Directory *directory);  // keep it for later
+
+    bool compressNew;  // MP4: Create makes compressed files
+
+    RWLockTable *dirLocks;  // one per directory, by header sector;
+                            // taken top down, before any other
+    Lock *freeMapLock;      // held from a change to the free map
+                            // until it is written back or reverted
+    // MP4 end
 };
 
 #endif  // FILESYS
@@ -19,18 +19,155 @@
 #include "main.h"
 #include "synchdisk.h"
 
+// MP4: one reader/writer lock per open file, named by its header
+// sector.  Reads of a file overlap; a write, which may grow the file
+// or fill its holes, has the header to itself.
+static RWLockTable *headerLocks = NULL;
+
+//----------------------------------------------------------------------
+// Compress, Decompress
+// 	MP4: a small LZ77 codec for the chunks of compressed files, in
+//	the LZ4 block format: each sequence is a token byte (literal
+//	count, match length - 4, a nibble each; 15 means more length
+//	bytes follow), the literals, then a two byte backward offset and
+//	the match.  The last sequence is literals only.  Matches are found
+//	through a hash of the next four bytes, so compressing is one pass
+//	and decompressing is mostly copying.
+//
+//	Compress returns the size of the compressed data, or -1 if it
+//	would not be smaller than "limit" bytes; Decompress returns the
+//	size of the result, or -1 if the data is malformed or does not
+//	fit in "size" bytes.
+//----------------------------------------------------------------------
+
+#define CompressHashLog 10  // the match finder's table has 2^this slots
+#define MinMatch 4          // shortest match worth coding
+#define MatchLimit 12       // no match starts this close to the end
+#define LastLiterals 5      // and none ends this close to it
+
+static int PutLength(unsigned char *out, int op, int length) {
+    while (length >= 255) {
+        out[op++] = 255;
+        length -= 255;
+    }
+    out[op++] = length;
+    return op;
+}
+
+static int EmitSequence(unsigned char *out, int op, int limit, unsigned char *literals,
+                        int numLiterals, int offset, int matchLength) {
+    int needed = 1 + numLiterals + numLiterals / 255 + 1 + (matchLength > 0 ? 3 + matchLength / 255 : 0);
+
+    if (op + needed > limit)
+        return -1;
+    int token = op++;
+    out[token] = min(numLiterals, 15) << 4;
+    if (numLiterals >= 15)
+        op = PutLength(out, op, numLiterals - 15);
+    memcpy(&out[op], literals, numLiterals);
+    op += numLiterals;
+    if (matchLength > 0) {
+        out[token] |= min(matchLength - MinMatch, 15);
+        out[op++] = offset & 0xff;
+        out[op++] = offset >> 8;
+        if (matchLength - MinMatch >= 15)
+            op = PutLength(out, op, matchLength - MinMatch - 15);
+    }
+    return op;
+}
+
+static int Compress(char *from, int size, char *to, int limit) {
+    unsigned char *in = (unsigned char *)from, *out = (unsigned char *)to;
+    short table[1 << CompressHashLog];  // where each hash was last seen
+    int ip = 0, anchor = 0, op = 0;
+    unsigned int word;
+
+    for (int i = 0; i < (1 << CompressHashLog); i++)
+        table[i] = -1;
+    while (ip + MatchLimit <= size) {
+        memcpy(&word, &in[ip], sizeof(word));
+        int h = (word * 2654435761U) >> (32 - CompressHashLog);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > 0xffff || memcmp(&in[ref], &in[ip], MinMatch) != 0) {
+            ip++;
+            continue;
+        }
+        int length = MinMatch;
+        while (ip + length < size - LastLiterals && in[ref + length] == in[ip + length])
+            length++;
+        op = EmitSequence(out, op, limit, &in[anchor], ip - anchor, ip - ref, length);
+        if (op < 0)
+            return -1;
+        ip += length;
+        anchor = ip;
+    }
+    return EmitSequence(out, op, limit, &in[anchor], size - anchor, 0, 0);
+}
+
+static int GetLength(unsigned char *in, int *ip, int n, int length) {
+    unsigned char b;
+
+    if (length < 15)
+        return length;
+    do {
+        if (*ip >= n)
+            return -1;
+        b = in[(*ip)++];
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+static int Decompress(char *from, int n, char *to, int size) {
+    unsigned char *in = (unsigned char *)from, *out = (unsigned char *)to;
+    int ip = 0, op = 0, length, offset;
+
+    while (ip < n) {
+        int token = in[ip++];
+        length = GetLength(in, &ip, n, token >> 4);
+        if (length < 0 || ip + length > n || op + length > size)
+            return -1;
+        memcpy(&out[op], &in[ip], length);
+        ip += length;
+        op += length;
+        if (ip == n)
+            break;  // the last sequence has no match
+        if (ip + 2 > n)
+            return -1;
+        offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        length = GetLength(in, &ip, n, token & 15);
+        if (offset == 0 || offset > op || length < 0 || op + length + MinMatch > size)
+            return -1;
+        length += MinMatch;
+        for (int i = 0; i < length; i++, op++)
+            out[op] = out[op - offset];  // the match may overlap itself
+    }
+    return op;
+}
+
 //----------------------------------------------------------------------
 // OpenFile::OpenFile
 // 	Open a Nachos file for reading and writing.  Bring the file header
 //	into memory while the file is open.
 //
+//	MP4: the header is shared with other opens of the same file,
+//	through the header cache.
+//
 //	"sector" -- the location on disk of the file header for this file
 //----------------------------------------------------------------------
 
 OpenFile::OpenFile(int sector) {
-    hdr = new FileHeader;
-    hdr->FetchFrom(sector);
+    if (headerLocks == NULL)  // MP4
+        headerLocks = new RWLockTable("file header");
+    hdr = FileHeader::Acquire(sector);
+    hdrSector = sector;
     seekPosition = 0;
+    isDirectory = FALSE;
+    lastReadEnd = 0;
+    raWindow = 0;
+    raNext = 0;
 }
 
 //----------------------------------------------------------------------
@@ -39,7 +176,7 @@ OpenFile::OpenFile(int sector) {
 //----------------------------------------------------------------------
 
 OpenFile::~OpenFile() {
-    delete hdr;
+    FileHeader::Release(hdr);
 }
 
 //----------------------------------------------------------------------
@@ -62,6 +199,10 @@ void OpenFile::Seek(int position) {
 //
 //	Implemented using the more primitive ReadAt/WriteAt.
 //
+//	MP4: Read also starts reading ahead when it sees a sequential
+//	stream, see ReadAhead.  Files small enough to be kept inline in
+//	their header are read and written there, with no data sectors.
+//
 //	"into" -- the buffer to contain the data to be read from disk
 //	"from" -- the buffer containing the data to be written to disk
 //	"numBytes" -- the number of bytes to transfer
@@ -69,6 +210,13 @@ void OpenFile::Seek(int position) {
 
 int OpenFile::Read(char *into, int numBytes) {
     int result = ReadAt(into, numBytes, seekPosition);
+    int oldFile = kernel->currentThread->ioFile;
+
+    headerLocks->Acquire(hdrSector, FALSE);  // MP4
+    kernel->currentThread->ioFile = hdrSector;
+    ReadAhead(seekPosition, result);
+    kernel->currentThread->ioFile = oldFile;
+    headerLocks->Release(hdrSector, FALSE);
     seekPosition += result;
     return result;
 }
@@ -92,22 +240,59 @@ int OpenFile::Write(char *into, int numBytes) {
 //	For ReadAt:
 //	   We read in all of the full or partial sectors that are part of the
 //	   request, but we only copy the part we are interested in.
+//	   MP4: unless the request is whole sectors, which are read
+//	   directly into the caller's buffer.
 //	For WriteAt:
+//	   MP4: if the write goes past the end of the file, the file is
+//	   grown first; it is only truncated if the disk is full.
 //	   We must first read in any sectors that will be partially written,
 //	   so that we don't overwrite the unmodified portion.  We then copy
 //	   in the data that will be modified, and write back all the full
-//	   or partial sectors that are part of the request.
+//	   or partial sectors that are part of the request.  MP4: a request
+//	   of whole sectors is written directly from the caller's buffer.
 //
 //	"into" -- the buffer to contain the data to be read from disk
 //	"from" -- the buffer containing the data to be written to disk
 //	"numBytes" -- the number of bytes to transfer
 //	"position" -- the offset within the file of the first byte to be
 //			read/written
+//
+//	MP4: both hold the file's header lock, shared for reading and
+//	alone for writing; the work is done by ReadAtUnlocked and
+//	WriteAtUnlocked, which WriteAt also uses for its own reads and
+//	writes.  Meanwhile the thread's ioFile is set, so the disk
+//	profile charges the requests to this file.
 //----------------------------------------------------------------------
 
 int OpenFile::ReadAt(char *into, int numBytes, int position) {
+    int oldFile = kernel->currentThread->ioFile;
+    int result;
+
+    headerLocks->Acquire(hdrSector, FALSE);
+    kernel->currentThread->ioFile = hdrSector;
+    result = ReadAtUnlocked(into, numBytes, position);
+    kernel->currentThread->ioFile = oldFile;
+    headerLocks->Release(hdrSector, FALSE);
+    return result;
+}
+
+int OpenFile::WriteAt(char *from, int numBytes, int position) {
+    int oldFile = kernel->currentThread->ioFile;
+    int result;
+
+    headerLocks->Acquire(hdrSector, TRUE);
+    kernel->currentThread->ioFile = hdrSector;
+    result = WriteAtUnlocked(from, numBytes, position);
+    kernel->currentThread->ioFile = oldFile;
+    headerLocks->Release(hdrSector, TRUE);
+    return result;
+}
+
+int OpenFile::ReadAtUnlocked(char *into, int numBytes, int position) {
     int fileLength = hdr->FileLength();
-    int i, firstSector, lastSector, numSectors;
+    int i, j, firstSector, lastSector, numSectors;
+    int *sectors;
+    bool aligned;
     char *buf;
 
     if ((numBytes <= 0) || (position >= fileLength))
@@ -116,63 +301,573 @@ int OpenFile::ReadAt(char *into, int numBytes, int position) {
         numBytes = fileLength - position;
     DEBUG(dbgFile, "Reading " << numBytes << " bytes at " << position << " from file of length " << fileLength);
 
+    // MP4: a small file's data came in with its header
+    if (hdr->IsInline()) {
+        bcopy(&hdr->InlineData()[position], into, numBytes);
+        return numBytes;
+    }
+    if (hdr->IsCompressed())
+        return ReadCompressed(into, numBytes, position);  // MP4
+
     firstSector = divRoundDown(position, SectorSize);
     lastSector = divRoundDown(position + numBytes - 1, SectorSize);
     numSectors = 1 + lastSector - firstSector;
 
     // read in all the full and partial sectors that we need
-    buf = new char[numSectors * SectorSize];
-    for (i = firstSector; i <= lastSector; i++)
-        kernel->synchDisk->ReadSector(hdr->ByteToSector(i * SectorSize),
-                                      &buf[(i - firstSector) * SectorSize]);
+    // MP4: as one vectored request, so contiguous sectors share a seek;
+    // a request of whole sectors is read straight into "into"
+    aligned = (position % SectorSize == 0) && (numBytes % SectorSize == 0);
+    buf = aligned ? into : new char[numSectors * SectorSize];
+    sectors = new int[numSectors];
+    hdr->MapSectors(firstSector, numSectors, sectors);
+    // MP4: holes in a sparse file read as zeros, with no disk I/O
+    for (i = 0; i < numSectors; i = j) {
+        for (j = i + 1; j < numSectors && (sectors[j] == -1) == (sectors[i] == -1); j++)
+            continue;
+        if (sectors[i] == -1)
+            memset(&buf[i * SectorSize], 0, (j - i) * SectorSize);
+        else
+            kernel->synchDisk->ReadSectors(&sectors[i], j - i, &buf[i * SectorSize]);
+    }
+    delete[] sectors;
 
     // copy the part we want
-    bcopy(&buf[position - (firstSector * SectorSize)], into, numBytes);
-    delete[] buf;
+    if (!aligned) {
+        bcopy(&buf[position - (firstSector * SectorSize)], into, numBytes);
+        delete[] buf;
+    }
     return numBytes;
 }
 
-int OpenFile::WriteAt(char *from, int numBytes, int position) {
+int OpenFile::WriteAtUnlocked(char *from, int numBytes, int position) {
     int fileLength = hdr->FileLength();
     int i, firstSector, lastSector, numSectors;
-    bool firstAligned, lastAligned;
+    int *sectors;
+    bool firstAligned, lastAligned, holes;
     char *buf;
 
-    if ((numBytes <= 0) || (position >= fileLength))
+    if ((numBytes <= 0) || (position < 0))
         return 0;  // check request
+    // MP4: grow the file rather than truncating the write, and zero any
+    // gap between the old end of the file and the write
+    if ((position + numBytes) > fileLength &&
+        kernel->fileSystem->ExtendFile(this, position + numBytes)) {
+        if (position > fileLength) {
+            buf = new char[position - fileLength];
+            memset(buf, 0, position - fileLength);
+            WriteAtUnlocked(buf, position - fileLength, fileLength);
+            delete[] buf;
+        }
+        fileLength = hdr->FileLength();
+    }
+    if (position >= fileLength)
+        return 0;
     if ((position + numBytes) > fileLength)
         numBytes = fileLength - position;
     DEBUG(dbgFile, "Writing " << numBytes << " bytes at " << position << " from file of length " << fileLength);
 
+    // MP4: a small file's data is written as part of its header
+    if (hdr->IsInline()) {
+        bcopy(from, &hdr->InlineData()[position], numBytes);
+        hdr->WriteBack(hdrSector);
+        return numBytes;
+    }
+    if (hdr->IsCompressed())
+        return WriteCompressed(from, numBytes, position);  // MP4
+
     firstSector = divRoundDown(position, SectorSize);
     lastSector = divRoundDown(position + numBytes - 1, SectorSize);
     numSectors = 1 + lastSector - firstSector;
 
-    buf = new char[numSectors * SectorSize];
-
-    memset(buf, 0, sizeof(char) * numSectors * SectorSize);  // dummy operation to keep valgrind happy
-
     firstAligned = (position == (firstSector * SectorSize));
     lastAligned = ((position + numBytes) == ((lastSector + 1) * SectorSize));
 
-    // read in first and last sector, if they are to be partially modified
-    if (!firstAligned)
-        ReadAt(buf, SectorSize, firstSector * SectorSize);
-    if (!lastAligned && ((firstSector != lastSector) || firstAligned))
-        ReadAt(&buf[(lastSector - firstSector) * SectorSize],
-               SectorSize, lastSector * SectorSize);
+    // MP4: whole sectors are written straight from "from"
+    if (firstAligned && lastAligned) {
+        buf = from;
+    } else {
+        buf = new char[numSectors * SectorSize];
 
-    // copy in the bytes we want to change
-    bcopy(from, &buf[position - (firstSector * SectorSize)], numBytes);
+        memset(buf, 0, sizeof(char) * numSectors * SectorSize);  // dummy operation to keep valgrind happy
+
+        // read in first and last sector, if they are to be partially modified
+        if (!firstAligned)
+            ReadAtUnlocked(buf, SectorSize, firstSector * SectorSize);
+        if (!lastAligned && ((firstSector != lastSector) || firstAligned))
+            ReadAtUnlocked(&buf[(lastSector - firstSector) * SectorSize],
+                           SectorSize, lastSector * SectorSize);
+
+        // copy in the bytes we want to change
+        bcopy(from, &buf[position - (firstSector * SectorSize)], numBytes);
+    }
 
     // write modified sectors back
-    for (i = firstSector; i <= lastSector; i++)
-        kernel->synchDisk->WriteSector(hdr->ByteToSector(i * SectorSize),
-                                       &buf[(i - firstSector) * SectorSize]);
+    // MP4: first giving disk space to any holes they fall in
+    sectors = new int[numSectors];
+    hdr->MapSectors(firstSector, numSectors, sectors);
+    for (i = 0, holes = FALSE; i < numSectors; i++)
+        holes = holes || (sectors[i] == -1);
+    if (holes) {
+        if (!kernel->fileSystem->FillHoles(this, position, position + numBytes)) {
+            delete[] sectors;
+            if (buf != from)
+                delete[] buf;
+            return 0;  // the disk is full
+        }
+        hdr->MapSectors(firstSector, numSectors, sectors);
+    }
+    // MP4: and sectors shared with a clone new sectors of their own
+    if (hdr->IsShared() && kernel->fileSystem->AnyShared(sectors, numSectors)) {
+        if (!kernel->fileSystem->UnshareSectors(this, position, position + numBytes)) {
+            delete[] sectors;
+            if (buf != from)
+                delete[] buf;
+            return 0;  // the disk is full
+        }
+        hdr->MapSectors(firstSector, numSectors, sectors);
+    }
+    kernel->synchDisk->WriteSectors(sectors, numSectors, buf);
+    delete[] sectors;
+    if (buf != from)
+        delete[] buf;
+    return numBytes;
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// OpenFile::ReadChunk/WriteChunk
+// 	Read/write chunk number "chunk" of a compressed file: ChunkBytes
+//	of data starting at byte chunk * ChunkBytes.  On disk a chunk is
+//	one of:
+//	  all holes -- it is all zeros
+//	  every sector allocated -- it is stored as it is
+//	  its first few sectors allocated, the rest holes -- they hold
+//	    the length of the compressed data, as an int, and the data
+//	So WriteChunk keeps a chunk that does not compress by at least a
+//	sector as it is, gives disk space to the sectors it needs (see
+//	FileSystem::FillHoles) and frees the ones it no longer needs (see
+//	FileSystem::PunchHoles).  Either way the sectors go through the
+//	buffer cache as one request; sectors still shared with a clone
+//	are moved to new ones first.  WriteChunk returns FALSE if the disk
+//	is full.
+//
+//	A chunk that fails to decompress reads as zeros.
+//
+//	"chunk" -- which chunk of the file
+//	"into" -- ChunkBytes to hold the data read
+//	"from" -- ChunkBytes of data to write
+//----------------------------------------------------------------------
+
+void OpenFile::ReadChunk(int chunk, char *into) {
+    int sectors[ChunkSectors], used, length;
+    char *buf;
+
+    hdr->MapSectors(chunk * ChunkSectors, ChunkSectors, sectors);
+    for (used = 0; used < ChunkSectors && sectors[used] != -1; used++)
+        continue;
+    if (used == 0) {
+        memset(into, 0, ChunkBytes);
+        return;
+    }
+    if (used == ChunkSectors) {
+        kernel->synchDisk->ReadSectors(sectors, ChunkSectors, into);
+        return;
+    }
+    buf = new char[used * SectorSize];
+    kernel->synchDisk->ReadSectors(sectors, used, buf);
+    memcpy(&length, buf, sizeof(int));
+    if (length < 0 || length > used * SectorSize - (int)sizeof(int) ||
+        Decompress(&buf[sizeof(int)], length, into, ChunkBytes) != ChunkBytes) {
+        DEBUG(dbgFile, "Chunk " << chunk << " of file " << hdrSector << " is corrupt");
+        memset(into, 0, ChunkBytes);
+    }
     delete[] buf;
+}
+
+bool OpenFile::WriteChunk(int chunk, char *from) {
+    int sectors[ChunkSectors], used, length, start = chunk * ChunkBytes;
+    char *buf = new char[ChunkBytes];
+    bool holes = FALSE, allocated = FALSE;
+
+    for (used = 0; used < ChunkBytes && from[used] == 0; used++)
+        continue;
+    if (used == ChunkBytes) {
+        used = 0;  // all zeros: nothing to store
+    } else {
+        length = Compress(from, ChunkBytes, &buf[sizeof(int)],
+                          (ChunkSectors - 1) * SectorSize - sizeof(int));
+        if (length < 0) {
+            used = ChunkSectors;
+        } else {
+            used = divRoundUp(sizeof(int) + length, SectorSize);
+            memcpy(buf, &length, sizeof(int));
+            memset(&buf[sizeof(int) + length], 0, used * SectorSize - sizeof(int) - length);
+        }
+    }
+
+    hdr->MapSectors(chunk * ChunkSectors, ChunkSectors, sectors);
+    for (int i = 0; i < ChunkSectors; i++) {
+        if (i < used)
+            holes = holes || (sectors[i] == -1);
+        else
+            allocated = allocated || (sectors[i] != -1);
+    }
+    if (holes) {
+        if (!kernel->fileSystem->FillHoles(this, start, start + used * SectorSize)) {
+            delete[] buf;
+            return FALSE;  // the disk is full
+        }
+        hdr->MapSectors(chunk * ChunkSectors, ChunkSectors, sectors);
+    }
+    if (used > 0 && hdr->IsShared() && kernel->fileSystem->AnyShared(sectors, used)) {
+        if (!kernel->fileSystem->UnshareSectors(this, start, start + used * SectorSize)) {
+            delete[] buf;
+            return FALSE;
+        }
+        hdr->MapSectors(chunk * ChunkSectors, ChunkSectors, sectors);
+    }
+    if (used > 0)
+        kernel->synchDisk->WriteSectors(sectors, used, (used == ChunkSectors) ? from : buf);
+    if (allocated)
+        kernel->fileSystem->PunchHoles(this, start + used * SectorSize, start + ChunkBytes);
+    kernel->stats->numChunkWrites++;
+    kernel->stats->numChunkSectors += used;
+    delete[] buf;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::ReadCompressed/WriteCompressed
+// 	ReadAtUnlocked/WriteAtUnlocked for a compressed file, once the
+//	request has been checked against the length of the file: each
+//	chunk it touches is read (and, to write it, changed and written
+//	back) whole.  Whole chunks are read straight into "into", and
+//	written straight from "from".  Return the number of bytes read
+//	or written, which is short only if the disk is full.
+//----------------------------------------------------------------------
+
+int OpenFile::ReadCompressed(char *into, int numBytes, int position) {
+    char *chunk = new char[ChunkBytes];
+    int done = 0, offset, n;
+
+    while (done < numBytes) {
+        offset = (position + done) % ChunkBytes;
+        n = min(ChunkBytes - offset, numBytes - done);
+        if (n == ChunkBytes) {
+            ReadChunk((position + done) / ChunkBytes, &into[done]);
+        } else {
+            ReadChunk((position + done) / ChunkBytes, chunk);
+            bcopy(&chunk[offset], &into[done], n);
+        }
+        done += n;
+    }
+    delete[] chunk;
     return numBytes;
 }
 
+int OpenFile::WriteCompressed(char *from, int numBytes, int position) {
+    char *chunk = new char[ChunkBytes];
+    int done = 0, offset, n;
+    bool written;
+
+    while (done < numBytes) {
+        offset = (position + done) % ChunkBytes;
+        n = min(ChunkBytes - offset, numBytes - done);
+        if (n == ChunkBytes) {
+            written = WriteChunk((position + done) / ChunkBytes, &from[done]);
+        } else {
+            ReadChunk((position + done) / ChunkBytes, chunk);
+            bcopy(&from[done], &chunk[offset], n);
+            written = WriteChunk((position + done) / ChunkBytes, chunk);
+        }
+        if (!written)
+            break;  // the disk is full
+        done += n;
+    }
+    delete[] chunk;
+    return done;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::ReadAhead
+// 	Called after each Read.  If the read started where the previous
+//	one stopped, the stream is sequential: grow the read-ahead
+//	window (MinReadAhead, doubling up to MaxReadAhead sectors) and
+//	ask the disk to start fetching the sectors in the window past
+//	this read, so they are cached by the time they are wanted.
+//	Any other access pattern shuts read-ahead off again.
+//
+//	"position" -- where the read started
+//	"numBytes" -- how many bytes it returned
+//----------------------------------------------------------------------
+
+void OpenFile::ReadAhead(int position, int numBytes) {
+    int next, first, last;
+    int *sectors;
+
+    if (numBytes <= 0 || hdr->IsInline())
+        return;  // MP4: inline files have nothing to read ahead
+    if (position == lastReadEnd) {
+        raWindow = (raWindow == 0) ? MinReadAhead : min(2 * raWindow, MaxReadAhead);
+    } else {
+        raWindow = 0;
+        raNext = 0;
+    }
+    lastReadEnd = position + numBytes;
+    if (raWindow == 0)
+        return;
+
+    next = divRoundUp(lastReadEnd, SectorSize);  // the sector after this read
+    first = max(next, raNext);                   // skip what was read ahead before
+    last = min(next + raWindow, divRoundUp(hdr->FileLength(), SectorSize));
+    if (first >= last)
+        return;
+
+    sectors = new int[last - first];
+    hdr->MapSectors(first, last - first, sectors);
+    for (int i = first; i < last; i++) {
+        if (sectors[i - first] == -1) {
+            last = i;  // a hole, there is nothing to fetch
+            break;
+        }
+    }
+    if (last > first)
+        raNext = first + kernel->synchDisk->Prefetch(sectors, last - first);
+    delete[] sectors;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::MapRange
+// 	Find the disk sectors a read of "numBytes" bytes at "position"
+//	would touch, so that they can be fetched ahead of it.  Holes, and
+//	anything past the end of the file, have no sectors; nor do inline
+//	files, nor compressed ones, whose bytes are not where the header
+//	maps them.
+//
+//	Return the number of sectors stored in "sectors".
+//
+//	"sectors" -- where the disk sector numbers go, in file order
+//	"max" -- the most that fit there
+//	"numBytes" -- the size of the read
+//	"position" -- where in the file it starts
+//----------------------------------------------------------------------
+
+int OpenFile::MapRange(int *sectors, int max, int numBytes, int position) {
+    int first, last, found = 0;
+    int *map;
+
+    headerLocks->Acquire(hdrSector, FALSE);
+    numBytes = min(numBytes, hdr->FileLength() - position);
+    if (numBytes <= 0 || position < 0 || max <= 0 || hdr->IsInline() || hdr->IsCompressed()) {
+        headerLocks->Release(hdrSector, FALSE);
+        return 0;
+    }
+    first = position / SectorSize;
+    last = min(divRoundUp(position + numBytes, SectorSize), first + max);
+    map = new int[last - first];
+    hdr->MapSectors(first, last - first, map);
+    headerLocks->Release(hdrSector, FALSE);
+
+    for (int i = 0; i < last - first; i++) {
+        if (map[i] != -1)
+            sectors[found++] = map[i];
+    }
+    delete[] map;
+    return found;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::Extend
+// 	Grow the file to "newLength" bytes, if it is shorter, and write
+//	the updated header back to disk.  The caller is responsible for
+//	writing "freeMap" back.  Return FALSE if the disk is full.
+//	New sectors are looked for from the header onwards, so they stay
+//	in the file's block group.
+//
+//	"freeMap" -- the bit map of free disk sectors
+//	"newLength" -- the length the file should have
+//----------------------------------------------------------------------
+
+bool OpenFile::Extend(PersistentBitmap *freeMap, int newLength) {
+    if (newLength <= hdr->FileLength())
+        return TRUE;
+    freeMap->SetGoal(hdrSector);
+    if (!hdr->Extend(freeMap, newLength))
+        return FALSE;
+    hdr->WriteBack(hdrSector);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::FillHoles
+// 	Allocate the holes of a sparse file among the sectors holding
+//	bytes "from" up to "to", and write the updated header back.  The
+//	sectors are looked for right after the data before them, so a
+//	file written in order comes out contiguous.  The caller is
+//	responsible for writing "freeMap" back.  Return FALSE if the disk
+//	is full.
+//
+//	"freeMap" -- the bit map of free disk sectors
+//	"from", "to" -- the bytes about to be written
+//----------------------------------------------------------------------
+
+bool OpenFile::FillHoles(PersistentBitmap *freeMap, int from, int to) {
+    int before = (from >= SectorSize) ? hdr->ByteToSector(from - SectorSize) : -1;
+
+    freeMap->SetGoal((before == -1) ? hdrSector : before + 1);
+    if (!hdr->FillHoles(freeMap, from, to))
+        return FALSE;
+    hdr->WriteBack(hdrSector);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::PunchHoles
+// 	Free the sectors holding bytes "from" up to "to", and write the
+//	updated header back.  The caller is responsible for writing
+//	"freeMap" back.
+//
+//	"freeMap" -- the bit map of free disk sectors
+//	"from", "to" -- the bytes to free, on sector boundaries
+//----------------------------------------------------------------------
+
+void OpenFile::PunchHoles(PersistentBitmap *freeMap, int from, int to) {
+    hdr->PunchHoles(freeMap, from, to);
+    hdr->WriteBack(hdrSector);
+}
+
+//----------------------------------------------------------------------
+// OpenFile::Unshare
+// 	Give the sectors holding bytes "from" up to "to" that are shared
+//	with a clone new sectors of their own, and write the updated
+//	header back.  The new sectors are looked for near the header.
+//	The caller is responsible for writing "freeMap" back.  Return
+//	FALSE if the disk is full.
+//
+//	"freeMap" -- the bit map of free disk sectors
+//	"from", "to" -- the bytes about to be written
+//----------------------------------------------------------------------
+
+bool OpenFile::Unshare(PersistentBitmap *freeMap, int from, int to) {
+    freeMap->SetGoal(hdrSector);
+    if (!hdr->Unshare(freeMap, from, to))
+        return FALSE;
+    hdr->WriteBack(hdrSector);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::CopyToRun, SwitchToRun
+// 	Move the file's data into one run of sectors, looked for from the
+//	header onwards so it lands in the file's block group.  CopyToRun
+//	copies the data, and has the copies on disk when it returns; the
+//	caller must not have a transaction open, or every copy would be
+//	journalled too.  SwitchToRun then points the header at the copies
+//	and writes it back; the caller journals that together with
+//	"freeMap".  A crash before the switch commits leaves the header
+//	pointing at the old, intact, data.
+//
+//	CopyToRun returns the run's first sector, or -1 if there is
+//	nothing to move (see FileHeader::CopyToRun).
+//
+//	"freeMap" -- the bit map of free disk sectors
+//	"start" -- the run the data was copied to
+//----------------------------------------------------------------------
+
+int OpenFile::CopyToRun(PersistentBitmap *freeMap) {
+    freeMap->SetGoal(hdrSector);
+    return hdr->CopyToRun(freeMap);
+}
+
+void OpenFile::SwitchToRun(PersistentBitmap *freeMap, int start) {
+    hdr->SwitchToRun(freeMap, start);
+    hdr->WriteBack(hdrSector);
+}
+
+//----------------------------------------------------------------------
+// OpenFile::Defragment
+// 	Relocate the file, through FileSystem::RelocateFile, holding the
+//	header lock so that no one reads or writes it meanwhile.  The
+//	file is added to "before" as it was and to "after" as it is left.
+//	Return TRUE if it was moved.
+//
+//	"before", "after" -- totals for FileSystem::Defragment's report
+//----------------------------------------------------------------------
+
+bool OpenFile::Defragment(FragmentStats *before, FragmentStats *after) {
+    int oldFile = kernel->currentThread->ioFile;
+    bool moved;
+
+    headerLocks->Acquire(hdrSector, TRUE);
+    kernel->currentThread->ioFile = hdrSector;
+    hdr->Measure(hdrSector, before);
+    moved = kernel->fileSystem->RelocateFile(this);
+    hdr->Measure(hdrSector, after);
+    kernel->currentThread->ioFile = oldFile;
+    headerLocks->Release(hdrSector, TRUE);
+    return moved;
+}
+
+//----------------------------------------------------------------------
+// OpenFile::Clone
+// 	Create "name" as a clone of the file, through
+//	FileSystem::CreateClone, holding the header lock for reading so
+//	that no one writes the file halfway through.  The header is
+//	written back marked shared.  Return FALSE if the clone could not
+//	be made.
+//
+//	"name" -- the path of the new file
+//----------------------------------------------------------------------
+
+bool OpenFile::Clone(char *name) {
+    bool cloned;
+
+    headerLocks->Acquire(hdrSector, FALSE);
+    cloned = kernel->fileSystem->CreateClone(name, hdr, hdrSector);
+    headerLocks->Release(hdrSector, FALSE);
+    return cloned;
+}
+// MP4 end
+
+// MP4 start
+//----------------------------------------------------------------------
+// OpenFile::WriteChanged
+// 	Write back only the parts of a buffer that changed.  "shadow"
+//	holds what was last read or written at "position"; each run of
+//	file sectors in which "from" differs from it is written with one
+//	WriteAt, and copied into "shadow".  Return the number of bytes
+//	written.
+//
+//	"from" -- the buffer containing the data to be written to disk
+//	"shadow" -- the data on disk, numBytes long; updated
+//	"numBytes" -- the number of bytes in "from"
+//	"position" -- the offset within the file of the first byte
+//----------------------------------------------------------------------
+
+int OpenFile::WriteChanged(char *from, char *shadow, int numBytes, int position) {
+    int start = 0, end, runStart = -1, written = 0;
+
+    while (start < numBytes) {
+        // the piece of "from" that falls in this file sector
+        end = min(numBytes, (divRoundDown(position + start, SectorSize) + 1) * SectorSize - position);
+        if (memcmp(&from[start], &shadow[start], end - start) != 0) {
+            if (runStart == -1)
+                runStart = start;
+        } else if (runStart != -1) {
+            written += WriteAt(&from[runStart], start - runStart, position + runStart);
+            memcpy(&shadow[runStart], &from[runStart], start - runStart);
+            runStart = -1;
+        }
+        start = end;
+    }
+    if (runStart != -1) {
+        written += WriteAt(&from[runStart], numBytes - runStart, position + runStart);
+        memcpy(&shadow[runStart], &from[runStart], numBytes - runStart);
+    }
+    return written;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // OpenFile::Length
 // 	Return the number of bytes in the file.
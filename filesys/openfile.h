@@ -60,6 +60,21 @@ class OpenFile {
         return Tell(file);
     }
 
+    void Seek(int position) { currentOffset = position; }  // MP4
+
+    // MP4: no sectors to save here, so write it all if anything changed
+    int WriteChanged(char *from, char *shadow, int numBytes, int position) {
+        if (memcmp(from, shadow, numBytes) == 0)
+            return 0;
+        memcpy(shadow, from, numBytes);
+        return WriteAt(from, numBytes, position);
+    }
+
+    // MP4: the host lays out its files, there is nothing to move
+    bool Defragment(struct FragmentStats *before, struct FragmentStats *after) {
+        return FALSE;
+    }
+
    private:
     int file;
     int currentOffset;
@@ -67,6 +82,13 @@ class OpenFile {
 
 #else  // FILESYS
 class FileHeader;
+class PersistentBitmap;
+struct FragmentStats;
+
+// MP4 start
+const int MinReadAhead = 2;   // read-ahead window, in sectors, once a
+const int MaxReadAhead = 16;  //  sequential stream is seen; doubles up to max
+// MP4 end
 
 class OpenFile {
    public:
@@ -76,6 +98,7 @@ class OpenFile {
 
     void Seek(int position);  // Set the position from which to
                               // start reading/writing -- UNIX lseek
+    int Tell() { return seekPosition; }  // MP4: where that is now
 
     int Read(char *into, int numBytes);  // Read/write bytes from the file,
                                          // starting at the implicit position.
@@ -93,9 +116,76 @@ class OpenFile {
                    // than the UNIX idiom -- lseek to
                    // end of file, tell, lseek back
 
+    // MP4 start
+    bool Extend(PersistentBitmap *freeMap, int newLength);
+    // Grow the file to newLength bytes,
+    // and write its header back
+    bool FillHoles(PersistentBitmap *freeMap, int from, int to);
+    // Allocate the holes of a sparse
+    // file that bytes from..to fall in,
+    // and write its header back
+    void PunchHoles(PersistentBitmap *freeMap, int from, int to);
+    // Free the sectors of bytes from..to,
+    // and write its header back
+    int CopyToRun(PersistentBitmap *freeMap);
+    // Copy the data into one run near
+    // the header, straight to disk
+    void SwitchToRun(PersistentBitmap *freeMap, int start);
+    // Point the header at that run, and
+    // write it back
+    bool Unshare(PersistentBitmap *freeMap, int from, int to);
+    // Move the sectors of bytes from..to
+    // shared with a clone to new ones,
+    // and write the header back
+    bool Clone(char *name);
+    // Make "name" a copy-on-write clone
+    // of the file, with the header locked
+    bool Defragment(FragmentStats *before, FragmentStats *after);
+    // Relocate, if it is worth it, with
+    // the header locked; add the file
+    // to the stats either way
+    int WriteChanged(char *from, char *shadow, int numBytes, int position);
+    // Like WriteAt, but only write the
+    // sectors where "from" differs from
+    // "shadow" (the data last written),
+    // then bring "shadow" up to date
+    int MapRange(int *sectors, int max, int numBytes, int position);
+    // Store the disk sectors that hold
+    // bytes position.. of the file in
+    // "sectors" (at most "max"), and
+    // return how many there are
+    int HeaderSector() { return hdrSector; }
+    // Tells which file this is: no
+    // two files share a header sector
+    void MarkDirectory() { isDirectory = TRUE; }
+    bool IsDirectory() { return isDirectory; }
+    // Was it opened as a directory?
+    // (set by FileSystem::Open)
+    // MP4 end
+
    private:
     FileHeader *hdr;   // Header for this file
     int seekPosition;  // Current position within the file
+    int hdrSector;     // MP4: where the header lives on disk
+    bool isDirectory;  // MP4: its directory entry says it is one
+
+    // MP4 start
+    int lastReadEnd;  // where the previous Read stopped
+    int raWindow;     // current read-ahead window in sectors, 0 if
+                      //  the reads are not sequential
+    int raNext;       // first file sector not yet read ahead
+    void ReadAhead(int position, int numBytes);
+    int ReadAtUnlocked(char *into, int numBytes, int position);
+    int WriteAtUnlocked(char *from, int numBytes, int position);
+    // ReadAt/WriteAt, with the header
+    //  lock already held
+    int ReadCompressed(char *into, int numBytes, int position);
+    int WriteCompressed(char *from, int numBytes, int position);
+    void ReadChunk(int chunk, char *into);
+    bool WriteChunk(int chunk, char *from);
+    // the same, for a compressed file,
+    //  a chunk at a time
+    // MP4 end
 };
 
 #endif  // FILESYS
@@ -9,6 +9,27 @@
 #include "pbitmap.h"
 
 #include "copyright.h"
+#include "debug.h"
+#include "hash.h"  // MP4
+
+#include <stdlib.h>  // MP4: qsort
+
+// MP4: an entry of the index of shared sectors: where the sector's
+// count is in the list that is saved in the share map file.
+class SharePosition {
+   public:
+    SharePosition() : sector(-1), slot(-1) {}
+    SharePosition(int s, int i) : sector(s), slot(i) {}
+
+    int sector;
+    int slot;  // its entry in PersistentBitmap::shares
+
+    static int Key(SharePosition p) { return p.sector; }
+    static unsigned Hash(int sector) {
+        unsigned h = (unsigned)sector * 2654435761u;
+        return h ^ (h >> 16);  // the table only looks at the low bits
+    }
+};
 
 //----------------------------------------------------------------------
 // PersistentBitmap::PersistentBitmap(int)
@@ -21,6 +42,22 @@
 //----------------------------------------------------------------------
 
 PersistentBitmap::PersistentBitmap(int numItems) : Bitmap(numItems) {
+    onDisk = NULL;  // MP4: nothing known about the disk copy
+    // MP4 start
+    numGroups = divRoundUp(numBits, SectorsPerGroup);
+    groupClear = new int[numGroups];
+    goal = 0;
+    deferred = NULL;
+    numDeferred = deferredSize = 0;
+    deferring = FALSE;
+    shares = sharesOnDisk = NULL;
+    numShared = numSharedOnDisk = sharesSize = 0;
+    shareIndex = NULL;
+    shareFile = NULL;
+    sharesLow = MaxSharedSectors;
+    sharesHigh = 0;
+    Recount();
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -31,15 +68,31 @@ PersistentBitmap::PersistentBitmap(int numItems) : Bitmap(numItems) {
 //	"numItems" is the number of bits in the bitmap.
 //      "file" refers to an open file containing the bitmap (written
 //        by a previous call to PersistentBitmap::WriteBack
+//	"counts" -- MP4: the clear bits of each group, if known
 //
 //      This constructor initializes the bitmap from a disk file
 //----------------------------------------------------------------------
 
-PersistentBitmap::PersistentBitmap(OpenFile *file, int numItems) : Bitmap(numItems) {
+PersistentBitmap::PersistentBitmap(OpenFile *file, int numItems, const int *counts) : Bitmap(numItems) {
     // map has already been initialized by the BitMap constructor,
     // but we will just overwrite that with the contents of the
     // map found in the file
-    file->ReadAt((char *)map, numWords * sizeof(unsigned), 0);
+    onDisk = NULL;
+    // MP4 start
+    numGroups = divRoundUp(numBits, SectorsPerGroup);
+    groupClear = new int[numGroups];
+    goal = 0;
+    deferred = NULL;
+    numDeferred = deferredSize = 0;
+    deferring = FALSE;
+    shares = sharesOnDisk = NULL;
+    numShared = numSharedOnDisk = sharesSize = 0;
+    shareIndex = NULL;
+    shareFile = NULL;
+    sharesLow = MaxSharedSectors;
+    sharesHigh = 0;
+    FetchFrom(file, counts);  // shared with FetchFrom
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -48,6 +101,12 @@ PersistentBitmap::PersistentBitmap(OpenFile *file, int numItems) : Bitmap(numIte
 //----------------------------------------------------------------------
 
 PersistentBitmap::~PersistentBitmap() {
+    delete[] onDisk;      // MP4
+    delete[] groupClear;  // MP4
+    delete[] deferred;    // MP4
+    delete[] shares;      // MP4
+    delete[] sharesOnDisk;
+    delete shareIndex;
 }
 
 //----------------------------------------------------------------------
@@ -55,19 +114,504 @@ PersistentBitmap::~PersistentBitmap() {
 // 	Initialize the contents of a persistent bitmap from a Nachos file.
 //
 //	"file" is the place to read the bitmap from
+//	"counts" -- MP4: the clear bits of each group, saved when the map
+//		was last known to match them (see FileSystem's superblock);
+//		NULL to count them from the map
 //----------------------------------------------------------------------
 
-void PersistentBitmap::FetchFrom(OpenFile *file) {
+void PersistentBitmap::FetchFrom(OpenFile *file, const int *counts) {
     file->ReadAt((char *)map, numWords * sizeof(unsigned), 0);
+    // MP4 start
+    freeHint = 0;  // contents replaced, forget the search hint
+    if (onDisk == NULL)
+        onDisk = new unsigned int[numWords];
+    memcpy(onDisk, map, numWords * sizeof(unsigned));
+    if (counts == NULL) {
+        Recount();
+        return;
+    }
+    numClear = 0;
+    for (int g = 0; g < numGroups; g++) {
+        groupClear[g] = counts[g];
+        numClear += counts[g];
+    }
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
 // PersistentBitmap::WriteBack
 // 	Store the contents of a persistent bitmap to a Nachos file.
 //
+//	MP4: only the sectors of the map that changed since it was last
+//	read or written go to the file -- usually one or two, instead of
+//	the whole map.
+//
 //	"file" is the place to write the bitmap to
 //----------------------------------------------------------------------
 
 void PersistentBitmap::WriteBack(OpenFile *file) {
-    file->WriteAt((char *)map, numWords * sizeof(unsigned), 0);
+    // MP4 start
+    if (onDisk == NULL) {
+        file->WriteAt((char *)map, numWords * sizeof(unsigned), 0);
+        onDisk = new unsigned int[numWords];
+        memcpy(onDisk, map, numWords * sizeof(unsigned));
+        return;
+    }
+    file->WriteChanged((char *)map, (char *)onDisk, numWords * sizeof(unsigned), 0);
+    // entries past the end of the list were dropped, and need not go;
+    // those past its end on disk may never have been written, so the
+    // shadow says nothing about them
+    sharesHigh = min(sharesHigh, numShared);
+    if (sharesLow < sharesHigh) {
+        int known = max(sharesLow, min(sharesHigh, numSharedOnDisk));
+
+        shareFile->WriteChanged((char *)&shares[sharesLow], (char *)&sharesOnDisk[sharesLow],
+                                (known - sharesLow) * sizeof(ShareCount),
+                                sizeof(int) + sharesLow * sizeof(ShareCount));
+        if (known < sharesHigh) {
+            shareFile->WriteAt((char *)&shares[known], (sharesHigh - known) * sizeof(ShareCount),
+                               sizeof(int) + known * sizeof(ShareCount));
+            memcpy(&sharesOnDisk[known], &shares[known], (sharesHigh - known) * sizeof(ShareCount));
+        }
+    }
+    if (numShared != numSharedOnDisk) {
+        shareFile->WriteAt((char *)&numShared, sizeof(int), 0);
+        numSharedOnDisk = numShared;
+    }
+    sharesLow = MaxSharedSectors;
+    sharesHigh = 0;
+    // MP4 end
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// PersistentBitmap::Mark
+// 	Set the "nth" bit, taking it off its group's count of clear bits
+//	if it was clear.  Bitmap's FindAndSet routines come through here
+//	as well, so the counts always match the map.
+//
+//	"which" is the number of the bit to be set.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::Mark(int which) {
+    if (!Test(which)) {
+        groupClear[which / SectorsPerGroup]--;
+        numClear--;
+    }
+    Bitmap::Mark(which);
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::Clear
+// 	Clear the "nth" bit, adding it to its group's count of clear bits
+//	if it was set.  If the sector is shared, only one of its owners
+//	lets go of it, and the bit stays set.
+//
+//	"which" is the number of the bit to be cleared.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::Clear(int which) {
+    int slot = FindShare(which);
+
+    if (slot != -1) {  // another file still owns it
+        if (--shares[slot].count == 0) {
+            // no longer shared: move the last entry into its place
+            shareIndex->Remove(which);
+            if (slot != --numShared) {
+                SharePosition moved(shares[numShared].sector, slot);
+
+                shareIndex->Remove(moved.sector);
+                shares[slot] = shares[numShared];
+                shareIndex->Insert(moved);
+            }
+        }
+        SharesChanged(slot);
+        return;
+    }
+    if (deferring) {
+        ASSERT(which >= 0 && which < numBits);
+        if (numDeferred == deferredSize) {
+            int *bigger = new int[2 * deferredSize + 64];
+            memcpy(bigger, deferred, numDeferred * sizeof(int));
+            delete[] deferred;
+            deferred = bigger;
+            deferredSize = 2 * deferredSize + 64;
+        }
+        deferred[numDeferred++] = which;
+        return;
+    }
+    if (Test(which)) {
+        groupClear[which / SectorsPerGroup]++;
+        numClear++;
+    }
+    Bitmap::Clear(which);
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::Revert
+// 	Throw away every change made since the map was last read or
+//	written, by copying back what is on disk.  Lets the file system
+//	keep one map in memory and still back out of a failed operation.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::Revert() {
+    ASSERT(onDisk != NULL);
+    memcpy(map, onDisk, numWords * sizeof(unsigned));
+    freeHint = 0;
+    numDeferred = 0;  // those clears are dropped too
+    deferring = FALSE;
+    if (sharesLow < sharesHigh || numShared != numSharedOnDisk) {
+        if (sharesLow < sharesHigh)
+            memcpy(&shares[sharesLow], &sharesOnDisk[sharesLow],
+                   (sharesHigh - sharesLow) * sizeof(ShareCount));
+        numShared = numSharedOnDisk;
+        sharesLow = MaxSharedSectors;
+        sharesHigh = 0;
+        IndexShares();  // entries may have moved
+    }
+    Recount();
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::AttachShares
+// 	Keep the share counts in "file", and read them from it -- or,
+//	when formatting, write out that no sector is shared.  Only the
+//	counts of the sectors actually shared are read, or kept.  Without
+//	this, no sector can be shared.
+//
+//	"file" -- the share map file, ShareCount entries long enough for
+//		MaxSharedSectors, after their number
+//	"format" -- is the file new?
+//----------------------------------------------------------------------
+
+void PersistentBitmap::AttachShares(OpenFile *file, bool format) {
+    ASSERT(shareIndex == NULL);
+    shareFile = file;
+    numShared = 0;
+    if (format)
+        file->WriteAt((char *)&numShared, sizeof(int), 0);
+    else
+        file->ReadAt((char *)&numShared, sizeof(int), 0);
+    ASSERT(numShared >= 0 && numShared <= MaxSharedSectors);
+    numSharedOnDisk = numShared;
+    sharesSize = max(numShared, 64);
+    shares = new ShareCount[sharesSize];
+    sharesOnDisk = new ShareCount[sharesSize];
+    if (numShared > 0)
+        file->ReadAt((char *)shares, numShared * sizeof(ShareCount), sizeof(int));
+    memcpy(sharesOnDisk, shares, numShared * sizeof(ShareCount));
+    IndexShares();
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::Share
+// 	Give the sector "which", in use, one more owner.  Return FALSE if
+//	there is no share map, or it has no room for another sector, the
+//	sector already has MaxShares owners, or it is not in use after
+//	all (its file was just removed).
+//----------------------------------------------------------------------
+
+bool PersistentBitmap::Share(int which) {
+    int slot = FindShare(which);
+
+    if (shareIndex == NULL || !Test(which))
+        return FALSE;
+    if (slot == -1) {  // its first share
+        if (numShared == MaxSharedSectors)
+            return FALSE;
+        if (numShared == sharesSize)
+            GrowShares();
+        slot = numShared++;
+        shares[slot].sector = which;
+        shares[slot].count = 0;
+        shareIndex->Insert(SharePosition(which, slot));
+    } else if (shares[slot].count == MaxShares - 1) {
+        return FALSE;
+    }
+    shares[slot].count++;
+    SharesChanged(slot);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::SharesChanged
+// 	Note that the entry in "slot" of the shared sectors changed, so
+//	that WriteBack and Revert only look at the entries between the
+//	lowest and the highest changed since.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::SharesChanged(int slot) {
+    sharesLow = min(sharesLow, slot);
+    sharesHigh = max(sharesHigh, slot + 1);
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::FindShare
+// 	Return where the sector "which" is in the list of shared sectors,
+//	or -1 if it is not shared.
+//----------------------------------------------------------------------
+
+int PersistentBitmap::FindShare(int which) const {
+    SharePosition position;
+
+    if (shareIndex == NULL || !shareIndex->Find(which, &position))
+        return -1;
+    return position.slot;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::GrowShares
+// 	Double the room for shared sectors, up to MaxSharedSectors.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::GrowShares() {
+    int size = min(2 * sharesSize, MaxSharedSectors);
+    ShareCount *bigger = new ShareCount[size];
+    ShareCount *biggerOnDisk = new ShareCount[size];
+
+    ASSERT(size > sharesSize);
+    memcpy(bigger, shares, sharesSize * sizeof(ShareCount));
+    memcpy(biggerOnDisk, sharesOnDisk, sharesSize * sizeof(ShareCount));
+    delete[] shares;
+    delete[] sharesOnDisk;
+    shares = bigger;
+    sharesOnDisk = biggerOnDisk;
+    sharesSize = size;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::IndexShares
+// 	Build the index from each shared sector to its entry afresh, from
+//	the list.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::IndexShares() {
+    delete shareIndex;
+    shareIndex = new OpenHashTable<int, SharePosition>(SharePosition::Key,
+                                                       SharePosition::Hash);
+    for (int slot = 0; slot < numShared; slot++)
+        shareIndex->Insert(SharePosition(shares[slot].sector, slot));
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::DeferClears
+// 	Start collecting the bits Clear is asked to clear, instead of
+//	clearing them one by one.  Until ClearDeferred, the bits stay set.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::DeferClears() {
+    ASSERT(!deferring);
+    deferring = TRUE;
+    numDeferred = 0;
+}
+
+static int CompareBits(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::ClearDeferred
+// 	Clear every bit collected since DeferClears: sort them, and clear
+//	each run of consecutive bits with ClearRange.  Files are mostly
+//	laid out in runs, so this touches each word of the map once
+//	rather than once per bit.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::ClearDeferred() {
+    int i = 0, first, last;
+
+    ASSERT(deferring);
+    deferring = FALSE;
+    qsort(deferred, numDeferred, sizeof(int), CompareBits);
+    while (i < numDeferred) {
+        first = last = deferred[i++];
+        while (i < numDeferred && deferred[i] <= last + 1)
+            last = deferred[i++];  // the next bit, or the same one again
+        ClearRange(first, last - first + 1);
+    }
+    numDeferred = 0;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::ClearRange
+// 	Clear "count" bits starting at "first", a word at a time, keeping
+//	the group counts right.  A group is a whole number of words, so
+//	each word falls in one group.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::ClearRange(int first, int count) {
+    int last = first + count;  // one past the run
+    int bit, end, set;
+    unsigned int mask;
+
+    ASSERT(first >= 0 && count >= 0 && last <= numBits);
+    for (bit = first; bit < last; bit = end) {
+        end = min(last, (bit / BitsInWord + 1) * BitsInWord);
+        if (end - bit == BitsInWord)
+            mask = ~0u;
+        else
+            mask = ((1u << (end - bit)) - 1) << (bit % BitsInWord);
+        set = __builtin_popcount(map[bit / BitsInWord] & mask);
+        map[bit / BitsInWord] &= ~mask;
+        groupClear[bit / SectorsPerGroup] += set;
+        numClear += set;
+    }
+    if (count > 0 && first < freeHint)
+        freeHint = first;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::Recount
+// 	Recompute the clear bit count of every group, and of the whole
+//	map, after its contents were replaced.
+//----------------------------------------------------------------------
+
+void PersistentBitmap::Recount() {
+    numClear = 0;
+    for (int g = 0; g < numGroups; g++) {
+        int first = g * SectorsPerGroup;
+        int last = min(numBits, first + SectorsPerGroup);
+        int count = last - first;
+
+        // groups are whole words, except maybe the last
+        for (int i = first; i < last; i++) {
+            if (i % BitsInWord == 0 && i + BitsInWord <= last) {
+                count -= __builtin_popcount(map[i / BitsInWord]);
+                i += BitsInWord - 1;
+            } else if (Test(i)) {
+                count--;
+            }
+        }
+        groupClear[g] = count;
+        numClear += count;
+    }
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::SearchSpan
+// 	Give the bits that step "i" of a search from the goal looks at:
+//	step 0 is the rest of the goal's group, steps 1 to numGroups-1
+//	are the groups after it in turn (wrapping around), and the last
+//	step is the start of the goal's group.  Return the group.
+//
+//	"i" -- the step, 0 to numGroups
+//	"from", "to" -- where to return the span of bits
+//----------------------------------------------------------------------
+
+int PersistentBitmap::SearchSpan(int i, int *from, int *to) const {
+    int group = (goal / SectorsPerGroup + i) % numGroups;
+
+    *from = group * SectorsPerGroup;
+    *to = min(numBits, *from + SectorsPerGroup);
+    if (i == 0)
+        *from = goal;
+    if (i == numGroups)
+        *to = goal;
+    return group;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::FindAndSet
+// 	Allocate the first clear bit at or after the goal, looking in the
+//	goal's group first, and in the following groups after that.  The
+//	goal moves past the bit, so the next one ends up right after it.
+//	Groups with no clear bits are skipped without looking at the map.
+//
+//	Return the bit, or -1 if the map is full.
+//----------------------------------------------------------------------
+
+int PersistentBitmap::FindAndSet() {
+    int from, to, bit;
+
+    for (int i = 0; i <= numGroups; i++) {
+        if (groupClear[SearchSpan(i, &from, &to)] == 0 || from >= to)
+            continue;
+        bit = Bitmap::FindAndSet(from, to);
+        if (bit != -1) {
+            goal = (bit + 1) % numBits;
+            return bit;
+        }
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::FindAndSetRange
+// 	Allocate "n" contiguous clear bits, in the goal's group if they
+//	fit there, else in the nearest group after it that has them.
+//	Runs longer than any one group can hold are taken from anywhere.
+//
+//	Return the first bit, or -1 if there is no such run.
+//
+//	"n" is the number of contiguous bits wanted
+//----------------------------------------------------------------------
+
+int PersistentBitmap::FindAndSetRange(int n) {
+    int from, to, start;
+
+    for (int i = 0; i <= numGroups; i++) {
+        if (groupClear[SearchSpan(i, &from, &to)] < n || to - from < n)
+            continue;
+        start = Bitmap::FindAndSetRange(n, from, to);
+        if (start != -1) {
+            goal = (start + n) % numBits;
+            return start;
+        }
+    }
+    start = Bitmap::FindAndSetRange(n);  // spans several groups
+    if (start != -1)
+        goal = (start + n) % numBits;
+    return start;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::FindAndSetRun
+// 	Allocate the first clear bit at or after the goal, as FindAndSet
+//	does, together with the clear bits right after it in the same
+//	group, up to "maxBits" of them.
+//
+//	Return the first bit, and store the number of bits set in
+//	"numSet".  Return -1 if the map is full.
+//
+//	"maxBits" is the largest run wanted
+//	"numSet" is where to return the number of bits actually set
+//----------------------------------------------------------------------
+
+int PersistentBitmap::FindAndSetRun(int maxBits, int *numSet) {
+    int from, to, first;
+
+    *numSet = 0;
+    for (int i = 0; i <= numGroups; i++) {
+        if (groupClear[SearchSpan(i, &from, &to)] == 0 || from >= to)
+            continue;
+        first = Bitmap::FindAndSetRun(maxBits, numSet, from, to);
+        if (first != -1) {
+            goal = (first + *numSet) % numBits;
+            return first;
+        }
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------
+// PersistentBitmap::SpreadGroup
+// 	Choose the group a new directory should go in: the one with the
+//	most clear bits, looking at the groups after "group" (its parent's)
+//	first, so ties go to the next group along.  Directories -- and so
+//	the files created in them -- are spread over the whole disk, each
+//	with free space around it.
+//
+//	"group" -- the group of the parent directory
+//----------------------------------------------------------------------
+
+int PersistentBitmap::SpreadGroup(int group) const {
+    int best = (group + 1) % numGroups;
+
+    for (int i = 2; i <= numGroups; i++) {
+        int g = (group + i) % numGroups;
+        if (groupClear[g] > groupClear[best])
+            best = g;
+    }
+    return best;
 }
+// MP4 end
@@ -15,21 +15,127 @@
 
 #include "bitmap.h"
 #include "copyright.h"
+#include "disk.h"
 #include "openfile.h"
 
+// MP4: the bits are divided into groups of this many, each with a
+// count of its clear bits, so that free space can be found without
+// scanning the map.  For the free map, a group is 16 tracks.
+const int SectorsPerGroup = 16 * SectorsPerTrack;
+
+// MP4: a sector can be shared by at most this many cloned files.
+const int MaxShares = 256;
+
+// MP4: a sector shared by cloned files, and how many owners it has
+// besides the first.  The share map file holds the number of shared
+// sectors, then a list of these, in no particular order; it has room
+// for MaxSharedSectors of them.
+class ShareCount {
+   public:
+    int sector;
+    int count;
+};
+
+const int MaxSharedSectors = NumSectors / 8;
+
+class SharePosition;
+template <class Key, class T> class OpenHashTable;
+
 // The following class defines a persistent bitmap.  It inherits all
 // the behavior of a bitmap (see bitmap.h), adding the ability to
 // be read from and stored to the disk.
 
 class PersistentBitmap : public Bitmap {
    public:
-    PersistentBitmap(OpenFile *file, int numItems);  // initialize bitmap from disk
-    PersistentBitmap(int numItems);                  // or don't...
+    PersistentBitmap(OpenFile *file, int numItems,
+                     const int *counts = NULL);  // initialize bitmap from disk
+    PersistentBitmap(int numItems);              // or don't...
 
     ~PersistentBitmap();  // deallocate bitmap
 
-    void FetchFrom(OpenFile *file);  // read bitmap from the disk
+    void FetchFrom(OpenFile *file, const int *counts = NULL);
+    // read bitmap from the disk; MP4: with
+    // "counts", the clear bits of each group
+    // as saved, instead of counting them
     void WriteBack(OpenFile *file);  // write bitmap contents to disk
+
+    // MP4 start
+    void Mark(int which);   // set a bit, counting it in its group
+    void Clear(int which);  // clear a bit, counting it in its group
+    int NumClear() const { return numClear; }
+
+    int NumGroups() const { return numGroups; }
+    int GroupClear(int group) const { return groupClear[group]; }
+
+    // Allocation starts at the "goal" sector and moves on through its
+    // group and then the groups after it, so that the sectors of one
+    // file end up close together, and close to the goal.
+    void SetGoal(int sector) { goal = sector; }
+    int Goal() const { return goal; }
+    int FindAndSet();
+    int FindAndSetRange(int n);
+    int FindAndSetRun(int maxBits, int *numSet);
+    int SpreadGroup(int group) const;  // a group for a new directory
+
+    void Revert();  // drop every change since the last
+                    // FetchFrom or WriteBack
+
+    // Between DeferClears and ClearDeferred, Clear only records the
+    // bit; ClearDeferred then sorts them and clears them a run, and a
+    // word, at a time.  Used to free a whole tree of files.
+    void DeferClears();
+    void ClearDeferred();
+    void ClearRange(int first, int count);  // clear a run of bits
+                                            // (none of them shared)
+
+    // The sectors of a cloned file are shared with the original until
+    // written (see FileSystem::Clone).  For each shared sector the map
+    // keeps how many owners it has besides the first, saved in a file
+    // of its own; Clear of a shared sector only drops one owner, and
+    // Revert and WriteBack cover the counts too.  Only shared sectors
+    // take any room, on disk or in memory.
+    void AttachShares(OpenFile *file, bool format);
+    // keep the counts in "file"; with
+    // "format", start with none
+    bool Share(int which);  // one more owner; FALSE if there is
+                            // no share map, or it is full, or too
+                            // many owners, or the sector is free
+    bool IsShared(int which) const { return FindShare(which) != -1; }
+    // MP4 end
+
+   private:
+    // MP4 start
+    int numGroups;    // number of groups of SectorsPerGroup bits
+    int *groupClear;  // number of clear bits in each group
+    int numClear;     // number of clear bits in the whole map
+    int goal;         // where the next allocation is looked for
+
+    int *deferred;     // bits Clear was asked to clear, while
+    int numDeferred;   // "deferring"; in no particular order
+    int deferredSize;  // room in "deferred"
+    bool deferring;
+
+    void Recount();  // recompute the counts from the map
+    int SearchSpan(int i, int *from, int *to) const;
+    // the bits to look at in step "i" of a search
+
+    ShareCount *shares;        // the shared sectors, NULL without
+    ShareCount *sharesOnDisk;  //  a share map; and as saved
+    int numShared;             // how many there are
+    int numSharedOnDisk;       //  and as saved
+    int sharesSize;            // room in "shares" and "sharesOnDisk"
+    OpenHashTable<int, SharePosition> *shareIndex;
+                               // where each sector is in "shares"
+    OpenFile *shareFile;       // where they are saved
+    int sharesLow, sharesHigh;  // the entries changed since then
+    void SharesChanged(int slot);
+    int FindShare(int which) const;  // its entry, or -1 if not shared
+    void GrowShares();   // make room for more entries
+    void IndexShares();  // rebuild "shareIndex" from "shares"
+    // MP4 end
+    unsigned int *onDisk;  // MP4: the map as last read or written, so
+                           // WriteBack only writes changed sectors;
+                           // NULL until then
 };
 
 #endif  // PBITMAP_H
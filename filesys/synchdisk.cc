@@ -10,6 +10,31 @@
 //	handle one operation at a time, use a lock to enforce mutual
 //	exclusion.
 //
+//	MP4: recently used sectors are kept in a write-back buffer
+//	cache, replaced with the CLOCK algorithm; the lock protects the
+//	cache.  Disk requests are queued and the disk serves them in the
+//	order chosen by a DiskPolicy, each requester waiting on its own
+//	semaphore.  A read claims ("busy") cache slots for its sectors and
+//	drops the lock while it waits; the interrupt handler fills the
+//	slots.  Write-backs keep the lock while they wait, so nobody can
+//	read a sector from disk while its newer copy is on its way there.
+//
+//	MP4: with a journal, sectors written inside a transaction are
+//	"pinned": they may not be evicted or written home until the
+//	transaction's record -- a descriptor plus their contents -- has
+//	been written to the journal region with one disk request.  The
+//	journal is emptied lazily: when it fills up, and whenever the
+//	cache is flushed with no transaction open, since every logged
+//	sector is then home.  A dirty sector is written home before a
+//	transaction pins it, so a pinned sector never holds the only
+//	copy of an update already committed to the log.
+//
+//	MP4: with checksums, the CRC-32C of every sector is recorded as
+//	it is written to the disk and checked as it is read back, in the
+//	interrupt handler, and a scrubber thread reads sectors whose sum
+//	is known whenever the disk would otherwise go idle.  The sums
+//	are kept in memory and written to their region on every Flush.
+//
 // Copyright (c) 1992-1993 The Regents of the University of California.
 // All rights reserved.  See copyright.h for copyright notice and limitation
 // of liability and disclaimer of warranty provisions.
@@ -17,18 +42,61 @@
 #include "synchdisk.h"
 
 #include "copyright.h"
+#include "main.h"
 
 //----------------------------------------------------------------------
 // SynchDisk::SynchDisk
 // 	Initialize the synchronous interface to the physical disk, in turn
 //	initializing the physical disk.
 //
+//	"diskPolicy" -- MP4: the order in which queued requests are served
+//	"mapDisk" -- MP4: keep the disk file mapped in memory
+//	"restoreFrom" -- MP4: a snapshot to start the disk from, or NULL
+//	"device" -- MP4: the kind of device to simulate
 //----------------------------------------------------------------------
 
-SynchDisk::SynchDisk() {
-    semaphore = new Semaphore("synch disk", 0);
+SynchDisk::SynchDisk(DiskPolicy diskPolicy, bool mapDisk, char *restoreFrom,
+                     DeviceKind device) {
     lock = new Lock("synch disk lock");
-    disk = new Disk(this);
+    disk = new Disk(this, mapDisk, restoreFrom, device);
+    // MP4 start
+    clockHand = 0;
+    prefetchPending = FALSE;
+    for (int i = 0; i < NumCacheEntries; i++) {
+        cache[i].valid = FALSE;
+        cache[i].dirty = FALSE;
+        cache[i].referenced = FALSE;
+        cache[i].busy = FALSE;
+        cache[i].writingBack = FALSE;
+        cache[i].pinned = FALSE;
+        cache[i].sector = -1;
+        cache[i].owner = -1;
+        cache[i].dirtiedAt = 0;
+    }
+    policy = diskPolicy;
+    queue = new List<DiskRequest *>;
+    inFlight = 0;
+    writingBack = 0;
+    busyWaiters = 0;
+    busySemaphore = new Semaphore("synch disk busy", 0);
+    journalFirst = -1;
+    journalSize = 0;  // no journal until SetJournal
+    journalHead = 1;
+    journalSeq = 1;
+    txDepth = 0;
+    txCount = 0;
+    flushWanted = NULL;  // no flusher until StartFlusher
+    flushPosted = FALSE;
+    sums = NULL;  // no checksums until SetChecksums
+    sumsFirst = -1;
+    sumsDirty = NULL;
+    scrubNext = 0;
+    scrubPending = FALSE;
+    scrubWanted = NULL;  // no scrubber until StartScrubber
+    traceFd = -1;        // no trace until RecordTrace
+    traceText = NULL;
+    traceUsed = 0;
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -40,7 +108,18 @@ SynchDisk::SynchDisk() {
 SynchDisk::~SynchDisk() {
     delete disk;
     delete lock;
-    delete semaphore;
+    // MP4 start
+    delete queue;  // only read-aheads can be left, never waited for
+    delete busySemaphore;
+    delete[] sums;
+    delete sumsDirty;
+    if (traceFd != -1) {
+        WriteFile(traceFd, traceText, traceUsed);  // the last lines
+        Close(traceFd);
+        delete[] traceText;
+    }
+    // the flusher is still asleep on flushWanted, and never wakes again
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -48,39 +127,1469 @@ SynchDisk::~SynchDisk() {
 // 	Read the contents of a disk sector into a buffer.  Return only
 //	after the data has been read.
 //
+//	MP4: served from the buffer cache when possible.
+//
 //	"sectorNumber" -- the disk sector to read
 //	"data" -- the buffer to hold the contents of the disk sector
 //----------------------------------------------------------------------
 
 void SynchDisk::ReadSector(int sectorNumber, char *data) {
-    lock->Acquire();  // only one disk I/O at a time
-    disk->ReadRequest(sectorNumber, data);
-    semaphore->P();  // wait for interrupt
-    lock->Release();
+    ReadSectors(&sectorNumber, 1, data);
 }
 
 //----------------------------------------------------------------------
 // SynchDisk::WriteSector
-// 	Write the contents of a buffer into a disk sector.  Return only
-//	after the data has been written.
+// 	Write the contents of a buffer into a disk sector.
+//
+//	MP4: the sector is only updated in the buffer cache and marked
+//	dirty; it reaches the disk when evicted or flushed.
 //
 //	"sectorNumber" -- the disk sector to be written
 //	"data" -- the new contents of the disk sector
 //----------------------------------------------------------------------
 
 void SynchDisk::WriteSector(int sectorNumber, char *data) {
-    lock->Acquire();  // only one disk I/O at a time
-    disk->WriteRequest(sectorNumber, data);
-    semaphore->P();  // wait for interrupt
+    WriteSectors(&sectorNumber, 1, data);
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// SynchDisk::ReadSectors
+// 	Read a list of disk sectors into consecutive SectorSize pieces
+//	of a buffer.  Return only after all the data has been read.
+//
+//	Sectors found in the buffer cache are copied out of it.  Each
+//	run of missing sectors that are also physically contiguous on
+//	disk (up to MaxReadRun of them) is fetched with a single disk
+//	request, straight into "data"; the cache slots claimed for the
+//	run are filled when the request completes.
+//
+//	"sectors" -- the disk sectors to read, in buffer order
+//	"numSectors" -- the number of entries in "sectors"
+//	"data" -- the buffer to hold the contents, numSectors * SectorSize
+//		bytes long
+//----------------------------------------------------------------------
+
+void SynchDisk::ReadSectors(int *sectors, int numSectors, char *data) {
+    int i, j, run, slot;
+    int *slots;
+
+    lock->Acquire();
+    Record('r', sectors, numSectors);  // MP4
+    i = 0;
+    while (i < numSectors) {
+        slot = FindEntry(sectors[i]);
+        if (slot != -1 && cache[slot].busy) {
+            WaitBusy();  // someone else is reading it in
+            continue;
+        }
+        if (slot != -1) {
+            kernel->stats->numCacheHits++;
+            cache[slot].referenced = TRUE;
+            memcpy(&data[i * SectorSize], cache[slot].data, SectorSize);
+            i++;
+            continue;
+        }
+
+        // extend the miss over the following contiguous, uncached sectors
+        run = 1;
+        while ((i + run < numSectors) && (run < MaxReadRun) &&
+               (sectors[i + run] == sectors[i] + run) &&
+               (FindEntry(sectors[i + run]) == -1))
+            run++;
+
+        // claim a slot for each of them
+        slots = new int[run];
+        for (j = 0; j < run; j++) {
+            slots[j] = AllocEntry(sectors[i + j]);
+            if (slots[j] == -1)
+                break;
+            cache[slots[j]].busy = TRUE;
+        }
+        if (j == 0) {  // every slot is busy
+            delete[] slots;
+            WaitBusy();
+            continue;
+        }
+        run = j;
+
+        kernel->stats->numCacheMisses += run;
+        lock->Release();  // let other threads queue requests meanwhile
+        DiskIO(sectors[i], run, &data[i * SectorSize], FALSE, slots, FALSE,
+               kernel->currentThread->ioFile);
+        lock->Acquire();
+        delete[] slots;
+        i += run;
+    }
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WriteSectors
+// 	Write consecutive SectorSize pieces of a buffer into a list of
+//	disk sectors.  The sectors are only updated in the buffer cache;
+//	dirty sectors are written back to disk, merged into contiguous
+//	runs, when they are evicted or flushed.
+//
+//	Inside a transaction, the sectors are also pinned and remembered,
+//	to be logged when it commits.
+//
+//	"sectors" -- the disk sectors to write, in buffer order
+//	"numSectors" -- the number of entries in "sectors"
+//	"data" -- the new contents, numSectors * SectorSize bytes long
+//----------------------------------------------------------------------
+
+void SynchDisk::WriteSectors(int *sectors, int numSectors, char *data) {
+    int slot;
+
+    lock->Acquire();
+    Record('w', sectors, numSectors);
+    for (int i = 0; i < numSectors;) {
+        slot = FindEntry(sectors[i]);
+        if (slot != -1 && (cache[slot].busy || cache[slot].writingBack)) {
+            WaitBusy();  // a read would overwrite us when it lands, and
+            continue;    // a write back could land after ours
+        }
+        if (slot != -1) {
+            kernel->stats->numCacheHits++;
+        } else {
+            slot = AllocEntry(sectors[i]);  // whole sector is overwritten,
+                                            // no need to read it first
+            if (slot == -1) {
+                WaitBusy();
+                continue;
+            }
+            kernel->stats->numCacheMisses++;
+        }
+        cache[slot].referenced = TRUE;
+        if (txDepth > 0 && journalSize > 0 && !cache[slot].pinned) {
+            if (txCount == MaxTransactionSectors) {
+                Commit();  // too big for one record, log it in pieces
+            }
+            if (cache[slot].dirty) {
+                // its last committed contents may only be in the
+                // journal, which a checkpoint could empty while the
+                // new ones are pinned: send them home first
+                WriteBackRun(slot, FALSE);
+            }
+            cache[slot].pinned = TRUE;
+            txSectors[txCount++] = sectors[i];
+        }
+        if (!cache[slot].dirty) {
+            cache[slot].dirtiedAt = kernel->stats->totalTicks;
+        }
+        cache[slot].dirty = TRUE;
+        cache[slot].owner = kernel->currentThread->ioFile;
+        memcpy(cache[slot].data, &data[i * SectorSize], SectorSize);
+        i++;
+    }
+    CheckFlush();  // MP4: maybe that was too much to keep
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WriteThrough
+// 	Write a run of physically contiguous sectors to disk with one
+//	request, and return once they are there.  Unlike WriteSectors,
+//	the data is neither left dirty in the cache nor pinned by an open
+//	transaction -- which, with the lock given up around every disk
+//	wait, may well belong to another thread.  Sectors already cached
+//	are brought up to date, so no stale copy is read back later.
+//
+//	"firstSector" -- the first disk sector of the run
+//	"numSectors" -- the number of sectors in the run
+//	"data" -- the new contents, numSectors * SectorSize bytes long
+//----------------------------------------------------------------------
+
+void SynchDisk::WriteThrough(int firstSector, int numSectors, char *data) {
+    int sectors[MaxReadRun];
+    int slot;
+
+    ASSERT(numSectors <= MaxReadRun);
+    lock->Acquire();
+    for (int i = 0; i < numSectors; i++) {
+        sectors[i] = firstSector + i;
+    }
+    Record('w', sectors, numSectors);
+    for (int i = 0; i < numSectors;) {
+        slot = FindEntry(firstSector + i);
+        if (slot != -1 && (cache[slot].busy || cache[slot].writingBack)) {
+            WaitBusy();  // a read would overwrite us when it lands, and
+            continue;    // a write back could land after ours
+        }
+        if (slot != -1) {
+            memcpy(cache[slot].data, &data[i * SectorSize], SectorSize);
+            if (!cache[slot].pinned) {
+                cache[slot].dirty = FALSE;  // the disk is about to match
+            }
+        }
+        i++;
+    }
+    DiskIO(firstSector, numSectors, data, TRUE, NULL, FALSE,
+           kernel->currentThread->ioFile);
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::ReadAsync
+// 	Start reading a sector and return without waiting for the disk,
+//	so the caller can go on computing meanwhile.  When the data is
+//	in "data", callWhenDone->CallBack() is invoked: from the disk
+//	interrupt handler if the sector had to be read, or before
+//	ReadAsync returns if it was cached.  "data" must stay around
+//	until then.
+//
+//	Like the synchronous routines, this may still wait for the
+//	lock, or for a cache slot to write back or become free.
+//
+//	"sectorNumber" -- the disk sector to read
+//	"data" -- the buffer to hold the contents of the disk sector
+//	"callWhenDone" -- who to tell when the read has completed
+//----------------------------------------------------------------------
+
+void SynchDisk::ReadAsync(int sectorNumber, char *data, CallBackObj *callWhenDone) {
+    DiskRequest *request;
+    int slot;
+
+    lock->Acquire();
+    Record('r', &sectorNumber, 1);
+    for (;;) {
+        slot = FindEntry(sectorNumber);
+        if (slot == -1) {
+            slot = AllocEntry(sectorNumber);
+            if (slot != -1)
+                break;  // a miss, and we have a slot to read into
+        } else if (!cache[slot].busy) {
+            kernel->stats->numCacheHits++;
+            cache[slot].referenced = TRUE;
+            memcpy(data, cache[slot].data, SectorSize);
+            lock->Release();
+            callWhenDone->CallBack();
+            return;
+        }
+        WaitBusy();
+    }
+
+    kernel->stats->numCacheMisses++;
+    cache[slot].busy = TRUE;
+    request = new DiskRequest;
+    request->sector = sectorNumber;
+    request->numSectors = 1;
+    request->data = data;
+    request->writing = FALSE;
+    request->slots = new int[1];
+    request->slots[0] = slot;
+    request->readAhead = FALSE;
+    request->notify = callWhenDone;
+    request->done = NULL;
+    request->owner = kernel->currentThread->ioFile;
+    Submit(request);
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WriteAsync
+// 	Start writing a sector straight to disk, as WriteThrough does,
+//	and return without waiting for it.  The cached copy is brought
+//	up to date and marked writingBack, so it is neither changed nor
+//	reused until the write lands; then callWhenDone->CallBack() is
+//	invoked, from the disk interrupt handler.  "data" must stay
+//	around until then.
+//
+//	Like the synchronous routines, this may still wait for the
+//	lock, or for a cache slot to write back or become free.
+//
+//	"sectorNumber" -- the disk sector to be written
+//	"data" -- the new contents of the disk sector
+//	"callWhenDone" -- who to tell when the write has completed
+//----------------------------------------------------------------------
+
+void SynchDisk::WriteAsync(int sectorNumber, char *data, CallBackObj *callWhenDone) {
+    DiskRequest *request;
+    int slot;
+
+    lock->Acquire();
+    Record('w', &sectorNumber, 1);
+    for (;;) {
+        slot = FindEntry(sectorNumber);
+        if (slot == -1) {
+            slot = AllocEntry(sectorNumber);  // whole sector is written
+            if (slot != -1)
+                break;
+        } else if (!cache[slot].busy && !cache[slot].writingBack) {
+            break;  // a read or write landing later would undo us
+        }
+        WaitBusy();
+    }
+
+    cache[slot].referenced = TRUE;
+    memcpy(cache[slot].data, data, SectorSize);
+    if (!cache[slot].pinned) {
+        cache[slot].dirty = FALSE;  // the disk is about to match
+    }
+    cache[slot].writingBack = TRUE;
+    writingBack++;
+    request = new DiskRequest;
+    request->sector = sectorNumber;
+    request->numSectors = 1;
+    request->data = data;
+    request->writing = TRUE;
+    request->slots = new int[1];
+    request->slots[0] = slot;
+    request->readAhead = FALSE;
+    request->notify = callWhenDone;
+    request->done = NULL;
+    request->owner = kernel->currentThread->ioFile;
+    Submit(request);
     lock->Release();
 }
 
+//----------------------------------------------------------------------
+// SynchDisk::Prefetch
+// 	Start reading sectors that are about to be needed into the
+//	buffer cache, and return without waiting for them.  Only the
+//	first run of uncached sectors that are contiguous on disk is
+//	read, at most MaxPrefetch of them, and only if no other read
+//	ahead is still outstanding.
+//
+//	Return the number of leading entries of "sectors" that are now
+//	cached or on their way; the caller may offer the rest later.
+//
+//	"sectors" -- the disk sectors wanted soon, in the order needed
+//	"numSectors" -- the number of entries in "sectors"
+//----------------------------------------------------------------------
+
+int SynchDisk::Prefetch(int *sectors, int numSectors) {
+    DiskRequest *request = NULL;
+    int i, j, run;
+
+    lock->Acquire();
+    Record('p', sectors, numSectors);
+    if (prefetchPending) {  // the disk is still busy with the last one
+        lock->Release();
+        return 0;
+    }
+    for (i = 0; i < numSectors && FindEntry(sectors[i]) != -1; i++)
+        ;
+    run = 0;
+    while (i + run < numSectors && run < MaxPrefetch &&
+           sectors[i + run] == sectors[i] + run &&
+           FindEntry(sectors[i + run]) == -1)
+        run++;
+    if (run > 0) {
+        request = new DiskRequest;
+        request->slots = new int[run];
+        for (j = 0; j < run; j++) {
+            request->slots[j] = AllocEntry(sectors[i + j]);
+            if (request->slots[j] == -1)
+                break;
+            cache[request->slots[j]].busy = TRUE;
+        }
+        run = j;
+    }
+    if (run > 0) {
+        DEBUG(dbgDisk, "Prefetching " << run << " sectors from " << sectors[i]);
+        kernel->stats->numPrefetchSectors += run;
+        prefetchPending = TRUE;
+        request->sector = sectors[i];
+        request->numSectors = run;
+        request->data = new char[run * SectorSize];
+        request->writing = FALSE;
+        request->readAhead = TRUE;
+        request->notify = NULL;
+        request->done = NULL;
+        request->owner = kernel->currentThread->ioFile;
+        Submit(request);
+    } else if (request != NULL) {
+        delete[] request->slots;  // no slot to read into
+        delete request;
+    }
+    lock->Release();  // the request finishes while we go on running
+    return i + run;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Fetch
+// 	Read the sectors in the list that are not cached into the buffer
+//	cache, and return once they are there.  The sectors are sorted,
+//	and each run of them that is contiguous on disk (up to MaxReadRun
+//	sectors) becomes one request; every request is queued before we
+//	wait for the first, so the DiskPolicy can order the whole batch.
+//	At most MaxFetch sectors are read, and fewer if the cache has no
+//	free slot for them.
+//
+//	Return the number of sectors read from the disk.
+//
+//	"sectors" -- the disk sectors wanted, in any order, repeats allowed
+//	"numSectors" -- the number of entries in "sectors"
+//----------------------------------------------------------------------
+
+int SynchDisk::Fetch(int *sectors, int numSectors) {
+    Semaphore done("disk fetch", 0);
+    DiskRequest *requests[MaxFetch];
+    int *sorted = new int[numSectors];
+    int i, j, n = 0, run, total, numRequests = 0;
+
+    for (i = 0; i < numSectors; i++) {  // insertion sort, dropping repeats
+        for (j = n; j > 0 && sorted[j - 1] > sectors[i]; j--)
+            ;
+        if (j > 0 && sorted[j - 1] == sectors[i])
+            continue;
+        memmove(&sorted[j + 1], &sorted[j], (n - j) * sizeof(int));
+        sorted[j] = sectors[i];
+        n++;
+    }
+
+    lock->Acquire();
+    Record('f', sectors, numSectors);
+    total = 0;
+    i = 0;
+    while (i < n && total < MaxFetch) {
+        if (FindEntry(sorted[i]) != -1) {
+            i++;  // cached, or already on its way
+            continue;
+        }
+        run = 1;
+        while (i + run < n && run < MaxReadRun && total + run < MaxFetch &&
+               sorted[i + run] == sorted[i] + run &&
+               FindEntry(sorted[i + run]) == -1)
+            run++;
+
+        DiskRequest *request = new DiskRequest;
+        request->slots = new int[run];
+        for (j = 0; j < run; j++) {
+            request->slots[j] = AllocEntry(sorted[i + j]);
+            if (request->slots[j] == -1)
+                break;
+            cache[request->slots[j]].busy = TRUE;
+        }
+        if (j == 0) {  // no slot left to read into
+            delete[] request->slots;
+            delete request;
+            break;
+        }
+        run = j;
+        kernel->stats->numCacheMisses += run;
+        request->sector = sorted[i];
+        request->numSectors = run;
+        request->data = new char[run * SectorSize];
+        request->writing = FALSE;
+        request->readAhead = FALSE;
+        request->notify = NULL;
+        request->done = &done;
+        request->owner = kernel->currentThread->ioFile;
+        Submit(request);
+        requests[numRequests++] = request;
+        total += run;
+        i += run;
+    }
+    lock->Release();  // as in ReadSectors, don't hold it while waiting
+    DEBUG(dbgDisk, "Fetching " << total << " sectors in " << numRequests << " requests");
+
+    for (i = 0; i < numRequests; i++) {
+        done.P();  // one signal per request, in whatever order they finish
+    }
+    for (i = 0; i < numRequests; i++) {
+        delete[] requests[i]->data;
+        delete[] requests[i]->slots;
+        delete requests[i];
+    }
+    delete[] sorted;
+    return total;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Flush
+// 	Write every dirty sector in the buffer cache back to the disk.
+//	Return only after all the writes have completed.
+//
+//	MP4: sectors pinned by an open transaction are not written, and
+//	the journal is only emptied when there are none, so that every
+//	record in it is home first.
+//----------------------------------------------------------------------
+
+void SynchDisk::Flush() {
+    lock->Acquire();
+    WriteBackAll(FALSE);
+    if (journalSize > 0 && journalHead > 1 && txDepth == 0 && txCount == 0) {
+        ResetJournal(FALSE);  // MP4: everything logged is home now
+    }
+    WriteSums(FALSE);  // MP4
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::FlushIdle
+// 	Write every dirty sector in the buffer cache back to the disk,
+//	without ever putting the current thread to sleep.  Called when
+//	there is nothing left to run, with interrupts disabled; instead
+//	of waiting on a semaphore, advance simulated time until each
+//	write completes.
+//
+//	If any request is queued or in flight, some thread still
+//	expects the disk to wake it up; leave things alone.
+//----------------------------------------------------------------------
+
+void SynchDisk::FlushIdle() {
+    ASSERT(kernel->interrupt->getLevel() == IntOff);
+    if (inFlight > 0 || !queue->IsEmpty()) {
+        return;
+    }
+    WriteBackAll(TRUE);
+    if (journalSize > 0 && journalHead > 1 && txDepth == 0 && txCount == 0) {
+        ResetJournal(TRUE);  // MP4: everything logged is home now
+    }
+    WriteSums(TRUE);  // MP4
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Snapshot
+// 	Write everything cached back to the disk, then save the disk
+//	image to the UNIX file "snapshotFile" (see Disk::Snapshot).  Other
+//	threads must not be using the disk meanwhile.  Return FALSE if
+//	the image can't be saved.
+//----------------------------------------------------------------------
+
+bool SynchDisk::Snapshot(char *snapshotFile) {
+    Flush();
+    ASSERT(inFlight == 0 && queue->IsEmpty());
+    return disk->Snapshot(snapshotFile);
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::SnapshotIdle
+// 	Like Snapshot, but without putting the current thread to sleep:
+//	for a checkpoint, taken with interrupts disabled while the disk
+//	IsIdle.  Return FALSE if the image can't be saved.
+//----------------------------------------------------------------------
+
+bool SynchDisk::SnapshotIdle(char *snapshotFile) {
+    ASSERT(IsIdle());
+    FlushIdle();
+    return disk->Snapshot(snapshotFile);
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::FlushFile
+// 	Write back, in sector order, the dirty cached sectors of one
+//	file: its header, and whatever it dirtied -- its data, and the
+//	index and free map sectors it grew into.  Return only after the
+//	writes have completed.  Other files' sectors stay in the cache.
+//
+//	"headerSector" -- the file's header sector
+//----------------------------------------------------------------------
+
+void SynchDisk::FlushFile(int headerSector) {
+    lock->Acquire();
+    WriteBackSorted(kernel->stats->totalTicks, headerSector);
+    WaitWritingBack();  // the flusher may have some of them on the way
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::StartFlusher, RunFlusher
+// 	The flusher thread keeps dirty sectors from piling up in the
+//	cache, so that a write only has to reach the cache, yet nothing
+//	stays off the disk for long.  It sleeps until CheckFlush finds
+//	a sector dirty for MaxDirtyAge ticks, or DirtyHighWater slots
+//	dirty, then writes back, in sector order, the old sectors -- or
+//	every one, if there are too many.
+//
+//	The runs are copied out under the lock, but written with the lock
+//	let go (see FlushRun), so threads using the cache are not held up
+//	behind the flusher's writes.
+//----------------------------------------------------------------------
+
+static void FlusherThread(SynchDisk *synchDisk) {
+    synchDisk->RunFlusher();
+}
+
+void SynchDisk::StartFlusher() {
+    Thread *flusher = new Thread("disk flusher", -1);
+
+    flushWanted = new Semaphore("disk flusher", 0);
+    flusher->Fork((VoidFunctionPtr)FlusherThread, (void *)this);
+}
+
+void SynchDisk::RunFlusher() {
+    int slots[NumCacheEntries];
+
+    for (;;) {
+        flushWanted->P();
+        lock->Acquire();
+
+        int now = kernel->stats->totalTicks, dirty = 0, count;
+        for (int i = 0; i < NumCacheEntries; i++) {
+            if (cache[i].valid && cache[i].dirty && !cache[i].pinned) {
+                dirty++;
+            }
+        }
+        DEBUG(dbgDisk, "Flusher woken with " << dirty << " dirty sectors");
+        kernel->stats->numFlusherRuns++;
+        count = SortDirty((dirty >= DirtyHighWater) ? now : now - MaxDirtyAge, -1, slots);
+        for (int k = 0; k < count; k++) {
+            // the lock was let go during the last write: look again
+            CacheEntry *entry = &cache[slots[k]];
+            if (entry->valid && entry->dirty && !entry->pinned) {
+                kernel->stats->numFlusherSectors += FlushRun(slots[k]);
+            }
+        }
+        flushPosted = FALSE;  // what our writes found old is gone now
+        lock->Release();
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::FlushRun
+// 	Like WriteBackRun, for the flusher: copy the dirty run at "slot"
+//	into the flusher's own buffer and mark its slots clean, but
+//	writingBack, so they are neither changed nor reused; then let go
+//	of the lock while the disk writes them.  CallBack clears
+//	writingBack once they are home.  Called, and returns, with the
+//	lock held.  Return how many sectors were written.
+//
+//	"slot" -- a cache slot holding a dirty sector
+//----------------------------------------------------------------------
+
+int SynchDisk::FlushRun(int slot) {
+    int first = cache[slot].sector;
+    int owner = cache[slot].owner;
+    int run = 0;
+
+    ASSERT(cache[slot].valid && cache[slot].dirty);
+    while (run < NumCacheEntries) {
+        int next = FindEntry(first + run);
+        if (next == -1 || !cache[next].dirty || cache[next].pinned) {
+            break;
+        }
+        memcpy(&flushBuffer[run * SectorSize], cache[next].data, SectorSize);
+        cache[next].dirty = FALSE;
+        cache[next].writingBack = TRUE;
+        flushSlots[run++] = next;
+    }
+    writingBack += run;
+    DEBUG(dbgDisk, "Flusher writing back " << run << " cached sectors from " << first);
+    lock->Release();
+    DiskIO(first, run, flushBuffer, TRUE, flushSlots, FALSE, owner);
+    lock->Acquire();
+    return run;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WaitWritingBack
+// 	Wait until none of the flusher's or WriteAsync's writes is on its
+//	way: a slot being written is already clean, so a flush that has
+//	to see everything home must also wait for them.  Called with the
+//	lock held.
+//----------------------------------------------------------------------
+
+void SynchDisk::WaitWritingBack() {
+    while (writingBack > 0) {
+        WaitBusy();
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::SetChecksums
+// 	Start keeping a checksum of every sector, in the
+//	ChecksumRegionSectors starting at "firstSector", which the file
+//	system reserves.  If "trusted" the region is read in; otherwise
+//	(a new disk, or one not unmounted cleanly, whose writes may have
+//	outrun the region) no sum is known yet, and the whole region is
+//	written back on the next Flush.  Call before anything else
+//	writes to the disk.
+//
+//	"firstSector" -- the first sector of the checksum region
+//	"trusted" -- the region is up to date
+//----------------------------------------------------------------------
+
+void SynchDisk::SetChecksums(int firstSector, bool trusted) {
+    unsigned int *table = new unsigned int[ChecksumRegionSectors * SectorSize / sizeof(unsigned int)];
+    char *bytes = (char *)table;
+
+    ASSERT(sums == NULL);
+    sumsFirst = firstSector;
+    sumsDirty = new Bitmap(ChecksumRegionSectors);
+    if (trusted) {
+        for (int i = 0; i < ChecksumRegionSectors; i += NumCacheEntries) {
+            int n = min(NumCacheEntries, ChecksumRegionSectors - i);
+            DiskIO(firstSector + i, n, &bytes[i * SectorSize], FALSE, NULL, FALSE);
+        }
+    } else {
+        memset(table, 0, ChecksumRegionSectors * SectorSize);
+        for (int i = 0; i < ChecksumRegionSectors; i++)
+            sumsDirty->Mark(i);
+    }
+    sums = table;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::CheckSums
+// 	Called by the interrupt handler for a finished request, before
+//	anyone sees its data.  A sector just written gets the sum of
+//	what was written; one just read is checked against its sum, or
+//	gets one if it had none.  A mismatch means the disk changed the
+//	sector behind our back: it is counted, and reported with -d d.
+//
+//	"request" -- the request the disk has finished
+//----------------------------------------------------------------------
+
+void SynchDisk::CheckSums(DiskRequest *request) {
+    for (int i = 0; i < request->numSectors; i++) {
+        int sector = request->sector + i;
+        if (sector >= sumsFirst && sector < sumsFirst + ChecksumRegionSectors) {
+            continue;  // the region itself is not checksummed
+        }
+        unsigned int sum = Crc32c(&request->data[i * SectorSize], SectorSize);
+        if (sum == 0) {
+            sum = 1;  // 0 stands for "not known"
+        }
+        if (!request->writing && sums[sector] != 0) {
+            if (sums[sector] != sum) {
+                kernel->stats->numChecksumErrors++;
+                DEBUG(dbgDisk, "Checksum mismatch in sector " << sector);
+            }
+        } else if (sums[sector] != sum) {
+            sums[sector] = sum;
+            sumsDirty->Mark(sector * sizeof(unsigned int) / SectorSize);
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WriteSums
+// 	Write the checksum region sectors that changed since they were
+//	last written, merged into runs.  Called with the lock held, or
+//	"polled" as for WriteBackAll.  A sum that changes while its
+//	sector is on the way out is marked again, for the next time.
+//----------------------------------------------------------------------
+
+void SynchDisk::WriteSums(bool polled) {
+    char *bytes = (char *)sums;
+    int first, count;
+
+    if (sums == NULL) {
+        return;
+    }
+    for (first = 0; first < ChecksumRegionSectors; first += count) {
+        count = 1;
+        if (!sumsDirty->Test(first)) {
+            continue;
+        }
+        while (first + count < ChecksumRegionSectors && count < NumCacheEntries &&
+               sumsDirty->Test(first + count)) {
+            count++;
+        }
+        for (int i = first; i < first + count; i++) {
+            sumsDirty->Clear(i);
+        }
+        DiskIO(sumsFirst + first, count, &bytes[first * SectorSize], TRUE, NULL, polled);
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::StartScrubber, RunScrubber
+// 	With checksums, the scrubber thread reads sectors that are not
+//	otherwise being read, so that damage is found before it is
+//	needed.  It sleeps until a request leaves the disk idle, then
+//	reads the next run of up to ScrubRun sectors whose sums are known
+//	(the interrupt handler checks them), going round the disk.  Its
+//	own reads do not wake it, so it never keeps the disk busy by
+//	itself, and Nachos still halts once everything else is done.
+//----------------------------------------------------------------------
+
+static void ScrubberThread(SynchDisk *synchDisk) {
+    synchDisk->RunScrubber();
+}
+
+void SynchDisk::StartScrubber() {
+    if (sums == NULL) {
+        return;
+    }
+    Thread *scrubber = new Thread("disk scrubber", -1);
+
+    scrubWanted = new Semaphore("disk scrubber", 0);
+    scrubber->Fork((VoidFunctionPtr)ScrubberThread, (void *)this);
+}
+
+void SynchDisk::RunScrubber() {
+    for (;;) {
+        scrubWanted->P();
+
+        // find the next sector with a known sum, then the run after it
+        int first = -1, count = 0;
+        for (int i = 0; i < ScrubScan && first < 0; i++) {
+            int sector = (scrubNext + i) % NumSectors;
+            if (sums[sector] != 0 &&
+                (sector < sumsFirst || sector >= sumsFirst + ChecksumRegionSectors)) {
+                first = sector;
+            }
+        }
+        if (first < 0) {
+            scrubNext = (scrubNext + ScrubScan) % NumSectors;
+        } else {
+            while (count < ScrubRun && first + count < NumSectors &&
+                   sums[first + count] != 0 && first + count != sumsFirst) {
+                count++;
+            }
+            DiskIO(first, count, scrubBuffer, FALSE, NULL, FALSE);
+            kernel->stats->numScrubbedSectors += count;
+            scrubNext = (first + count) % NumSectors;
+        }
+        scrubPending = FALSE;
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::RecordTrace
+// 	Start writing every request made of the disk to a trace file, to
+//	be replayed later (see -dreplay in main.cc).  What is traced is
+//	what callers ask for, before the buffer cache and the queue have
+//	had their say, so that a replay can be served by other caches
+//	and disk policies.  The trace is written a DiskTraceBufferSize
+//	piece at a time, and finished off by the destructor.
+//
+//	"traceFile" -- the UNIX file to write it to
+//----------------------------------------------------------------------
+
+void SynchDisk::RecordTrace(char *traceFile) {
+    const char *header = "# tick thread op sector sectors\n";
+
+    traceFd = OpenForWrite(traceFile);
+    traceText = new char[DiskTraceBufferSize];
+    strcpy(traceText, header);
+    traceUsed = strlen(header);
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Record
+// 	Add a request to the trace, if one is being taken: a line for
+//	each run of the list that is contiguous on disk.  Called with
+//	the lock held, so that the lines of two threads don't mix.
+//
+//	"op" -- the kind of request, as it appears in the trace
+//	"sectors" -- the disk sectors requested, in order
+//	"numSectors" -- the number of entries in "sectors"
+//----------------------------------------------------------------------
+
+void SynchDisk::Record(char op, int *sectors, int numSectors) {
+    int run;
+
+    if (traceFd == -1)
+        return;
+    for (int i = 0; i < numSectors; i += run) {
+        for (run = 1; i + run < numSectors && sectors[i + run] == sectors[i] + run; run++)
+            ;
+        if (traceUsed > DiskTraceBufferSize - 64) {  // no room for a line
+            WriteFile(traceFd, traceText, traceUsed);
+            traceUsed = 0;
+        }
+        traceUsed += sprintf(traceText + traceUsed, "%d %d %c %d %d\n",
+                             kernel->stats->totalTicks, kernel->currentThread->getID(),
+                             op, sectors[i], run);
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::CheckFlush
+// 	Wake the flusher if a sector has been dirty for MaxDirtyAge
+//	ticks, or DirtyHighWater slots are dirty.  Called as sectors are
+//	written, and from the disk interrupt handler, so old sectors are
+//	found while the disk is in use.  Only reads the cache.
+//----------------------------------------------------------------------
+
+void SynchDisk::CheckFlush() {
+    int now = kernel->stats->totalTicks, dirty = 0;
+    bool old = FALSE;
+
+    if (flushWanted == NULL || flushPosted) {
+        return;  // no flusher, or it has not got round to it yet
+    }
+    for (int i = 0; i < NumCacheEntries; i++) {
+        if (cache[i].valid && cache[i].dirty && !cache[i].pinned) {
+            dirty++;
+            old = old || now - cache[i].dirtiedAt >= MaxDirtyAge;
+        }
+    }
+    if (old || dirty >= DirtyHighWater) {
+        flushPosted = TRUE;
+        flushWanted->V();
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::SetJournal
+// 	Use "numSectors" sectors starting at "firstSector" as the journal.
+//	The file system reserves the region; call FormatJournal on a new
+//	disk, or Recover on one that was in use.  A size of 0 turns
+//	journaling off.
+//
+//	"firstSector" -- the journal header sector
+//	"numSectors" -- the size of the region, header included
+//----------------------------------------------------------------------
+
+void SynchDisk::SetJournal(int firstSector, int numSectors) {
+    ASSERT(numSectors == 0 || numSectors >= 2 + MaxTransactionSectors);
+    journalFirst = firstSector;
+    journalSize = numSectors;
+    journalHead = 1;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::FormatJournal
+// 	Write the header of an empty journal.
+//----------------------------------------------------------------------
+
+void SynchDisk::FormatJournal() {
+    lock->Acquire();
+    journalSeq = 1;
+    ResetJournal(FALSE);
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Recover
+// 	Replay the journal after an unclean shutdown.  Records are read
+//	in order from the start of the region; each one with the expected
+//	sequence number and a good checksum was fully committed, and its
+//	sectors are copied to their home locations.  The first bad one
+//	marks the end of the log.  Then everything is flushed and the
+//	journal emptied.
+//
+//	Return the number of records replayed, or -1 if there is no
+//	journal header (a disk formatted without one).
+//----------------------------------------------------------------------
+
+int SynchDisk::Recover() {
+    int header[SectorSize / sizeof(int)];
+    char *data;
+    int seq, n, pos = 1, replayed = 0;
+
+    ASSERT(journalSize > 0);
+    DiskIO(journalFirst, 1, (char *)header, FALSE, NULL, FALSE);
+    if (header[0] != JournalMagic) {
+        return -1;
+    }
+    seq = header[1];
+    data = new char[MaxTransactionSectors * SectorSize];
+    while (pos + 1 < journalSize) {
+        DiskIO(journalFirst + pos, 1, (char *)header, FALSE, NULL, FALSE);
+        n = header[2];
+        if (header[0] != JournalMagic || header[1] != seq || n <= 0 ||
+            n > MaxTransactionSectors || pos + 1 + n > journalSize) {
+            break;
+        }
+        DiskIO(journalFirst + pos + 1, n, data, FALSE, NULL, FALSE);
+        if ((unsigned int)header[3] != Checksum(header, data, n)) {
+            break;  // torn write: this record never committed
+        }
+        DEBUG(dbgDisk, "Replaying journal record " << seq << ", " << n << " sectors");
+        WriteSectors(&header[4], n, data);
+        pos += 1 + n;
+        seq++;
+        replayed++;
+    }
+    delete[] data;
+
+    journalSeq = seq;  // never reuse a number that may be on disk
+    journalHead = pos;
+    Flush();           // write everything home, empty the journal
+    return replayed;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::BeginTransaction/EndTransaction
+// 	Bracket a file system operation.  The sectors written in between
+//	are committed to the journal together by EndTransaction, so after
+//	a crash either all of them or none are replayed.  (A transaction
+//	that writes more than MaxTransactionSectors is logged, and
+//	therefore replayed, in pieces.)  Transactions may nest; only the
+//	outermost EndTransaction commits.  Without a journal these do
+//	nothing.
+//----------------------------------------------------------------------
+
+void SynchDisk::BeginTransaction() {
+    lock->Acquire();
+    txDepth++;
+    lock->Release();
+}
+
+void SynchDisk::EndTransaction() {
+    lock->Acquire();
+    ASSERT(txDepth > 0);
+    if (--txDepth == 0) {
+        Commit();
+    }
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Commit
+// 	Log the sectors pinned by the open transaction as one journal
+//	record, written with a single disk request, then unpin them so
+//	they can go home whenever the cache likes.  If the record does
+//	not fit in the rest of the journal, checkpoint first: write every
+//	other dirty sector home and start the journal over.  That is safe
+//	with this record's sectors still pinned, since WriteSectors sent
+//	their committed contents home before pinning them.  Called with
+//	the lock held.
+//----------------------------------------------------------------------
+
+void SynchDisk::Commit() {
+    int n = txCount;
+    int *header;
+    char *record;
+    int slot;
+
+    ASSERT(lock->IsHeldByCurrentThread());
+    if (n == 0) {
+        return;
+    }
+    if (journalHead + 1 + n > journalSize) {
+        DEBUG(dbgDisk, "Journal full, checkpointing");
+        WriteBackAll(FALSE);
+        ResetJournal(FALSE);
+    }
+
+    record = new char[(1 + n) * SectorSize];
+    memset(record, 0, SectorSize);
+    header = (int *)record;
+    header[0] = JournalMagic;
+    header[1] = journalSeq;
+    header[2] = n;
+    for (int i = 0; i < n; i++) {
+        slot = FindEntry(txSectors[i]);
+        ASSERT(slot != -1 && cache[slot].pinned);
+        header[4 + i] = txSectors[i];
+        memcpy(&record[(1 + i) * SectorSize], cache[slot].data, SectorSize);
+    }
+    header[3] = Checksum(header, &record[SectorSize], n);
+
+    DEBUG(dbgDisk, "Committing journal record " << journalSeq << ", " << n << " sectors");
+    DiskIO(journalFirst + journalHead, 1 + n, record, TRUE, NULL, FALSE);
+    delete[] record;
+
+    for (int i = 0; i < n; i++) {
+        cache[FindEntry(txSectors[i])].pinned = FALSE;
+    }
+    journalHead += 1 + n;
+    journalSeq++;
+    txCount = 0;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::ResetJournal
+// 	Mark the journal empty, by writing a header that says records
+//	start from the next sequence number.  Only call this once every
+//	logged sector has been written home.
+//
+//	"polled" -- passed on to DiskIO
+//----------------------------------------------------------------------
+
+void SynchDisk::ResetJournal(bool polled) {
+    int header[SectorSize / sizeof(int)];
+
+    memset(header, 0, sizeof(header));
+    header[0] = JournalMagic;
+    header[1] = journalSeq;
+    DiskIO(journalFirst, 1, (char *)header, TRUE, NULL, polled);
+    journalHead = 1;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Checksum
+// 	Checksum a journal record: its descriptor (except the checksum
+//	field itself) and the "numSectors" sectors of data after it.
+//----------------------------------------------------------------------
+
+unsigned int SynchDisk::Checksum(int *header, char *data, int numSectors) {
+    unsigned int sum = 0;
+    unsigned int *words = (unsigned int *)data;
+
+    for (int i = 0; i < 4 + numSectors; i++) {
+        if (i != 3) {
+            sum = sum * 31 + (unsigned int)header[i];
+        }
+    }
+    for (int i = 0; i < numSectors * SectorSize / (int)sizeof(int); i++) {
+        sum = sum * 31 + words[i];
+    }
+    return sum;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Submit
+// 	Put a request on the disk queue, and start it right away if the
+//	disk is idle.  The interrupt handler takes requests off the
+//	queue, so interrupts are disabled while it is touched.
+//
+//	"request" -- the request; it must stay around until it finishes
+//----------------------------------------------------------------------
+
+void SynchDisk::Submit(DiskRequest *request) {
+    IntStatus oldLevel = kernel->interrupt->SetLevel(IntOff);
+
+    request->finished = FALSE;
+    request->queuedAt = kernel->stats->totalTicks;
+    if (request->writing)
+        kernel->currentThread->diskWrites++;  // whoever it is made for
+    else
+        kernel->currentThread->diskReads++;
+    queue->Append(request);
+    Dispatch();
+    (void)kernel->interrupt->SetLevel(oldLevel);
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::Dispatch
+// 	Hand queued requests, chosen by the policy, to the disk until
+//	it has as many as it can take -- one for a rotational disk, a
+//	command queue's worth for an SSD.  Called with interrupts
+//	disabled.
+//----------------------------------------------------------------------
+
+void SynchDisk::Dispatch() {
+    while (inFlight < disk->QueueDepth() && !queue->IsEmpty()) {
+        DiskRequest *request = NextRequest();
+
+        inFlight++;
+        if (request->writing) {
+            disk->WriteRunRequest(request->sector, request->numSectors, request->data,
+                                  request->owner, request);
+        } else {
+            disk->ReadRunRequest(request->sector, request->numSectors, request->data,
+                                 request->owner, request);
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::NextRequest
+// 	Remove and return the queued request to serve next:
+//	  DiskFIFO  -- the oldest one
+//	  DiskSSTF  -- the one closest to the head
+//	  DiskCLOOK -- the lowest one at or past the head; if there is
+//	               none, wrap around to the lowest one overall
+//----------------------------------------------------------------------
+
+DiskRequest *SynchDisk::NextRequest() {
+    int head = disk->HeadSector();
+    DiskRequest *best = NULL, *lowest = NULL;
+
+    if (policy == DiskFIFO) {
+        return queue->RemoveFront();
+    }
+
+    ListIterator<DiskRequest *> it(queue);
+    for (; !it.IsDone(); it.Next()) {
+        DiskRequest *r = it.Item();
+        if (policy == DiskSSTF) {
+            if (best == NULL || abs(r->sector - head) < abs(best->sector - head))
+                best = r;
+        } else {
+            if (r->sector >= head && (best == NULL || r->sector < best->sector))
+                best = r;
+            if (lowest == NULL || r->sector < lowest->sector)
+                lowest = r;
+        }
+    }
+    if (best == NULL)
+        best = lowest;  // C-LOOK: nothing ahead of the head, start over
+    queue->Remove(best);
+    return best;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::DiskIO
+// 	Queue a request for a run of contiguous sectors and wait for it
+//	to complete.  Reads must not hold the lock (so that other threads
+//	can queue requests meanwhile); write-backs hold it, unless
+//	"polled" is set: then we are running with no other thread able to
+//	touch the disk, and we spin on the interrupt queue rather than
+//	block.  The flusher's write-backs mark their slots writingBack,
+//	and pass them in "slots", instead of holding the lock (as
+//	WriteAsync's requests do, without calling us).
+//
+//	"sectorNumber" -- the first disk sector
+//	"numSectors" -- the number of sectors in the run
+//	"data" -- the buffer to read into or write from
+//	"writing" -- a write rather than a read
+//	"slots" -- busy cache slots a read fills in, writingBack ones a
+//		write frees, or NULL
+//	"polled" -- wait by advancing simulated time, not by sleeping
+//	"owner" -- the file to charge the request to in the disk profile
+//----------------------------------------------------------------------
+
+void SynchDisk::DiskIO(int sectorNumber, int numSectors, char *data,
+                       bool writing, int *slots, bool polled, int owner) {
+    DiskRequest request;
+    Semaphore done("disk request", 0);
+
+    ASSERT(polled || (writing && slots == NULL) == lock->IsHeldByCurrentThread());
+    request.sector = sectorNumber;
+    request.numSectors = numSectors;
+    request.data = data;
+    request.writing = writing;
+    request.slots = slots;
+    request.readAhead = FALSE;
+    request.notify = NULL;
+    request.done = polled ? NULL : &done;
+    request.owner = owner;
+    Submit(&request);
+    if (polled) {
+        while (!request.finished) {
+            kernel->interrupt->Idle();  // run pending interrupts
+        }
+    } else {
+        done.P();  // wait for interrupt
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WaitBusy
+// 	Give up the lock and sleep until the disk has filled some busy
+//	cache slot, then take the lock back.  The caller must look the
+//	cache up again.
+//----------------------------------------------------------------------
+
+void SynchDisk::WaitBusy() {
+    busyWaiters++;
+    lock->Release();
+    busySemaphore->P();
+    lock->Acquire();
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WriteBackRun
+// 	Write back the dirty sector in "slot", together with the dirty
+//	cached sectors that follow it on disk, as one disk request.
+//	Return how many sectors that was.
+//
+//	"slot" -- a cache slot holding a dirty sector
+//	"polled" -- passed on to DiskIO
+//----------------------------------------------------------------------
+
+int SynchDisk::WriteBackRun(int slot, bool polled) {
+    int first = cache[slot].sector;
+    int run = 0;
+
+    ASSERT(cache[slot].valid && cache[slot].dirty);
+    while (run < NumCacheEntries) {
+        int next = FindEntry(first + run);
+        if (next == -1 || !cache[next].dirty || cache[next].pinned) {
+            break;
+        }
+        memcpy(&runBuffer[run * SectorSize], cache[next].data, SectorSize);
+        cache[next].dirty = FALSE;
+        run++;
+    }
+    DEBUG(dbgDisk, "Writing back " << run << " cached sectors from " << first);
+    DiskIO(first, run, runBuffer, TRUE, NULL, polled, cache[slot].owner);
+    return run;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WriteBackAll
+// 	Write back every dirty sector in the cache.  Runs are started at
+//	sectors whose predecessor is not dirty, so each contiguous dirty
+//	range goes out in one request.  MP4: pinned sectors stay put.
+//
+//	"polled" -- passed on to DiskIO
+//----------------------------------------------------------------------
+
+void SynchDisk::WriteBackAll(bool polled) {
+    if (!polled) {
+        WaitWritingBack();  // polled, nothing is in flight at all
+    }
+    for (int i = 0; i < NumCacheEntries; i++) {
+        if (cache[i].valid && cache[i].dirty && !cache[i].pinned) {
+            int prev = FindEntry(cache[i].sector - 1);
+            if (prev == -1 || !cache[prev].dirty || cache[prev].pinned) {
+                WriteBackRun(i, polled);
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::WriteBackSorted
+// 	Write back the dirty sectors that were dirtied by time
+//	"dirtiedBy", and by the file with header "owner" (or that are its
+//	header) unless it is -1, in increasing sector order, so the disk
+//	head sweeps across them once.  Each takes any dirty sectors that
+//	follow it along in its run.  Pinned sectors stay put.  Return how
+//	many sectors were written.
+//----------------------------------------------------------------------
+
+int SynchDisk::WriteBackSorted(int dirtiedBy, int owner) {
+    int slots[NumCacheEntries];
+    int count = SortDirty(dirtiedBy, owner, slots), written = 0;
+
+    // the lock is held throughout, so only the dirty bits change
+    for (int k = 0; k < count; k++) {
+        if (cache[slots[k]].dirty) {
+            written += WriteBackRun(slots[k], FALSE);
+        }
+    }
+    return written;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::SortDirty
+// 	Find the slots WriteBackSorted writes back, and put them in
+//	"slots" in increasing sector order.  Return how many there are.
+//----------------------------------------------------------------------
+
+int SynchDisk::SortDirty(int dirtiedBy, int owner, int *slots) {
+    int count = 0;
+
+    for (int i = 0; i < NumCacheEntries; i++) {
+        CacheEntry *entry = &cache[i];
+        if (!entry->valid || !entry->dirty || entry->pinned || entry->dirtiedAt > dirtiedBy) {
+            continue;
+        }
+        if (owner != -1 && entry->owner != owner && entry->sector != owner) {
+            continue;
+        }
+        int j = count++;  // insertion sort, by sector
+        while (j > 0 && cache[slots[j - 1]].sector > entry->sector) {
+            slots[j] = slots[j - 1];
+            j--;
+        }
+        slots[j] = i;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::FindEntry
+// 	Look up a sector in the buffer cache.  Return the slot holding
+//	it, or -1 if the sector is not cached.
+//
+//	"sectorNumber" -- the disk sector to look for
+//----------------------------------------------------------------------
+
+int SynchDisk::FindEntry(int sectorNumber) {
+    for (int i = 0; i < NumCacheEntries; i++) {
+        if (cache[i].valid && cache[i].sector == sectorNumber) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------
+// SynchDisk::AllocEntry
+// 	Pick a slot for a sector that is not in the cache, using the
+//	CLOCK algorithm: sweep the hand, clearing use bits, until a
+//	slot that has not been referenced since the last sweep is found.
+//	Busy and pinned slots are passed over.  A dirty victim is written back,
+//	along with the dirty sectors that follow it, before it is reused.
+//
+//	Return -1 if every slot is busy or pinned.
+//
+//	"sectorNumber" -- the disk sector the slot will hold
+//----------------------------------------------------------------------
+
+int SynchDisk::AllocEntry(int sectorNumber) {
+    int slot;
+
+    for (int i = 0;; i++) {
+        if (i == 2 * NumCacheEntries) {
+            return -1;  // two sweeps clear every use bit, unless busy
+        }
+        slot = clockHand;
+        clockHand = (clockHand + 1) % NumCacheEntries;
+        if (cache[slot].valid && (cache[slot].busy || cache[slot].writingBack || cache[slot].pinned)) {
+            continue;
+        }
+        if (!cache[slot].valid || !cache[slot].referenced) {
+            break;
+        }
+        cache[slot].referenced = FALSE;
+    }
+    if (cache[slot].valid && cache[slot].dirty) {
+        DEBUG(dbgDisk, "Evicting dirty sector " << cache[slot].sector);
+        WriteBackRun(slot, FALSE);
+    }
+    cache[slot].valid = TRUE;
+    cache[slot].dirty = FALSE;
+    cache[slot].busy = FALSE;
+    cache[slot].writingBack = FALSE;
+    cache[slot].pinned = FALSE;
+    cache[slot].sector = sectorNumber;
+    cache[slot].owner = -1;
+    return slot;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // SynchDisk::CallBack
 // 	Disk interrupt handler.  Wake up any thread waiting for the disk
 //	request to finish.
+//
+//	MP4: the data of a finished read is copied into the cache slots
+//	it claimed, threads waiting for busy slots are woken to look
+//	again, the next queued request is started, and then whoever
+//	made the request is told -- through its semaphore, or its
+//	callback for ReadAsync.
 //----------------------------------------------------------------------
 
 void SynchDisk::CallBack() {
-    semaphore->V();
+    // MP4 start
+    DiskRequest *request = (DiskRequest *)disk->Completed();
+    int ticks = kernel->stats->totalTicks - request->queuedAt;
+
+    ASSERT(inFlight > 0);
+    inFlight--;
+    kernel->stats->diskQueueRequests[policy]++;
+    kernel->stats->diskQueueTicks[policy] += ticks;
+    TRACE(TraceDisk, request->sector, ticks);
+    DEBUG(dbgDisk, "Request for sector " << request->sector << " done after " << ticks << " ticks");
+
+    if (sums != NULL) {
+        CheckSums(request);
+    }
+    if (request->slots != NULL && request->writing) {
+        for (int i = 0; i < request->numSectors; i++) {
+            CacheEntry *entry = &cache[request->slots[i]];
+            ASSERT(entry->valid && entry->writingBack && entry->sector == request->sector + i);
+            entry->writingBack = FALSE;  // home: it may change again
+        }
+        writingBack -= request->numSectors;
+    } else if (request->slots != NULL) {
+        for (int i = 0; i < request->numSectors; i++) {
+            CacheEntry *entry = &cache[request->slots[i]];
+            ASSERT(entry->valid && entry->busy && entry->sector == request->sector + i);
+            memcpy(entry->data, &request->data[i * SectorSize], SectorSize);
+            entry->referenced = TRUE;
+            entry->busy = FALSE;
+        }
+    }
+    if (request->slots != NULL) {
+        while (busyWaiters > 0) {
+            busyWaiters--;
+            busySemaphore->V(TRUE);
+        }
+    }
+    request->finished = TRUE;
+    Dispatch();  // keep the disk busy while we notify the requester
+    CheckFlush();  // sectors age while the disk works
+    if (scrubWanted != NULL && inFlight == 0 && !scrubPending) {
+        scrubPending = TRUE;  // the disk is idle: scrub a little
+        scrubWanted->V();
+    }
+    if (request->readAhead) {
+        prefetchPending = FALSE;
+        delete[] request->data;
+        delete[] request->slots;
+        delete request;
+    } else if (request->notify != NULL) {
+        request->notify->CallBack();
+        delete[] request->slots;
+        delete request;
+    } else if (request->done != NULL) {
+        request->done->V(TRUE);
+    }
+    // MP4 end
 }
@@ -11,10 +11,86 @@
 #ifndef SYNCHDISK_H
 #define SYNCHDISK_H
 
+#include "bitmap.h"
 #include "callback.h"
 #include "disk.h"
+#include "list.h"
 #include "synch.h"
 
+// MP4 start
+#define NumCacheEntries 64  // number of sectors kept in the buffer cache
+#define MaxPrefetch 16      // most sectors read ahead by one Prefetch
+#define MaxReadRun 16       // most cache misses merged into one disk read
+#define MaxFetch (NumCacheEntries / 2)
+                            // most sectors one Fetch reads in
+#define MaxDirtyAge 20000   // ticks a sector may stay dirty before the
+                            // flusher writes it back
+#define DirtyHighWater (NumCacheEntries / 2)
+                            // dirty slots that make the flusher write
+                            // back everything, however young
+
+// Journal layout: the first sector of the journal region is a header
+// holding JournalMagic and the sequence number of the first record.
+// Each record is a descriptor sector followed by the new contents of
+// the sectors it lists, written as one run.
+#define JournalMagic 0x4a524e4c  // "JRNL"
+#define MaxTransactionSectors ((int)(SectorSize / sizeof(int)) - 4)
+                                 // sectors one journal record can hold
+
+// Checksum region: a CRC-32C for every sector of the disk, indexed by
+// sector; the region's own entries are unused.  An entry of 0 means
+// the sector's checksum is not known yet (a sum that comes out as 0 is
+// kept as 1).
+#define ChecksumRegionSectors divRoundUp(NumSectors * (int)sizeof(unsigned int), SectorSize)
+#define ScrubRun MaxReadRun  // most sectors the scrubber reads at once
+#define ScrubScan 4096       // most entries it looks through for them
+
+// Disk trace: one text line per request made of the SynchDisk,
+//	<tick> <thread id> <op> <first sector> <sectors>
+// split into runs of contiguous sectors; <op> is 'r' (read), 'w'
+// (write), 'p' (Prefetch) or 'f' (Fetch).  Lines starting with '#'
+// are comments.
+#define DiskTraceBufferSize 4096  // bytes collected before each write
+
+// One slot of the sector buffer cache.  A slot is "dirty" when its
+// contents are newer than the copy on disk, and "referenced" is the
+// use bit consulted by the CLOCK replacement hand.  A "busy" slot
+// has been claimed for a sector whose disk read has not finished;
+// its data must not be used and the slot must not be reused.  One
+// "writingBack" is on its way to disk from the flusher or WriteAsync,
+// which do not hold the lock meanwhile: its data may be read, but not changed, and
+// the slot must not be reused.
+struct CacheEntry {
+    bool valid;
+    bool dirty;
+    bool referenced;
+    bool busy;
+    bool writingBack;
+    bool pinned;  // changed by an uncommitted transaction
+    int sector;
+    int owner;    // header sector of the file that dirtied it, or -1
+    int dirtiedAt;  // totalTicks when it last became dirty
+    char data[SectorSize];
+};
+
+// A request waiting in, or being served from, the SynchDisk queue.
+struct DiskRequest {
+    int sector;        // first sector of the run
+    int numSectors;    // number of contiguous sectors
+    char *data;        // numSectors * SectorSize bytes to read or write
+    bool writing;      // a write rather than a read
+    int *slots;        // busy cache slots to fill when a read is done,
+                       // or writingBack ones a write frees; or NULL
+    bool readAhead;    // a Prefetch; SynchDisk frees it when done
+    CallBackObj *notify;  // for ReadAsync: called when the request
+                          // completes, after which SynchDisk frees it
+    Semaphore *done;   // signalled when the request completes, or NULL
+    bool finished;     // set when the request completes
+    int queuedAt;      // totalTicks when the request was queued
+    int owner;         // header sector of the file it is for, or -1
+};
+// MP4 end
+
 // The following class defines a "synchronous" disk abstraction.
 // As with other I/O devices, the raw physical disk is an asynchronous device --
 // requests to read or write portions of the disk return immediately,
@@ -25,10 +101,29 @@
 // This class provides the abstraction that for any individual thread
 // making a request, it waits around until the operation finishes before
 // returning.
+//
+// MP4: requests are served out of a small write-back buffer cache.
+// Sectors are only written to the disk when they are evicted, when the
+// cache is flushed, or by the flusher thread once they are old or the
+// cache is filling up with them; Flush must be called before Nachos
+// exits.
+//
+// MP4: with a journal, the sectors a file system operation writes
+// between BeginTransaction and EndTransaction stay pinned in the cache
+// until they have been logged, together, with a single disk write.
+// They can then be written home lazily; Recover replays the log.
+//
+// MP4: disk requests from all threads go through a queue, and the
+// next one is chosen by a DiskPolicy when the disk finishes the last
+// (or, for a device with a command queue, whenever it has room).
+// Threads waiting for a read do not hold the lock, so several of them
+// can have requests queued at once.
 
 class SynchDisk : public CallBackObj {
    public:
-    SynchDisk();   // Initialize a synchronous disk,
+    SynchDisk(DiskPolicy diskPolicy = DiskCLOOK, bool mapDisk = FALSE,
+              char *restoreFrom = NULL, DeviceKind device = DeviceHDD);
+                   // Initialize a synchronous disk,
                    // by initializing the raw Disk.
     ~SynchDisk();  // De-allocate the synch disk data
 
@@ -40,16 +135,169 @@ class SynchDisk : public CallBackObj {
     // then wait until the request is done.
     void WriteSector(int sectorNumber, char *data);
 
+    // MP4 start
+    void ReadSectors(int *sectors, int numSectors, char *data);
+    // Read/write a list of sectors to or
+    // from one buffer; physically
+    // contiguous sectors are merged into
+    // a single disk request.
+    void WriteSectors(int *sectors, int numSectors, char *data);
+    void WriteThrough(int firstSector, int numSectors, char *data);
+    // Write a run of sectors straight to
+    // disk, whatever transaction is open,
+    // updating any cached copies.
+
+    void ReadAsync(int sectorNumber, char *data, CallBackObj *callWhenDone);
+    void WriteAsync(int sectorNumber, char *data, CallBackObj *callWhenDone);
+    // Start a read/write of one sector and
+    // return without waiting for the disk;
+    // callWhenDone->CallBack() is invoked
+    // (from the disk interrupt handler,
+    // unless the cache can serve it at
+    // once) when "data" may be used again.
+
+    int Prefetch(int *sectors, int numSectors);
+    // Start reading the uncached sectors in
+    // the list into the cache, without
+    // waiting for the data to arrive;
+    // return how many entries were dealt with.
+
+    int Fetch(int *sectors, int numSectors);
+    // Read the uncached sectors in the
+    // list into the cache, queueing all
+    // their runs at once, and wait for
+    // them; return how many were read.
+
+    void SetJournal(int firstSector, int numSectors);
+    // Log transactions to this region
+    void FormatJournal();  // Start an empty journal
+    int Recover();         // Replay committed records left in
+                           // the journal; return how many
+    void BeginTransaction();
+    void EndTransaction();
+    // Sectors written in between are
+    // logged to the journal as one
+    // record, committed by EndTransaction
+    bool InTransaction() { return txDepth > 0; }
+
+    void Flush();      // Write every dirty cached sector back
+                       // to disk, waiting for each write;
+                       // sectors pinned by an open transaction
+                       // stay, and so does the journal.
+    void FlushIdle();  // Same as Flush, but for use when no thread
+                       // is able to block (e.g. from Thread::Sleep);
+                       // does nothing if a request is in flight.
+    bool Snapshot(char *snapshotFile);
+                       // Flush, then save the disk image to
+                       // snapshotFile; FALSE if it can't be
+    bool SnapshotIdle(char *snapshotFile);
+                       // Same, by way of FlushIdle
+    bool IsIdle() { return inFlight == 0 && queue->IsEmpty() && txDepth == 0; }
+                       // No request outstanding, and no
+                       // transaction half done
+    void FlushFile(int headerSector);
+                       // Flush only the sectors the file with
+                       // this header dirtied, and the header
+
+    void StartFlusher();  // Fork the thread that writes dirty
+                          // sectors back in the background
+    void RunFlusher();    // What that thread does
+
+    void SetChecksums(int firstSector, bool trusted);
+                          // Checksum every sector, keeping the
+                          // sums in the ChecksumRegionSectors
+                          // at firstSector; if not "trusted",
+                          // what the region holds is stale
+    void StartScrubber(); // Fork the thread that checks sectors
+                          // while the disk is otherwise idle
+    void RunScrubber();   // What that thread does
+
+    void RecordTrace(char *traceFile);
+                          // Write every request from now on to
+                          // the UNIX file traceFile
+    // MP4 end
+
     void CallBack();  // Called by the disk device interrupt
                       // handler, to signal that the
                       // current disk operation is complete.
 
    private:
     Disk *disk;            // Raw disk device
-    Semaphore *semaphore;  // To synchronize requesting thread
-                           // with the interrupt handler
-    Lock *lock;            // Only one read/write request
-                           // can be sent to the disk at a time
+    Lock *lock;            // Protects the cache; the disk
+                           // itself is guarded by the queue
+
+    // MP4 start
+    CacheEntry cache[NumCacheEntries];       // sector buffer cache
+    int clockHand;                           // next slot to consider evicting
+    char runBuffer[NumCacheEntries * SectorSize];  // staging for write-back
+    char flushBuffer[NumCacheEntries * SectorSize];  // the flusher's own
+    int flushSlots[NumCacheEntries];          // the slots it is writing
+    int writingBack;                          // how many slots, its and
+                                              // WriteAsync's, 0 if none
+    bool prefetchPending;                    // a Prefetch read is outstanding
+
+    DiskPolicy policy;             // how the next request is chosen
+    List<DiskRequest *> *queue;    // requests not yet sent to the disk
+    int inFlight;                  // requests the disk is busy with, at
+                                   // most its QueueDepth()
+    int busyWaiters;               // threads waiting for a busy slot
+    Semaphore *busySemaphore;      // where they wait
+
+    void Submit(DiskRequest *request);  // queue a request
+    void Dispatch();                    // start the next request, if idle
+    DiskRequest *NextRequest();         // take the next one per policy
+    void DiskIO(int sectorNumber, int numSectors, char *data,
+                bool writing, int *slots, bool polled, int owner = -1);
+    // queue a request and wait for it
+    int journalFirst;   // first sector of the journal region
+    int journalSize;    // its length in sectors, 0 if no journal
+    int journalHead;    // where the next record goes, from journalFirst
+    int journalSeq;     // sequence number of the next record
+    int txDepth;        // BeginTransactions not yet ended
+    int txSectors[MaxTransactionSectors];  // sectors it has written
+    int txCount;        // number of entries in txSectors
+
+    void Commit();              // log the open transaction's sectors
+    void ResetJournal(bool polled);  // every record is home; start over
+    static unsigned int Checksum(int *header, char *data, int numSectors);
+
+    unsigned int *sums;   // checksum of each sector, NULL if off
+    int sumsFirst;        // first sector of the checksum region
+    Bitmap *sumsDirty;    // region sectors changed since written
+    int scrubNext;        // next sector the scrubber looks at
+    bool scrubPending;    // it has been woken, and not yet slept
+    Semaphore *scrubWanted;  // the scrubber waits here for work
+    char scrubBuffer[ScrubRun * SectorSize];  // what it reads
+
+    void CheckSums(DiskRequest *request);  // record or verify the
+                                           // sums of a finished request
+    void WriteSums(bool polled);  // write back changed checksums
+
+    int traceFd;          // the trace file, or -1 if not tracing
+    char *traceText;      // lines not yet written to it
+    int traceUsed;        // bytes of traceText in use
+    void Record(char op, int *sectors, int numSectors);
+                          // trace a request, one line per run
+
+    void WaitBusy();  // sleep until some busy slot is filled
+    int WriteBackRun(int slot, bool polled);   // write back dirty run at slot
+    void WriteBackAll(bool polled);            // write back every dirty run
+    int WriteBackSorted(int dirtiedBy, int owner);
+    // write back the sectors dirtied by
+    // then (and by owner, unless -1), in
+    // sector order
+    int SortDirty(int dirtiedBy, int owner, int *slots);
+    // find those slots, in sector order
+    int FlushRun(int slot);     // WriteBackRun, without the lock
+    void WaitWritingBack();     // until the flusher's write is home
+    Semaphore *flushWanted;  // the flusher waits here for work
+    bool flushPosted;        // and has been woken already
+    void CheckFlush();       // wake it if sectors are old or
+                             // too many are dirty
+    int FindEntry(int sectorNumber);  // slot caching sector, or -1
+    int AllocEntry(int sectorNumber);  // evict a slot, reuse it for sector;
+                                       // -1 if every slot is busy
+    // MP4 end
 };
 
 #endif  // SYNCHDISK_H
@@ -31,10 +31,7 @@ Bitmap::Bitmap(int numItems)
     {
         map[i] = 0; // initialize map to keep Purify happy
     }
-    for (i = 0; i < numBits; i++)
-    {
-        Clear(i);
-    }
+    freeHint = 0;
 }
 
 //----------------------------------------------------------------------
@@ -75,6 +72,10 @@ void Bitmap::Clear(int which)
     ASSERT(which >= 0 && which < numBits);
 
     map[which / BitsInWord] &= ~(1 << (which % BitsInWord));
+    if (which < freeHint)
+    {
+        freeHint = which;
+    }
 
     ASSERT(!Test(which));
 }
@@ -107,21 +108,160 @@ bool Bitmap::Test(int which) const
 //	(In other words, find and allocate a bit.)
 //
 //	If no bits are clear, return -1.
+//
+//	The search starts at freeHint, below which every bit is known to
+//	be set, and skips whole words that are full; the clear bit within
+//	a word is found by counting trailing ones.
+//
+//	"from", "to" -- only bits from "from" up to "to" are looked at;
+//		"to" of -1 stands for the end of the bitmap
 //----------------------------------------------------------------------
 
-int Bitmap::FindAndSet()
+int Bitmap::FindAndSet(int from, int to)
 {
-    for (int i = 0; i < numBits; i++)
+    int start = max(from, freeHint);
+
+    if (to < 0 || to > numBits)
+    {
+        to = numBits;
+    }
+    for (int w = start / BitsInWord; w * BitsInWord < to; w++)
     {
-        if (!Test(i))
+        unsigned int clear = ~map[w];
+
+        if (w == start / BitsInWord)
         {
+            clear &= ~0U << (start % BitsInWord); // bits before "start"
+        }
+        if (clear != 0)
+        {
+            int i = w * BitsInWord + __builtin_ctz(clear);
+            if (i >= to)
+            {
+                break;
+            }
             Mark(i);
+            if (start == freeHint)
+            {
+                freeHint = i + 1;
+            }
             return i;
         }
     }
+    if (start == freeHint && to == numBits)
+    {
+        freeHint = numBits;
+    }
     return -1;
 }
 
+//----------------------------------------------------------------------
+// Bitmap::FindAndSetRange
+// 	Find the first run of "n" contiguous clear bits, and set them all.
+//	Whole words that are empty or full are stepped over at once.
+//
+//	Return the number of the first bit of the run, or -1 if there
+//	is no run that long.
+//
+//	"n" is the number of contiguous bits wanted
+//	"from", "to" -- the run must lie within bits "from" up to "to";
+//		"to" of -1 stands for the end of the bitmap
+//----------------------------------------------------------------------
+
+int Bitmap::FindAndSetRange(int n, int from, int to)
+{
+    int start = max(from, freeHint);
+    int length = 0;
+    int i = start;
+
+    ASSERT(n > 0);
+
+    if (to < 0 || to > numBits)
+    {
+        to = numBits;
+    }
+    while (i < to && length < n)
+    {
+        unsigned int word = map[i / BitsInWord];
+
+        if ((i % BitsInWord) == 0 && word == 0 && i + BitsInWord <= to)
+        {
+            length += BitsInWord; // whole word is free
+            i += BitsInWord;
+        }
+        else if ((i % BitsInWord) == 0 && word == ~0U)
+        {
+            length = 0; // whole word is in use
+            i += BitsInWord;
+            start = i;
+        }
+        else if (Test(i))
+        {
+            length = 0;
+            i++;
+            start = i;
+        }
+        else
+        {
+            length++;
+            i++;
+        }
+    }
+    if (length < n)
+    {
+        return -1;
+    }
+    for (i = start; i < start + n; i++)
+    {
+        Mark(i);
+    }
+    if (start == freeHint)
+    {
+        freeHint = start + n;
+    }
+    return start;
+}
+
+//----------------------------------------------------------------------
+// Bitmap::FindAndSetRun
+// 	Find the first bit which is clear, and allocate it together with
+//	the clear bits immediately following it, stopping at the first
+//	set bit or after "maxBits" bits.  Used to hand out contiguous
+//	runs of disk sectors.
+//
+//	Return the number of the first bit of the run, and store its
+//	length in "numSet".  If no bits are clear, return -1.
+//
+//	"maxBits" is the largest run wanted
+//	"numSet" is where to return the number of bits actually set
+//	"from", "to" -- the run must lie within bits "from" up to "to";
+//		"to" of -1 stands for the end of the bitmap
+//----------------------------------------------------------------------
+
+int Bitmap::FindAndSetRun(int maxBits, int *numSet, int from, int to)
+{
+    int first = FindAndSet(from, to);
+
+    ASSERT(maxBits > 0);
+
+    if (to < 0 || to > numBits)
+    {
+        to = numBits;
+    }
+    *numSet = 0;
+    if (first == -1)
+    {
+        return -1;
+    }
+    *numSet = 1;
+    while (*numSet < maxBits && first + *numSet < to && !Test(first + *numSet))
+    {
+        Mark(first + *numSet);
+        (*numSet)++;
+    }
+    return first;
+}
+
 //----------------------------------------------------------------------
 // Bitmap::NumClear
 // 	Return the number of clear bits in the bitmap.
@@ -132,14 +272,11 @@ int Bitmap::NumClear() const
 {
     int count = 0;
 
-    for (int i = 0; i < numBits; i++)
+    for (int w = 0; w < numWords; w++)
     {
-        if (!Test(i))
-        {
-            count++;
-        }
+        count += __builtin_popcount(map[w]);
     }
-    return count;
+    return numBits - count; // bits past numBits are never set
 }
 
 //----------------------------------------------------------------------
@@ -184,6 +321,21 @@ void Bitmap::SelfTest()
     Clear(1);
     Clear(31);
 
+    int run;
+    Mark(5);
+    ASSERT(FindAndSetRun(10, &run) == 0 && run == 5); // stops at a set bit
+    ASSERT(FindAndSetRun(3, &run) == 6 && run == 3);  // stops at maxBits
+    ASSERT(FindAndSetRange(BitsInWord) == 9);           // first run that long
+    ASSERT(FindAndSet(3, 6) == -1);                     // nothing clear there
+    ASSERT(NumClear() == numBits - 9 - BitsInWord);
+    ASSERT(FindAndSetRun(4, &run, 50, 52) == 50 && run == 2); // stops at "to"
+    Clear(50);
+    Clear(51);
+    for (i = 0; i < 9 + BitsInWord; i++)
+    {
+        Clear(i);
+    }
+
     for (i = 0; i < numBits; i++)
     {
         Mark(i);
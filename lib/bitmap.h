@@ -35,15 +35,28 @@ class Bitmap
 public:
     Bitmap(int numItems); // Initialize a bitmap, with "numItems" bits
                           // initially, all bits are cleared.
-    ~Bitmap();            // De-allocate bitmap
+    virtual ~Bitmap();    // De-allocate bitmap
 
-    void Mark(int which);       // Set the "nth" bit
-    void Clear(int which);      // Clear the "nth" bit
+    virtual void Mark(int which);  // Set the "nth" bit
+    virtual void Clear(int which); // Clear the "nth" bit
+                                   // (virtual so that subclasses can
+                                   //  keep counts of their own)
     bool Test(int which) const; // Is the "nth" bit set?
-    int FindAndSet();           // Return the # of a clear bit, and as a side
+    int FindAndSet(int from = 0, int to = -1);
+        // Return the # of a clear bit, and as a side
         // effect, set the bit.
         // If no bits are clear, return -1.
-    int NumClear() const; // Return the number of clear bits
+    int FindAndSetRange(int n, int from = 0, int to = -1);
+        // Set "n" contiguous clear bits, and
+        // return the first; -1 if no such run.
+    int FindAndSetRun(int maxBits, int *numSet, int from = 0, int to = -1);
+        // Set the first clear bit and up to
+        // maxBits-1 clear bits right after it;
+        // return the first bit, -1 if none.
+        // (All three only look at bits "from"
+        //  up to, not including, "to"; -1 means
+        //  the end of the bitmap.)
+    virtual int NumClear() const; // Return the number of clear bits
 
     void Print() const; // Print contents of bitmap
     void SelfTest();    // Test whether bitmap is working
@@ -55,6 +68,8 @@ protected:
                        //  multiple of the number of bits in
                        //  a word)
     unsigned int *map; // bit storage
+    int freeHint;      // every bit below this one is set; a hint
+                       // of where to start looking for clear bits
 };
 
 #endif // BITMAP_H
@@ -24,22 +24,19 @@
 
 Debug::Debug(char *flagList)
 {
-    enableFlags = flagList;
-}
+    bool all;
 
+    enableFlags = flagList;
 
-//----------------------------------------------------------------------
-// Debug::IsEnabled
-//      Return TRUE if DEBUG messages with "flag" are to be printed.
-//----------------------------------------------------------------------
-
-bool
-Debug::IsEnabled(char flag)
-{
-    if (enableFlags != NULL) {
-	return ((strchr(enableFlags, flag) != 0) 
-		|| (strchr(enableFlags, '+') != 0));
-    } else {
-    	return FALSE;
+    // MP4: look the flags up once, here, instead of in every IsEnabled
+    all = (enableFlags != NULL) && (strchr(enableFlags, dbgAll) != 0);
+    for (int i = 0; i < 256 / 32; i++) {
+	enabled[i] = all ? ~0U : 0;
+    }
+    if (enableFlags != NULL && !all) {
+	for (char *p = enableFlags; *p != '\0'; p++) {
+	    unsigned char f = (unsigned char) *p;
+	    enabled[f / 32] |= 1U << (f % 32);
+	}
     }
 }
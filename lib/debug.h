@@ -30,14 +30,22 @@ const char dbgAddr = 'a'; 		// address spaces
 const char dbgNet = 'n'; 		// network emulation
 const char dbgSys = 'u';                // systemcall
 
+// MP4: the flags are looked up in a table of 256 bits, one per
+// character, filled in once from the flag list, so that a DEBUG whose
+// flag is off costs one bit test rather than a string search.
+
 class Debug {
   public:
     Debug(char *flagList);
 
-    bool IsEnabled(char flag);
+    bool IsEnabled(char flag) {
+	unsigned char f = (unsigned char) flag;
+	return (enabled[f / 32] >> (f % 32)) & 1;
+    }
 
   private:
     char *enableFlags;		// controls which DEBUG messages are printed
+    unsigned int enabled[256 / 32];	// MP4: bit "f" set if flag "f" is on
 };
 
 extern Debug *debug;
@@ -46,11 +54,23 @@ extern Debug *debug;
 //----------------------------------------------------------------------
 // DEBUG
 //      If flag is enabled, print a message.
+//
+//	MP4: if Nachos is compiled with -DNO_DEBUG, the messages are
+//	compiled out: the test is a constant, and the compiler drops the
+//	message (still checking that it compiles).  -d then only affects
+//	code that calls debug->IsEnabled itself.
 //----------------------------------------------------------------------
+#ifdef NO_DEBUG
+#define DEBUG(flag,expr)                                                     \
+    if (TRUE) {} else { 						\
+        cerr << expr << "\n";   				        \
+    }
+#else
 #define DEBUG(flag,expr)                                                     \
     if (!debug->IsEnabled(flag)) {} else { 				\
         cerr << expr << "\n";   				        \
     }
+#endif
 
 
 //----------------------------------------------------------------------
@@ -17,6 +17,12 @@ const int InitialBuckets = 4;	// how big a hash table do we start with
 const int ResizeRatio = 3;	// when do we grow the hash table?
 const int IncreaseSizeBy = 4;	// how much do we grow table when needed?
 
+// MP4: for OpenHashTable
+const int InitialSlots = 8;	// how many slots do we start with (a power of 2)
+const int MoveStep = 4;		// how many old slots each operation moves
+				//  while the table grows; at least 2, so
+				//  the move is done before the next one
+
 #include "copyright.h"
 
 //----------------------------------------------------------------------
@@ -176,7 +182,7 @@ HashTable<Key,T>::FindInBucket(int bucket,
 	    return TRUE;
         }
     }
-    *itemPtr = NULL;
+    *itemPtr = T();
     return FALSE;
 }
 
@@ -358,3 +364,431 @@ HashIterator<Key,T>::Next()
         }
     }
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::OpenHashTable
+//	Initialize an open hash table, empty to start with.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+OpenHashTable<Key,T>::OpenHashTable(Key (*get)(T x), unsigned (*hFunc)(Key x))
+{
+    numItems = 0;
+    InitSlots(&table, InitialSlots);
+    old.size = old.count = 0;
+    old.items = NULL;
+    old.used = NULL;
+    moved = 0;
+    getKey = get;
+    hash = hFunc;
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::~OpenHashTable
+//	Prepare an open hash table for deallocation.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+OpenHashTable<Key,T>::~OpenHashTable()
+{
+    ASSERT(IsEmpty());		// make sure table is empty
+    DeleteSlots(&table);
+    DeleteSlots(&old);
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::InitSlots, DeleteSlots
+//	Allocate an empty array of "size" slots, and free one.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::InitSlots(Slots *sl, int size)
+{
+    ASSERT((size & (size - 1)) == 0);
+    sl->items = new T[size];
+    sl->used = new bool[size];
+    for (int i = 0; i < size; i++) {
+	sl->used[i] = FALSE;
+    }
+    sl->size = size;
+    sl->count = 0;
+}
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::DeleteSlots(Slots *sl)
+{
+    delete [] sl->items;
+    delete [] sl->used;
+    sl->items = NULL;
+    sl->used = NULL;
+    sl->size = sl->count = 0;
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::Home
+//      Return the slot of "sl" that "key" hashes to; it is there, or
+//	in one of the used slots following.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+int
+OpenHashTable<Key,T>::Home(const Slots *sl, Key key) const
+{
+    return (*hash)(key) & (sl->size - 1);
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::FindSlot
+//      Return the slot of "sl" holding the item with "key", or -1.
+//	The arrays are never more than half full, so the probe always
+//	reaches an empty slot.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+int
+OpenHashTable<Key,T>::FindSlot(const Slots *sl, Key key) const
+{
+    if (sl->size == 0) {
+	return -1;
+    }
+    for (int i = Home(sl, key); sl->used[i]; i = (i + 1) & (sl->size - 1)) {
+	if (key == getKey(sl->items[i])) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::PutSlot
+//      Put "item" in the first free slot of "sl" from its home.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::PutSlot(Slots *sl, T item)
+{
+    int i = Home(sl, getKey(item));
+
+    while (sl->used[i]) {
+	i = (i + 1) & (sl->size - 1);
+    }
+    sl->items[i] = item;
+    sl->used[i] = TRUE;
+    sl->count++;
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::ClearSlot
+//      Empty slot "i" of "sl".  Each item further along the run of
+//	used slots whose probe passed over "i" is shifted back into the
+//	hole, which moves on to where it was, so that every item can
+//	still be reached from its home without crossing an empty slot.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::ClearSlot(Slots *sl, int i)
+{
+    int mask = sl->size - 1;
+    int j, k;
+    bool stays;
+
+    ASSERT(sl->used[i]);
+    sl->used[i] = FALSE;
+    sl->count--;
+    for (j = (i + 1) & mask; sl->used[j]; j = (j + 1) & mask) {
+	k = Home(sl, getKey(sl->items[j]));
+	if (i <= j) {		// does its probe start after the hole?
+	    stays = (i < k) && (k <= j);
+	} else {
+	    stays = (i < k) || (k <= j);
+	}
+	if (!stays) {
+	    sl->items[i] = sl->items[j];
+	    sl->used[i] = TRUE;
+	    sl->used[j] = FALSE;
+	    i = j;
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::MoveSome
+//      While the table is growing, do "n" steps of emptying the old
+//	array into the new one: each step moves the item in slot "moved",
+//	or goes on to the next slot if it is empty.  The slots before
+//	"moved" are all empty, so no shift can bring an item back into
+//	them.  The old array is freed once it is empty.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::MoveSome(int n)
+{
+    T item;
+
+    for (; old.size > 0 && n > 0; n--) {
+	if (old.count == 0) {
+	    DeleteSlots(&old);
+	    moved = 0;
+	    break;
+	}
+	ASSERT(moved < old.size);
+	if (old.used[moved]) {
+	    item = old.items[moved];
+	    ClearSlot(&old, moved);	// may shift another item into "moved"
+	    PutSlot(&table, item);
+	} else {
+	    moved++;
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::Insert
+//      Put an item into the hash table.
+//
+//	If that would make the table more than half full, start moving
+//	it into one twice as big.  A growth still under way is finished
+//	first, although MoveStep makes sure it always is by then.
+//
+//	"item" is the thing to put in the table.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::Insert(T item)
+{
+    Key key = getKey(item);
+
+    ASSERT(!IsInTable(key));
+
+    MoveSome(MoveStep);
+    if ((numItems + 1) * 2 > table.size) {	// counting those not moved yet
+	while (old.size > 0) {
+	    MoveSome(old.size);
+	}
+	old = table;
+	moved = 0;
+	InitSlots(&table, old.size * 2);
+    }
+    PutSlot(&table, item);
+    numItems++;
+
+    ASSERT(IsInTable(key));
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::Find
+//      Find an item from the hash table, in the old array if it has
+//	not been moved yet, or else in the new one.
+//
+// Returns:
+//	Whether item is found, and if found, the item.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+bool
+OpenHashTable<Key,T>::Find(Key key, T *itemPtr) const
+{
+    int i;
+
+    if ((i = FindSlot(&old, key)) != -1) {
+	*itemPtr = old.items[i];
+	return TRUE;
+    }
+    if ((i = FindSlot(&table, key)) != -1) {
+	*itemPtr = table.items[i];
+	return TRUE;
+    }
+    *itemPtr = T();
+    return FALSE;
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::Remove
+//      Remove an item from the hash table. The item must be in the table.
+//
+// Returns:
+//	The removed item.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+T
+OpenHashTable<Key,T>::Remove(Key key)
+{
+    Slots *sl = &old;
+    T item;
+    int i;
+
+    MoveSome(MoveStep);
+    i = FindSlot(sl, key);
+    if (i == -1) {
+	sl = &table;
+	i = FindSlot(sl, key);
+    }
+    ASSERT(i != -1);	// item must be in table
+
+    item = sl->items[i];
+    ClearSlot(sl, i);
+    numItems--;
+
+    ASSERT(!IsInTable(key));
+    return item;
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::Apply
+//      Apply function to every item in the hash table.
+//
+//	"func" -- the function to apply
+//----------------------------------------------------------------------
+
+template <class Key,class T>
+void
+OpenHashTable<Key,T>::Apply(void (*func)(T)) const
+{
+    for (int i = 0; i < old.size; i++) {
+	if (old.used[i]) {
+	    (*func)(old.items[i]);
+	}
+    }
+    for (int i = 0; i < table.size; i++) {
+	if (table.used[i]) {
+	    (*func)(table.items[i]);
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::SanityCheck
+//      Test whether this is still a legal hash table.
+//
+//	Tests: does each array hold as many items as it says?
+//	       can every item be found from its home slot?
+//	       are the old slots already moved empty?
+//	       does the table have the right # of elements?
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::SanityCheck() const
+{
+    const Slots *arrays[2] = { &old, &table };
+    int numFound = 0, numUsed;
+
+    ASSERT(numItems * 2 <= table.size);
+    for (int a = 0; a < 2; a++) {
+	numUsed = 0;
+	for (int i = 0; i < arrays[a]->size; i++) {
+	    if (arrays[a]->used[i]) {
+		ASSERT(FindSlot(arrays[a], getKey(arrays[a]->items[i])) == i);
+		numUsed++;
+	    }
+	}
+	ASSERT(numUsed == arrays[a]->count);
+	numFound += numUsed;
+    }
+    for (int i = 0; i < moved; i++) {
+	ASSERT(!old.used[i]);
+    }
+    ASSERT(numItems == numFound);
+}
+
+//----------------------------------------------------------------------
+// OpenHashTable<Key,T>::SelfTest
+//      Test whether this module is working.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+void
+OpenHashTable<Key,T>::SelfTest(T *p, int numEntries)
+{
+    int i, n;
+    OpenHashIterator<Key, T> *iterator = new OpenHashIterator<Key,T>(this);
+
+    SanityCheck();
+    ASSERT(IsEmpty());	// check that table is empty in various ways
+    for (; !iterator->IsDone(); iterator->Next()) {
+	ASSERTNOTREACHED();
+    }
+    delete iterator;
+
+    for (i = 0; i < numEntries; i++) {
+        Insert(p[i]);
+        ASSERT(IsInTable(getKey(p[i])));
+        ASSERT(!IsEmpty());
+	SanityCheck();
+    }
+
+    // the iterator sees each item once, even in the middle of a move
+    iterator = new OpenHashIterator<Key,T>(this);
+    for (n = 0; !iterator->IsDone(); iterator->Next()) {
+	n++;
+    }
+    delete iterator;
+    ASSERT(n == numEntries);
+
+    // should be able to get out everything we put in
+    for (i = 0; i < numEntries; i++) {
+        ASSERT(Remove(getKey(p[i])) == p[i]);
+	SanityCheck();
+    }
+
+    ASSERT(IsEmpty());
+    SanityCheck();
+}
+
+//----------------------------------------------------------------------
+// OpenHashIterator<Key,T>::OpenHashIterator
+//      Initialize a data structure to allow us to step through
+//	every entry in an open hash table: the old array first, if the
+//	table is growing, and then the new one.
+//----------------------------------------------------------------------
+
+template <class Key, class T>
+OpenHashIterator<Key,T>::OpenHashIterator(OpenHashTable<Key,T> *tbl)
+{
+    table = tbl;
+    slots = (table->old.size > 0) ? &table->old : &table->table;
+    slot = 0;
+    Skip();
+}
+
+//----------------------------------------------------------------------
+// OpenHashIterator<Key,T>::Next, Skip
+//      Update iterator to point to the next item in the table.
+//----------------------------------------------------------------------
+
+template <class Key,class T>
+void
+OpenHashIterator<Key,T>::Next()
+{
+    ASSERT(!IsDone());
+    slot++;
+    Skip();
+}
+
+template <class Key,class T>
+void
+OpenHashIterator<Key,T>::Skip()
+{
+    while (slots != NULL) {
+	for (; slot < slots->size; slot++) {
+	    if (slots->used[slot]) {
+		return;
+	    }
+	}
+	if (slots == &table->old) {
+	    slots = &table->table;
+	    slot = 0;
+	} else {
+	    slots = NULL;
+	}
+    }
+}
+// MP4 end
@@ -117,6 +117,101 @@ class HashIterator {
     ListIterator<T> *bucketIter; // where we are in the bucket
 };
 
+// MP4: The following class defines an "open hash table", with the
+// same interface as HashTable.  The items are kept in an array of
+// slots, probed linearly from where the key hashes to, so a lookup
+// reads neighbouring slots rather than chasing list pointers; a
+// removal shifts the items after it back, so there are no tombstones.
+// The table doubles when half full, but the items are moved into the
+// new array a few at a time, by the operations that follow, so no
+// single Insert pays for rehashing the whole table.
+
+template <class Key,class T> class OpenHashIterator;
+
+template <class Key, class T>
+class OpenHashTable {
+  public:
+    OpenHashTable(Key (*get)(T x), unsigned (*hFunc)(Key x));
+    				// initialize a hash table
+    ~OpenHashTable();		// deallocate a hash table
+
+    void Insert(T item);	// Put item into hash table
+    T Remove(Key key);		// Remove item from hash table.
+
+    bool Find(Key key, T *itemPtr) const;
+    				// Find an item from its key
+    bool IsInTable(Key key) { T dummy; return Find(key, &dummy); }
+				// Is the item in the table?
+
+    bool IsEmpty() { return numItems == 0; }
+				// does the table have anything in it
+
+    void Apply(void (*f)(T)) const;
+    				// apply function to all elements in table
+
+    void SanityCheck() const;// is this still a legal hash table?
+    void SelfTest(T *p, int numItems);
+    				// is the module working?
+
+  private:
+    // One array of slots.  While the table grows there are two: the
+    // new one, which takes all insertions, and the old one, emptied
+    // from slot "moved" on.
+    struct Slots {
+	T *items;		// the items
+	bool *used;		// which slots hold one
+	int size;		// number of slots, a power of 2
+	int count;		// number of slots used
+    };
+
+    Slots table;		// where items are inserted
+    Slots old;			// being emptied into "table", or size 0
+    int moved;			// slots of "old" already emptied
+    int numItems;		// the number of items in the table
+
+    Key (*getKey)(T x);		// get Key from value
+    unsigned (*hash)(Key x);	// the hash function
+
+    void InitSlots(Slots *s, int size);
+    void DeleteSlots(Slots *s);
+    int Home(const Slots *s, Key key) const;
+    				// the slot "key" hashes to
+    int FindSlot(const Slots *s, Key key) const;
+    				// the slot holding "key", or -1
+    void PutSlot(Slots *s, T item);
+    				// insert, knowing "item" is not there
+    void ClearSlot(Slots *s, int i);
+    				// empty slot "i", shifting back those
+				// that probed past it
+    void MoveSome(int n);	// move "n" slots of "old" to "table"
+
+    friend class OpenHashIterator<Key,T>;
+};
+
+// The following class steps through an open hash table, with the same
+// interface as HashIterator.
+
+template <class Key,class T>
+class OpenHashIterator {
+  public:
+    OpenHashIterator(OpenHashTable<Key,T> *table);
+				// initialize an iterator
+
+    bool IsDone() { return slots == NULL; };
+				// return TRUE if no more items in table
+    T Item() { ASSERT(!IsDone()); return slots->items[slot]; };
+				// return current item in table
+    void Next(); 		// update iterator to point to next
+
+  private:
+    OpenHashTable<Key,T> *table;// the hash table we're stepping through
+    const typename OpenHashTable<Key,T>::Slots *slots;
+    				// the array we are in, NULL when done
+    int slot;			// the slot we are at
+
+    void Skip();		// advance to a used slot, from "slot"
+};
+
 #include "hash.cc"		// templates are really like macros
 				// so needs to be included in every
 				// file that uses the template
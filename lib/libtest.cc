@@ -1,6 +1,7 @@
 // libtest.cc 
 //	Driver code to call self-test routines for standard library
 //	classes -- bitmaps, lists, sorted lists, and hash tables.
+//	MP4: and open hash tables, compared with the chained ones.
 //
 // Copyright (c) 1992-1996 The Regents of the University of California.
 // All rights reserved.  See copyright.h for copyright notice and limitation 
@@ -58,6 +59,50 @@ static int listTestVector[] = { 9, 5, 7 };
 static char *hashTestVector[] = { "0", "1", "2", "3", "4", "5", "6",
 	 "7", "8", "9", "10", "11", "12", "13", "14"};
 
+// MP4 start
+// How many keys HashBenchmark looks at, and how many it stores.
+static int keysCompared;
+static const int BenchmarkItems = 2000;
+
+//----------------------------------------------------------------------
+// CountedKey
+//	The item is its own key, like for HashInt; but count each call,
+//	since the hash tables call it once for each item they compare.
+//----------------------------------------------------------------------
+
+static int
+CountedKey(int item) {
+    keysCompared++;
+    return item;
+}
+
+//----------------------------------------------------------------------
+// HashBenchmark
+//	Put the same keys into a chained and an open hash table, look
+//	each one up, and take them all out again; print how many items
+//	each table had to look at to do it.
+//----------------------------------------------------------------------
+
+template <class Table>
+static int
+HashBenchmark(Table *table, int *items)
+{
+    int found;
+
+    keysCompared = 0;
+    for (int i = 0; i < BenchmarkItems; i++) {
+	table->Insert(items[i]);
+    }
+    for (int i = 0; i < BenchmarkItems; i++) {
+	ASSERT(table->Find(items[i], &found) && found == items[i]);
+    }
+    for (int i = 0; i < BenchmarkItems; i++) {
+	(void) table->Remove(items[i]);
+    }
+    return keysCompared;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // LibSelfTest
 //	Run self tests on bitmaps, lists, sorted lists, and 
@@ -71,15 +116,36 @@ LibSelfTest () {
     SortedList<int> *sortList = new SortedList<int>(IntCompare);
     HashTable<int, char *> *hashTable = 
 	new HashTable<int, char *>(HashKey, HashInt);
+    OpenHashTable<int, char *> *openTable =	// MP4
+	new OpenHashTable<int, char *>(HashKey, HashInt);
+    HashTable<int, int> *chainedInts =
+	new HashTable<int, int>(CountedKey, HashInt);
+    OpenHashTable<int, int> *openInts =
+	new OpenHashTable<int, int>(CountedKey, HashInt);
+    int *items = new int[BenchmarkItems];
 	
 		
     map->SelfTest();
     list->SelfTest(listTestVector, sizeof(listTestVector)/sizeof(int));
     sortList->SelfTest(listTestVector, sizeof(listTestVector)/sizeof(int));
     hashTable->SelfTest(hashTestVector, sizeof(hashTestVector)/sizeof(char *));
+    openTable->SelfTest(hashTestVector, sizeof(hashTestVector)/sizeof(char *));
+
+    // MP4: distinct keys, scattered (40503 is odd, so it permutes them)
+    for (int i = 0; i < BenchmarkItems; i++) {
+	items[i] = (i * 40503) & 0xfffff;
+    }
+    cout << "Hash tables, keys compared for " << BenchmarkItems
+	 << " inserts, finds and removes: chained "
+	 << HashBenchmark(chainedInts, items) << ", open "
+	 << HashBenchmark(openInts, items) << "\n";
 
     delete map;
     delete list;
     delete sortList;
     delete hashTable;
+    delete openTable;
+    delete chainedInts;
+    delete openInts;
+    delete [] items;
 }
@@ -32,6 +32,60 @@ ListElement<T>::ListElement(T itm)
      next = NULL;	// always initialize to something!
 }
 
+// MP4 start
+// How many list elements the free list is refilled with at once.
+#define ListPoolChunk 32
+
+template <class T>
+ListElement<T> *ListElement<T>::freeList = NULL;
+
+//----------------------------------------------------------------------
+// ListElement<T>::operator new
+// 	Take a list element off the free list for this type, first
+//	refilling the free list from the heap if it is empty.  The
+//	chunks are never given back: the lists of a program tend to
+//	stay about as long as they once were.
+//
+//	Lists need mutual exclusion from their callers anyway, and this
+//	never lets go of the CPU, so it needs nothing more.
+//----------------------------------------------------------------------
+
+template <class T>
+void *
+ListElement<T>::operator new(size_t size)
+{
+    ListElement<T> *element;
+
+    ASSERT(size == sizeof(ListElement<T>));
+    if (freeList == NULL) {
+	element = (ListElement<T> *)
+	    ::operator new(ListPoolChunk * sizeof(ListElement<T>));
+	for (int i = 0; i < ListPoolChunk; i++) {
+	    element[i].next = freeList;
+	    freeList = &element[i];
+	}
+    }
+    element = freeList;
+    freeList = element->next;
+    return element;
+}
+
+//----------------------------------------------------------------------
+// ListElement<T>::operator delete
+// 	Put a list element back on the free list for this type.
+//----------------------------------------------------------------------
+
+template <class T>
+void
+ListElement<T>::operator delete(void *p)
+{
+    ListElement<T> *element = (ListElement<T> *) p;
+
+    element->next = freeList;
+    freeList = element;
+}
+// MP4 end
+
 
 //----------------------------------------------------------------------
 // List<T>::List
@@ -381,3 +435,128 @@ SortedList<T>::SelfTest(T *p, int numEntries)
 
      delete q;
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// IntrusiveList<T>::Append
+//      Append "item" to the end of the list, linking it through its
+//	own "nextInList" field.
+//----------------------------------------------------------------------
+
+template <class T>
+void
+IntrusiveList<T>::Append(T *item)
+{
+    ASSERT(!IsInList(item));
+    item->nextInList = NULL;
+    if (IsEmpty()) {
+	first = item;
+    } else {
+	last->nextInList = item;
+    }
+    last = item;
+    numInList++;
+}
+
+//----------------------------------------------------------------------
+// IntrusiveList<T>::Prepend
+//      Put "item" at the beginning of the list.
+//----------------------------------------------------------------------
+
+template <class T>
+void
+IntrusiveList<T>::Prepend(T *item)
+{
+    ASSERT(!IsInList(item));
+    item->nextInList = first;
+    if (IsEmpty()) {
+	last = item;
+    }
+    first = item;
+    numInList++;
+}
+
+//----------------------------------------------------------------------
+// IntrusiveList<T>::RemoveFront
+//      Remove the first item from the list, and return it.  The list
+//	must not be empty.
+//----------------------------------------------------------------------
+
+template <class T>
+T *
+IntrusiveList<T>::RemoveFront()
+{
+    T *item = first;
+
+    ASSERT(!IsEmpty());
+    first = item->nextInList;
+    if (first == NULL) {
+	last = NULL;
+    }
+    item->nextInList = NULL;
+    numInList--;
+    return item;
+}
+
+//----------------------------------------------------------------------
+// IntrusiveList<T>::Remove
+//      Remove a specific item from the list.  Must be in the list!
+//----------------------------------------------------------------------
+
+template <class T>
+void
+IntrusiveList<T>::Remove(T *item)
+{
+    T *prev;
+
+    if (item == first) {
+	(void) RemoveFront();
+	return;
+    }
+    for (prev = first; prev != NULL; prev = prev->nextInList) {
+	if (prev->nextInList == item) {
+	    prev->nextInList = item->nextInList;
+	    if (last == item) {
+		last = prev;
+	    }
+	    item->nextInList = NULL;
+	    numInList--;
+	    return;
+	}
+    }
+    ASSERT(FALSE);		// should always find item!
+}
+
+//----------------------------------------------------------------------
+// IntrusiveList<T>::IsInList
+//      Return TRUE if "item" is on this list.
+//----------------------------------------------------------------------
+
+template <class T>
+bool
+IntrusiveList<T>::IsInList(T *item) const
+{
+    for (T *ptr = first; ptr != NULL; ptr = ptr->nextInList) {
+	if (ptr == item) {
+	    return TRUE;
+	}
+    }
+    return FALSE;
+}
+
+//----------------------------------------------------------------------
+// IntrusiveList<T>::Apply
+//      Apply function to every item on the list.
+//
+//	"func" -- the function to apply
+//----------------------------------------------------------------------
+
+template <class T>
+void
+IntrusiveList<T>::Apply(void (*func)(T *)) const
+{
+    for (T *ptr = first; ptr != NULL; ptr = ptr->nextInList) {
+	(*func)(ptr);
+    }
+}
+// MP4 end
@@ -24,12 +24,25 @@
 // This class is private to this module (and classes that inherit
 // from this module). Made public for notational convenience.
 
+//
+// MP4: list elements are not taken from the heap one by one, but from
+// a free list kept for each type of list, which is refilled a chunk
+// of elements at a time.  Once a program is running, putting an item
+// on a list and taking it off again does no heap allocation.
+
 template <class T>
 class ListElement {
   public:
     ListElement(T itm); 	// initialize a list element
     ListElement *next;	     	// next element on list, NULL if this is last
+				// (MP4: next free one, when on the free list)
     T item; 	   	     	// item on the list
+
+    static void *operator new(size_t size);	// MP4: from the free list
+    static void operator delete(void *p);	// MP4: back onto it
+
+  private:
+    static ListElement *freeList;	// MP4: elements not in use
 };
 
 // The following class defines a "list" -- a singly linked list of
@@ -136,6 +149,63 @@ class ListIterator {
     ListElement<T> *current;	// where we are in the list
 };
 
+// MP4: The following class defines an "intrusive list" -- a singly
+// linked list threaded through the items themselves, so that putting
+// an item on it allocates nothing at all.  The items are pointers to
+// objects with a public "T *nextInList" field, which the list owns
+// while the object is on it; so an object can be on only one such
+// list at a time.  It offers the operations of List that the ready
+// queue and semaphore queues use.
+
+template <class T> class IntrusiveListIterator;
+
+template <class T>
+class IntrusiveList {
+  public:
+    IntrusiveList() { first = last = NULL; numInList = 0; }
+    ~IntrusiveList() {}		// the items are not ours to free
+
+    void Prepend(T *item);	// Put item at the beginning of the list
+    void Append(T *item);	// Put item at the end of the list
+
+    T *Front() { return first; }
+    				// Return first item on list
+				// without removing it
+    T *RemoveFront();		// Take item off the front of the list
+    void Remove(T *item);	// Remove specific item from list
+
+    bool IsInList(T *item) const;// is the item in the list?
+
+    unsigned int NumInList() { return numInList; }
+    bool IsEmpty() { return (numInList == 0); }
+
+    void Apply(void (*f)(T *)) const;
+    				// apply function to all items in list
+
+  private:
+    T *first;			// Head of the list, NULL if list is empty
+    T *last;			// Last item of list
+    int numInList;		// number of items in list
+
+    friend class IntrusiveListIterator<T>;
+};
+
+// The following class steps through an intrusive list, as ListIterator
+// does through a List.
+
+template <class T>
+class IntrusiveListIterator {
+  public:
+    IntrusiveListIterator(IntrusiveList<T> *list) { current = list->first; }
+
+    bool IsDone() { return current == NULL; };
+    T *Item() { ASSERT(!IsDone()); return current; };
+    void Next() { current = current->nextInList; };
+
+  private:
+    T *current;			// where we are in the list
+};
+
 #include "list.cc"		// templates are really like macros
 				// so needs to be included in every
 				// file that uses the template
@@ -29,10 +29,18 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <cerrno>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>		// MP4: for FICLONE
+#endif
 
 #ifdef SOLARIS
 // KMS
@@ -45,13 +53,14 @@
 #endif
 #ifdef DOS	// neither does DOS
 #define NO_MPROT
+#define NO_MMAP		// MP4: or mmap
 #endif
 
 extern "C" {
 #include <signal.h>
 #include <sys/types.h>
 
-#ifndef NO_MPROT 
+#if !defined(NO_MPROT) || !defined(NO_MMAP)
 #include <sys/mman.h>
 #endif
 
@@ -132,6 +141,109 @@ Delay(int seconds)
     (void) sleep((unsigned) seconds);
 }
 
+//----------------------------------------------------------------------
+// Crc32c
+// 	MP4: Return the CRC-32C (Castagnoli) checksum of "length" bytes
+//	at "data".  Where the host has a CRC-32C instruction -- SSE4.2 on
+//	x86, checked for at run time, or the CRC extension of ARMv8 when
+//	the compiler targets it -- that does the work a word at a time;
+//	otherwise a table does it a byte at a time.
+//----------------------------------------------------------------------
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#else
+static unsigned int
+Crc32cTable(unsigned int crc, unsigned char *data, int length)
+{
+    static unsigned int table[256];
+    static bool built = FALSE;
+
+    if (!built) {
+	for (unsigned int i = 0; i < 256; i++) {
+	    unsigned int c = i;
+	    for (int k = 0; k < 8; k++)
+		c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+	    table[i] = c;
+	}
+	built = TRUE;
+    }
+    for (int i = 0; i < length; i++)
+	crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+__attribute__((target("sse4.2"))) static unsigned int
+Crc32cSSE42(unsigned int crc, unsigned char *data, int length)
+{
+    int i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+	unsigned int word;
+	memcpy(&word, data + i, 4);
+	crc = __builtin_ia32_crc32si(crc, word);
+    }
+    for (; i < length; i++)
+	crc = __builtin_ia32_crc32qi(crc, data[i]);
+    return crc;
+}
+#endif
+
+unsigned int
+Crc32c(char *data, int length)
+{
+    unsigned char *bytes = (unsigned char *) data;
+    unsigned int crc = 0xffffffff;
+
+#if defined(__ARM_FEATURE_CRC32)
+    int i = 0;
+    for (; i + 4 <= length; i += 4) {
+	unsigned int word;
+	memcpy(&word, bytes + i, 4);
+	crc = __crc32cw(crc, word);
+    }
+    for (; i < length; i++)
+	crc = __crc32cb(crc, bytes[i]);
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+    static int hasSSE42 = -1;
+
+    if (hasSSE42 < 0)
+	hasSSE42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    if (hasSSE42)
+	crc = Crc32cSSE42(crc, bytes, length);
+    else
+	crc = Crc32cTable(crc, bytes, length);
+#else
+    crc = Crc32cTable(crc, bytes, length);
+#endif
+    return crc ^ 0xffffffff;
+}
+
+//----------------------------------------------------------------------
+// HostNanoseconds
+// 	MP4: Return the host's clock, in nanoseconds since some fixed
+//	time; only the difference between two readings means anything.
+//	Uses the monotonic clock where the host has one.
+//----------------------------------------------------------------------
+
+long long
+HostNanoseconds()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (long long) now.tv_sec * 1000000000 + now.tv_usec * 1000;
+#endif
+}
+
 //----------------------------------------------------------------------
 // UDelay
 // 	Put the UNIX process running Nachos to sleep for x microseconds,
@@ -420,6 +532,163 @@ Unlink(char *name)
     return unlink(name);
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// MapFile
+// 	Map the first "size" bytes of an open file into memory, shared, so
+//	that stores into the mapping change the file.  Return NULL if the
+//	file can't be mapped, so the caller can fall back to read/write.
+//
+//	"fd" -- the file descriptor, open for reading and writing
+//	"size" -- bytes to map; the file must be at least this long
+//----------------------------------------------------------------------
+
+char *
+MapFile(int fd, int size)
+{
+#ifdef NO_MMAP
+    return NULL;
+#else
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED)
+	return NULL;
+    return (char *) addr;
+#endif
+}
+
+//----------------------------------------------------------------------
+// SyncMappedFile
+// 	Write a mapping made by MapFile back to its file, waiting until
+//	the data is on the host's disk.
+//----------------------------------------------------------------------
+
+void
+SyncMappedFile(char *addr, int size)
+{
+#ifndef NO_MMAP
+    int retVal = msync(addr, size, MS_SYNC);
+    ASSERT(retVal == 0);
+#endif
+}
+
+//----------------------------------------------------------------------
+// UnmapFile
+// 	Undo MapFile.
+//----------------------------------------------------------------------
+
+void
+UnmapFile(char *addr, int size)
+{
+#ifndef NO_MMAP
+    (void) munmap(addr, size);
+#endif
+}
+
+//----------------------------------------------------------------------
+// OpenDirectory
+// 	Start listing a UNIX directory.  Return NULL if "name" is not a
+//	directory that can be read.
+//----------------------------------------------------------------------
+
+void *
+OpenDirectory(char *name)
+{
+    return (void *) opendir(name);
+}
+
+//----------------------------------------------------------------------
+// NextDirectoryFile
+// 	Return the name of the next regular file in a directory listed
+//	by OpenDirectory, skipping subdirectories and anything else.
+//	Return FALSE when there are no more.
+//
+//	"dir" -- what OpenDirectory returned
+//	"dirName" -- what it was given, to look at the entries with
+//	"name" -- where to put the file's name (without "dirName")
+//	"size" -- room in "name"; longer names are skipped
+//----------------------------------------------------------------------
+
+bool
+NextDirectoryFile(void *dir, char *dirName, char *name, int size)
+{
+    struct dirent *entry;
+    struct stat info;
+    char path[1024];
+
+    while ((entry = readdir((DIR *) dir)) != NULL) {
+	if ((int) strlen(entry->d_name) >= size
+		|| strlen(dirName) + strlen(entry->d_name) + 2 > sizeof(path))
+	    continue;
+	sprintf(path, "%s/%s", dirName, entry->d_name);
+	if (stat(path, &info) == 0 && S_ISREG(info.st_mode)) {
+	    strcpy(name, entry->d_name);
+	    return TRUE;
+	}
+    }
+    return FALSE;
+}
+
+//----------------------------------------------------------------------
+// CloseDirectory
+// 	Finish with a directory listed by OpenDirectory.
+//----------------------------------------------------------------------
+
+void
+CloseDirectory(void *dir)
+{
+    (void) closedir((DIR *) dir);
+}
+
+//----------------------------------------------------------------------
+// CloneFile
+// 	Make "to" a copy of the UNIX file "from", replacing it.  Where
+//	the host file system can, the copy shares "from"'s blocks until
+//	either is written (a reflink); otherwise the data is copied,
+//	but blocks of zeroes are skipped, so a mostly empty disk image
+//	stays sparse and copies quickly.  Return FALSE if either file
+//	can't be opened.
+//----------------------------------------------------------------------
+
+#define CloneBlockSize 65536	// bytes copied, or skipped, at a time
+
+bool
+CloneFile(char *from, char *to)
+{
+    static char block[CloneBlockSize];
+    int in, out, n, i;
+    off_t size;
+
+    if ((in = open(from, O_RDONLY)) < 0)
+	return FALSE;
+    if ((out = open(to, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+	close(in);
+	return FALSE;
+    }
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+	close(in);
+	close(out);
+	return TRUE;
+    }
+#endif
+    size = lseek(in, 0, SEEK_END);
+    lseek(in, 0, SEEK_SET);
+    while ((n = read(in, block, CloneBlockSize)) > 0) {
+	for (i = 0; i < n && block[i] == 0; i++)
+	    ;
+	if (i == n)
+	    lseek(out, n, SEEK_CUR);	// leave a hole
+	else
+	    ASSERT(write(out, block, n) == n);
+    }
+    ASSERT(ftruncate(out, size) == 0);	// in case it ends in a hole
+    close(in);
+    close(out);
+    return TRUE;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // OpenSocket
 // 	Open an interprocess communication (IPC) connection.  For now, 
@@ -24,6 +24,7 @@ extern void Abort();
 extern void Exit(int exitCode);
 extern void Delay(int seconds);
 extern void UDelay(unsigned int usec);// rcgood - to avoid spinners.
+extern long long HostNanoseconds();	// MP4: host clock, for timing
 
 // Initialize system so that cleanUp routine is called when user hits ctl-C
 extern void CallOnUserAbort(void (*cleanup)(int));
@@ -52,6 +53,16 @@ extern void Lseek(int fd, int offset, int whence);
 extern int Tell(int fd);
 extern int Close(int fd);
 extern bool Unlink(char *name);
+extern char *MapFile(int fd, int size);	// MP4: NULL if it can't be mapped
+extern void SyncMappedFile(char *addr, int size);
+extern void UnmapFile(char *addr, int size);
+extern void *OpenDirectory(char *name);	// MP4: NULL if it isn't one
+extern bool NextDirectoryFile(void *dir, char *dirName, char *name, int size);
+extern void CloseDirectory(void *dir);
+extern bool CloneFile(char *from, char *to);	// MP4: copy-on-write if
+						// the host can, else sparse
+extern unsigned int Crc32c(char *data, int length);	// MP4: with the
+						// host's CRC instruction, if any
 
 // Other C library routines that are used by Nachos.
 // These are assumed to be portable, so we don't include a wrapper.
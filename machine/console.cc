@@ -139,6 +139,7 @@ ConsoleOutput::ConsoleOutput(char *writeFile, CallBackObj *toCall)
 
     callWhenDone = toCall;
     putBusy = FALSE;
+    putCount = 0;
 }
 
 //----------------------------------------------------------------------
@@ -161,7 +162,7 @@ ConsoleOutput::~ConsoleOutput()
 void ConsoleOutput::CallBack()
 {
     putBusy = FALSE;
-    kernel->stats->numConsoleCharsWritten++;
+    kernel->stats->numConsoleCharsWritten += putCount;	// MP4
     callWhenDone->CallBack();
 }
 
@@ -176,5 +177,25 @@ void ConsoleOutput::PutChar(char ch)
     ASSERT(putBusy == FALSE);
     WriteFile(writeFileNo, &ch, sizeof(char));
     putBusy = TRUE;
+    putCount = 1;
     kernel->interrupt->Schedule(this, ConsoleTime, ConsoleWriteInt);
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// ConsoleOutput::PutBuffer()
+// 	Write "n" characters to the simulated display in one operation,
+//	and schedule a single interrupt for the whole chunk, so that a
+//	line of output costs one completion rather than one per character.
+//----------------------------------------------------------------------
+
+void ConsoleOutput::PutBuffer(char *buf, int n)
+{
+    ASSERT(putBusy == FALSE);
+    ASSERT(n > 0);
+    WriteFile(writeFileNo, buf, n);
+    putBusy = TRUE;
+    putCount = n;
+    kernel->interrupt->Schedule(this, ConsoleTime, ConsoleWriteInt);
+}
+// MP4 end
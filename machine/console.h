@@ -80,6 +80,9 @@ class ConsoleOutput : public CallBackObj {
     void PutChar(char ch);	// Write "ch" to the console display, 
 				// and return immediately.  "callWhenDone" 
 				// will called when the I/O completes. 
+    void PutBuffer(char *buf, int n); // MP4: write "n" characters as one
+				// chunk; "callWhenDone" is called once,
+				// when the whole chunk is out
     void CallBack();		// Invoked when next character can be put
 				// out to the display.
 
@@ -89,6 +92,7 @@ class ConsoleOutput : public CallBackObj {
 					// the next char can be put 
     bool putBusy;    			// Is a PutChar operation in progress?
 					// If so, you can't do another one!
+    int putCount;			// MP4: characters in that operation
 };
 
 #endif // CONSOLE_H
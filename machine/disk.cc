@@ -22,9 +22,13 @@
 // We put a magic number at the front of the UNIX file representing the
 // disk, to make it less likely we will accidentally treat a useful file
 // as a disk (which would probably trash the file's contents).
+// MP4: followed by the geometry the disk was made with.
 
-const int MagicNumber = 0x456789ab;
-const int MagicSize = sizeof(int);
+const int MagicNumber = 0x456789ac;	// MP4: was ...ab, before the geometry
+const int OldMagicNumber = 0x456789ab;	// MP4: a disk with no geometry
+const int NumLabelInts = 4;		// MP4: magic, bytes per sector,
+					// sectors per track, tracks
+const int MagicSize = NumLabelInts * sizeof(int);
 const int DiskSize = (MagicSize + (NumSectors * SectorSize));
 
 //----------------------------------------------------------------------
@@ -33,37 +37,89 @@ const int DiskSize = (MagicSize + (NumSectors * SectorSize));
 //	if it doesn't exist), and check the magic number to make sure it's
 // 	ok to treat it as Nachos disk storage.
 //
+//	MP4: if "mapped", map the whole file into memory, so that a sector
+//	transfer is a memory copy rather than two host system calls.  The
+//	simulated time of a request is the same either way.
+//
+//	MP4: if "restoreFrom" is given, the disk file is first replaced by
+//	a copy of that snapshot (see Disk::Snapshot); CloneFile makes
+//	the copy copy-on-write where the host allows, so this is quick
+//	however full the disk is.
+//
 //	"toCall" -- object to call when disk read/write request completes
+//	"mapped" -- MP4: map the disk file, if the host allows
+//	"restoreFrom" -- MP4: UNIX file holding a snapshot, or NULL
+//	"kind" -- MP4: the device whose timing to simulate
 //----------------------------------------------------------------------
 
-Disk::Disk(CallBackObj *toCall)
+Disk::Disk(CallBackObj *toCall, bool mapped, char *restoreFrom, DeviceKind kind)
 {
-    int magicNum;
+    int label[NumLabelInts]; // MP4
     int tmp = 0;
 
     DEBUG(dbgDisk, "Initializing the disk.");
     callWhenDone = toCall;
-    lastSector = 0;
-    bufferInit = 0;
+    if (kind == DeviceSSD) // MP4
+        model = new FlashModel();
+    else
+        model = new RotationalModel();
+    outstanding = 0;
+    completed = NULL;
 
     sprintf(diskname, "DISK_%d", kernel->hostName);
+    if (restoreFrom != NULL && !CloneFile(restoreFrom, diskname))
+    { // MP4
+        cerr << "Can't restore " << diskname << " from " << restoreFrom << "\n";
+        Abort();
+    }
     fileno = OpenForReadWrite(diskname, FALSE);
     if (fileno >= 0)
     { // file exists, check magic number
-        Read(fileno, (char *)&magicNum, MagicSize);
-        ASSERT(magicNum == MagicNumber);
+        Read(fileno, (char *)label, MagicSize);
+        if (label[0] != MagicNumber)
+        { // MP4: refuse it, rather than misread it
+            if (label[0] == OldMagicNumber)
+                cerr << diskname << " was made before disks recorded their "
+                     << "geometry; remove it to make a new disk\n";
+            else
+                cerr << diskname << " is not a Nachos disk; remove it to "
+                     << "make a new disk\n";
+            Abort();
+        }
+        // MP4: and that it was laid out the way we were compiled
+        if (label[1] != SectorSize || label[2] != SectorsPerTrack ||
+            label[3] != NumTracks)
+        {
+            cerr << diskname << " has " << label[3] << " tracks of "
+                 << label[2] << " sectors of " << label[1] << " bytes, not "
+                 << NumTracks << " of " << SectorsPerTrack << " of "
+                 << SectorSize << "; remove it to make a new disk\n";
+            Abort();
+        }
     }
     else
     { // file doesn't exist, create it
         fileno = OpenForWrite(diskname);
-        magicNum = MagicNumber;
-        WriteFile(fileno, (char *)&magicNum, MagicSize); // write magic number
+        label[0] = MagicNumber;
+        label[1] = SectorSize; // MP4
+        label[2] = SectorsPerTrack;
+        label[3] = NumTracks;
+        WriteFile(fileno, (char *)label, MagicSize); // write magic number
 
         // need to write at end of file, so that reads will not return EOF
         Lseek(fileno, DiskSize - sizeof(int), 0);
         WriteFile(fileno, (char *)&tmp, sizeof(int));
     }
-    active = FALSE;
+
+    image = NULL; // MP4
+    if (mapped)
+    {
+        image = MapFile(fileno, DiskSize);
+        if (image == NULL)
+        {
+            DEBUG(dbgDisk, "Can't map the disk file; using read/write.");
+        }
+    }
 }
 
 //----------------------------------------------------------------------
@@ -74,8 +130,32 @@ Disk::Disk(CallBackObj *toCall)
 
 Disk::~Disk()
 {
+    if (image != NULL)
+    { // MP4: make sure the file is up to date on a clean shutdown
+        SyncMappedFile(image, DiskSize);
+        UnmapFile(image, DiskSize);
+    }
     Close(fileno);
+    delete model; // MP4
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// Disk::Snapshot()
+// 	Save the disk file, as it is now, to the UNIX file "snapshotFile",
+//	for a later Disk to be restored from.  The caller must have
+//	written back anything it caches.  Return FALSE if the copy
+//	can't be made.
+//----------------------------------------------------------------------
+
+bool Disk::Snapshot(char *snapshotFile)
+{
+    ASSERT(outstanding == 0);
+    if (image != NULL)
+        SyncMappedFile(image, DiskSize);
+    return CloneFile(diskname, snapshotFile);
 }
+// MP4 end
 
 //----------------------------------------------------------------------
 // Disk::PrintSector()
@@ -115,55 +195,171 @@ PrintSector(bool writing, int sector, char *data)
 
 void Disk::ReadRequest(int sectorNumber, char *data)
 {
-    int ticks = ComputeLatency(sectorNumber, FALSE);
+    ReadRunRequest(sectorNumber, 1, data);
+}
 
-    ASSERT(!active); // only one request at a time
-    ASSERT((sectorNumber >= 0) && (sectorNumber < NumSectors));
+void Disk::WriteRequest(int sectorNumber, char *data)
+{
+    WriteRunRequest(sectorNumber, 1, data);
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// Disk::ReadRunRequest/WriteRunRequest
+// 	Simulate a request to read/write a run of physically contiguous
+//	disk sectors.  The whole run is transferred by one request, so
+//	it pays for a single seek and rotational delay, and then one
+//	RotationTime per sector (cf. RotationalModel::ComputeLatency);
+//	or, on an SSD, is spread over its channels.
+//
+//	"sectorNumber" -- the first disk sector to read/write
+//	"numSectors" -- the number of sectors in the run
+//	"data" -- the bytes to be written, the buffer to hold the incoming
+//		bytes; numSectors * SectorSize bytes long
+//	"owner" -- header sector of the file it is for, or -1
+//	"tag" -- for the caller to tell its requests apart, see Completed
+//----------------------------------------------------------------------
+
+void Disk::ReadRunRequest(int sectorNumber, int numSectors, char *data,
+                          int owner, void *tag)
+{
+    DiskLatency parts;
 
-    DEBUG(dbgDisk, "Reading from sector " << sectorNumber);
-    Lseek(fileno, SectorSize * sectorNumber + MagicSize, 0);
-    Read(fileno, data, SectorSize);
+    ASSERT(outstanding < model->QueueDepth()); // only so many at a time
+    ASSERT((sectorNumber >= 0) && (numSectors > 0) &&
+           (sectorNumber + numSectors <= NumSectors));
+
+    int ticks = model->Start(sectorNumber, numSectors, FALSE, &parts);
+
+    DEBUG(dbgDisk, "Reading " << numSectors << " sectors from sector " << sectorNumber);
+    if (image != NULL)
+        bcopy(image + SectorSize * sectorNumber + MagicSize, data,
+              SectorSize * numSectors);
+    else
+    {
+        Lseek(fileno, SectorSize * sectorNumber + MagicSize, 0);
+        Read(fileno, data, SectorSize * numSectors);
+    }
     if (debug->IsEnabled('d'))
-        PrintSector(FALSE, sectorNumber, data);
+    {
+        for (int i = 0; i < numSectors; i++)
+            PrintSector(FALSE, sectorNumber + i, &data[i * SectorSize]);
+    }
 
-    active = TRUE;
-    UpdateLast(sectorNumber);
+    Profile(&parts, numSectors, FALSE, owner);
     kernel->stats->numDiskReads++;
-    kernel->interrupt->Schedule(this, ticks, DiskInt);
+    Issue(ticks, tag);
 }
 
-void Disk::WriteRequest(int sectorNumber, char *data)
+void Disk::WriteRunRequest(int sectorNumber, int numSectors, char *data,
+                           int owner, void *tag)
 {
-    int ticks = ComputeLatency(sectorNumber, TRUE);
+    DiskLatency parts;
 
-    ASSERT(!active);
-    ASSERT((sectorNumber >= 0) && (sectorNumber < NumSectors));
+    ASSERT(outstanding < model->QueueDepth());
+    ASSERT((sectorNumber >= 0) && (numSectors > 0) &&
+           (sectorNumber + numSectors <= NumSectors));
+    int ticks = model->Start(sectorNumber, numSectors, TRUE, &parts);
 
-    DEBUG(dbgDisk, "Writing to sector " << sectorNumber);
-    Lseek(fileno, SectorSize * sectorNumber + MagicSize, 0);
-    WriteFile(fileno, data, SectorSize);
+    DEBUG(dbgDisk, "Writing " << numSectors << " sectors to sector " << sectorNumber);
+    if (image != NULL)
+        bcopy(data, image + SectorSize * sectorNumber + MagicSize,
+              SectorSize * numSectors);
+    else
+    {
+        Lseek(fileno, SectorSize * sectorNumber + MagicSize, 0);
+        WriteFile(fileno, data, SectorSize * numSectors);
+    }
     if (debug->IsEnabled('d'))
-        PrintSector(TRUE, sectorNumber, data);
+    {
+        for (int i = 0; i < numSectors; i++)
+            PrintSector(TRUE, sectorNumber + i, &data[i * SectorSize]);
+    }
 
-    active = TRUE;
-    UpdateLast(sectorNumber);
+    Profile(&parts, numSectors, TRUE, owner);
     kernel->stats->numDiskWrites++;
+    Issue(ticks, tag);
+}
+
+//----------------------------------------------------------------------
+// Disk::Issue
+// 	Remember a request just started, and schedule the interrupt for
+//	when it completes.
+//
+//	"ticks" -- how long it takes, from now
+//	"tag" -- what Completed is to return then
+//----------------------------------------------------------------------
+
+void Disk::Issue(int ticks, void *tag)
+{
+    ASSERT(outstanding < model->QueueDepth());
+    doneAt[outstanding] = kernel->stats->totalTicks + ticks;
+    tags[outstanding] = tag;
+    outstanding++;
     kernel->interrupt->Schedule(this, ticks, DiskInt);
 }
+// MP4 end
 
 //----------------------------------------------------------------------
 // Disk::CallBack()
 // 	Called by the machine simulation when the disk interrupt occurs.
+//
+//	MP4: with several requests outstanding, the interrupt is for
+//	the one that completes first (the earliest issued, of those
+//	completing together); Completed tells the handler which it was.
 //----------------------------------------------------------------------
 
 void Disk::CallBack()
 {
-    active = FALSE;
+    int first = 0; // MP4
+
+    ASSERT(outstanding > 0);
+    for (int i = 1; i < outstanding; i++)
+    {
+        if (doneAt[i] < doneAt[first])
+            first = i;
+    }
+    completed = tags[first];
+    outstanding--;
+    for (int i = first; i < outstanding; i++)
+    {
+        doneAt[i] = doneAt[i + 1];
+        tags[i] = tags[i + 1];
+    }
     callWhenDone->CallBack();
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// RotationalModel::RotationalModel
+// 	The head starts over sector 0, with nothing in the track buffer.
+//----------------------------------------------------------------------
+
+RotationalModel::RotationalModel()
+{
+    lastSector = 0;
+    bufferInit = 0;
+}
+
+//----------------------------------------------------------------------
+// RotationalModel::Start
+// 	A request is being issued: work out how long it takes, and move
+//	the head to its last sector.
+//----------------------------------------------------------------------
+
+int RotationalModel::Start(int sector, int numSectors, bool writing,
+                           DiskLatency *parts)
+{
+    int ticks = ComputeLatency(sector, writing, numSectors, parts);
+
+    parts->erase = 0;
+    UpdateLast(sector + numSectors - 1);
+    return ticks;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
-// Disk::TimeToSeek()
+// RotationalModel::TimeToSeek()
 //	Returns how long it will take to position the disk head over the correct
 //	track on the disk.  Since when we finish seeking, we are likely
 //	to be in the middle of a sector that is rotating past the head,
@@ -173,7 +369,7 @@ void Disk::CallBack()
 //   	and rotates at one sector per RotationTime ticks
 //----------------------------------------------------------------------
 
-int Disk::TimeToSeek(int newSector, int *rotation)
+int RotationalModel::TimeToSeek(int newSector, int *rotation)
 {
     int newTrack = newSector / SectorsPerTrack;
     int oldTrack = lastSector / SectorsPerTrack;
@@ -190,12 +386,12 @@ int Disk::TimeToSeek(int newSector, int *rotation)
 }
 
 //----------------------------------------------------------------------
-// Disk::ModuloDiff()
+// RotationalModel::ModuloDiff()
 // 	Return number of sectors of rotational delay between target sector
 //	"to" and current sector position "from"
 //----------------------------------------------------------------------
 
-int Disk::ModuloDiff(int to, int from)
+int RotationalModel::ModuloDiff(int to, int from)
 {
     int toOffset = to % SectorsPerTrack;
     int fromOffset = from % SectorsPerTrack;
@@ -204,7 +400,7 @@ int Disk::ModuloDiff(int to, int from)
 }
 
 //----------------------------------------------------------------------
-// Disk::ComputeLatency()
+// RotationalModel::ComputeLatency()
 // 	Return how long will it take to read/write a disk sector, from
 //	the current position of the disk head.
 //
@@ -222,36 +418,77 @@ int Disk::ModuloDiff(int to, int from)
 //   	read requests to the current track to be satisfied more quickly.
 //   	The contents of the track buffer are discarded after every seek to
 //   	a new track.
+//
+//	MP4: a run of "numSectors" contiguous sectors is one request;
+//	after the first sector, each further sector costs one more
+//	RotationTime, plus a one-track seek whenever the run crosses
+//	onto the next track.
+//
+//	MP4: if "parts" is not NULL, the seek distance and the seek,
+//	rotation and transfer times are returned in it as well.
 //----------------------------------------------------------------------
 
-int Disk::ComputeLatency(int newSector, bool writing)
+int RotationalModel::ComputeLatency(int newSector, bool writing, int numSectors,
+                                    DiskLatency *parts)
 {
+    // MP4 start
+    if (numSectors > 1)
+    {
+        int lastTrack = (newSector + numSectors - 1) / SectorsPerTrack;
+        int crossed = lastTrack - newSector / SectorsPerTrack;
+        int latency = ComputeLatency(newSector, writing, 1, parts) +
+                      (numSectors - 1) * RotationTime + crossed * SeekTime;
+        if (parts != NULL)
+        {
+            parts->seek += crossed * SeekTime;
+            parts->transfer += (numSectors - 1) * RotationTime;
+        }
+        DEBUG(dbgDisk, "Run of " << numSectors << " sectors, latency = " << latency);
+        return latency;
+    }
+    // MP4 end
+
     int rotation;
     int seek = TimeToSeek(newSector, &rotation);
     int timeAfter = kernel->stats->totalTicks + seek + rotation;
 
+    if (parts != NULL)
+    { // MP4
+        parts->tracks = abs(newSector / SectorsPerTrack - lastSector / SectorsPerTrack);
+        parts->seek = seek;
+        parts->transfer = RotationTime;
+        parts->bufferHit = FALSE;
+    }
+
 #ifndef NOTRACKBUF // turn this on if you don't want the track buffer stuff
     // check if track buffer applies
     if ((writing == FALSE) && (seek == 0) && (((timeAfter - bufferInit) / RotationTime) > ModuloDiff(newSector, bufferInit / RotationTime)))
     {
+        if (parts != NULL)
+        { // MP4
+            parts->rotation = 0;
+            parts->bufferHit = TRUE;
+        }
         DEBUG(dbgDisk, "Request latency = " << RotationTime);
         return RotationTime; // time to transfer sector from the track buffer
     }
 #endif
 
     rotation += ModuloDiff(newSector, timeAfter / RotationTime) * RotationTime;
+    if (parts != NULL)
+        parts->rotation = rotation; // MP4
 
     DEBUG(dbgDisk, "Request latency = " << (seek + rotation + RotationTime));
     return (seek + rotation + RotationTime);
 }
 
 //----------------------------------------------------------------------
-// Disk::UpdateLast
+// RotationalModel::UpdateLast
 //   	Keep track of the most recently requested sector.  So we can know
 //	what is in the track buffer.
 //----------------------------------------------------------------------
 
-void Disk::UpdateLast(int newSector)
+void RotationalModel::UpdateLast(int newSector)
 {
     int rotate;
     int seek = TimeToSeek(newSector, &rotate);
@@ -261,3 +498,108 @@ void Disk::UpdateLast(int newSector)
     lastSector = newSector;
     DEBUG(dbgDisk, "Updating last sector = " << lastSector << " , " << bufferInit);
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// Disk::Profile
+// 	Add a request just started to the disk profile in the statistics:
+//	how far the head moved, where its time went, whether the track
+//	buffer served it, and which file it was for.
+//
+//	"parts" -- the breakdown the device model returned for it
+//	"numSectors" -- the number of sectors transferred
+//	"writing" -- a write rather than a read
+//	"owner" -- header sector of the file it is for, or -1
+//----------------------------------------------------------------------
+
+void Disk::Profile(DiskLatency *parts, int numSectors, bool writing, int owner)
+{
+    Statistics *stats = kernel->stats;
+
+    stats->diskSeekTracks.Add(parts->tracks);
+    stats->diskSeekTicks += parts->seek;
+    stats->diskRotationTicks += parts->rotation;
+    stats->diskTransferTicks += parts->transfer;
+    stats->diskEraseTicks += parts->erase;
+    if (parts->bufferHit)
+        stats->numTrackBufferHits++;
+    stats->RecordDiskFile(owner, numSectors, writing,
+                          parts->seek + parts->rotation + parts->transfer + parts->erase);
+}
+
+//----------------------------------------------------------------------
+// FlashModel::FlashModel
+// 	Every channel starts idle, with an empty erase block open.
+//----------------------------------------------------------------------
+
+FlashModel::FlashModel()
+{
+    lastSector = 0;
+    for (int c = 0; c < FlashChannels; c++)
+    {
+        channelFree[c] = 0;
+        pagesLeft[c] = FlashBlockPages;
+    }
+}
+
+//----------------------------------------------------------------------
+// FlashModel::Start
+// 	A request is being issued: give each of its pages to its
+//	channel, after whatever that channel was already given, and
+//	return when the last of them is done and all the data has
+//	crossed the bus.  Reads take FlashReadTime a page and writes
+//	FlashProgramTime, plus FlashEraseTime whenever a channel's open
+//	erase block is full and another has to be erased for it.  Only
+//	requests that meet at a channel wait for one another, so up to
+//	FlashQueueDepth of them overlap.
+//
+//	The breakdown is that of the page finishing last: the wait for
+//	its channel, the erase, and the read or program time plus the
+//	bus time of the whole request.
+//
+//	"sector" -- the first sector of the request
+//	"numSectors" -- the number of sectors in it
+//	"writing" -- a write rather than a read
+//	"parts" -- where the breakdown goes
+//----------------------------------------------------------------------
+
+int FlashModel::Start(int sector, int numSectors, bool writing,
+                      DiskLatency *parts)
+{
+    int now = kernel->stats->totalTicks;
+    int done = now, wait = 0, erase = 0, work = 0;
+
+    for (int i = 0; i < numSectors; i++)
+    {
+        int c = (sector + i) % FlashChannels;
+        int start = max(now, channelFree[c]);
+        int pageErase = 0;
+        int pageWork = writing ? FlashProgramTime : FlashReadTime;
+
+        if (writing && --pagesLeft[c] < 0)
+        { // the open block is full
+            pagesLeft[c] = FlashBlockPages - 1;
+            pageErase = FlashEraseTime;
+            kernel->stats->numFlashErases++;
+        }
+        channelFree[c] = start + pageErase + pageWork;
+        if (channelFree[c] > done)
+        {
+            done = channelFree[c];
+            wait = start - now;
+            erase = pageErase;
+            work = pageWork;
+        }
+    }
+    lastSector = sector + numSectors - 1;
+
+    parts->tracks = 0;
+    parts->seek = 0;
+    parts->rotation = wait;
+    parts->erase = erase;
+    parts->transfer = work + numSectors * FlashTransferTime;
+    parts->bufferHit = FALSE;
+    DEBUG(dbgDisk, "Flash request latency = " << (done - now) + numSectors * FlashTransferTime);
+    return (done - now) + numSectors * FlashTransferTime;
+}
+// MP4 end
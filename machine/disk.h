@@ -46,49 +46,206 @@
 // disks these days now come with a track buffer.
 //
 // The track buffer simulation can be disabled by compiling with -DNOTRACKBUF
+//
+// MP4: all of the above is now the RotationalModel; a Disk can also be
+// given the timing of a flash SSD instead (FlashModel), which takes
+// several requests at once.
+
+// MP4 start
+// The geometry can be changed from the Makefile, e.g.
+// -DDISK_SECTOR_SIZE=512 or -DDISK_SECTOR_SIZE=4096; unless the number
+// of tracks is given too, it is chosen to keep the disk at 128MB.
+// The geometry is written into the disk file when it is created, and
+// a disk file made with another geometry is refused.
+#ifndef DISK_SECTOR_SIZE
+#define DISK_SECTOR_SIZE 128
+#endif
+#ifndef DISK_SECTORS_PER_TRACK
+#define DISK_SECTORS_PER_TRACK 1024
+#endif
+#ifndef DISK_NUM_TRACKS
+#define DISK_NUM_TRACKS ((128 << 20) / (DISK_SECTOR_SIZE * DISK_SECTORS_PER_TRACK))
+#endif
+// MP4 end
 
-const int SectorSize = 128;  // number of bytes per disk sector
+const int SectorSize = DISK_SECTOR_SIZE;  // number of bytes per disk sector
 // MP4 start
 // Mod to total 128MB
-const int SectorsPerTrack = 1024;                      // number of sectors per disk track
-const int NumTracks = 1024;                            // number of tracks per disk
+const int SectorsPerTrack = DISK_SECTORS_PER_TRACK;    // number of sectors per disk track
+const int NumTracks = DISK_NUM_TRACKS;                 // number of tracks per disk
 const int NumSectors = (SectorsPerTrack * NumTracks);  // total # of sectors per disk
+
+// Orders in which SynchDisk may serve the requests queued for the disk:
+// first come first served, shortest seek (from the head position)
+// first, or circular LOOK -- sweep upward, then jump back to the
+// lowest pending sector.
+enum DiskPolicy { DiskFIFO,
+                  DiskSSTF,
+                  DiskCLOOK,
+                  NumDiskPolicies };
+
+// MP4: the kinds of storage device a Disk can be (see DeviceModel):
+// a rotating disk, or a flash SSD.
+enum DeviceKind { DeviceHDD,
+                  DeviceSSD,
+                  NumDeviceKinds };
+
+// The SSD's flash: each sector is a flash page, and consecutive
+// sectors are striped across the channels, so that a run of them is
+// read or programmed on all the channels at once.  Pages are written
+// out of place into an open erase block on each channel; when that
+// fills up, a block has to be erased before the channel can go on.
+#define FlashChannels 8       // channels working in parallel
+#define FlashBlockPages 64    // pages in an erase block
+#define FlashQueueDepth 8     // commands the SSD accepts at once
+#define MaxQueueDepth FlashQueueDepth  // the most of any device
+
+// Where the time of one disk request went, as worked out by the
+// device model.
+struct DiskLatency {
+    int tracks;      // distance the head moved, in tracks
+    int seek;        // ticks spent seeking
+    int rotation;    // ticks waiting for the sector to come around
+                     // (on an SSD: for a busy channel)
+    int transfer;    // ticks moving the data
+    int erase;       // ticks erasing flash blocks first
+    bool bufferHit;  // served from the track buffer
+};
+
+// How long requests take on one kind of storage device.  Disk moves
+// the data and raises the interrupts, and asks its model for the
+// timing of each request as it is issued.
+class DeviceModel {
+   public:
+    virtual ~DeviceModel() {}
+
+    virtual int QueueDepth() = 0;
+    // Requests the device accepts at once
+    virtual int Start(int sector, int numSectors, bool writing,
+                      DiskLatency *parts) = 0;
+    // A request is being issued now:
+    // return the ticks until it
+    // completes, and their breakdown
+    virtual int HeadSector() = 0;
+    // Where the last request ended
+};
+
+// A single rotating surface with a track buffer: the disk Nachos has
+// always simulated.  It serves one request at a time.
+class RotationalModel : public DeviceModel {
+   public:
+    RotationalModel();
+
+    int QueueDepth() { return 1; }
+    int Start(int sector, int numSectors, bool writing, DiskLatency *parts);
+    int HeadSector() { return lastSector; }
+
+    int ComputeLatency(int newSector, bool writing, int numSectors = 1,
+                       DiskLatency *parts = NULL);
+    // Return how long a request to
+    // newSector will take:
+    // (seek + rotational delay + transfer)
+    // and, if "parts" is given, how
+    // that time breaks down
+
+   private:
+    int lastSector;  // The previous disk request
+    int bufferInit;  // When the track buffer started
+                     // being loaded
+
+    int TimeToSeek(int newSector, int *rotate);  // time to get to the new track
+    int ModuloDiff(int to, int from);            // # sectors between to and from
+    void UpdateLast(int newSector);
+};
+
+// A flash SSD: no seeks, fixed page read and program times, erase
+// blocks, FlashChannels channels working side by side, and a command
+// queue FlashQueueDepth deep.
+class FlashModel : public DeviceModel {
+   public:
+    FlashModel();
+
+    int QueueDepth() { return FlashQueueDepth; }
+    int Start(int sector, int numSectors, bool writing, DiskLatency *parts);
+    int HeadSector() { return lastSector; }
+
+   private:
+    int lastSector;                   // where the last request ended
+    int channelFree[FlashChannels];   // totalTicks when each channel
+                                      // is done with what it was given
+    int pagesLeft[FlashChannels];     // free pages in each channel's
+                                      // open erase block
+};
 // MP4 end
 
 class Disk : public CallBackObj {
    public:
-    Disk(CallBackObj *toCall);  // Create a simulated disk.
+    Disk(CallBackObj *toCall, bool mapped = FALSE, char *restoreFrom = NULL,
+         DeviceKind kind = DeviceHDD);
+                                // Create a simulated disk.
                                 // Invoke toCall->CallBack()
                                 // when each request completes.
+                                // MP4: "mapped" keeps the disk
+                                // file mapped in memory;
+                                // "restoreFrom" is a snapshot
+                                // to start the disk file from;
+                                // "kind" picks the timing model
     ~Disk();                    // Deallocate the disk.
 
     void ReadRequest(int sectorNumber, char *data);
     // Read/write an single disk sector.
     // These routines send a request to
     // the disk and return immediately.
-    // Only one request allowed at a time!
+    // MP4: at most QueueDepth() requests
+    // may be outstanding at a time!
     void WriteRequest(int sectorNumber, char *data);
 
+    // MP4 start
+    void ReadRunRequest(int sectorNumber, int numSectors, char *data,
+                        int owner = -1, void *tag = NULL);
+    // Read/write "numSectors" physically
+    // contiguous sectors as one request:
+    // a single seek, then the transfer.
+    // "owner" is the header sector of the
+    // file the request is for, or -1; it
+    // is only used to profile the disk.
+    // "tag" is handed back by Completed.
+    void WriteRunRequest(int sectorNumber, int numSectors, char *data,
+                         int owner = -1, void *tag = NULL);
+
+    int QueueDepth() { return model->QueueDepth(); }
+    // Requests that may be outstanding
+    void *Completed() { return completed; }
+    // The tag of the request whose
+    // completion is being signalled
+    // MP4 end
+
     void CallBack();  // Invoked when disk request
                       // finishes. In turn calls, callWhenDone.
 
-    int ComputeLatency(int newSector, bool writing);
-    // Return how long a request to
-    // newSector will take:
-    // (seek + rotational delay + transfer)
+    int HeadSector() { return model->HeadSector(); }  // MP4: last sector
+                                             // accessed, i.e. where the head is
+    bool Snapshot(char *snapshotFile);  // MP4: copy the disk file, as it
+                                        // is now, to snapshotFile
 
    private:
     int fileno;                 // UNIX file number for simulated disk
+    char *image;                // MP4: the disk file mapped in memory,
+                                // or NULL to read and write the file
     char diskname[32];          // name of simulated disk's file
     CallBackObj *callWhenDone;  // Invoke when any disk request finishes
-    bool active;                // Is a disk operation in progress?
-    int lastSector;             // The previous disk request
-    int bufferInit;             // When the track buffer started
-                                // being loaded
 
-    int TimeToSeek(int newSector, int *rotate);  // time to get to the new track
-    int ModuloDiff(int to, int from);            // # sectors between to and from
-    void UpdateLast(int newSector);
+    // MP4 start
+    DeviceModel *model;         // how long requests take
+    int outstanding;            // requests issued and not completed
+    int doneAt[MaxQueueDepth];  // when each of them completes,
+    void *tags[MaxQueueDepth];  // and its tag
+    void *completed;            // tag of the one just completed
+
+    void Issue(int ticks, void *tag);  // a request was started
+    void Profile(DiskLatency *parts, int numSectors, bool writing,
+                 int owner);  // add a request to the stats
+    // MP4 end
 };
 
 #endif  // DISK_H
@@ -23,6 +23,7 @@
 #include "copyright.h"
 #include "interrupt.h"
 #include "main.h"
+#include "synchdisk.h"
 
 // String definitions for debugging messages
 
@@ -31,6 +32,9 @@ static char *intTypeNames[] = {"timer", "disk", "console write",
                                "console read", "network send",
                                "network recv"};
 
+static const int NeverDue = 0x7fffffff;	// MP4: nextDue with nothing pending
+static const int InitialPending = 16;	// MP4: first size of the heap
+
 //----------------------------------------------------------------------
 // PendingInterrupt::PendingInterrupt
 // 	Initialize a hardware device interrupt that is to be scheduled
@@ -47,11 +51,15 @@ PendingInterrupt::PendingInterrupt(CallBackObj *callOnInt,
     callOnInterrupt = callOnInt;
     when = time;
     type = kind;
+    order = 0;
+    nextFree = NULL;
 }
 
 //----------------------------------------------------------------------
 // PendingCompare
 //	Compare to interrupts based on which should occur first.
+//	MP4: interrupts due at the same time occur in the order they were
+//	scheduled, as they did on the old sorted list.
 //----------------------------------------------------------------------
 
 static int
@@ -67,7 +75,7 @@ PendingCompare(PendingInterrupt *x, PendingInterrupt *y)
     }
     else
     {
-        return 0;
+        return x->order - y->order;
     }
 }
 
@@ -81,10 +89,16 @@ PendingCompare(PendingInterrupt *x, PendingInterrupt *y)
 Interrupt::Interrupt()
 {
     level = IntOff;
-    pending = new SortedList<PendingInterrupt *>(PendingCompare);
+    maxPending = InitialPending;		// MP4
+    pending = new PendingInterrupt *[maxPending];
+    numPending = 0;
+    numScheduled = 0;
+    freePending = NULL;
     inHandler = FALSE;
     yieldOnReturn = FALSE;
     status = SystemMode;
+    nextDue = NeverDue;				// MP4
+    traceTicks = debug->IsEnabled(dbgInt);
 }
 
 //----------------------------------------------------------------------
@@ -94,11 +108,19 @@ Interrupt::Interrupt()
 
 Interrupt::~Interrupt()
 {
-    while (!pending->IsEmpty())
+    PendingInterrupt *p;
+
+    for (int i = 0; i < numPending; i++)
     {
-        delete pending->RemoveFront();
+        delete pending[i];
+    }
+    delete[] pending;
+    while (freePending != NULL)
+    {	// MP4: and the pool
+        p = freePending;
+        freePending = p->nextFree;
+        delete p;
     }
-    delete pending;
 }
 
 //----------------------------------------------------------------------
@@ -153,8 +175,18 @@ Interrupt::SetLevel(IntStatus now)
 //	Two things can cause OneTick to be called:
 //		interrupts are re-enabled
 //		a user instruction is executed
+//
+//	MP4: with the basic-block engine, a whole block of "count" user
+//	instructions is charged at once, so interrupts are only noticed
+//	between blocks.
+//
+//	MP4: nothing can fire before "nextDue", the time of the earliest
+//	pending interrupt, and only a handler can ask for a yield.  So
+//	until then a tick just advances the clock; the interrupt level
+//	toggling and CheckIfDue are only done once an interrupt is due,
+//	which is exactly when they would have found it.
 //----------------------------------------------------------------------
-void Interrupt::OneTick()
+void Interrupt::OneTick(int count)
 {
     MachineStatus oldStatus = status;
     Statistics *stats = kernel->stats;
@@ -162,14 +194,18 @@ void Interrupt::OneTick()
     // advance simulated time
     if (status == SystemMode)
     {
-        stats->totalTicks += SystemTick;
-        stats->systemTicks += SystemTick;
+        stats->totalTicks += count * SystemTick;
+        stats->systemTicks += count * SystemTick;
+        kernel->currentThread->systemTicks += count * SystemTick; // MP4
     }
     else
     {
-        stats->totalTicks += UserTick;
-        stats->userTicks += UserTick;
+        stats->totalTicks += count * UserTick;
+        stats->userTicks += count * UserTick;
+        kernel->currentThread->userTicks += count * UserTick;
     }
+    if (stats->totalTicks < nextDue && !traceTicks)
+        return;		// MP4: no interrupt can be due yet
     DEBUG(dbgInt, "== Tick " << stats->totalTicks << " ==");
 
     // check any pending interrupts are now ready to fire
@@ -183,7 +219,11 @@ void Interrupt::OneTick()
         // for a context switch, ok to do it now
         yieldOnReturn = FALSE;
         status = SystemMode; // yield is a kernel routine
+        // MP4: a thread switched out of its user program here can be
+        // checkpointed, and resumed, from its registers alone
+        kernel->currentThread->userPreempted = (oldStatus == UserMode);
         kernel->currentThread->Yield();
+        kernel->currentThread->userPreempted = FALSE;
         status = oldStatus;
     }
 }
@@ -253,6 +293,9 @@ void Interrupt::Halt()
     cout << "This is halt\n";
     kernel->stats->Print();
 	*/
+    if (kernel->synchDisk != NULL)	// MP4: write back the buffer cache
+	kernel->synchDisk->Flush();	// while DEBUG still works; ~Kernel
+					// finds it clean
     delete debug;
 
     delete kernel; // Never returns.
@@ -263,7 +306,8 @@ void Interrupt::Halt()
 // 	Arrange for the CPU to be interrupted when simulated time
 //	reaches "now + when".
 //
-//	Implementation: just put it on a sorted list.
+//	Implementation: push it on a binary heap (MP4), reusing a pooled
+//	PendingInterrupt if there is one.
 //
 //	NOTE: the Nachos kernel should not call this routine directly.
 //	Instead, it is only called by the hardware device simulators.
@@ -276,12 +320,29 @@ void Interrupt::Halt()
 void Interrupt::Schedule(CallBackObj *toCall, int fromNow, IntType type)
 {
     int when = kernel->stats->totalTicks + fromNow;
-    PendingInterrupt *toOccur = new PendingInterrupt(toCall, when, type);
+    PendingInterrupt *toOccur;
+
+    if (freePending != NULL)
+    {	// MP4: reuse one that has already fired
+        toOccur = freePending;
+        freePending = toOccur->nextFree;
+        toOccur->callOnInterrupt = toCall;
+        toOccur->when = when;
+        toOccur->type = type;
+    }
+    else
+    {
+        toOccur = new PendingInterrupt(toCall, when, type);
+    }
+    toOccur->order = numScheduled++;
+    TRACE(TraceIntSchedule, type, when);	// MP4
 
     DEBUG(dbgInt, "Scheduling interrupt handler the " << intTypeNames[type] << " at time = " << when);
     ASSERT(fromNow > 0);
 
-    pending->Insert(toOccur);
+    Push(toOccur);
+    if (when < nextDue)
+        nextDue = when;	// MP4
 }
 
 //----------------------------------------------------------------------
@@ -307,11 +368,11 @@ bool Interrupt::CheckIfDue(bool advanceClock)
     {
         DumpState();
     }
-    if (pending->IsEmpty())
+    if (numPending == 0)
     { // no pending interrupts
         return FALSE;
     }
-    next = pending->Front();
+    next = pending[0];
 
     if (next->when > stats->totalTicks)
     {
@@ -338,14 +399,86 @@ bool Interrupt::CheckIfDue(bool advanceClock)
     inHandler = TRUE;
     do
     {
-        next = pending->RemoveFront();     // pull interrupt off list
+        next = Pop();                      // pull interrupt off the heap
+        TRACE(TraceIntDispatch, next->type, next->when);   // MP4
         next->callOnInterrupt->CallBack(); // call the interrupt handler
-        delete next;
-    } while (!pending->IsEmpty() && (pending->Front()->when <= stats->totalTicks));
+        next->nextFree = freePending;      // MP4: keep it for reuse
+        freePending = next;
+    } while (numPending > 0 && (pending[0]->when <= stats->totalTicks));
     inHandler = FALSE;
+    UpdateNextDue();	// MP4
     return TRUE;
 }
 
+//----------------------------------------------------------------------
+// Interrupt::UpdateNextDue
+// 	Recompute when the earliest pending interrupt is due, after some
+//	have been taken off the list (MP4).
+//----------------------------------------------------------------------
+
+void Interrupt::UpdateNextDue()
+{
+    if (numPending == 0)
+        nextDue = NeverDue;
+    else
+        nextDue = pending[0]->when;
+}
+
+//----------------------------------------------------------------------
+// Interrupt::Push
+// 	Add an interrupt to the "pending" heap, growing the array if it is
+//	full, and sift it up to its place (MP4).
+//----------------------------------------------------------------------
+
+void Interrupt::Push(PendingInterrupt *toOccur)
+{
+    int i, parent;
+
+    if (numPending == maxPending)
+    {
+        PendingInterrupt **bigger = new PendingInterrupt *[2 * maxPending];
+        for (i = 0; i < numPending; i++)
+            bigger[i] = pending[i];
+        delete[] pending;
+        pending = bigger;
+        maxPending *= 2;
+    }
+    for (i = numPending++; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+        if (PendingCompare(pending[parent], toOccur) <= 0)
+            break;
+        pending[i] = pending[parent];
+    }
+    pending[i] = toOccur;
+}
+
+//----------------------------------------------------------------------
+// Interrupt::Pop
+// 	Remove and return the interrupt that is to occur first, moving the
+//	last one in the heap down into its place (MP4).
+//----------------------------------------------------------------------
+
+PendingInterrupt *Interrupt::Pop()
+{
+    PendingInterrupt *first = pending[0];
+    PendingInterrupt *last = pending[--numPending];
+    int i, child;
+
+    ASSERT(numPending >= 0);
+    for (i = 0; (child = 2 * i + 1) < numPending; i = child)
+    {
+        if (child + 1 < numPending &&
+            PendingCompare(pending[child + 1], pending[child]) < 0)
+            child++;
+        if (PendingCompare(last, pending[child]) <= 0)
+            break;
+        pending[i] = pending[child];
+    }
+    pending[i] = last;
+    return first;
+}
+
 //----------------------------------------------------------------------
 // PrintPending
 // 	Print information about an interrupt that is scheduled to occur.
@@ -359,6 +492,23 @@ PrintPending(PendingInterrupt *pending)
     cout << ", scheduled at " << pending->when;
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Interrupt::IsPending
+// 	Return TRUE if an interrupt of kind "type" is scheduled to occur.
+//----------------------------------------------------------------------
+
+bool Interrupt::IsPending(IntType type)
+{
+    for (int i = 0; i < numPending; i++)
+    {
+        if (pending[i]->type == type)
+            return TRUE;
+    }
+    return FALSE;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // DumpState
 // 	Print the complete interrupt state - the status, and all interrupts
@@ -370,6 +520,10 @@ void Interrupt::DumpState()
     cout << "Time: " << kernel->stats->totalTicks;
     cout << ", interrupts " << intLevelNames[level] << "\n";
     cout << "Pending interrupts:\n";
-    pending->Apply(PrintPending);
+    // MP4: print them in the order they will occur, from a sorted copy
+    SortedList<PendingInterrupt *> inOrder(PendingCompare);
+    for (int i = 0; i < numPending; i++)
+        inOrder.Insert(pending[i]);
+    inOrder.Apply(PrintPending);
     cout << "\nEnd of pending interrupts\n";
 }
@@ -66,6 +66,9 @@ class PendingInterrupt {
     
     int when;			// When the interrupt is supposed to fire
     IntType type;		// for debugging
+    int order;			// MP4: breaks ties in "when" -- the one
+				// scheduled first fires first
+    PendingInterrupt *nextFree;	// MP4: link in the pool of unused ones
 };
 
 // The following class defines the data structures for the simulation
@@ -87,6 +90,8 @@ class Interrupt {
     IntStatus getLevel() {return level;}
     				// Return whether interrupts
 				// are enabled or disabled
+    bool InHandler() {return inHandler;}
+				// MP4: is an interrupt handler running?
     
     void Idle(); 		// The ready queue is empty, roll 
 				// simulated time forward until the 
@@ -107,6 +112,8 @@ class Interrupt {
         			// idle, kernel, user
 
     void DumpState();		// Print interrupt state
+    bool IsPending(IntType type);	// MP4: is an interrupt from this
+				// device scheduled?
     
 
     // NOTE: the following are internal to the hardware simulation code.
@@ -119,13 +126,20 @@ class Interrupt {
 				// at time "when".  This is called
     				// by the hardware device simulators.
     
-    void OneTick();       	// Advance simulated time
+    void OneTick(int count = 1); // Advance simulated time, by "count"
+				// instructions' worth (MP4)
 
   private:
     IntStatus level;		// are interrupts enabled or disabled?
-    SortedList<PendingInterrupt *> *pending;		
-    				// the list of interrupts scheduled
-				// to occur in the future
+    // MP4 start
+    PendingInterrupt **pending;	// the interrupts scheduled to occur in
+				// the future, as a binary heap ordered
+				// by (when, order): pending[0] is next
+    int numPending;		// how many there are
+    int maxPending;		// size of the "pending" array
+    int numScheduled;		// source of PendingInterrupt::order
+    PendingInterrupt *freePending;	// pool of PendingInterrupts to reuse
+    // MP4 end
     //int writeFileNo;            //UNIX file emulating the display
     bool inHandler;		// TRUE if we are running an interrupt handler
     //bool putBusy;               // Is a PrintInt operation in progress
@@ -133,6 +147,9 @@ class Interrupt {
     bool yieldOnReturn; 	// TRUE if we are to context switch
 				// on return from the interrupt handler
     MachineStatus status;	// idle, kernel mode, user mode
+    int nextDue;		// MP4: when the first pending interrupt is
+				// due; OneTick does nothing else before then
+    bool traceTicks;		// MP4: dbgInt is on, so every tick is traced
 
     // these functions are internal to the interrupt simulation code
 
@@ -142,6 +159,12 @@ class Interrupt {
 
     void ChangeLevel(IntStatus old, 	// SetLevel, without advancing the
 			IntStatus now); // simulated time
+
+    void UpdateNextDue();	// MP4: recompute nextDue from "pending"
+
+    // MP4: heap operations on "pending"
+    void Push(PendingInterrupt *toOccur);
+    PendingInterrupt *Pop();	// remove and return the next one
 };
 
 #endif // INTERRRUPT_H
@@ -50,9 +50,10 @@ static void CheckEndian()
 //
 //	"debug" -- if TRUE, drop into the debugger after each user instruction
 //		is executed.
+//	"blocks" -- if TRUE, use the basic-block engine (see RunBlock)
 //----------------------------------------------------------------------
 
-Machine::Machine(bool debug)
+Machine::Machine(bool debug, bool blocks)
 {
     int i;
 
@@ -62,6 +63,7 @@ Machine::Machine(bool debug)
     for (i = 0; i < MemorySize; i++)
         mainMemory[i] = 0;
 #ifdef USE_TLB
+    ASSERT(TLBSets * TLBWays == TLBSize);
     tlb = new TranslationEntry[TLBSize];
     for (i = 0; i < TLBSize; i++)
         tlb[i].valid = FALSE;
@@ -70,8 +72,13 @@ Machine::Machine(bool debug)
     tlb = NULL;
     pageTable = NULL;
 #endif
+    asid = 0;
+    cachedPage = -1;
+    for (i = 0; i < NumPhysPages; i++)
+        pageVersion[i] = 1; // MP4: decode cache entries start at 0
 
     singleStep = debug;
+    blockEngine = blocks;
     CheckEndian();
 }
 
@@ -38,7 +38,22 @@ const int PageSize = 128; // set the page size equal to
 const int NumPhysPages = 128;
 
 const int MemorySize = (NumPhysPages * PageSize);
-const int TLBSize = 4; // if there is a TLB, make it small
+// MP4 start
+// The TLB, if there is one, is set associative: an entry for virtual
+// page "vpn" can only be in set (vpn % TLBSets), which has TLBWays
+// entries.  Both can be changed from the Makefile, e.g.
+// -DUSE_TLB -DTLB_SIZE=16 -DTLB_WAYS=2; by default the TLB is small and
+// fully associative.
+#ifndef TLB_SIZE
+#define TLB_SIZE 4
+#endif
+#ifndef TLB_WAYS
+#define TLB_WAYS TLB_SIZE
+#endif
+const int TLBSize = TLB_SIZE; // if there is a TLB, make it small
+const int TLBWays = TLB_WAYS;
+const int TLBSets = TLBSize / TLBWays;
+// MP4 end
 
 enum ExceptionType
 {
@@ -96,8 +111,10 @@ class Interrupt;
 class Machine
 {
 public:
-	Machine(bool debug); // Initialize the simulation of the hardware
-		// for running user programs
+	Machine(bool debug, bool blocks = FALSE);
+	// Initialize the simulation of the hardware
+	// for running user programs; MP4: if "blocks",
+	// run them a basic block at a time
 	~Machine(); // De-allocate the data structures
 
 	// Routines callable by the Nachos kernel
@@ -140,20 +157,49 @@ public:
 
 	TranslationEntry *pageTable;
 	unsigned int pageTableSize;
+	int asid; // MP4: only TLB entries tagged with this
+		  // address space id are used
+
+	void InvalidateTranslation() { cachedPage = -1; }
+	// MP4: forget the last translation; the
+	// kernel must call this whenever it changes
+	// the page table, the TLB or the asid
 
 	bool ReadMem(int addr, int size, int *value);
 	bool WriteMem(int addr, int size, int value);
 	// Read or write 1, 2, or 4 bytes of virtual
 	// memory (at addr).  Return FALSE if a
 	// correct translation couldn't be found.
+
+	void MemoryChanged(int physAddr, int length);
+	// MP4: "length" bytes of main memory from
+	// "physAddr" were written other than by
+	// WriteMem; the kernel must call this
+	// whenever it fills or copies into a frame,
+	// so the decode cache forgets those pages
 private:
 	// Routines internal to the machine simulation -- DO NOT call these directly
 	void DelayedLoad(int nextReg, int nextVal);
 	// Do a pending delayed load (modifying a reg)
 
-	void OneInstruction(Instruction *instr);
+	void OneInstruction();
 	// Run one instruction of a user program.
 
+	bool ExecuteInstruction(Instruction *instr);
+	// MP4: execute an instruction already fetched
+	// and decoded; FALSE if it raised an exception
+
+	int RunBlock();
+	// MP4: run instructions up to the end of the
+	// basic block; return how many were run
+
+	bool ReadAddress(int addr, int size, int *physAddr);
+	// MP4: ReadMem's translation, without the
+	// read; FALSE if it raised an exception
+	Instruction *Fetch(int physAddr);
+	// MP4: the decoded instruction there, from
+	// the decode cache if its page is unchanged
+
 	ExceptionType Translate(int virtAddr, int *physAddr, int size, bool writing);
 	// Translate an address, and check for
 	// alignment.  Set the use and dirty bits in
@@ -172,6 +218,18 @@ private:
 
 	int registers[NumTotalRegs]; // CPU registers, for executing user programs
 
+	// MP4: the last page translated, so that further references to it
+	// can skip Translate.  Not kept while dbgAddr is being traced.
+	int cachedPage;				 // virtual page #, or -1 for none
+	TranslationEntry *cachedEntry; // its page table or TLB entry
+	int cachedFrame;			 // physical address of its frame
+
+	unsigned int pageVersion[NumPhysPages]; // MP4: bumped whenever a
+		// frame is written, to check the decode cache against
+
+	bool blockEngine; // MP4: run basic blocks of threaded code,
+		// rather than one instruction at a time
+
 	bool singleStep; // drop back into the debugger after each
 		// simulated instruction
 	int runUntilTime; // drop back into the debugger when simulated
@@ -23,6 +23,12 @@
 
 static void Mult(int a, int b, bool signedArith, int *hiPtr, int *loPtr);
 
+// MP4: a threaded-code handler, which carries out one instruction that
+// only computes on registers (see Machine::RunBlock)
+class Instruction;
+typedef void (*ThreadedOp)(int *registers, Instruction *instr);
+static ThreadedOp ThreadedOpFor(int opCode);
+
 // The following class defines an instruction, represented in both
 // 	undecoded binary form
 //      decoded to identify
@@ -42,8 +48,41 @@ public:
 	char rs, rt, rd; // Three registers from instruction.
 	int extra;		 // Immediate or target or shamt field or offset.
 					 // Immediates are sign-extended.
+	ThreadedOp op;	 // MP4: handler for RunBlock, or NULL if the
+					 // instruction needs ExecuteInstruction
+	unsigned int version; // MP4: pageVersion of its frame when decoded
 };
 
+// MP4: the decode cache.  Every word of physical memory has an entry,
+// holding the last instruction decoded from that address.  An entry is
+// only reused while its frame's pageVersion is the one it was decoded
+// under; a store to the page, or the kernel filling it (by paging,
+// copy on write or I/O, see Machine::MemoryChanged), bumps the version
+// and so has the page's words read and decoded afresh.  A hit costs
+// neither a memory read nor a compare of the word.
+static Instruction decodeCache[MemorySize / 4];
+
+//----------------------------------------------------------------------
+// Machine::Fetch
+// 	Return the decoded instruction at physical address "physAddr",
+//	decoding it from memory if the cached one is out of date.
+//----------------------------------------------------------------------
+
+Instruction *
+Machine::Fetch(int physAddr)
+{
+	Instruction *instr = &decodeCache[physAddr / 4];
+	unsigned int version = pageVersion[physAddr / PageSize];
+
+	if (instr->version != version)
+	{
+		instr->value = WordToHost(*(unsigned int *)&mainMemory[physAddr]);
+		instr->Decode();
+		instr->version = version;
+	}
+	return instr;
+}
+
 //----------------------------------------------------------------------
 // Machine::Run
 // 	Simulate the execution of a user-level program on Nachos.
@@ -55,7 +94,9 @@ public:
 
 void Machine::Run()
 {
-	Instruction *instr = new Instruction; // storage for decoded instruction
+	// MP4: the block engine cannot stop after each instruction, nor
+	// trace them one by one
+	bool blocks = blockEngine && !singleStep && !debug->IsEnabled('m');
 
 	if (debug->IsEnabled('m'))
 	{
@@ -65,7 +106,12 @@ void Machine::Run()
 	kernel->interrupt->setStatus(UserMode);
 	for (;;)
 	{
-		OneInstruction(instr);
+		if (blocks)
+		{
+			kernel->interrupt->OneTick(RunBlock());
+			continue;
+		}
+		OneInstruction();
 		kernel->interrupt->OneTick();
 		if (singleStep && (runUntilTime <= kernel->stats->totalTicks))
 			Debugger();
@@ -115,25 +161,22 @@ TypeToReg(RegType reg, Instruction *instr)
 //	store all data back to the machine registers and memory before
 //	leaving.  This allows the Nachos kernel to control our behavior
 //	by controlling the contents of memory, the translation table,
-//	and the register set.
+//	and the register set.  (MP4: the decode cache is no exception: it
+//	only remembers what a word of memory decodes to, and is checked
+//	against its page's version every time.)
 //----------------------------------------------------------------------
 
-void Machine::OneInstruction(Instruction *instr)
+void Machine::OneInstruction()
 {
-#ifdef SIM_FIX
-	int byte; // described in Kane for LWL,LWR,...
-#endif
-
-	int raw;
-	int nextLoadReg = 0;
-	int nextLoadValue = 0; // record delayed load operation, to apply
-		// in the future
+	Instruction *instr;
+	int physicalPC;
 
 	// Fetch instruction
-	if (!ReadMem(registers[PCReg], 4, &raw))
+	if (!ReadAddress(registers[PCReg], 4, &physicalPC))
 		return; // exception occurred
-	instr->value = raw;
-	instr->Decode();
+
+	// MP4: decode only if this page has changed since last time
+	instr = Fetch(physicalPC);
 
 	if (debug->IsEnabled('m'))
 	{
@@ -147,6 +190,29 @@ void Machine::OneInstruction(Instruction *instr)
 		cout << "\t" << buf << "\n";
 	}
 
+	ExecuteInstruction(instr); // MP4: shared with RunBlock
+}
+
+//----------------------------------------------------------------------
+// Machine::ExecuteInstruction
+// 	Execute an instruction that has been fetched and decoded, and
+//	advance the program counters past it.  Split out of OneInstruction
+//	(MP4) so that RunBlock can use it too.
+//
+//	Return FALSE if the instruction raised an exception, in which case
+//	the kernel has already handled it.
+//----------------------------------------------------------------------
+
+bool Machine::ExecuteInstruction(Instruction *instr)
+{
+#ifdef SIM_FIX
+	int byte; // described in Kane for LWL,LWR,...
+#endif
+
+	int nextLoadReg = 0;
+	int nextLoadValue = 0; // record delayed load operation, to apply
+		// in the future
+
 	// Compute next pc, but don't install in case there's an error or branch.
 	int pcAfter = registers[NextPCReg] + 4;
 	int sum, diff, tmp, value;
@@ -162,7 +228,7 @@ void Machine::OneInstruction(Instruction *instr)
 			((registers[instr->rs] ^ sum) & SIGN_BIT))
 		{
 			RaiseException(OverflowException, 0);
-			return;
+			return FALSE;
 		}
 		registers[instr->rd] = sum;
 		break;
@@ -173,7 +239,7 @@ void Machine::OneInstruction(Instruction *instr)
 			((instr->extra ^ sum) & SIGN_BIT))
 		{
 			RaiseException(OverflowException, 0);
-			return;
+			return FALSE;
 		}
 		registers[instr->rt] = sum;
 		break;
@@ -274,7 +340,7 @@ void Machine::OneInstruction(Instruction *instr)
 	case OP_LBU:
 		tmp = registers[instr->rs] + instr->extra;
 		if (!ReadMem(tmp, 1, &value))
-			return;
+			return FALSE;
 
 		if ((value & 0x80) && (instr->opCode == OP_LB))
 			value |= 0xffffff00;
@@ -290,10 +356,10 @@ void Machine::OneInstruction(Instruction *instr)
 		if (tmp & 0x1)
 		{
 			RaiseException(AddressErrorException, tmp);
-			return;
+			return FALSE;
 		}
 		if (!ReadMem(tmp, 2, &value))
-			return;
+			return FALSE;
 
 		if ((value & 0x8000) && (instr->opCode == OP_LH))
 			value |= 0xffff0000;
@@ -313,10 +379,10 @@ void Machine::OneInstruction(Instruction *instr)
 		if (tmp & 0x3)
 		{
 			RaiseException(AddressErrorException, tmp);
-			return;
+			return FALSE;
 		}
 		if (!ReadMem(tmp, 4, &value))
-			return;
+			return FALSE;
 		nextLoadReg = instr->rt;
 		nextLoadValue = value;
 		break;
@@ -336,7 +402,7 @@ void Machine::OneInstruction(Instruction *instr)
 		// DEBUG('P', "Addr 0x%X\n",tmp-byte);
 
 		if (!ReadMem(tmp - byte, 4, &value))
-			return;
+			return FALSE;
 #else
 		// ReadMem assumes all 4 byte requests are aligned on an even
 		// word boundary.  Also, the little endian/big endian swap code would
@@ -344,7 +410,7 @@ void Machine::OneInstruction(Instruction *instr)
 		ASSERT((tmp & 0x3) == 0);
 
 		if (!ReadMem(tmp, 4, &value))
-			return;
+			return FALSE;
 #endif
 
 		if (registers[LoadReg] == instr->rt)
@@ -388,7 +454,7 @@ void Machine::OneInstruction(Instruction *instr)
 		// DEBUG('P', "Addr 0x%X\n",tmp-byte);
 
 		if (!ReadMem(tmp - byte, 4, &value))
-			return;
+			return FALSE;
 #else
 		// ReadMem assumes all 4 byte requests are aligned on an even
 		// word boundary.  Also, the little endian/big endian swap code would
@@ -396,7 +462,7 @@ void Machine::OneInstruction(Instruction *instr)
 		ASSERT((tmp & 0x3) == 0);
 
 		if (!ReadMem(tmp, 4, &value))
-			return;
+			return FALSE;
 #endif
 
 		if (registers[LoadReg] == instr->rt)
@@ -468,12 +534,12 @@ void Machine::OneInstruction(Instruction *instr)
 
 	case OP_SB:
 		if (!WriteMem((unsigned)(registers[instr->rs] + instr->extra), 1, registers[instr->rt]))
-			return;
+			return FALSE;
 		break;
 
 	case OP_SH:
 		if (!WriteMem((unsigned)(registers[instr->rs] + instr->extra), 2, registers[instr->rt]))
-			return;
+			return FALSE;
 		break;
 
 	case OP_SLL:
@@ -543,7 +609,7 @@ void Machine::OneInstruction(Instruction *instr)
 			((registers[instr->rs] ^ diff) & SIGN_BIT))
 		{
 			RaiseException(OverflowException, 0);
-			return;
+			return FALSE;
 		}
 		registers[instr->rd] = diff;
 		break;
@@ -554,7 +620,7 @@ void Machine::OneInstruction(Instruction *instr)
 
 	case OP_SW:
 		if (!WriteMem((unsigned)(registers[instr->rs] + instr->extra), 4, registers[instr->rt]))
-			return;
+			return FALSE;
 		break;
 
 	case OP_SWL:
@@ -570,7 +636,7 @@ void Machine::OneInstruction(Instruction *instr)
 		byte = tmp & 0x3;
 		// DEBUG('P', "Addr 0x%X\n",tmp-byte);
 		if (!ReadMem(tmp - byte, 4, &value))
-			return;
+			return FALSE;
 
 			// DEBUG('P', "Value 0x%X\n",value);
 #else
@@ -580,7 +646,7 @@ void Machine::OneInstruction(Instruction *instr)
 		ASSERT((tmp & 0x3) == 0);
 
 		if (!ReadMem((tmp & ~0x3), 4, &value))
-			return;
+			return FALSE;
 #endif
 
 #ifdef SIM_FIX
@@ -607,12 +673,12 @@ void Machine::OneInstruction(Instruction *instr)
 		}
 #ifndef SIM_FIX
 		if (!WriteMem((tmp & ~0x3), 4, value))
-			return;
+			return FALSE;
 #else
 		// DEBUG('P', "Value 0x%X\n",value);
 
 		if (!WriteMem((tmp - byte), 4, value))
-			return;
+			return FALSE;
 #endif // SIM_FIX
 		break;
 
@@ -625,7 +691,7 @@ void Machine::OneInstruction(Instruction *instr)
 		ASSERT((tmp & 0x3) == 0);
 
 		if (!ReadMem((tmp & ~0x3), 4, &value))
-			return;
+			return FALSE;
 #else
 		// The only difference between this code and the BIG ENDIAN code
 		// is that the ReadMem call is guaranteed an aligned access as
@@ -638,7 +704,7 @@ void Machine::OneInstruction(Instruction *instr)
 		// DEBUG('P', "Addr 0x%X\n",tmp-byte);
 
 		if (!ReadMem(tmp - byte, 4, &value))
-			return;
+			return FALSE;
 			// DEBUG('P', "Value 0x%X\n",value);
 #endif // SIM_FIX
 
@@ -664,19 +730,19 @@ void Machine::OneInstruction(Instruction *instr)
 
 #ifndef SIM_FIX
 		if (!WriteMem((tmp & ~0x3), 4, value))
-			return;
+			return FALSE;
 #else
 		// DEBUG('P', "Value 0x%X\n",value);
 
 		if (!WriteMem((tmp - byte), 4, value))
-			return;
+			return FALSE;
 #endif // SIM_FIX
 
 		break;
 
 	case OP_SYSCALL:
 		RaiseException(SyscallException, 0);
-		return;
+		return FALSE;
 
 	case OP_XOR:
 		registers[instr->rd] = registers[instr->rs] ^ registers[instr->rt];
@@ -689,7 +755,7 @@ void Machine::OneInstruction(Instruction *instr)
 	case OP_RES:
 	case OP_UNIMP:
 		RaiseException(IllegalInstrException, 0);
-		return;
+		return FALSE;
 
 	default:
 		ASSERT(FALSE);
@@ -705,7 +771,205 @@ void Machine::OneInstruction(Instruction *instr)
 											 // are jumping into lala-land
 	registers[PCReg] = registers[NextPCReg];
 	registers[NextPCReg] = pcAfter;
+	return TRUE;
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// Machine::RunBlock
+// 	Execute user instructions from the current PC to the end of its
+//	basic block: up to the first instruction after which control does
+//	not just fall through to the next word (a taken branch or jump,
+//	once its delay slot has run, or a trap to the kernel), or to the
+//	end of the page.
+//
+//	Only the first instruction's address is translated; the rest of
+//	the block is on the same physical page, so each following word is
+//	just looked up in the decode cache.  Instructions that only compute on registers are run by
+//	their threaded-code handler, followed by the delayed load and PC
+//	update OneInstruction would do; all others go through
+//	ExecuteInstruction, so branch delay slots, delayed loads and
+//	exceptions behave exactly as in the interpreter.
+//
+//	Return the number of instructions executed, for Run to charge to
+//	simulated time in one go.
+//----------------------------------------------------------------------
+
+int Machine::RunBlock()
+{
+	Instruction *instr;
+	int physicalPC, pc;
+	int count = 0;
+
+	if (!ReadAddress(registers[PCReg], 4, &physicalPC))
+		return 1; // exception occurred; it costs a tick, as in Run
+	int pageEnd = (physicalPC / PageSize + 1) * PageSize;
+
+	for (;;)
+	{
+		pc = registers[PCReg];
+		instr = Fetch(physicalPC);
+		count++;
+
+		if (instr->op != NULL)
+		{
+			(*instr->op)(registers, instr);
+			DelayedLoad(0, 0);
+			registers[PrevPCReg] = registers[PCReg];
+			registers[PCReg] = registers[NextPCReg];
+			registers[NextPCReg] = registers[PCReg] + 4;
+		}
+		else if (!ExecuteInstruction(instr))
+			break; // trapped to the kernel
+
+		physicalPC += 4;
+		if (registers[PCReg] != pc + 4 || physicalPC >= pageEnd)
+			break; // end of the block
+	}
+	return count;
+}
+
+//----------------------------------------------------------------------
+// Threaded-code handlers
+// 	One for each instruction that cannot trap, branch or touch memory,
+//	each doing what the corresponding case of ExecuteInstruction does.
+//----------------------------------------------------------------------
+
+static void DoADDIU(int *registers, Instruction *instr)
+{
+	registers[instr->rt] = registers[instr->rs] + instr->extra;
+}
+
+static void DoADDU(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = registers[instr->rs] + registers[instr->rt];
+}
+
+static void DoAND(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = registers[instr->rs] & registers[instr->rt];
+}
+
+static void DoANDI(int *registers, Instruction *instr)
+{
+	registers[instr->rt] = registers[instr->rs] & (instr->extra & 0xffff);
+}
+
+static void DoLUI(int *registers, Instruction *instr)
+{
+	registers[instr->rt] = instr->extra << 16;
+}
+
+static void DoNOR(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = ~(registers[instr->rs] | registers[instr->rt]);
+}
+
+static void DoOR(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = registers[instr->rs] | registers[instr->rt];
+}
+
+static void DoORI(int *registers, Instruction *instr)
+{
+	registers[instr->rt] = registers[instr->rs] | (instr->extra & 0xffff);
+}
+
+static void DoSLL(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = registers[instr->rt] << instr->extra;
+}
+
+static void DoSLT(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = (registers[instr->rs] < registers[instr->rt]);
+}
+
+static void DoSLTI(int *registers, Instruction *instr)
+{
+	registers[instr->rt] = (registers[instr->rs] < instr->extra);
+}
+
+static void DoSLTIU(int *registers, Instruction *instr)
+{
+	registers[instr->rt] = ((unsigned int)registers[instr->rs] < (unsigned int)instr->extra);
+}
+
+static void DoSLTU(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = ((unsigned int)registers[instr->rs] < (unsigned int)registers[instr->rt]);
+}
+
+static void DoSRA(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = registers[instr->rt] >> instr->extra;
+}
+
+static void DoSUBU(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = registers[instr->rs] - registers[instr->rt];
+}
+
+static void DoXOR(int *registers, Instruction *instr)
+{
+	registers[instr->rd] = registers[instr->rs] ^ registers[instr->rt];
+}
+
+static void DoXORI(int *registers, Instruction *instr)
+{
+	registers[instr->rt] = registers[instr->rs] ^ (instr->extra & 0xffff);
+}
+
+//----------------------------------------------------------------------
+// ThreadedOpFor
+// 	Return the threaded-code handler for "opCode", or NULL if the
+//	instruction has to be run by ExecuteInstruction.
+//----------------------------------------------------------------------
+
+static ThreadedOp
+ThreadedOpFor(int opCode)
+{
+	switch (opCode)
+	{
+	case OP_ADDIU:
+		return DoADDIU;
+	case OP_ADDU:
+		return DoADDU;
+	case OP_AND:
+		return DoAND;
+	case OP_ANDI:
+		return DoANDI;
+	case OP_LUI:
+		return DoLUI;
+	case OP_NOR:
+		return DoNOR;
+	case OP_OR:
+		return DoOR;
+	case OP_ORI:
+		return DoORI;
+	case OP_SLL:
+		return DoSLL;
+	case OP_SLT:
+		return DoSLT;
+	case OP_SLTI:
+		return DoSLTI;
+	case OP_SLTIU:
+		return DoSLTIU;
+	case OP_SLTU:
+		return DoSLTU;
+	case OP_SRA:
+		return DoSRA;
+	case OP_SUBU:
+		return DoSUBU;
+	case OP_XOR:
+		return DoXOR;
+	case OP_XORI:
+		return DoXORI;
+	default:
+		return NULL;
+	}
 }
+// MP4 end
 
 //----------------------------------------------------------------------
 // Machine::DelayedLoad
@@ -782,6 +1046,7 @@ void Instruction::Decode()
 			opCode = OP_UNIMP;
 		}
 	}
+	op = ThreadedOpFor(opCode); // MP4
 }
 
 //----------------------------------------------------------------------
@@ -24,7 +24,8 @@ NetworkInput::NetworkInput(CallBackObj *toCall)
     // set up the stuff to emulate asynchronous interrupts
     callWhenAvail = toCall;
     packetAvail = FALSE;
-    inHdr.length = 0;
+    inHead = inCount = 0; // MP4
+    pollInterval = NetworkTime;
 
     sock = OpenSocket();
     sprintf(sockName, "SOCKET_%d", kernel->hostName);
@@ -55,33 +56,47 @@ NetworkInput::~NetworkInput()
 //      First check to make sure packet is available & there's space to
 //	pull it in.  Then invoke the "callBack" registered by whoever
 //	wants the packet.
+//
+//	MP4: pull in every packet waiting on the socket, as long as the
+//	receive queue has room, and signal each of them in turn.  The
+//	next look is sooner if anything arrived, later if the link is
+//	idle.
 //-----------------------------------------------------------------------
 
 void NetworkInput::CallBack()
 {
-    // schedule the next time to poll for a packet
-    kernel->interrupt->Schedule(this, NetworkTime, NetworkRecvInt);
-
-    if (inHdr.length != 0) // do nothing if packet is already buffered
-        return;
-    if (!PollSocket(sock)) // do nothing if no packet to be read
-        return;
-
-    // otherwise, read packet in
+    int arrived = 0, slot;
     char *buffer = new char[MaxWireSize];
-    ReadFromSocket(sock, buffer, MaxWireSize);
 
-    // divide packet into header and data
-    inHdr = *(PacketHeader *)buffer;
-    ASSERT((inHdr.to == kernel->hostName) && (inHdr.length <= MaxPacketSize));
-    bcopy(buffer + sizeof(PacketHeader), inbox, inHdr.length);
+    while (inCount < NetworkQueueSize && PollSocket(sock))
+    {
+        // read packet in
+        ReadFromSocket(sock, buffer, MaxWireSize);
+
+        // divide packet into header and data
+        slot = (inHead + inCount) % NetworkQueueSize;
+        inHdr[slot] = *(PacketHeader *)buffer;
+        ASSERT((inHdr[slot].to == kernel->hostName) &&
+               (inHdr[slot].length <= MaxPacketSize));
+        bcopy(buffer + sizeof(PacketHeader), inbox[slot], inHdr[slot].length);
+        inCount++;
+        arrived++;
+
+        DEBUG(dbgNet, "Network received packet from " << inHdr[slot].from << ", length " << inHdr[slot].length);
+        kernel->stats->numPacketsRecvd++;
+    }
     delete[] buffer;
 
-    DEBUG(dbgNet, "Network received packet from " << inHdr.from << ", length " << inHdr.length);
-    kernel->stats->numPacketsRecvd++;
+    // schedule the next time to poll for a packet
+    if (arrived > 0 || inCount == NetworkQueueSize)
+        pollInterval = NetworkTime;
+    else
+        pollInterval = min(2 * pollInterval, NetworkMaxPoll);
+    kernel->interrupt->Schedule(this, pollInterval, NetworkRecvInt);
 
-    // tell post office that the packet has arrived
-    callWhenAvail->CallBack();
+    // tell post office that the packets have arrived
+    for (int i = 0; i < arrived; i++)
+        callWhenAvail->CallBack();
 }
 
 //-----------------------------------------------------------------------
@@ -92,13 +107,17 @@ void NetworkInput::CallBack()
 PacketHeader
 NetworkInput::Receive(char *data)
 {
-    PacketHeader hdr = inHdr;
+    PacketHeader hdr;
 
-    inHdr.length = 0;
-    if (hdr.length != 0)
+    if (inCount == 0) // MP4
     {
-        bcopy(inbox, data, hdr.length);
+        hdr.length = 0;
+        return hdr;
     }
+    hdr = inHdr[inHead];
+    bcopy(inbox[inHead], data, hdr.length);
+    inHead = (inHead + 1) % NetworkQueueSize;
+    inCount--;
     return hdr;
 }
 
@@ -43,6 +43,16 @@ public:
 #define MaxPacketSize (MaxWireSize - sizeof(struct PacketHeader))
 // data "payload" of the largest packet
 
+// MP4 start
+// The network input device has a small receive queue, and each time it
+// looks at the socket it pulls in every datagram waiting there.  On an
+// idle link it looks less and less often, doubling the interval from
+// NetworkTime up to NetworkMaxPoll, and goes back to NetworkTime as soon
+// as something arrives.
+#define NetworkQueueSize 16          // packets the device can hold
+#define NetworkMaxPoll (16 * NetworkTime) // longest wait between looks
+// MP4 end
+
 // The following two classes defines a physical network device.  The network
 // is capable of delivering fixed sized packets, in order but unreliably,
 // to other machines connected to the network.
@@ -77,8 +87,14 @@ private:
         // 	arrived.
     bool packetAvail; // Packet has arrived, can be pulled off of
         //   network
-    PacketHeader inHdr;        // Information about arrived packet
-    char inbox[MaxPacketSize]; // Data for arrived packet
+    // MP4 start
+    PacketHeader inHdr[NetworkQueueSize];        // Information about
+        // arrived packets, oldest at "inHead"
+    char inbox[NetworkQueueSize][MaxPacketSize]; // Data for arrived packets
+    int inHead;       // Oldest packet not yet received
+    int inCount;      // Packets waiting to be received
+    int pollInterval; // Ticks until the socket is looked at again
+    // MP4 end
 };
 
 class NetworkOutput : public CallBackObj
@@ -10,6 +10,114 @@
 #include "copyright.h"
 #include "debug.h"
 #include "stats.h"
+#include "syscall.h"
+
+// MP4: printable names of the DiskPolicy values
+static const char *diskPolicyName[NumDiskPolicies] = { "FIFO", "SSTF", "C-LOOK" };
+
+//----------------------------------------------------------------------
+// SyscallName
+// 	MP4: the printable name of a system call code, or NULL if it
+//	has none.
+//----------------------------------------------------------------------
+
+static const char *
+SyscallName(int code)
+{
+    switch (code) {
+      case SC_Halt:		return "Halt";
+      case SC_Exit:		return "Exit";
+      case SC_Exec:		return "Exec";
+      case SC_Join:		return "Join";
+      case SC_Create:		return "Create";
+      case SC_Remove:		return "Remove";
+      case SC_Open:		return "Open";
+      case SC_Read:		return "Read";
+      case SC_Write:		return "Write";
+      case SC_Seek:		return "Seek";
+      case SC_Close:		return "Close";
+      case SC_ThreadFork:	return "ThreadFork";
+      case SC_ThreadYield:	return "ThreadYield";
+      case SC_ExecV:		return "ExecV";
+      case SC_ThreadExit:	return "ThreadExit";
+      case SC_ThreadJoin:	return "ThreadJoin";
+      case SC_Fork:		return "Fork";
+      case SC_Mmap:		return "Mmap";
+      case SC_Munmap:		return "Munmap";
+      case SC_PRead:		return "PRead";
+      case SC_PWrite:		return "PWrite";
+      case SC_ReadV:		return "ReadV";
+      case SC_WriteV:		return "WriteV";
+      case SC_Sync:		return "Sync";
+      case SC_Fsync:		return "Fsync";
+      case SC_ReadDir:		return "ReadDir";
+      case SC_Clone:		return "Clone";
+      case SC_Rename:		return "Rename";
+      case SC_Submit:		return "Submit";
+      case SC_GetStats:		return "GetStats";
+      case SC_Add:		return "Add";
+      case SC_MSG:		return "MSG";
+      default:			return NULL;
+    }
+}
+
+//----------------------------------------------------------------------
+// LatencyHistogram::LatencyHistogram
+// 	MP4: Start with no samples.
+//----------------------------------------------------------------------
+
+LatencyHistogram::LatencyHistogram()
+{
+    count = 0;
+    total = 0;
+    for (int i = 0; i < NumLatencyBuckets; i++)
+	buckets[i] = 0;
+}
+
+//----------------------------------------------------------------------
+// LatencyHistogram::Add
+// 	MP4: Count "value" in the bucket for its highest set bit.
+//----------------------------------------------------------------------
+
+void
+LatencyHistogram::Add(long long value)
+{
+    int bucket = 0;
+
+    ASSERT(value >= 0);
+    count++;
+    total += value;
+    while (value > 0 && bucket < NumLatencyBuckets - 1) {
+	value >>= 1;
+	bucket++;
+    }
+    buckets[bucket]++;
+}
+
+//----------------------------------------------------------------------
+// LatencyHistogram::Print
+// 	MP4: Print the buckets that have samples, one per line, as the
+//	range of values each covers.
+//
+//	"units" -- what the samples were measured in
+//----------------------------------------------------------------------
+
+void
+LatencyHistogram::Print(const char *units)
+{
+    for (int i = 0; i < NumLatencyBuckets; i++) {
+	if (buckets[i] == 0)
+	    continue;
+	if (i == 0)
+	    cout << "\t0 " << units;
+	else if (i == NumLatencyBuckets - 1)
+	    cout << "\t>= " << (1LL << (i - 1)) << " " << units;
+	else
+	    cout << "\t" << (1LL << (i - 1)) << " - " << (1LL << i) - 1
+		<< " " << units;
+	cout << ": " << buckets[i] << "\n";
+    }
+}
 
 //----------------------------------------------------------------------
 // Statistics::Statistics
@@ -22,6 +130,85 @@ Statistics::Statistics()
     numDiskReads = numDiskWrites = 0;
     numConsoleCharsRead = numConsoleCharsWritten = 0;
     numPageFaults = numPacketsSent = numPacketsRecvd = 0;
+    numPacketsRetransmitted = numPacketsDropped = 0;
+    numPageEvictions = numDirtyWriteBacks = numCopyOnWrites = 0;
+    numSharedCodePages = numZeroFillPages = 0;
+    numTLBHits = numTLBMisses = 0;
+    numCacheHits = numCacheMisses = 0;
+    numPrefetchSectors = 0;
+    numFlusherRuns = numFlusherSectors = 0;
+    numChecksumErrors = numScrubbedSectors = 0;
+    numChunkWrites = numChunkSectors = 0;
+    numSharedSectors = numUnsharedSectors = 0;
+    mountTicks = 0;
+    mountNanos = 0;
+    numContextSwitches = threadRunTicks = threadWaitTicks = 0;
+    numTimerInterrupts = 0;
+    numCPUs = 1;
+    numSteals = 0;
+    for (int i = 0; i < MaxCPUs; i++)
+	cpuBusyTicks[i] = 0;
+    for (int i = 0; i < NumDiskPolicies; i++)
+	diskQueueRequests[i] = diskQueueTicks[i] = 0;
+    diskSeekTicks = diskRotationTicks = diskTransferTicks = 0;
+    numTrackBufferHits = 0;
+    numFlashErases = diskEraseTicks = 0;
+    numProfiledFiles = 0;
+}
+
+//----------------------------------------------------------------------
+// Statistics::RecordSyscall
+// 	MP4: Add one call of system call "code" to its histograms.
+//
+//	"ticks" -- simulated time from the trap until it returned
+//	"nanos" -- host time, in nanoseconds, for the same
+//----------------------------------------------------------------------
+
+void
+Statistics::RecordSyscall(int code, int ticks, long long nanos)
+{
+    if (code < 0 || code >= NumSyscallCodes)
+	return;			// a bad code, not worth a histogram
+    syscallTicks[code].Add(ticks);
+    syscallNanos[code].Add(nanos);
+}
+
+//----------------------------------------------------------------------
+// Statistics::RecordDiskFile
+// 	MP4: Charge a disk request to the file it was made for, giving
+//	the file an entry the first time it is seen.
+//
+//	"owner" -- header sector of the file, or -1
+//	"numSectors" -- sectors the request moved
+//	"writing" -- a write rather than a read
+//	"ticks" -- how long the disk took over it
+//----------------------------------------------------------------------
+
+void
+Statistics::RecordDiskFile(int owner, int numSectors, bool writing, int ticks)
+{
+    DiskFileProfile *file = NULL;
+
+    for (int i = 0; i < numProfiledFiles; i++) {
+	if (diskFiles[i].owner == owner) {
+	    file = &diskFiles[i];
+	    break;
+	}
+    }
+    if (file == NULL && numProfiledFiles < NumProfiledFiles) {
+	file = &diskFiles[numProfiledFiles++];
+	file->owner = (numProfiledFiles < NumProfiledFiles) ? owner
+							    : OtherFiles;
+	file->reads = file->writes = file->sectors = file->ticks = 0;
+    }
+    if (file == NULL)
+	file = &diskFiles[NumProfiledFiles - 1];	// one of the rest
+    if (writing)
+	file->writes++;
+    else
+	file->reads++;
+    file->sectors += numSectors;
+    file->ticks += ticks;
 }
 
 //----------------------------------------------------------------------
@@ -35,11 +222,225 @@ Statistics::Print()
 {
     cout << "Ticks: total " << totalTicks << ", idle " << idleTicks;
 		cout << ", system " << systemTicks << ", user " << userTicks <<"\n";
+    if (mountNanos > 0) {
+	cout << "Startup: file system mounted in " << mountTicks;
+		cout << " ticks, " << mountNanos / 1000 << " us on the host\n";
+    }
     cout << "Disk I/O: reads " << numDiskReads;
 		cout << ", writes " << numDiskWrites << "\n";
+    cout << "Buffer cache: hits " << numCacheHits;
+		cout << ", misses " << numCacheMisses;
+		cout << ", read ahead " << numPrefetchSectors << "\n";
+    if (numFlusherRuns > 0) {
+	cout << "Flusher: runs " << numFlusherRuns;
+		cout << ", sectors written " << numFlusherSectors << "\n";
+    }
+    if (numScrubbedSectors > 0 || numChecksumErrors > 0) {
+	cout << "Checksums: errors " << numChecksumErrors;
+		cout << ", sectors scrubbed " << numScrubbedSectors << "\n";
+    }
+    if (numChunkWrites > 0) {
+	cout << "Compression: chunks written " << numChunkWrites;
+		cout << ", sectors used " << numChunkSectors << "\n";
+    }
+    if (numSharedSectors > 0 || numUnsharedSectors > 0) {
+	cout << "Clones: sectors shared " << numSharedSectors;
+		cout << ", copied on write " << numUnsharedSectors << "\n";
+    }
+    for (int i = 0; i < NumDiskPolicies; i++) {
+	if (diskQueueRequests[i] > 0) {
+	    cout << "Disk queue (" << diskPolicyName[i] << "): requests ";
+		cout << diskQueueRequests[i] << ", average latency ";
+		cout << diskQueueTicks[i] / diskQueueRequests[i] << " ticks\n";
+	}
+    }
+    if (diskSeekTracks.count > 0) {
+	cout << "Disk time: seek " << diskSeekTicks;
+		cout << ", rotation " << diskRotationTicks;
+		cout << ", transfer " << diskTransferTicks;
+		if (numFlashErases > 0)
+		    cout << ", erase " << diskEraseTicks;
+		cout << " ticks";
+		if (numFlashErases > 0)
+		    cout << ", flash blocks erased " << numFlashErases;
+		cout << ", track buffer hits " << numTrackBufferHits;
+		cout << " of " << numDiskReads << " reads\n";
+	cout << "Disk seeks: average " << diskSeekTracks.total / diskSeekTracks.count;
+	cout << " tracks\n";
+	diskSeekTracks.Print("tracks");
+	for (int i = 0; i < numProfiledFiles; i++) {
+	    DiskFileProfile *file = &diskFiles[i];
+
+	    if (file->owner == OtherFiles) {
+		cout << "Disk use, other files";
+	    } else if (file->owner == -1) {
+		cout << "Disk use, no file";
+	    } else {
+		cout << "Disk use, file at sector " << file->owner;
+	    }
+	    cout << ": reads " << file->reads << ", writes " << file->writes;
+	    cout << ", sectors " << file->sectors;
+	    cout << ", " << file->ticks << " ticks\n";
+	}
+    }
 		cout << "Console I/O: reads " << numConsoleCharsRead;
     cout << ", writes " << numConsoleCharsWritten << "\n";
-    cout << "Paging: faults " << numPageFaults << "\n";
+    cout << "Paging: faults " << numPageFaults;
+		cout << ", evictions " << numPageEvictions;
+		cout << ", dirty write-backs " << numDirtyWriteBacks;
+		cout << ", zero-fill " << numZeroFillPages;
+		cout << ", copy-on-write " << numCopyOnWrites;
+		cout << ", shared code " << numSharedCodePages << "\n";
+    if (numTLBHits + numTLBMisses > 0) {
+	cout << "TLB: hits " << numTLBHits << ", misses " << numTLBMisses;
+		cout << ", hit rate ";
+		cout << 100.0 * numTLBHits / (numTLBHits + numTLBMisses) << "%\n";
+    }
+    cout << "Scheduling: context switches " << numContextSwitches;
+		cout << ", timer interrupts " << numTimerInterrupts;
+		cout << ", run " << threadRunTicks;
+		cout << ", wait " << threadWaitTicks << " ticks\n";
+    if (numCPUs > 1) {
+	int busiest = 0;
+
+	cout << "SMP: " << numCPUs << " CPUs, busy ticks";
+	for (int i = 0; i < numCPUs; i++) {
+	    cout << " " << cpuBusyTicks[i];
+	    busiest = max(busiest, cpuBusyTicks[i]);
+	}
+	cout << ", steals " << numSteals;
+	// the run time divided by the busiest CPU's share of it: how
+	// much faster the CPUs would have got it done side by side
+	cout << ", speedup " << ((busiest > 0) ? (double)threadRunTicks / busiest : 1.0) << "\n";
+    }
     cout << "Network I/O: packets received " << numPacketsRecvd;
-		cout << ", sent " << numPacketsSent << "\n";
+		cout << ", sent " << numPacketsSent;
+		cout << ", retransmitted " << numPacketsRetransmitted;
+		cout << ", dropped " << numPacketsDropped << "\n";
+    for (int i = 0; i < NumSyscallCodes; i++) {
+	const char *name = SyscallName(i);
+	int calls = syscallTicks[i].count;
+
+	if (calls == 0)
+	    continue;
+	cout << "System call ";
+		if (name != NULL) cout << name; else cout << i;
+		cout << ": calls " << calls << ", average ";
+		cout << syscallTicks[i].total / calls << " ticks, ";
+		cout << syscallNanos[i].total / calls << " ns\n";
+	syscallTicks[i].Print("ticks");
+	syscallNanos[i].Print("ns");
+    }
+}
+
+// MP4 start
+// Pseudo-thread ids for the trace rows that are not Nachos threads.
+#define TraceDiskRow 1000
+#define TraceInterruptRow 1001
+
+//----------------------------------------------------------------------
+// TraceBuffer::TraceBuffer
+// 	Start with an empty ring, to be dumped to "traceFile".
+//
+//	"clock" -- the statistics whose totalTicks stamp the events
+//	"traceFile" -- the UNIX file the events are written to
+//----------------------------------------------------------------------
+
+TraceBuffer::TraceBuffer(Statistics *clock, char *traceFile)
+{
+    this->clock = clock;
+    fileName = traceFile;
+    events = new TraceEvent[TraceSize];
+    numRecorded = 0;
+    dumped = FALSE;
+}
+
+//----------------------------------------------------------------------
+// TraceBuffer::~TraceBuffer
+// 	Dump the events, unless Kernel::PrepareToEnd already did (it is
+//	not called when a program halts the machine).
+//----------------------------------------------------------------------
+
+TraceBuffer::~TraceBuffer()
+{
+    if (!dumped)
+	Dump();
+    delete [] events;
+}
+
+//----------------------------------------------------------------------
+// TraceBuffer::Dump
+// 	Write the events in the ring, oldest first, to the trace file.
+//	Each thread's time on the CPU becomes a slice, from the switch
+//	to it until the next switch; disk requests are slices on a row
+//	of their own, from queueing to completion; everything else is an
+//	instant event.
+//----------------------------------------------------------------------
+
+void
+TraceBuffer::Dump()
+{
+    unsigned int first = (numRecorded > TraceSize) ? numRecorded - TraceSize : 0;
+    TraceEvent *e, *running = NULL;	// the last switch seen
+    char line[200];
+    int fd, n;
+
+    dumped = TRUE;
+    fd = OpenForWrite(fileName);
+    n = sprintf(line, "{\"traceEvents\":[\n"
+	"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+	"\"args\":{\"name\":\"disk\"}},\n"
+	"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+	"\"args\":{\"name\":\"interrupts\"}}",
+	TraceDiskRow, TraceInterruptRow);
+    WriteFile(fd, line, n);
+
+    for (unsigned int i = first; i < numRecorded; i++) {
+	e = &events[i & (TraceSize - 1)];
+	switch (e->kind) {
+	  case TraceSwitch:
+	    if (running != NULL) {
+		n = sprintf(line, ",\n{\"name\":\"run\",\"ph\":\"X\",\"pid\":0,"
+		    "\"tid\":%d,\"ts\":%d,\"dur\":%d}",
+		    running->b, running->when, e->when - running->when);
+		WriteFile(fd, line, n);
+	    }
+	    running = e;
+	    continue;
+	  case TraceDisk:
+	    n = sprintf(line, ",\n{\"name\":\"sector %d\",\"ph\":\"X\",\"pid\":0,"
+		"\"tid\":%d,\"ts\":%d,\"dur\":%d}",
+		e->a, TraceDiskRow, e->when - e->b, e->b);
+	    break;
+	  case TraceIntSchedule:
+	  case TraceIntDispatch:
+	    n = sprintf(line, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+		"\"pid\":0,\"tid\":%d,\"ts\":%d,\"args\":{\"type\":%d,\"due\":%d}}",
+		(e->kind == TraceIntSchedule) ? "schedule" : "interrupt",
+		TraceInterruptRow, e->when, e->a, e->b);
+	    break;
+	  case TracePageFault:
+	  case TraceSyscall:
+	    n = sprintf(line, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+		"\"pid\":0,\"tid\":%d,\"ts\":%d,\"args\":{\"%s\":%d}}",
+		(e->kind == TracePageFault) ? "page fault" : "syscall",
+		e->b, e->when, (e->kind == TracePageFault) ? "page" : "code",
+		e->a);
+	    break;
+	  default:
+	    ASSERTNOTREACHED();
+	}
+	WriteFile(fd, line, n);
+    }
+    if (running != NULL) {	// still running at the end of the trace
+	e = &events[(numRecorded - 1) & (TraceSize - 1)];
+	n = sprintf(line, ",\n{\"name\":\"run\",\"ph\":\"X\",\"pid\":0,"
+	    "\"tid\":%d,\"ts\":%d,\"dur\":%d}",
+	    running->b, running->when, e->when - running->when);
+	WriteFile(fd, line, n);
+    }
+    n = sprintf(line, "\n]}\n");
+    WriteFile(fd, line, n);
+    Close(fd);
 }
+// MP4 end
@@ -12,6 +12,47 @@
 #define STATS_H
 
 #include "copyright.h"
+#include "disk.h"
+
+// MP4: The following class defines a latency histogram: how many
+// samples were added, their total, and how many fell in each
+// power-of-two bucket.  Bucket 0 counts zeros, bucket i counts
+// values in [2^(i-1), 2^i), and the last bucket everything above.
+
+#define NumLatencyBuckets 32
+
+class LatencyHistogram {
+  public:
+    LatencyHistogram();		// initialize to no samples
+
+    void Add(long long value);	// count one more sample
+    void Print(const char *units);	// print the non-empty buckets
+
+    int count;			// samples added
+    long long total;		// their sum
+    int buckets[NumLatencyBuckets];
+};
+
+// MP4: system call codes that have a histogram (see syscall.h)
+#define NumSyscallCodes 128
+
+// MP4: most simulated CPUs the scheduler can share out (see -ncpu)
+#define MaxCPUs 16
+
+// MP4: disk traffic charged to one file, named by the sector of its
+// header (-1 for requests made for no file: headers, the journal).
+// The first NumProfiledFiles - 1 files seen get an entry each; the
+// last entry, with owner OtherFiles, is charged for all the rest.
+
+#define NumProfiledFiles 32
+#define OtherFiles -2
+
+struct DiskFileProfile {
+    int owner;			// header sector of the file
+    int reads, writes;		// requests for it
+    int sectors;		// sectors they moved
+    int ticks;			// disk time they took
+};
 
 // The following class defines the statistics that are to be kept
 // about Nachos behavior -- how much time (ticks) elapsed, how
@@ -33,14 +74,115 @@ class Statistics {
     int numConsoleCharsRead;	// number of characters read from the keyboard
     int numConsoleCharsWritten; // number of characters written to the display
     int numPageFaults;		// number of virtual memory page faults
+    int numPageEvictions;	// MP4: pages taken out of memory
+    int numDirtyWriteBacks;	// MP4: evicted pages written to swap
+    int numCopyOnWrites;	// MP4: shared pages copied on a write
+    int numZeroFillPages;	// MP4: faults on never-touched BSS and
+				// stack pages, filled without any I/O
+    int numSharedCodePages;	// MP4: code page faults served by mapping
+				// another process's frame
+    int numTLBHits;		// MP4: translations found in the TLB
+    int numTLBMisses;		// MP4: translations the kernel had to load
+    int numContextSwitches;	// MP4: threads dispatched by the scheduler
+    int numTimerInterrupts;	// MP4: time-slice ticks taken
+    int threadRunTicks;		// MP4: ticks threads spent on the CPU, and
+    int threadWaitTicks;	// ready but waiting for it, in total
+    int numCPUs;		// MP4: simulated CPUs (see Scheduler),
+    int cpuBusyTicks[MaxCPUs];	// the ticks threads ran on each,
+    int numSteals;		// and threads an idle one took from another
     int numPacketsSent;		// number of packets sent over the network
     int numPacketsRecvd;	// number of packets received over the network
+    int numPacketsRetransmitted; // MP4: segments the transport sent again
+    int numPacketsDropped;	// MP4: messages a full mailbox had no room for
+    int numCacheHits;		// MP4: sector requests served by the buffer cache
+    int numCacheMisses;		// MP4: sector requests that missed the cache
+    int numPrefetchSectors;	// MP4: sectors read ahead into the cache
+    int numFlusherRuns;		// MP4: times the flusher thread woke up
+    int numFlusherSectors;	// MP4: sectors it wrote back
+    int numChecksumErrors;	// MP4: sectors read back with a bad checksum
+    int numScrubbedSectors;	// MP4: sectors the scrubber checked
+    int numChunkWrites;		// MP4: compressed file chunks written
+    int numChunkSectors;	// MP4: sectors they were stored in
+    int numSharedSectors;	// MP4: sectors cloned files were given
+    int numUnsharedSectors;	//  in common, and copied when written
+    int mountTicks;		// MP4: time it took to open the disk and
+    long long mountNanos;	// mount the file system, simulated and
+				// on the host; 0 if it never was
+    int diskQueueRequests[NumDiskPolicies];	// MP4: requests served, and
+    int diskQueueTicks[NumDiskPolicies];	// total ticks from queueing to
+						// completion, per disk policy
+    LatencyHistogram syscallTicks[NumSyscallCodes];	// MP4: time from
+    LatencyHistogram syscallNanos[NumSyscallCodes];	// trap to return of
+			// each system call, simulated and on the host
+    LatencyHistogram diskSeekTracks;	// MP4: tracks the head moved, per
+					// disk request
+    int diskSeekTicks;		// MP4: disk time spent seeking,
+    int diskRotationTicks;	// waiting for the sector to come
+    int diskTransferTicks;	// around, and transferring, in total
+    int numTrackBufferHits;	// MP4: reads served by the track buffer
+    int numFlashErases;		// MP4: blocks an SSD erased, and the
+    int diskEraseTicks;		// ticks requests spent waiting for that
+    DiskFileProfile diskFiles[NumProfiledFiles];	// MP4: disk traffic
+    int numProfiledFiles;	// per file, in the first this many entries
 
     Statistics(); 		// initialize everything to zero
 
+    void RecordSyscall(int code, int ticks, long long nanos);
+				// MP4: a system call took this long
+    void RecordDiskFile(int owner, int numSectors, bool writing, int ticks);
+				// MP4: charge a disk request to a file
     void Print();		// print collected statistics
 };
 
+// MP4: The following class defines a trace buffer: a ring of the
+// last few thousand kernel events, each stamped with totalTicks.
+// Recording one is a few stores, so it can stay on while the kernel
+// runs; the events are only formatted when the buffer is dumped, as
+// a JSON file in the Trace Event Format that chrome://tracing and
+// Perfetto load (with one tick shown as one microsecond).
+
+enum TraceKind {
+    TraceSwitch,		// a = thread switched from, b = to
+    TraceIntSchedule,		// a = IntType, b = when it is due
+    TraceIntDispatch,		// a = IntType, b = when it was due
+    TraceDisk,			// a = sector, b = ticks since queued
+    TracePageFault,		// a = virtual page, b = thread
+    TraceSyscall,		// a = system call code, b = thread
+    NumTraceKinds
+};
+
+struct TraceEvent {
+    int when;			// totalTicks when it was recorded
+    int kind;			// a TraceKind
+    int a, b;			// what happened, see TraceKind
+};
+
+#define TraceSize 8192		// events kept, a power of 2
+
+class TraceBuffer {
+  public:
+    TraceBuffer(Statistics *clock, char *traceFile);
+    				// record until asked to dump to traceFile
+    ~TraceBuffer();		// dump, if that has not been done
+
+    void Record(TraceKind kind, int a, int b) {
+	TraceEvent *e = &events[numRecorded++ & (TraceSize - 1)];
+	e->when = clock->totalTicks;
+	e->kind = kind;
+	e->a = a;
+	e->b = b;
+    }
+    void Dump();		// write out the events still in the ring
+
+  private:
+    Statistics *clock;		// where the time comes from
+    char *fileName;		// where Dump writes to
+    TraceEvent *events;		// the ring
+    unsigned int numRecorded;	// events recorded so far; the latest
+				// TraceSize of them are in the ring
+    bool dumped;
+};
+
 // Constants used to reflect the relative time an operation would
 // take in a real system.  A "tick" is a just a unit of time -- if you 
 // like, a microsecond.
@@ -53,6 +195,10 @@ const int UserTick = 	   1;	// advance for each user-level instruction
 const int SystemTick =	  10; 	// advance each time interrupts are enabled
 const int RotationTime = 500; 	// time disk takes to rotate one sector
 const int SeekTime =	 500;  	// time disk takes to seek past one track
+const int FlashReadTime = 50;	// MP4: time an SSD takes to read a page,
+const int FlashProgramTime = 200;	// to program (write) one,
+const int FlashEraseTime = 2000;	// to erase a block of them,
+const int FlashTransferTime = 10;	// and to move one over its bus
 const int ConsoleTime =	 100;	// time to read or write one character
 const int NetworkTime =	 100;  	// time to send or receive one packet
 const int TimerTicks = 	 100;  	// (average) time between timer interrupts
@@ -33,16 +33,39 @@
 //      "doRandom" -- if true, arrange for the interrupts to occur
 //		at random, instead of fixed, intervals.
 //      "toCall" is the interrupt handler to call when the timer expires.
+//	"period" -- MP4: the ticks between interrupts, or their average
+//		if "doRandom"
 //----------------------------------------------------------------------
 
-Timer::Timer(bool doRandom, CallBackObj *toCall)
+Timer::Timer(bool doRandom, CallBackObj *toCall, int period)
 {
+    ASSERT(period > 0);
     randomize = doRandom;
     callPeriodically = toCall;
     disable = FALSE;
+    this->period = period;	// MP4
+    stopped = pending = FALSE;
     SetInterrupt();
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Timer::Start
+//      Start generating interrupts again after Stop.  If the one
+//	scheduled before Stop has not fired yet, it simply goes on
+//	from there.
+//----------------------------------------------------------------------
+
+void Timer::Start()
+{
+    stopped = FALSE;
+    if (!pending)
+    {
+        SetInterrupt();
+    }
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Timer::CallBack
 //      Routine called when interrupt is generated by the hardware
@@ -51,6 +74,8 @@ Timer::Timer(bool doRandom, CallBackObj *toCall)
 //----------------------------------------------------------------------
 void Timer::CallBack()
 {
+    pending = FALSE; // MP4
+
     // invoke the Nachos interrupt handler for this device
     callPeriodically->CallBack();
 
@@ -63,19 +88,21 @@ void Timer::CallBack()
 //      Cause a timer interrupt to occur in the future, unless
 //	future interrupts have been disabled.  The delay is either
 //	fixed or random.
+//	MP4: nor while the timer is stopped.
 //----------------------------------------------------------------------
 
 void Timer::SetInterrupt()
 {
-    if (!disable)
+    if (!disable && !stopped)
     {
-        int delay = TimerTicks;
+        int delay = period;
 
         if (randomize)
         {
-            delay = 1 + (RandomNumber() % (TimerTicks * 2));
+            delay = 1 + (RandomNumber() % (period * 2));
         }
         // schedule the next timer device interrupt
         kernel->interrupt->Schedule(this, delay, TimerInt);
+        pending = TRUE; // MP4
     }
 }
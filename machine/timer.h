@@ -23,24 +23,37 @@
 #include "copyright.h"
 #include "utility.h"
 #include "callback.h"
+#include "stats.h"
 
 // The following class defines a hardware timer. 
 class Timer : public CallBackObj {
   public:
-    Timer(bool doRandom, CallBackObj *toCall);
+    Timer(bool doRandom, CallBackObj *toCall, int period = TimerTicks);
 				// Initialize the timer, and callback to "toCall"
 				// every time slice.
+				// MP4: of "period" ticks (on average)
     virtual ~Timer() {}
     
     void Disable() { disable = TRUE; }
     				// Turn timer device off, so it doesn't
 				// generate any more interrupts.
 
+    // MP4 start
+    void Stop() { stopped = TRUE; }
+    				// Generate no more interrupts until
+				// Start, so an idle machine can skip
+				// ahead to the next real event
+    void Start();		// Resume generating them
+    // MP4 end
+
   private:
     bool randomize;		// set if we need to use a random timeout delay
     CallBackObj *callPeriodically; // call this every TimerTicks time units 
     bool disable;		// turn off the timer device after next
     				// interrupt.
+    int period;			// MP4: ticks between interrupts
+    bool stopped;		// MP4: don't schedule the next one
+    bool pending;		// MP4: one is scheduled
     
     void CallBack();		// called internally when the hardware
 				// timer generates an interrupt
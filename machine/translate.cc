@@ -86,17 +86,10 @@ ShortToMachine(unsigned short shortword) { return ShortToHost(shortword); }
 bool Machine::ReadMem(int addr, int size, int *value)
 {
 	int data;
-	ExceptionType exception;
 	int physicalAddress;
 
-	DEBUG(dbgAddr, "Reading VA " << addr << ", size " << size);
-
-	exception = Translate(addr, &physicalAddress, size, FALSE);
-	if (exception != NoException)
-	{
-		RaiseException(exception, addr);
-		return FALSE;
-	}
+	if (!ReadAddress(addr, size, &physicalAddress))
+		return FALSE; // MP4: exception occurred
 	switch (size)
 	{
 	case 1:
@@ -122,6 +115,55 @@ bool Machine::ReadMem(int addr, int size, int *value)
 	return (TRUE);
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Machine::ReadAddress
+// 	Translate "addr" for a read of "size" bytes, as ReadMem does,
+//	into "physAddr", without reading memory.  Returns FALSE, having
+//	raised the exception, if the translation failed.
+//----------------------------------------------------------------------
+
+bool Machine::ReadAddress(int addr, int size, int *physAddr)
+{
+	ExceptionType exception;
+
+	// fast path -- an aligned reference to the last page translated
+	if ((int)((unsigned)addr / PageSize) == cachedPage && (addr & (size - 1)) == 0)
+	{
+		cachedEntry->use = TRUE;
+		if (tlb != NULL)
+			kernel->stats->numTLBHits++;
+		*physAddr = cachedFrame + (unsigned)addr % PageSize;
+		return TRUE;
+	}
+	DEBUG(dbgAddr, "Reading VA " << addr << ", size " << size);
+
+	exception = Translate(addr, physAddr, size, FALSE);
+	if (exception != NoException)
+	{
+		RaiseException(exception, addr);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+//----------------------------------------------------------------------
+// Machine::MemoryChanged
+// 	Note that the kernel has written "length" bytes of main memory
+//	from "physAddr" directly, so that the decode cache does not run
+//	what those pages used to hold.
+//----------------------------------------------------------------------
+
+void Machine::MemoryChanged(int physAddr, int length)
+{
+	if (length <= 0)
+		return;
+	for (int frame = physAddr / PageSize;
+		 frame <= (physAddr + length - 1) / PageSize; frame++)
+		pageVersion[frame]++;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Machine::WriteMem
 //      Write "size" (1, 2, or 4) bytes of the contents of "value" into
@@ -140,13 +182,26 @@ bool Machine::WriteMem(int addr, int size, int value)
 	ExceptionType exception;
 	int physicalAddress;
 
-	DEBUG(dbgAddr, "Writing VA " << addr << ", size " << size << ", value " << value);
-
-	exception = Translate(addr, &physicalAddress, size, TRUE);
-	if (exception != NoException)
+	// MP4: fast path, as in ReadMem; read-only pages take the slow path
+	if ((int)((unsigned)addr / PageSize) == cachedPage && (addr & (size - 1)) == 0 &&
+		!cachedEntry->readOnly)
 	{
-		RaiseException(exception, addr);
-		return FALSE;
+		cachedEntry->use = TRUE;
+		cachedEntry->dirty = TRUE;
+		if (tlb != NULL)
+			kernel->stats->numTLBHits++;
+		physicalAddress = cachedFrame + (unsigned)addr % PageSize;
+	}
+	else
+	{
+		DEBUG(dbgAddr, "Writing VA " << addr << ", size " << size << ", value " << value);
+
+		exception = Translate(addr, &physicalAddress, size, TRUE);
+		if (exception != NoException)
+		{
+			RaiseException(exception, addr);
+			return FALSE;
+		}
 	}
 	switch (size)
 	{
@@ -165,6 +220,7 @@ bool Machine::WriteMem(int addr, int size, int value)
 	default:
 		ASSERT(FALSE);
 	}
+	pageVersion[physicalAddress / PageSize]++; // MP4: for the decode cache
 
 	return TRUE;
 }
@@ -225,19 +281,25 @@ Machine::Translate(int virtAddr, int *physAddr, int size, bool writing)
 	}
 	else
 	{
-		for (entry = NULL, i = 0; i < TLBSize; i++)
-			if (tlb[i].valid && (tlb[i].virtualPage == ((int)vpn)))
+		// MP4: only the set vpn maps to is searched, and only entries
+		// of the running address space match
+		TranslationEntry *set = &tlb[(vpn % TLBSets) * TLBWays];
+		for (entry = NULL, i = 0; i < TLBWays; i++)
+			if (set[i].valid && (set[i].virtualPage == ((int)vpn)) &&
+				set[i].asid == asid)
 			{
-				entry = &tlb[i]; // FOUND!
+				entry = &set[i]; // FOUND!
 				break;
 			}
 		if (entry == NULL)
 		{ // not found
+			kernel->stats->numTLBMisses++;
 			DEBUG(dbgAddr, "Invalid TLB entry for this virtual page!");
 			return PageFaultException; // really, this is a TLB fault,
 									   // the page may be in memory,
 									   // but not in the TLB
 		}
+		kernel->stats->numTLBHits++;
 	}
 
 	if (entry->readOnly && writing)
@@ -260,5 +322,14 @@ Machine::Translate(int virtAddr, int *physAddr, int size, bool writing)
 	*physAddr = pageFrame * PageSize + offset;
 	ASSERT((*physAddr >= 0) && ((*physAddr + size) <= MemorySize));
 	DEBUG(dbgAddr, "phys addr = " << *physAddr);
+
+	// MP4: remember this page for the ReadMem/WriteMem fast path, unless
+	// every translation is to be traced
+	if (!debug->IsEnabled(dbgAddr))
+	{
+		cachedPage = vpn;
+		cachedEntry = entry;
+		cachedFrame = pageFrame * PageSize;
+	}
 	return NoException;
 }
@@ -40,6 +40,8 @@ class TranslationEntry {
 			// page is referenced or modified.
     bool dirty;         // This bit is set by the hardware every time the
 			// page is modified.
+    int asid;		// MP4: In a TLB entry, the address space the
+			// translation belongs to.
 };
 
 #endif
@@ -44,12 +44,15 @@ Mail::Mail(PacketHeader pktH, MailHeader mailH, char *msgData)
 //	can receive incoming messages.
 //
 //	Just initialize a list of messages, representing the mailbox.
+//	MP4: a bounded queue, so no Mail is allocated as messages arrive.
 //----------------------------------------------------------------------
 
 
 MailBox::MailBox()
 { 
-    messages = new SynchList<Mail *>(); 
+    messages = new SynchQueue<Mail>(MailBoxSlots); 
+    assembly = new char[MaxMailSize];	// MP4
+    assembled = 0;
 }
 
 //----------------------------------------------------------------------
@@ -63,6 +66,7 @@ MailBox::MailBox()
 MailBox::~MailBox()
 { 
     delete messages; 
+    delete [] assembly;			// MP4
 }
 
 //----------------------------------------------------------------------
@@ -88,6 +92,9 @@ PrintHeader(PacketHeader pktHdr, MailHeader mailHdr)
 //
 //	We need to reconstruct the Mail message (by concatenating the headers
 //	to the data), to simplify queueing the message on the SynchList.
+//	MP4: if the mailbox is full, the message is dropped and counted,
+//	as the network would drop a packet: the postal worker must not
+//	wait on one mailbox's reader while mail for others piles up.
 //
 //	"pktHdr" -- source, destination machine ID's
 //	"mailHdr" -- source, destination mailbox ID's
@@ -97,11 +104,14 @@ PrintHeader(PacketHeader pktHdr, MailHeader mailHdr)
 void 
 MailBox::Put(PacketHeader pktHdr, MailHeader mailHdr, char *data)
 { 
-    Mail *mail = new Mail(pktHdr, mailHdr, data); 
+    Mail mail(pktHdr, mailHdr, data); 
 
-    messages->Append(mail);		// put on the end of the list of 
-					// arrived messages, and wake up 
+    if (!messages->TryAppend(mail)) {	// put on the end of the list of
+					// arrived messages, and wake up
 					// any waiters
+	DEBUG(dbgNet, "Mailbox full, message dropped");
+	kernel->stats->numPacketsDropped++;	// MP4
+    }
 }
 
 //----------------------------------------------------------------------
@@ -120,22 +130,70 @@ void
 MailBox::Get(PacketHeader *pktHdr, MailHeader *mailHdr, char *data) 
 { 
     DEBUG(dbgNet, "Waiting for mail in mailbox");
-    Mail *mail = messages->RemoveFront();	// remove message from list;
+    Mail mail = messages->RemoveFront();	// remove message from list;
 						// will wait if list is empty
 
-    *pktHdr = mail->pktHdr;
-    *mailHdr = mail->mailHdr;
+    *pktHdr = mail.pktHdr;
+    *mailHdr = mail.mailHdr;
     if (debug->IsEnabled('n')) {
 	cout << "Got mail from mailbox: ";
 	PrintHeader(*pktHdr, *mailHdr);
     }
-    bcopy(mail->data, data, mail->mailHdr.length);
+    bcopy(mail.data, data, mail.mailHdr.length);
 					// copy the message data into
 					// the caller's buffer
-    delete mail;			// we've copied out the stuff we
-					// need, we can now discard the message
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// MailBox::Assemble
+// 	Add one arriving fragment to the message being put together in
+//	this mailbox.  Only the postal worker calls this, so the assembly
+//	buffer needs no lock.
+//
+//	The network may drop packets, but never reorders those from one
+//	machine, and a post office sends each message's fragments back to
+//	back, so a fragment that does not carry on where the last one left
+//	off (a gap, or another sender) means the partial message lost a
+//	fragment; it is thrown away, as a dropped packet would be.
+//
+//	A message that fits in one packet is returned in place, uncopied.
+//
+//	"pktHdr" -- source, destination machine ID's
+//	"mailHdr" -- source, destination mailbox ID's, message length, and
+//		where this fragment goes
+//	"data" -- the fragment data
+//----------------------------------------------------------------------
+
+char *
+MailBox::Assemble(PacketHeader pktHdr, MailHeader mailHdr, char *data)
+{
+    unsigned size = pktHdr.length - sizeof(MailHeader);
+
+    if (mailHdr.offset == 0) {
+	assembled = 0;			// start, or give up on, a message
+	if (size == mailHdr.length)
+	    return data;		// all in one packet
+	assemblyPkt = pktHdr;
+	assemblyMail = mailHdr;
+    } else if (mailHdr.offset != assembled
+		|| pktHdr.from != assemblyPkt.from
+		|| mailHdr.from != assemblyMail.from
+		|| mailHdr.length != assemblyMail.length) {
+	DEBUG(dbgNet, "Dropping fragment at " << mailHdr.offset);
+	assembled = 0;
+	return NULL;
+    }
+
+    bcopy(data, assembly + assembled, size);
+    assembled += size;
+    if (assembled < mailHdr.length)
+	return NULL;
+    assembled = 0;
+    return assembly;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // PostOfficeInput::PostOfficeInput
 // 	Initialize the post office input queues as a collection of mailboxes.
@@ -156,10 +214,13 @@ PostOfficeInput::PostOfficeInput(int nBoxes)
 
     numBoxes = nBoxes;
     boxes = new MailBox[nBoxes];
+    transports = new MailTransport *[nBoxes];	// MP4
+    for (int i = 0; i < nBoxes; i++)
+	transports[i] = NULL;
 
     network = new NetworkInput(this);
 
-    Thread *t = new Thread("postal worker", 1);
+    Thread *t = new Thread("postal worker", -1);	// MP4: not a process
 
     t->Fork(PostOfficeInput::PostalDelivery, this);
 }
@@ -177,6 +238,7 @@ PostOfficeInput::~PostOfficeInput()
 {
     delete network;
     delete [] boxes;
+    delete [] transports;		// MP4
 }
 
 //----------------------------------------------------------------------
@@ -206,15 +268,56 @@ PostOfficeInput::PostalDelivery(void* data)
 	    PrintHeader(pktHdr, mailHdr);
         }
 
-	// check that arriving message is legal!
-	ASSERT(0 <= mailHdr.to && mailHdr.to < _this->numBoxes);
-	ASSERT(mailHdr.length <= MaxMailSize);
+	// check that arriving message is legal!  MP4: it comes from
+	// another machine, so one that isn't is dropped, not ASSERTed
+	if (!(0 <= mailHdr.to && mailHdr.to < _this->numBoxes)
+		|| mailHdr.length > MaxMailSize
+		|| pktHdr.length < sizeof(MailHeader)
+		|| mailHdr.offset + pktHdr.length - sizeof(MailHeader)
+						> mailHdr.length) {
+	    DEBUG(dbgNet, "Malformed mail, dropped");
+	    kernel->stats->numPacketsDropped++;
+	    continue;
+	}
+
+	// MP4: wait for the rest of the message
+	char *message = _this->boxes[mailHdr.to].Assemble(pktHdr, mailHdr,
+					buffer + sizeof(MailHeader));
+	if (message == NULL)
+	    continue;
+
+	// MP4: a transport keeps ACKs and duplicates out of the mailbox;
+	// it must not ACK a segment the mailbox has no room for, so that
+	// is dropped first, unseen, and will be sent again
+	MailTransport *transport = _this->transports[mailHdr.to];
+	if (transport != NULL && _this->boxes[mailHdr.to].IsFull()) {
+	    DEBUG(dbgNet, "Mailbox full, segment dropped");
+	    kernel->stats->numPacketsDropped++;
+	    continue;
+	}
+	if (transport != NULL && !transport->Arrived(pktHdr, mailHdr, message))
+	    continue;
 
 	// put into mailbox
-        _this->boxes[mailHdr.to].Put(pktHdr, mailHdr, buffer + sizeof(MailHeader));
+        _this->boxes[mailHdr.to].Put(pktHdr, mailHdr, message);
     }
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// PostOfficeInput::Attach
+// 	Route mail arriving at "box" through "transport" (or, if NULL,
+//	straight into the mailbox again).
+//----------------------------------------------------------------------
+
+void
+PostOfficeInput::Attach(int box, MailTransport *transport)
+{
+    ASSERT((box >= 0) && (box < numBoxes));
+    transports[box] = transport;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // PostOfficeInput::Receive
 // 	Retrieve a message from a specific box if one is available, 
@@ -287,6 +390,9 @@ PostOfficeOutput::~PostOfficeOutput()
 // PostOfficeOutput::Send
 // 	Concatenate the MailHeader to the front of the data, and pass 
 //	the result to the Network for delivery to the destination machine.
+//	MP4: a message too big for one packet goes out as a run of
+//	fragments, each with the MailHeader saying where it belongs, one
+//	right after the other, for the receiver to put back together.
 //
 //	Note that the MailHeader + data looks just like normal payload
 //	data to the Network.
@@ -301,6 +407,7 @@ PostOfficeOutput::Send(PacketHeader pktHdr, MailHeader mailHdr, char* data)
 {
     char* buffer = new char[MaxPacketSize];	// space to hold concatenated
 						// mailHdr + data
+    unsigned size;
 
     if (debug->IsEnabled('n')) {
 	cout << "Post send: ";
@@ -311,17 +418,24 @@ PostOfficeOutput::Send(PacketHeader pktHdr, MailHeader mailHdr, char* data)
     
     // fill in pktHdr, for the Network layer
     pktHdr.from = kernel->hostName;
-    pktHdr.length = mailHdr.length + sizeof(MailHeader);
-
-    // concatenate MailHeader and data
-    bcopy((char *)&mailHdr, buffer, sizeof(MailHeader));
-    bcopy(data, buffer + sizeof(MailHeader), mailHdr.length);
 
     sendLock->Acquire();   		// only one message can be sent
-					// to the network at any one time
-    network->Send(pktHdr, buffer);
-    messageSent->P();			// wait for interrupt to tell us
-					// ok to send the next message
+					// to the network at any one time;
+					// MP4: all of its fragments
+    mailHdr.offset = 0;
+    do {
+	size = min(mailHdr.length - mailHdr.offset, (unsigned) MaxFragmentSize);
+	pktHdr.length = size + sizeof(MailHeader);
+
+	// concatenate MailHeader and data
+	bcopy((char *)&mailHdr, buffer, sizeof(MailHeader));
+	bcopy(data + mailHdr.offset, buffer + sizeof(MailHeader), size);
+
+	network->Send(pktHdr, buffer);
+	messageSent->P();		// wait for interrupt to tell us
+					// ok to send the next packet
+	mailHdr.offset += size;
+    } while (mailHdr.offset < mailHdr.length);
     sendLock->Release();
 
     delete [] buffer;			// we've sent the message, so
@@ -342,3 +456,304 @@ PostOfficeOutput::CallBack()
     messageSent->V();
 }
 
+
+// MP4 start
+//----------------------------------------------------------------------
+// MailTransport::MailTransport
+// 	Initialize a reliable transport between mailbox "box" here and
+//	mailbox "farBox" on machine "farHost", attach it to the post
+//	office, and start the thread that resends timed-out segments.
+//
+//	"window" -- how many segments may be unacknowledged at once
+//----------------------------------------------------------------------
+
+MailTransport::MailTransport(int myBox, NetworkAddress toHost,
+				MailBoxAddress toBox, int size)
+{
+    ASSERT(size > 0);
+    box = myBox;
+    farHost = toHost;
+    farBox = toBox;
+    window = size;
+
+    segments = new char[window * MaxFragmentSize];
+    segmentLength = new int[window];
+    base = nextSeq = expected = 0;
+
+    lock = new Lock("transport");
+    windowOpen = new Condition("transport window");
+    sendLock = new Lock("transport send");
+
+    retransmitAt = 0;
+    timerPending = FALSE;
+    timeout = new Semaphore("transport timeout", 0);
+
+    kernel->postOfficeIn->Attach(box, this);
+
+    Thread *t = new Thread("retransmitter", -1);    // not a process
+
+    t->Fork(MailTransport::Retransmitter, this);
+}
+
+//----------------------------------------------------------------------
+// MailTransport::Send
+// 	Cut a message into segments and send them, as long as there is
+//	room in the window; the caller only waits while "window" segments
+//	are already unacknowledged, so a long message is pipelined rather
+//	than sent one packet per round trip.
+//
+//	Returns once every segment has been handed to the network; use
+//	Flush to wait for them to be acknowledged.
+//
+//	"data" -- message data
+//	"size" -- bytes of message data (possibly 0)
+//----------------------------------------------------------------------
+
+void
+MailTransport::Send(char *data, int size)
+{
+    char segment[MaxFragmentSize];
+    TransportHeader *hdr = (TransportHeader *)segment;
+    int n, length;
+
+    ASSERT(size >= 0);
+    sendLock->Acquire();
+    do {
+	n = min(size, (int) MaxSegmentSize);
+	hdr->isAck = FALSE;
+	hdr->last = (n == size);
+	hdr->length = n;
+	bcopy(data, segment + sizeof(TransportHeader), n);
+	length = sizeof(TransportHeader) + n;
+
+	lock->Acquire();
+	while (nextSeq - base >= window)
+	    windowOpen->Wait(lock);
+	hdr->seq = nextSeq++;
+	bcopy(segment, &segments[(hdr->seq % window) * MaxFragmentSize], length);
+	segmentLength[hdr->seq % window] = length;
+	if (hdr->seq == base)
+	    StartTimer();	// the window was empty
+	lock->Release();
+
+	Transmit(segment, length);
+	data += n;
+	size -= n;
+    } while (size > 0);
+    sendLock->Release();
+}
+
+//----------------------------------------------------------------------
+// MailTransport::Receive
+// 	Wait for the segments of the next message to arrive, in order,
+//	and copy them into "data".
+//
+//	Returns the size of the message; if it is bigger than "size",
+//	only the first "size" bytes are kept.
+//----------------------------------------------------------------------
+
+int
+MailTransport::Receive(char *data, int size)
+{
+    PacketHeader pktHdr;
+    MailHeader mailHdr;
+    char buffer[MaxMailSize];
+    TransportHeader *hdr = (TransportHeader *)buffer;
+    int done = 0;
+
+    do {
+	kernel->postOfficeIn->Receive(box, &pktHdr, &mailHdr, buffer);
+	if (done < size)
+	    bcopy(buffer + sizeof(TransportHeader), data + done,
+			min((int) hdr->length, size - done));
+	done += hdr->length;
+    } while (!hdr->last);
+    return done;
+}
+
+//----------------------------------------------------------------------
+// MailTransport::Flush
+// 	Wait until every segment sent has been acknowledged.
+//----------------------------------------------------------------------
+
+void
+MailTransport::Flush()
+{
+    lock->Acquire();
+    while (base != nextSeq)
+	windowOpen->Wait(lock);
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// MailTransport::Arrived
+// 	Process a segment arriving at our mailbox; runs in the postal
+//	worker.  An ACK slides the window forward and wakes up senders.
+//	A data segment is accepted only if it is the next one in order
+//	(go-back-N keeps nothing out of order), and either way is answered
+//	with a cumulative ACK, so that a lost ACK is made up for by the
+//	next one.
+//
+//	Mail from anyone but the peer, or too short to hold a segment, is
+//	not part of the connection: it is dropped, and not answered.
+//
+//	Returns TRUE if the segment should be put in the mailbox.
+//----------------------------------------------------------------------
+
+bool
+MailTransport::Arrived(PacketHeader pktHdr, MailHeader mailHdr, char *data)
+{
+    TransportHeader *hdr = (TransportHeader *)data;
+    bool accept = FALSE;
+    int ack;
+
+    if (pktHdr.from != farHost || mailHdr.from != farBox
+	    || mailHdr.length < sizeof(TransportHeader)
+	    || hdr->length != mailHdr.length - sizeof(TransportHeader)) {
+	DEBUG(dbgNet, "Mail from (" << pktHdr.from << ", " << mailHdr.from
+		<< ") is not for this transport, dropped");
+	kernel->stats->numPacketsDropped++;
+	return FALSE;
+    }
+    lock->Acquire();
+    if (hdr->isAck) {
+	if (hdr->seq >= base) {		// else an old, duplicate ACK
+	    base = hdr->seq + 1;
+	    if (base == nextSeq)
+		retransmitAt = 0;	// nothing left to time out
+	    else
+		StartTimer();
+	    windowOpen->Broadcast(lock);
+	}
+	lock->Release();
+	return FALSE;
+    }
+    if (hdr->seq == expected) {
+	expected++;
+	accept = TRUE;
+    }
+    ack = expected - 1;
+    lock->Release();
+
+    SendAck(ack);
+    return accept;
+}
+
+//----------------------------------------------------------------------
+// MailTransport::Transmit
+// 	Send one segment (TransportHeader plus data) to the peer mailbox.
+//----------------------------------------------------------------------
+
+void
+MailTransport::Transmit(char *segment, int length)
+{
+    PacketHeader pktHdr;
+    MailHeader mailHdr;
+
+    pktHdr.to = farHost;
+    mailHdr.to = farBox;
+    mailHdr.from = box;
+    mailHdr.length = length;
+    kernel->postOfficeOut->Send(pktHdr, mailHdr, segment);
+}
+
+//----------------------------------------------------------------------
+// MailTransport::SendAck
+// 	Tell the peer we have every data segment up to and including "seq".
+//----------------------------------------------------------------------
+
+void
+MailTransport::SendAck(int seq)
+{
+    TransportHeader hdr;
+
+    hdr.seq = seq;
+    hdr.isAck = TRUE;
+    hdr.last = FALSE;
+    hdr.length = 0;
+    Transmit((char *)&hdr, sizeof(TransportHeader));
+}
+
+//----------------------------------------------------------------------
+// MailTransport::StartTimer
+// 	Give the oldest outstanding segment RetransmitTime ticks to be
+//	acknowledged.  Interrupts can't be cancelled, so if one is already
+//	pending, it just finds the new deadline and waits some more.
+//----------------------------------------------------------------------
+
+void
+MailTransport::StartTimer()
+{
+    IntStatus oldLevel = kernel->interrupt->SetLevel(IntOff);
+
+    retransmitAt = kernel->stats->totalTicks + RetransmitTime;
+    if (!timerPending) {
+	timerPending = TRUE;
+	kernel->interrupt->Schedule(this, RetransmitTime, NetworkSendInt);
+    }
+    (void) kernel->interrupt->SetLevel(oldLevel);
+}
+
+//----------------------------------------------------------------------
+// MailTransport::CallBack
+// 	Timer interrupt.  If the oldest segment is still unacknowledged
+//	at its deadline, wake up the retransmitter; sending the window
+//	again needs locks, so it can't be done by the interrupt handler.
+//----------------------------------------------------------------------
+
+void
+MailTransport::CallBack()
+{
+    int now = kernel->stats->totalTicks;
+
+    timerPending = FALSE;
+    if (retransmitAt == 0)
+	return;				// everything was acknowledged
+    if (now < retransmitAt) {		// the timer was restarted
+	timerPending = TRUE;
+	kernel->interrupt->Schedule(this, retransmitAt - now, NetworkSendInt);
+	return;
+    }
+    retransmitAt = 0;
+    timeout->V();
+}
+
+//----------------------------------------------------------------------
+// MailTransport::Retransmitter
+// 	Each time the timer expires, send every unacknowledged segment
+//	again, and restart the timer.  Runs in its own thread.
+//----------------------------------------------------------------------
+
+void
+MailTransport::Retransmitter(void *data)
+{
+    MailTransport *_this = (MailTransport *)data;
+    char *resend = new char[_this->window * MaxFragmentSize];
+    int *length = new int[_this->window];
+    int count, seq, slot;
+
+    for (;;) {
+	_this->timeout->P();
+
+	// copy the window, so ACKs may slide it while we send
+	_this->lock->Acquire();
+	count = _this->nextSeq - _this->base;
+	for (int i = 0; i < count; i++) {
+	    seq = _this->base + i;
+	    slot = seq % _this->window;
+	    length[i] = _this->segmentLength[slot];
+	    bcopy(&_this->segments[slot * MaxFragmentSize],
+			&resend[i * MaxFragmentSize], length[i]);
+	}
+	if (count > 0)
+	    _this->StartTimer();
+	_this->lock->Release();
+
+	DEBUG(dbgNet, "Retransmitting " << count << " segments");
+	for (int i = 0; i < count; i++) {
+	    _this->Transmit(&resend[i * MaxFragmentSize], length[i]);
+	    kernel->stats->numPacketsRetransmitted++;
+	}
+    }
+}
+// MP4 end
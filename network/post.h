@@ -48,12 +48,29 @@ class MailHeader {
     MailBoxAddress from;	// Mail box to reply to
     unsigned length;		// Bytes of message data (excluding the 
 				// mail header)
+    unsigned offset;		// MP4: where the data in this packet goes
+				// in the message; filled in by Send
 };
 
+// MP4 start
+// A message bigger than one packet is sent as several fragments, each
+// with its own copy of the MailHeader, and put back together by the
+// receiving post office before it reaches the mailbox.
+
+// Most message data that fits in a single packet,
+// excluding the MailHeader and the PacketHeader
+#define MaxFragmentSize	(MaxPacketSize - sizeof(MailHeader))
+
+#define MaxMailFragments 32	// packets a message may be cut into
+
+#define MailBoxSlots 8		// messages a mailbox holds before the
+				// postal worker waits for them to be read
+// MP4 end
+
 // Maximum "payload" -- real data -- that can included in a single message
 // Excluding the MailHeader and the PacketHeader
 
-#define MaxMailSize 	(MaxPacketSize - sizeof(MailHeader))
+#define MaxMailSize 	(MaxMailFragments * MaxFragmentSize)	// MP4
 
 
 // The following class defines the format of an incoming/outgoing 
@@ -67,6 +84,7 @@ class Mail {
      Mail(PacketHeader pktH, MailHeader mailH, char *msgData);
 				// Initialize a mail message by
 				// concatenating the headers to the data
+     Mail() {}			// MP4: an empty slot in a mailbox
 
      PacketHeader pktHdr;	// Header appended by Network
      MailHeader mailHdr;	// Header appended by PostOffice
@@ -85,14 +103,33 @@ class MailBox {
 
     void Put(PacketHeader pktHdr, MailHeader mailHdr, char *data);
    				// Atomically put a message into the mailbox
+				// MP4: dropped if it is full
+    bool IsFull() { return messages->IsFull(); }
+				// MP4: would Put drop a message?
     void Get(PacketHeader *pktHdr, MailHeader *mailHdr, char *data); 
    				// Atomically get a message out of the 
 				// mailbox (and wait if there is no message 
 				// to get!)
+    char *Assemble(PacketHeader pktHdr, MailHeader mailHdr, char *data);
+				// MP4: add a fragment to the message being
+				// put together; return the whole message
+				// once its last fragment is in, else NULL
+
   private:
-    SynchList<Mail *> *messages; // A mailbox is just a list of arrived messages
+    SynchQueue<Mail> *messages;	// A mailbox is just a list of arrived messages
+				// MP4: kept in place, MailBoxSlots of them
+
+    // MP4 start
+    char *assembly;		// Message being put together, allocated
+				// up front so delivery never waits for memory
+    unsigned assembled;		// Bytes of it received so far
+    PacketHeader assemblyPkt;	// Who it is from
+    MailHeader assemblyMail;
+    // MP4 end
 };
 
+class MailTransport;		// MP4
+
 // The following two classes defines a "Post Office", or a collection of 
 // mailboxes.  The Post Office provides two main operations: 
 //	Send -- send a message to a mailbox on a remote machine 
@@ -120,11 +157,17 @@ class PostOfficeInput : public CallBackObj {
 				// and can be pulled off of network 
 				// (i.e., time to call PostalDelivery)
 
+    void Attach(int box, MailTransport *transport);
+				// MP4: hand mail arriving at "box" to
+				// "transport" before it is delivered
+
   private:
     NetworkInput *network;	// Physical network connection
     MailBox *boxes;		// Table of mail boxes to hold incoming mail
     int numBoxes;		// Number of mail boxes
     Semaphore *messageAvailable;// V'ed when message has arrived from network
+    MailTransport **transports;	// MP4: transport attached to each box,
+				// or NULL
 };
 
 class PostOfficeOutput : public CallBackObj {
@@ -148,4 +191,91 @@ class PostOfficeOutput : public CallBackObj {
     Semaphore *messageSent;	// V'ed when next message can be sent to network
     Lock *sendLock;		// Only one outgoing message at a time
 };
+
+// MP4 start
+// The following classes define a reliable transport on top of the
+// post office.  A message of any size is cut into segments, each
+// carrying a TransportHeader after the MailHeader.  Up to "window"
+// segments can be outstanding at once; the receiver acknowledges the
+// last segment it has received in order (a cumulative ACK), and drops
+// anything out of order.  If the oldest outstanding segment is not
+// acknowledged within RetransmitTime, every outstanding segment is
+// sent again (go-back-N).
+//
+// A transport owns mailbox "box" on this machine and talks to mailbox
+// "farBox" on machine "farHost", which should have a transport of its
+// own pointed back at "box".  Data and ACKs in both directions share
+// the two boxes.
+
+class TransportHeader {
+  public:
+    int seq;			// Sequence number of the data segment,
+				// or the last one received, for an ACK
+    bool isAck;			// Acknowledgement rather than data
+    bool last;			// Last segment of a message
+    unsigned length;		// Bytes of segment data
+};
+
+// Maximum data that fits in one segment, which is kept to one packet
+#define MaxSegmentSize	(MaxFragmentSize - sizeof(TransportHeader))
+
+#define DefaultWindow	4	// segments in flight, unless asked otherwise
+#define RetransmitTime	5000	// ticks to wait for an ACK before resending
+
+class MailTransport : public CallBackObj {
+  public:
+    MailTransport(int box, NetworkAddress farHost, MailBoxAddress farBox,
+		int window = DefaultWindow);
+				// Attach a transport to mailbox "box".
+				// A transport lives until Nachos halts,
+				// since its retransmit thread and timer
+				// refer to it (just like the postal worker)
+
+    void Send(char *data, int size);
+				// Send a message of "size" bytes, waiting
+				// only while the window is full
+    int Receive(char *data, int size);
+				// Wait for the next message, and return
+				// its size; anything past "size" is lost
+    void Flush();		// Wait until everything sent is acknowledged
+
+    bool Arrived(PacketHeader pktHdr, MailHeader mailHdr, char *data);
+				// Called by the postal worker for mail
+				// arriving at "box".  Returns TRUE if it
+				// is the next data segment in order from
+				// the peer, and so belongs in the mailbox
+
+    void CallBack();		// Retransmit timer interrupt
+
+  private:
+    int box;			// Our mailbox
+    NetworkAddress farHost;	// Peer machine
+    MailBoxAddress farBox;	// Peer mailbox
+    int window;			// Segments allowed in flight
+
+    char *segments;		// Unacknowledged segments, "window" slots
+				// of MaxFragmentSize bytes, indexed by seq
+    int *segmentLength;		// Bytes used in each slot
+    int base;			// Oldest unacknowledged segment
+    int nextSeq;		// Next segment to send
+    int expected;		// Next segment we will accept
+
+    Lock *lock;			// Protects the window state
+    Condition *windowOpen;	// Signalled when ACKs free up slots
+    Lock *sendLock;		// Only one message sent at a time, so
+				// segments of messages don't interleave
+
+    int retransmitAt;		// When the oldest segment times out, or
+				// 0 if nothing is outstanding
+    bool timerPending;		// Is a timer interrupt scheduled?
+    Semaphore *timeout;		// V'ed when the timer expires
+
+    void Transmit(char *segment, int length);
+				// Hand one segment to the post office
+    void SendAck(int seq);	// Acknowledge segments up to "seq"
+    void StartTimer();		// (Re)arm the timer for the oldest segment
+    static void Retransmitter(void *data);
+				// Resend the window whenever it times out
+};
+// MP4 end
 #endif
@@ -0,0 +1,79 @@
+#include "syscall.h"
+
+// File system workload for timing with the statistics Nachos prints
+// at Halt (per system call latency, and the disk profile); see also
+// "nachos -fsbench", which times the same things from the kernel.
+// Run it on a freshly formatted disk.
+
+#define NumFiles 32
+#define Chunk 1024
+
+char buffer[Chunk];
+
+// fill in the decimal digits of n, from p; return the end of them
+char *digits(char *p, int n)
+{
+	if (n >= 10)
+		p = digits(p, n / 10);
+	*p++ = '0' + n % 10;
+	return p;
+}
+
+// write, then read back, a file of "size" bytes, a chunk at a time
+void readwrite(char *name, int size)
+{
+	OpenFileId fid;
+	int i;
+
+	if (Create(name, size) != 1)
+		MSG("Failed on creating file");
+	fid = Open(name);
+	if (fid < 0)
+		MSG("Failed on opening file");
+	for (i = 0; i < size; i += Chunk)
+		if (Write(buffer, Chunk, fid) != Chunk)
+			MSG("Failed on writing file");
+	Close(fid);
+	fid = Open(name);
+	if (fid < 0)
+		MSG("Failed on opening file");
+	for (i = 0; i < size; i += Chunk)
+		if (Read(buffer, Chunk, fid) != Chunk)
+			MSG("Failed on reading file");
+	Close(fid);
+}
+
+int main(void)
+{
+	char name[8];
+	OpenFileId fid;
+	int i;
+
+	for (i = 0; i < Chunk; i++)
+		buffer[i] = 'x';
+
+	// create rate
+	for (i = 0; i < NumFiles; i++) {
+		name[0] = '/';
+		name[1] = 'f';
+		*digits(&name[2], i) = '\0';
+		if (Create(name, 0) != 1)
+			MSG("Failed on creating file");
+	}
+
+	// sequential throughput: a direct, single and double indirect
+	// file, with the default disk geometry
+	readwrite("/small", 2 * Chunk);
+	readwrite("/medium", 64 * Chunk);
+	readwrite("/large", 1024 * Chunk);
+
+	// lookups of the last entry of a full directory (user programs
+	// cannot make directories; -fsbench also times deep paths)
+	for (i = 0; i < NumFiles; i++) {
+		fid = Open(name);
+		if (fid < 0)
+			MSG("Failed on opening file");
+		Close(fid);
+	}
+	Halt();
+}
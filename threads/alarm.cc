@@ -18,11 +18,12 @@
 //
 //      "doRandom" -- if true, arrange for the hardware interrupts to 
 //		occur at random, instead of fixed, intervals.
+//	"period" -- MP4: the ticks between them, see Scheduler::TimerPeriod
 //----------------------------------------------------------------------
 
-Alarm::Alarm(bool doRandom)
+Alarm::Alarm(bool doRandom, int period)
 {
-    timer = new Timer(doRandom, this);
+    timer = new Timer(doRandom, this, period);
 }
 
 //----------------------------------------------------------------------
@@ -41,6 +42,10 @@ Alarm::Alarm(bool doRandom)
 //
 //	For now, just provide time-slicing.  Only need to time slice 
 //      if we're currently running something (in other words, not idle).
+//	MP4: and only if the scheduler says so -- under MLFQ the thread
+//	keeps the CPU until its quantum is used up.
+//	MP4: with no thread ready, there is nothing to time-slice
+//	against: stop the timer until Scheduler::ReadyToRun starts it.
 //----------------------------------------------------------------------
 
 void 
@@ -49,7 +54,50 @@ Alarm::CallBack()
     Interrupt *interrupt = kernel->interrupt;
     MachineStatus status = interrupt->getStatus();
     
-    if (status != IdleMode) {
+    kernel->stats->numTimerInterrupts++;	// MP4
+    if (!kernel->scheduler->AnyReady()) {
+	timer->Stop();			// MP4: tickless
+	return;
+    }
+    if (status != IdleMode && kernel->scheduler->ShouldPreempt()) {
 	interrupt->YieldOnReturn();
     }
 }
+
+//----------------------------------------------------------------------
+// Alarm::WaitUntil
+//	MP4: Put the current thread to sleep until "x" ticks from now.
+//	Rather than have each timer interrupt look for sleepers to wake
+//	(the timer stops whenever no thread is ready), a one-shot
+//	interrupt of its own is scheduled for the moment; while nothing
+//	else is runnable, the machine idles straight up to it.
+//
+//	"x" -- how many ticks to sleep; nothing happens if it is not
+//		positive
+//----------------------------------------------------------------------
+
+void
+Alarm::WaitUntil(int x)
+{
+    AlarmWakeup wakeup(kernel->currentThread);
+    IntStatus oldLevel;
+
+    if (x <= 0)
+	return;
+    oldLevel = kernel->interrupt->SetLevel(IntOff);
+    kernel->interrupt->Schedule(&wakeup, x, TimerInt);
+    kernel->currentThread->Sleep(FALSE);
+    (void) kernel->interrupt->SetLevel(oldLevel);
+}
+
+//----------------------------------------------------------------------
+// AlarmWakeup::CallBack
+//	MP4: The time a thread asked to sleep for is up; it can run again.
+//	Called with interrupts disabled.
+//----------------------------------------------------------------------
+
+void
+AlarmWakeup::CallBack()
+{
+    kernel->scheduler->ReadyToRun(thread);
+}
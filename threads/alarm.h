@@ -22,17 +22,38 @@
 #include "callback.h"
 #include "timer.h"
 
+class Thread;
+
+// MP4: wakes up a thread sleeping in Alarm::WaitUntil, when the
+// interrupt it scheduled comes due.
+class AlarmWakeup : public CallBackObj {
+  public:
+    AlarmWakeup(Thread *sleeper) { thread = sleeper; }
+    void CallBack();		// put the thread back on the ready list
+
+  private:
+    Thread *thread;
+};
+
 // The following class defines a software alarm clock. 
 class Alarm : public CallBackObj {
   public:
-    Alarm(bool doRandomYield);	// Initialize the timer, and callback 
+    Alarm(bool doRandomYield, int period = TimerTicks);
+				// Initialize the timer, and callback 
 				// to "toCall" every time slice.
+				// MP4: of "period" ticks
     ~Alarm() { delete timer; }
     
     void WaitUntil(int x);	// suspend execution until time > now + x
-                                // this method is not yet implemented
+				// MP4: implemented with an interrupt
+				// of its own, so the timer can stop
 	
 	void Disable() { timer->Disable(); } //2015.11.25
+	// MP4: tickless idle -- the scheduler stops the timer while no
+	// thread is waiting for the CPU, since there is no one to
+	// switch to
+	void Start() { timer->Start(); }
+	void Stop() { timer->Stop(); }
 
   private:
     Timer *timer;		// the hardware timer device
@@ -18,6 +18,37 @@
 #include "post.h"
 #include "synchconsole.h"
 
+// MP4 start
+// The start of a checkpoint file (see Kernel::Checkpoint).  It is
+// followed by the Statistics and then, for each process, its id, base
+// priority, name, user registers and address space.  The disk image
+// goes to a file of its own, named by CheckpointDiskName.
+#define CheckpointMagic 0x4e434b50	// "NCKP"
+
+struct CheckpointHeader {
+    int magic;
+    int statsSize;		// sizeof(Statistics), as a sanity check
+    int numProcesses;		// how many processes were saved
+    int nextId;			// the id the next one would have got
+};
+
+//----------------------------------------------------------------------
+// CheckpointDiskName
+// 	Return the name of the file the disk image of checkpoint "file"
+//	is saved in.
+//----------------------------------------------------------------------
+
+static char *
+CheckpointDiskName(char *file)
+{
+    char *name = new char[strlen(file) + 6];
+
+    strcpy(name, file);
+    strcat(name, ".disk");
+    return name;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Kernel::Kernel
 // 	Interpret command line arguments in order to determine flags 
@@ -28,17 +59,40 @@ Kernel::Kernel(int argc, char **argv)
 {
     randomSlice = FALSE; 
     debugUserProg = FALSE;
+    blockEngine = FALSE;
     consoleIn = NULL;          // default is stdin
     consoleOut = NULL;         // default is stdout
 #ifndef FILESYS_STUB
     formatFlag = FALSE;
+    checksums = FALSE;          // MP4: no checksums unless -crc
+    compressFiles = FALSE;      // MP4: plain files unless -compress
 #endif
     reliability = 1;            // network reliability, default is 1.0
     hostName = 0;               // machine id, also UNIX socket name
                                 // 0 is the default machine id
+    diskPolicy = DiskCLOOK;     // MP4: elevator order by default
+    mapDisk = FALSE;            // MP4: read and write the disk file
+    deviceKind = DeviceHDD;     // MP4: a rotational disk
+    restoreFile = NULL;         // MP4: use DISK_x as it is
+    replacementPolicy = ReplaceFIFO;    // MP4: oldest page out first
+    schedulerPolicy = SchedFIFO;        // MP4: plain round robin
+    numCPUs = 1;                // MP4: a uniprocessor
+    quantum = 0;                // MP4: the policy's own quantum
+    checkpointFile = NULL;      // MP4: no checkpoint unless -checkpoint
+    checkpointTicks = 0;
+    resumeFd = -1;              // MP4: boot from scratch unless -resume
+    resumeProcesses = resumeNextId = 0;
+    char *resumeFile = NULL;
+    traceFile = NULL;           // MP4: no trace unless -tr
+    diskTraceFile = NULL;       // MP4: no disk trace unless -dtrace
 								
 	// MP4 mod tag
 	execfileNum = 0; // dummy operation to keep valgrind happy
+	for (int i = 0; i < MaxProcesses; i++) {
+		t[i] = NULL;		// MP4: no processes running,
+		exited[i] = NULL;	// and no one to Join yet
+		joiners[i] = 0;
+	}
 								
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-rs") == 0) {
@@ -49,8 +103,16 @@ Kernel::Kernel(int argc, char **argv)
 	    	i++;
         } else if (strcmp(argv[i], "-s") == 0) {
             debugUserProg = TRUE;
+		} else if (strcmp(argv[i], "-bb") == 0) {
+			blockEngine = TRUE;		// MP4
 		} else if (strcmp(argv[i], "-e") == 0) {
         	execfile[++execfileNum]= argv[++i];
+			execPriority[execfileNum] = DefaultPriority;	// MP4
+			cout << execfile[execfileNum] << "\n";
+		} else if (strcmp(argv[i], "-ep") == 0) {
+			ASSERT(i + 2 < argc);	// MP4: a file and its priority
+        	execfile[++execfileNum]= argv[++i];
+			execPriority[execfileNum] = atoi(argv[++i]);
 			cout << execfile[execfileNum] << "\n";
 		} else if (strcmp(argv[i], "-ci") == 0) {
 	    	ASSERT(i + 1 < argc);
@@ -63,6 +125,10 @@ Kernel::Kernel(int argc, char **argv)
 #ifndef FILESYS_STUB
 		} else if (strcmp(argv[i], "-f") == 0) {
 	    	formatFlag = TRUE;
+		} else if (strcmp(argv[i], "-crc") == 0) {	// MP4
+	    	checksums = TRUE;
+		} else if (strcmp(argv[i], "-compress") == 0) {	// MP4
+	    	compressFiles = TRUE;
 #endif
         } else if (strcmp(argv[i], "-n") == 0) {
             ASSERT(i + 1 < argc);   // next argument is float
@@ -72,16 +138,120 @@ Kernel::Kernel(int argc, char **argv)
             ASSERT(i + 1 < argc);   // next argument is int
             hostName = atoi(argv[i + 1]);
             i++;
+		// MP4 start
+		} else if (strcmp(argv[i], "-ds") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is a policy name
+	    	if (strcmp(argv[i + 1], "fifo") == 0) {
+				diskPolicy = DiskFIFO;
+	    	} else if (strcmp(argv[i + 1], "sstf") == 0) {
+				diskPolicy = DiskSSTF;
+	    	} else {
+				ASSERT(strcmp(argv[i + 1], "clook") == 0);
+				diskPolicy = DiskCLOOK;
+	    	}
+	    	i++;
+		} else if (strcmp(argv[i], "-dtrace") == 0) {
+	    	ASSERT(i + 1 < argc);   // MP4: next argument is a UNIX file
+	    	diskTraceFile = argv[i + 1];
+	    	i++;
+		} else if (strcmp(argv[i], "-dm") == 0) {
+			mapDisk = TRUE;
+		} else if (strcmp(argv[i], "-dev") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is a device name
+	    	if (strcmp(argv[i + 1], "ssd") == 0) {
+				deviceKind = DeviceSSD;
+	    	} else {
+				ASSERT(strcmp(argv[i + 1], "hdd") == 0);
+				deviceKind = DeviceHDD;
+	    	}
+	    	i++;
+		} else if (strcmp(argv[i], "-restore") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is the snapshot
+	    	restoreFile = argv[i + 1];
+	    	i++;
+		} else if (strcmp(argv[i], "-rp") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is a policy name
+	    	if (strcmp(argv[i + 1], "lru") == 0) {
+				replacementPolicy = ReplaceLRU;
+	    	} else if (strcmp(argv[i + 1], "clock") == 0) {
+				replacementPolicy = ReplaceClock;
+	    	} else if (strcmp(argv[i + 1], "ws") == 0) {
+				replacementPolicy = ReplaceWorkingSet;
+	    	} else {
+				ASSERT(strcmp(argv[i + 1], "fifo") == 0);
+				replacementPolicy = ReplaceFIFO;
+	    	}
+	    	i++;
+		} else if (strcmp(argv[i], "-sp") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is a policy name
+	    	if (strcmp(argv[i + 1], "mlfq") == 0) {
+				schedulerPolicy = SchedMLFQ;
+	    	} else if (strcmp(argv[i + 1], "prio") == 0) {
+				schedulerPolicy = SchedPriority;
+	    	} else {
+				ASSERT(strcmp(argv[i + 1], "fifo") == 0);
+				schedulerPolicy = SchedFIFO;
+	    	}
+	    	i++;
+		} else if (strcmp(argv[i], "-ncpu") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is the CPU count
+	    	numCPUs = atoi(argv[i + 1]);
+	    	ASSERT(numCPUs >= 1 && numCPUs <= MaxCPUs);
+	    	i++;
+		} else if (strcmp(argv[i], "-quantum") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is in ticks
+	    	quantum = atoi(argv[i + 1]);
+	    	ASSERT(quantum > 0);
+	    	i++;
+		} else if (strcmp(argv[i], "-checkpoint") == 0) {
+	    	ASSERT(i + 2 < argc);   // a file, and the time to take it
+	    	checkpointFile = argv[i + 1];
+	    	checkpointTicks = atoi(argv[i + 2]);
+	    	i += 2;
+		} else if (strcmp(argv[i], "-resume") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is the checkpoint
+	    	resumeFile = argv[i + 1];
+	    	i++;
+		} else if (strcmp(argv[i], "-tr") == 0) {
+	    	ASSERT(i + 1 < argc);   // next argument is the trace file
+	    	traceFile = argv[i + 1];
+	    	i++;
+		// MP4 end
         } else if (strcmp(argv[i], "-u") == 0) {
             cout << "Partial usage: nachos [-rs randomSeed]\n";
-	   		cout << "Partial usage: nachos [-s]\n";
+	   		cout << "Partial usage: nachos [-s] [-bb]\n";
             cout << "Partial usage: nachos [-ci consoleIn] [-co consoleOut]\n";
 #ifndef FILESYS_STUB
 	    	cout << "Partial usage: nachos [-nf]\n";
 #endif
             cout << "Partial usage: nachos [-n #] [-m #]\n";
+            cout << "Partial usage: nachos [-ds fifo|sstf|clook] [-dm] [-dev hdd|ssd] [-dtrace traceFile]\n";
+            cout << "Partial usage: nachos [-restore snapshotFile]\n";
+            cout << "Partial usage: nachos [-rp fifo|lru|clock|ws]\n";
+            cout << "Partial usage: nachos [-sp fifo|mlfq|prio]\n";
+            cout << "Partial usage: nachos [-ncpu numCPUs]\n";
+            cout << "Partial usage: nachos [-quantum ticks]\n";
+            cout << "Partial usage: nachos [-checkpoint file ticks] [-resume file]\n";
+            cout << "Partial usage: nachos [-ep file priority]\n";
+            cout << "Partial usage: nachos [-tr traceFile]\n";
 		}
     }
+
+    // MP4: resuming, the disk starts from the checkpoint's image; the
+    // rest is read back as the kernel comes up (Initialize, ExecAll)
+    if (resumeFile != NULL) {
+		CheckpointHeader header;
+
+		resumeFd = OpenForReadWrite(resumeFile, TRUE);
+		Read(resumeFd, (char *)&header, sizeof(header));
+		ASSERT(header.magic == CheckpointMagic);
+		ASSERT(header.statsSize == sizeof(Statistics));
+		resumeProcesses = header.numProcesses;
+		resumeNextId = header.nextId;
+#ifndef FILESYS_STUB
+		restoreFile = CheckpointDiskName(resumeFile);
+#endif
+    }
 }
 
 //----------------------------------------------------------------------
@@ -103,18 +273,25 @@ Kernel::Initialize()
     currentThread->setStatus(RUNNING);
 
     stats = new Statistics();		// collect statistics
+    if (resumeFd != -1)			// MP4: go on from the checkpoint,
+		Read(resumeFd, (char *)stats, sizeof(Statistics));	// clock too
+    trace = (traceFile != NULL) ?	// MP4: and, with -tr, events
+		new TraceBuffer(stats, traceFile) : NULL;
     interrupt = new Interrupt;		// start up interrupt handling
-    scheduler = new Scheduler();	// initialize the ready queue
-    alarm = new Alarm(randomSlice);	// start up time slicing
-    machine = new Machine(debugUserProg);
-    synchConsoleIn = new SynchConsoleInput(consoleIn); // input from stdin
-    synchConsoleOut = new SynchConsoleOutput(consoleOut); // output to stdout
-    synchDisk = new SynchDisk();    //
-#ifdef FILESYS_STUB
-    fileSystem = new FileSystem();
-#else
-    fileSystem = new FileSystem(formatFlag);
-#endif // FILESYS_STUB
+    scheduler = new Scheduler(schedulerPolicy, numCPUs, quantum);	// initialize the ready queue
+    stats->numCPUs = numCPUs;		// MP4
+    alarm = new Alarm(randomSlice, scheduler->TimerPeriod());	// start up time slicing
+    machine = new Machine(debugUserProg, blockEngine);
+    frameTable = new FrameTable(replacementPolicy);	// MP4: all frames free
+    synchConsoleIn = NULL;		// MP4: the console, disk and file
+    synchConsoleOut = NULL;		// system are set up when first used
+    synchDisk = NULL;
+    fileSystem = NULL;
+    mountLock = new Lock("mount");
+#ifndef FILESYS_STUB
+    if (formatFlag)
+	MountFileSystem();		// -f is a use of its own
+#endif
 
 	// MP4 mod tag
     /*
@@ -131,12 +308,19 @@ Kernel::Initialize()
 // 	Since Nachos does not disable Timer, Console after all threads complete,
 //	which will result in generating infinite interrupts. We manually disable timer,
 //	console, etc. after all threads complete.
+//	MP4: called whenever no thread is ready.  The timer is stopped
+//	rather than disabled, so time slicing resumes once one is.
 //----------------------------------------------------------------------
 void
 Kernel::PrepareToEnd()
 {
-	alarm->Disable();
-	synchConsoleIn->Disable();
+	alarm->Stop();
+	if (synchConsoleIn != NULL)
+		synchConsoleIn->Disable();
+	if (synchDisk != NULL)
+		synchDisk->FlushIdle();	// MP4: write back the buffer cache
+	if (trace != NULL)
+		trace->Dump();			// MP4: write out the event trace
 }
 
 //----------------------------------------------------------------------
@@ -146,6 +330,12 @@ Kernel::PrepareToEnd()
 
 Kernel::~Kernel()
 {
+    // MP4: the file system flushes the buffer cache through synchDisk,
+    // so tear it down while the rest of the kernel is still around
+    delete frameTable;		// closes the swap file before that
+    delete fileSystem;
+    delete synchDisk;
+    delete trace;		// MP4: dumps it, if PrepareToEnd didn't
     delete stats;
     delete interrupt;
     delete scheduler;
@@ -153,8 +343,7 @@ Kernel::~Kernel()
     delete machine;
     delete synchConsoleIn;
     delete synchConsoleOut;
-    delete synchDisk;
-    delete fileSystem;
+    delete mountLock;
 	
 	// Mp4 mod tag
 	/*
@@ -174,6 +363,7 @@ void
 Kernel::ThreadSelfTest() {
    Semaphore *semaphore;
    SynchList<int> *synchList;
+   SynchQueue<int> *synchQueue;		// MP4
    
    LibSelfTest();		// test library routines
    
@@ -190,6 +380,11 @@ Kernel::ThreadSelfTest() {
    synchList->SelfTest(9);
    delete synchList;
 
+   				// MP4: and a bounded queue, with timings
+   synchQueue = new SynchQueue<int>(4);
+   synchQueue->SelfTest(9);
+   delete synchQueue;
+
 }
 
 //----------------------------------------------------------------------
@@ -201,6 +396,10 @@ void
 Kernel::ConsoleTest() {
     char ch;
 
+    if (synchConsoleIn == NULL) {	// MP4: the first use of the console
+	synchConsoleIn = new SynchConsoleInput(consoleIn); // input from stdin
+	(void) ConsoleOut();		// output to stdout
+    }
     cout << "Testing the console device.\n" 
         << "Typed characters will be echoed, until ^D is typed.\n"
         << "Note newlines are needed to flush input through UNIX.\n";
@@ -277,6 +476,7 @@ Kernel::NetworkTest() {
 void ForkExecute(Thread *t)
 {
 	if ( !t->space->Load(t->getName()) ) {
+		kernel->ExitProcess(-1);	// MP4: for anyone joining it
     	return;             // executable not found
     }
 	
@@ -284,10 +484,57 @@ void ForkExecute(Thread *t)
 
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// ForkReturn
+// 	The first thing the child of a Fork does: pick up the user
+//	registers the parent had at the syscall, with 0 as the result.
+//----------------------------------------------------------------------
+
+void ForkReturn(Thread *t)
+{
+	t->LoadUserState();		// saves the parent's, still loaded
+	kernel->machine->WriteRegister(2, 0);
+	kernel->machine->Run();		// back into the user program
+	ASSERTNOTREACHED();
+}
+
+//----------------------------------------------------------------------
+// ResumeProcess
+// 	The first thing a process resumed from a checkpoint does: carry
+//	on with the instruction it would have run next.
+//----------------------------------------------------------------------
+
+void ResumeProcess(Thread *t)
+{
+	t->LoadUserState();
+	kernel->machine->Run();
+	ASSERTNOTREACHED();
+}
+
+//----------------------------------------------------------------------
+// Checkpointer
+// 	The thread -checkpoint starts, to take the checkpoint.
+//----------------------------------------------------------------------
+
+static void Checkpointer(void *unused)
+{
+	kernel->Checkpoint();
+}
+// MP4 end
+
 void Kernel::ExecAll()
 {
+	if (resumeFd != -1)
+		ResumeAll();		// MP4: the checkpointed ones first
 	for (int i=1;i<=execfileNum;i++) {
 		int a = Exec(execfile[i]);
+		t[a]->setPriority(execPriority[i]);	// MP4
+	}
+	if (checkpointFile != NULL) {	// MP4
+		Thread *checkpointer = new Thread("checkpointer", -1);
+
+		checkpointer->Fork((VoidFunctionPtr) &Checkpointer, NULL);
 	}
 	currentThread->Finish();
     //Kernel::Exec();	
@@ -296,12 +543,16 @@ void Kernel::ExecAll()
 
 int Kernel::Exec(char* name)
 {
-	t[threadNum] = new Thread(name, threadNum);
-	t[threadNum]->space = new AddrSpace();
-	t[threadNum]->Fork((VoidFunctionPtr) &ForkExecute, (void *)t[threadNum]);
-	threadNum++;
+	int id = AllocateId();	// MP4
+
+	if (id == -1)
+		return -1;		// MP4: no room to keep track of it
+	exited[id] = new Semaphore("exit", 0);
+	t[id] = new Thread(name, id);
+	t[id]->space = new AddrSpace();
+	t[id]->Fork((VoidFunctionPtr) &ForkExecute, (void *)t[id]);
 
-	return threadNum-1;
+	return id;
 /*
     cout << "Total threads number is " << execfileNum << endl;
     for (int n=1;n<=execfileNum;n++) {
@@ -329,10 +580,334 @@ int Kernel::Exec(char* name)
 //  cout << "after ThreadedKernel:Run();" << endl;  // unreachable
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Kernel::AllocateId
+// 	Find an id for a new process, and return it; -1 if every one is
+//	taken.  Ids are handed out round robin from threadNum, so one
+//	that has just been freed is not reused at once.  An id is free
+//	once its process has exited and been Joined; if none is, the id
+//	of a process that exited with no one in Join for it is taken
+//	back, and Joining it later returns -1.  Id 0 is the main
+//	thread's.
+//----------------------------------------------------------------------
+
+int Kernel::AllocateId()
+{
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < MaxProcesses - 1; i++) {
+			int id = 1 + (threadNum - 1 + i) % (MaxProcesses - 1);
+
+			if (t[id] != NULL || joiners[id] > 0)
+				continue;	// still running, or being Joined
+			if (exited[id] != NULL && pass == 0)
+				continue;	// someone may still Join it
+			delete exited[id];
+			exited[id] = NULL;
+			threadNum = id + 1;
+			return id;
+		}
+	}
+	return -1;
+}
+
+//----------------------------------------------------------------------
+// Kernel::Fork
+// 	Start a copy of the current user program in a new thread.  Its
+//	address space shares our frames copy-on-write, and its registers
+//	are ours as they are now, so the syscall's pc must already have
+//	been advanced.  Return the copy's id, or -1.
+//----------------------------------------------------------------------
+
+int Kernel::Fork()
+{
+	AddrSpace *space;
+	int id = AllocateId();
+
+	if (id == -1)
+		return -1;
+	space = currentThread->space->Fork();
+	if (space == NULL)
+		return -1;		// the id stays free
+	exited[id] = new Semaphore("exit", 0);
+	t[id] = new Thread(currentThread->getName(), id);
+	t[id]->space = space;
+	t[id]->SaveUserState();	// from the machine's registers
+	t[id]->setPriority(currentThread->basePriority);
+	t[id]->Fork((VoidFunctionPtr) &ForkReturn, (void *)t[id]);
+
+	return id;
+}
+
+//----------------------------------------------------------------------
+// Kernel::Join
+// 	Wait until process "id" has exited, and return its exit status;
+//	-1 if there is no such process, or it is ourselves.  Once every
+//	thread waiting here has its status, the id is free again (see
+//	AllocateId).
+//----------------------------------------------------------------------
+
+int Kernel::Join(int id)
+{
+	int status;
+
+	if (id <= 0 || id >= MaxProcesses || exited[id] == NULL
+			|| id == currentThread->getID())
+		return -1;
+	joiners[id]++;
+	exited[id]->P();
+	exited[id]->V();		// for anyone else joining it
+	status = exitStatus[id];
+	if (--joiners[id] == 0) {
+		delete exited[id];	// the last of them: free the id
+		exited[id] = NULL;
+	}
+	return status;
+}
+
+//----------------------------------------------------------------------
+// Kernel::ExitProcess
+// 	Record the exit status of the current process and wake up anyone
+//	waiting in Join for it.  The thread still has to Finish.
+//
+//	MP4: its mapped files are written back and its files closed here,
+//	since the AddrSpace destructor runs where nothing may block.  What
+//	it used is reported here too, so a process killed by an exception
+//	is reported like one that called Exit.
+//----------------------------------------------------------------------
+
+void Kernel::ExitProcess(int status)
+{
+	int id = currentThread->getID();
+
+	if (currentThread->space != NULL)
+		currentThread->space->CloseAll();	// while we can block
+	currentThread->PrintUsage();
+	if (id < MaxProcesses && exited[id] != NULL) {
+		exitStatus[id] = status;
+		exited[id]->V();
+		t[id] = NULL;		// no longer running
+	}
+}
+
+//----------------------------------------------------------------------
+// Kernel::Checkpoint
+// 	Once the clock reaches checkpointTicks, and at a moment when
+//	every process can be saved (see CanCheckpoint), write the state of
+//	the kernel to checkpointFile, for a later "-resume" to start from:
+//	the Statistics, the disk, and each process's registers and pages.
+//	Until then, keep giving up the CPU.  The run then goes on.
+//
+//	Kernel threads are not saved; the resumed kernel starts its own.
+//	Threads blocked inside the kernel can't be saved either, so if
+//	processes keep doing I/O, this can take a while.
+//----------------------------------------------------------------------
+
+void Kernel::Checkpoint()
+{
+	IntStatus oldLevel;
+
+	for (;;) {
+		bool anyProcess = FALSE;
+
+		oldLevel = interrupt->SetLevel(IntOff);
+		if (stats->totalTicks >= checkpointTicks && CanCheckpoint())
+			break;
+		for (int i = 0; i < MaxProcesses; i++)
+			anyProcess = anyProcess || (t[i] != NULL);
+		(void) interrupt->SetLevel(oldLevel);
+		if (!anyProcess) {
+			cout << "Checkpoint: no processes left at tick "
+				<< stats->totalTicks << ", none taken\n";
+			return;
+		}
+		currentThread->Yield();
+	}
+	WriteCheckpoint();		// with interrupts off, so all at once
+	(void) interrupt->SetLevel(oldLevel);
+}
+
+//----------------------------------------------------------------------
+// Kernel::CanCheckpoint
+// 	Return TRUE if a checkpoint taken now could be resumed from: the
+//	disk is idle, no console or network output is under way, and every
+//	process was switched out by the timer in the middle of its user
+//	program, with nothing that only the swap file holds.  Called with
+//	interrupts disabled.
+//----------------------------------------------------------------------
+
+bool Kernel::CanCheckpoint()
+{
+	if ((synchDisk != NULL && !synchDisk->IsIdle())
+			|| interrupt->IsPending(DiskInt)
+			|| interrupt->IsPending(ConsoleWriteInt)
+			|| interrupt->IsPending(NetworkSendInt))
+		return FALSE;
+	for (int i = 0; i < MaxProcesses; i++) {
+		if (t[i] == NULL)
+			continue;
+		if (t[i]->getStatus() != READY || !t[i]->userPreempted
+				|| !t[i]->space->CanCheckpoint())
+			return FALSE;
+	}
+	return TRUE;
+}
+
+//----------------------------------------------------------------------
+// Kernel::WriteCheckpoint
+// 	Save the disk image (flushing the buffer cache into it first),
+//	then the Statistics and every process, to the checkpoint files.
+//	Called with interrupts disabled, once CanCheckpoint.
+//----------------------------------------------------------------------
+
+void Kernel::WriteCheckpoint()
+{
+	CheckpointHeader header;
+	int fd;
+
+#ifndef FILESYS_STUB
+	char *diskImage = CheckpointDiskName(checkpointFile);
+
+	if (synchDisk == NULL || !synchDisk->SnapshotIdle(diskImage))
+		cout << "Checkpoint: couldn't save the disk to " << diskImage << "\n";
+	delete [] diskImage;
+#endif
+	header.magic = CheckpointMagic;
+	header.statsSize = sizeof(Statistics);
+	header.numProcesses = 0;
+	for (int i = 0; i < MaxProcesses; i++) {
+		if (t[i] != NULL)
+			header.numProcesses++;
+	}
+	header.nextId = threadNum;
+
+	fd = OpenForWrite(checkpointFile);
+	WriteFile(fd, (char *)&header, sizeof(header));
+	WriteFile(fd, (char *)stats, sizeof(Statistics));
+	for (int i = 0; i < MaxProcesses; i++) {
+		int info[3];		// id, base priority, name length
+		int registers[NumTotalRegs];
+
+		if (t[i] == NULL)
+			continue;
+		info[0] = i;
+		info[1] = t[i]->basePriority;
+		info[2] = strlen(t[i]->getName());
+		t[i]->GetUserRegisters(registers);
+		WriteFile(fd, (char *)info, sizeof(info));
+		WriteFile(fd, t[i]->getName(), info[2]);
+		WriteFile(fd, (char *)registers, sizeof(registers));
+		t[i]->space->Checkpoint(fd);
+	}
+	Close(fd);
+	cout << "Checkpoint: " << header.numProcesses << " processes saved to "
+		<< checkpointFile << " at tick " << stats->totalTicks << "\n";
+}
+
+//----------------------------------------------------------------------
+// Kernel::ResumeAll
+// 	Start again each process saved in the -resume checkpoint, under
+//	its old id, from where it was switched out.
+//----------------------------------------------------------------------
+
+void Kernel::ResumeAll()
+{
+	for (int n = 0; n < resumeProcesses; n++) {
+		int info[3];		// as WriteCheckpoint put them
+		int registers[NumTotalRegs];
+		char *name;
+		Thread *thread;
+
+		Read(resumeFd, (char *)info, sizeof(info));
+		ASSERT(info[0] > 0 && info[0] < MaxProcesses && t[info[0]] == NULL);
+		name = new char[info[2] + 1];	// kept as the thread's name
+		Read(resumeFd, name, info[2]);
+		name[info[2]] = '\0';
+		Read(resumeFd, (char *)registers, sizeof(registers));
+
+		thread = new Thread(name, info[0]);
+		thread->space = new AddrSpace();
+		if (!thread->space->Resume(resumeFd)) {
+			cerr << "Resume: can't load " << name << "\n";
+			Abort();
+		}
+		thread->SetUserRegisters(registers);
+		thread->setPriority(info[1]);
+		exited[info[0]] = new Semaphore("exit", 0);
+		t[info[0]] = thread;
+		thread->Fork((VoidFunctionPtr) &ResumeProcess, (void *)thread);
+	}
+	threadNum = max(threadNum, resumeNextId);
+	Close(resumeFd);
+	resumeFd = -1;
+}
+// MP4 end
+
 #ifdef FILESYS_STUB
 int Kernel::CreateFile(char *filename)
 {
-	return fileSystem->Create(filename);
+	return FileSys()->Create(filename);
 }
 #endif
 
+// MP4 start
+//----------------------------------------------------------------------
+// Kernel::ConsoleOut
+// 	Return the synchronized console display, opening it (on stdout,
+//	or the -co file) the first time it is wanted.
+//----------------------------------------------------------------------
+
+SynchConsoleOutput *
+Kernel::ConsoleOut()
+{
+	if (synchConsoleOut == NULL)
+		synchConsoleOut = new SynchConsoleOutput(consoleOut);
+	return synchConsoleOut;
+}
+// MP4 end
+
+//----------------------------------------------------------------------
+// Kernel::MountFileSystem
+// 	MP4: Open the disk and mount the file system on it (formatting
+//	it with -f), and start the disk's background threads.  Nothing
+//	does this at startup, so runs that never touch a file, such as
+//	thread tests, don't pay for reading the disk image in, replaying
+//	its journal or loading its bitmaps; FileSys() and Disk() call
+//	this the first time they are used.  If several threads get there
+//	at once, the first mounts and the others wait for it.
+//
+//	The simulated and host time the mount took go in the statistics.
+//----------------------------------------------------------------------
+
+void
+Kernel::MountFileSystem()
+{
+	int ticks;
+	long long nanos;
+
+	mountLock->Acquire();
+	if (fileSystem != NULL) {	// someone else got there first
+		mountLock->Release();
+		return;
+	}
+	ticks = stats->totalTicks;
+	nanos = HostNanoseconds();
+	synchDisk = new SynchDisk(diskPolicy, mapDisk, restoreFile, deviceKind);	// queued in diskPolicy order
+	if (diskTraceFile != NULL)
+		synchDisk->RecordTrace(diskTraceFile);	// the mount too
+#ifdef FILESYS_STUB
+	fileSystem = new FileSystem();
+#else
+	FileSystem *mounted = new FileSystem(formatFlag, checksums);
+
+	mounted->CompressNewFiles(compressFiles);
+	fileSystem = mounted;		// only now may others use it
+#endif // FILESYS_STUB
+	synchDisk->StartFlusher();	// write-back in the background
+	synchDisk->StartScrubber();	// with checksums, check idle sectors
+	stats->mountTicks = stats->totalTicks - ticks;
+	stats->mountNanos = HostNanoseconds() - nanos;
+	DEBUG(dbgFile, "File system mounted in " << stats->mountTicks << " ticks");
+	mountLock->Release();
+}
+
@@ -24,6 +24,12 @@ class PostOfficeOutput;
 class SynchConsoleInput;
 class SynchConsoleOutput;
 class SynchDisk;
+class Semaphore;
+class Lock;
+
+#define MaxProcesses 64		// MP4: threads Exec and Fork can have
+					// running, or exited and not yet
+					// Joined, at once
 
 
 
@@ -42,6 +48,15 @@ class Kernel {
 	
 	void ExecAll();
 	int Exec(char* name);
+	// MP4 start
+	int Fork();			// copy the current process, sharing its
+					// memory copy-on-write; the copy's id
+	int Join(int id);		// wait for process "id" to exit;
+					// its exit status, or -1
+	void ExitProcess(int status);	// the current process is exiting
+	void Checkpoint();		// save the processes to checkpointFile,
+					// once it is time and they are quiet
+	// MP4 end
     void ThreadSelfTest();	// self test of threads and synchronization
 	
     void ConsoleTest();         // interactive console self test
@@ -52,6 +67,20 @@ class Kernel {
 	int CreateFile(char* filename); // fileSystem call
 	#endif
 
+	// MP4: the disk is only opened, and the file system mounted, the
+	// first time something outside the file system wants them
+	FileSystem *FileSys() {
+		if (fileSystem == NULL) MountFileSystem();
+		return fileSystem;
+	}
+	SynchDisk *Disk() {
+		if (fileSystem == NULL) MountFileSystem();
+		return synchDisk;
+	}
+	void MountFileSystem();	// do it now, if not done yet
+	SynchConsoleOutput *ConsoleOut();
+				// MP4: the display, opened on first use
+
 // These are public for notational convenience; really, 
 // they're global variables used everywhere.
 
@@ -59,33 +88,71 @@ class Kernel {
     Scheduler *scheduler;	// the ready list
     Interrupt *interrupt;	// interrupt status
     Statistics *stats;		// performance metrics
+    TraceBuffer *trace;		// MP4: kernel event trace, NULL unless -tr
     Alarm *alarm;		// the software alarm clock    
     Machine *machine;           // the simulated CPU
-    SynchConsoleInput *synchConsoleIn;
+    SynchConsoleInput *synchConsoleIn;	// MP4: NULL until ConsoleTest
     SynchConsoleOutput *synchConsoleOut;
-    SynchDisk *synchDisk;
-    FileSystem *fileSystem;     
+    SynchDisk *synchDisk;	// MP4: both NULL until mounted; use
+    FileSystem *fileSystem;	// Disk() and FileSys() to get them
     PostOfficeInput *postOfficeIn;
     PostOfficeOutput *postOfficeOut;
+    FrameTable *frameTable;	// MP4: owners of the physical page frames
 
     int hostName;               // machine identifier
 
   private:
 
-	Thread* t[10];
+	Thread* t[MaxProcesses];
+	int exitStatus[MaxProcesses];	// MP4: for Join, set on exit
+	Semaphore *exited[MaxProcesses];	// MP4: V'ed once it has exited
+	int joiners[MaxProcesses];	// MP4: threads in Join for each
 	char*   execfile[10];
+	int execPriority[10];	// MP4: priority to run each execfile at
 	int execfileNum;
-	int threadNum;
+	int threadNum;			// MP4: the next id AllocateId tries
+	int AllocateId();		// MP4: a free process id, or -1
     bool randomSlice;		// enable pseudo-random time slicing
     bool debugUserProg;         // single step user program
+    bool blockEngine;           // MP4: run user code a basic block at a time
     double reliability;         // likelihood messages are dropped
     char *consoleIn;            // file to read console input from
     char *consoleOut;           // file to send console output to
 #ifndef FILESYS_STUB
     bool formatFlag;          // format the disk if this is true
+    bool checksums;           // MP4: format it with sector checksums
+    bool compressFiles;       // MP4: create files compressed
 #endif
+    Lock *mountLock;            // MP4: one thread mounts, the rest wait
+    DiskPolicy diskPolicy;      // MP4: order to serve disk requests in
+    bool mapDisk;               // MP4: map the disk file into memory
+    DeviceKind deviceKind;      // MP4: what kind of disk to simulate
+    char *restoreFile;          // MP4: disk snapshot to start from
+    ReplacementPolicy replacementPolicy;    // MP4: which page to evict
+    SchedulerPolicy schedulerPolicy;    // MP4: which thread runs next
+    int numCPUs;                // MP4: simulated CPUs, see Scheduler
+    int quantum;                // MP4: scheduling quantum, 0 for default
+    char *checkpointFile;       // MP4: where -checkpoint saves the kernel,
+    int checkpointTicks;        // and when
+    int resumeFd;               // MP4: -resume checkpoint, or -1
+    int resumeProcesses;        // how many processes it holds
+    int resumeNextId;           // and the id the next one would have got
+
+    bool CanCheckpoint();       // MP4: is every process between two
+                                // instructions, and the disk idle?
+    void WriteCheckpoint();     // MP4: save the kernel's state
+    void ResumeAll();           // MP4: start the checkpointed processes
+    char *traceFile;            // MP4: where -tr writes the trace
+    char *diskTraceFile;        // MP4: where -dtrace writes disk requests
 };
 
+// MP4: record a kernel event in the trace, if one is being taken.
+// Like DEBUG, this is cheap when tracing is off.
+#define TRACE(kind, a, b)						\
+    if (kernel->trace == NULL) {} else {				\
+        kernel->trace->Record(kind, a, b);				\
+    }
+
 
 #endif // KERNEL_H
 
@@ -3,16 +3,25 @@
 //	operating system kernel.
 //
 // Usage: nachos -d <debugflags> -rs <random seed #>
-//              -s -x <nachos file> -ci <consoleIn> -co <consoleOut>
-//              -f -cp <unix file> <nachos file>
-//              -p <nachos file> -r <nachos file> -l -D
+//              -s -bb -x <nachos file> -ci <consoleIn> -co <consoleOut>
+//              -e <nachos file> -ep <nachos file> <priority>
+//              -f -cp <unix file> <nachos file> -cpdir <unix dir> <nachos dir>
+//              -p <nachos file> -r <nachos file> -l -D -Dm -Dp <nachos path>
 //              -n <network reliability> -m <machine id>
-//              -z -K -C -N
+//              -z -K -C -N -rp <policy> -sp <policy> -quantum <ticks>
+//              -tr <trace file> -checkpoint <unix file> <ticks>
+//              -resume <unix file>
+//              -cpubench <runs> <nachos file> -fsbench -script <file>
+//              -snapshot <unix file> -restore <unix file> -defrag -crc
+//              -compress -dtrace <unix file> -dreplay <unix file> <speed>
+//              -dev <device>
 //
 //    -d causes certain debugging messages to be printed (see debug.h)
 //    -rs causes Yield to occur at random (but repeatable) spots
 //    -z prints the copyright message
 //    -s causes user programs to be executed in single-step mode
+//    -bb runs user programs a basic block at a time, through threaded
+//        code, instead of interpreting each instruction
 //    -x runs a user program
 //    -ci specify file for console input (stdin is the default)
 //    -co specify file for console output (stdout is the default)
@@ -21,14 +30,66 @@
 //    -K run a simple self test of kernel threads and synchronization
 //    -C run an interactive console test
 //    -N run a two-machine network test (see Kernel::NetworkTest)
+//    -rp picks the page replacement policy: fifo (default), lru, clock
+//        or ws (working set)
+//    -sp picks the CPU scheduling policy: fifo (default), mlfq
+//        (multi-level feedback queue) or prio (priority)
+//    -quantum sets the scheduling quantum in ticks (TimerTicks by
+//        default, 200 at the top MLFQ level, doubling at each level down)
+//    -checkpoint saves the processes, the disk and the statistics to a
+//        UNIX file (and the disk to that name plus ".disk") once the
+//        clock reaches the given tick and every process is between two
+//        user instructions; the run then goes on
+//    -resume starts from such a checkpoint instead of from boot
+//    -ep runs a user program at the given priority (0 to 100, the
+//        default for -e is 50)
+//    -cpubench runs a user program the given number of times, one run
+//        after another, and prints the host time and instructions per
+//        second of each run as JSON (see CPUBenchmark); it may be
+//        repeated, for several programs
+//    -tr records scheduler, interrupt, disk, page fault and system call
+//        events, and writes them to the trace file as Trace Event JSON
+//        (load it in chrome://tracing or Perfetto)
 //
 //    Filesystem-related flags:
 //    -f forces the Nachos disk to be formatted
+//    -crc, with -f, keeps a CRC-32C of every sector, checked as sectors
+//        are read and by a scrubber while the disk is idle
+//    -compress stores the files created in this run compressed, in
+//        chunks (see OpenFile::ReadChunk)
 //    -cp copies a file from UNIX to Nachos
+//    -cpdir copies the files in a UNIX directory into a Nachos directory
+//    -script runs file system commands (cp, mkdir, rm, l, ...) read from
+//        a UNIX file, or from standard input for "-", in one session
 //    -p prints a Nachos file to stdout
 //    -r removes a Nachos file from the file system
 //    -l lists the contents of the Nachos directory
 //    -D prints the contents of the entire file system
+//    -Dm prints the same without the data of the files: only headers,
+//        sectors, the bitmap and directories
+//    -Dp prints only the file or directory tree at a Nachos path, and
+//        can be given several times; with -Dm, without file data
+//    -ds picks the disk scheduling policy: fifo, sstf or clook (default)
+//    -dm maps the DISK file into memory instead of reading and writing it
+//    -dev picks the device the DISK file stands for: hdd, a rotational
+//        disk (default), or ssd, flash with parallel channels, a command
+//        queue and erase blocks
+//    -dtrace writes every request made of the disk (tick, thread, read
+//        or write, sectors) to a UNIX file, as text lines
+//    -dreplay replays such a trace against this run's cache and disk
+//        policy, at <speed> percent of the traced rate (0: as fast as
+//        the disk goes), and prints what it cost; the sectors it writes
+//        are overwritten
+//    -snapshot saves the DISK file, once the other file system flags
+//        have been carried out, to a UNIX file
+//    -restore starts from a snapshot, copied copy-on-write (where the
+//        host file system allows) over the DISK file
+//    -fsbench times file system operations and prints the results as
+//        comma-separated "fsbench,..." lines (see FileSystemBenchmark);
+//        test/fsbench is a user program running a similar workload
+//    -defrag starts a kernel thread that gathers each fragmented file
+//        into one run of sectors, while any user programs run, and
+//        prints how scattered the files were before and after
 //
 //  Note: the file system flags are not used if the stub filesystem
 //        is being used
@@ -45,6 +106,12 @@
 #include "main.h"
 #include "openfile.h"
 #include "sysdep.h"
+#ifndef FILESYS_STUB
+#include "directory.h"
+#include "filehdr.h"
+#include "synch.h"
+#include "synchdisk.h"
+#endif
 
 // global variables
 Kernel *kernel;
@@ -69,15 +136,26 @@ Cleanup(int x) {
 static const int TransferSize = 128;
 
 #ifndef FILESYS_STUB
+// MP4: Copy moves data this many bytes, a whole number of sectors, at
+// a time; whole sectors are written without a bounce buffer, and go
+// back to the disk as contiguous runs
+static const int BulkTransferSize = 64 * SectorSize;
+
 //----------------------------------------------------------------------
 // Copy
 //      Copy the contents of the UNIX file "from" to the Nachos file "to"
+//
+//      MP4: the file is created at its full length, so its sectors are
+//      allocated at once (in as few contiguous extents as the free map
+//      allows) and its header written once; then the data is streamed
+//      in BulkTransferSize pieces, each read from the UNIX file and
+//      written straight to its place in the Nachos file.
 //----------------------------------------------------------------------
 
 static void Copy(char *from, char *to) {
     int fd;
     OpenFile *openFile;
-    int amountRead, fileLength;
+    int amountRead, fileLength, filled, position;
     char *buffer;
 
     // Open UNIX file
@@ -93,19 +171,29 @@ static void Copy(char *from, char *to) {
 
     // Create a Nachos file of the same length
     DEBUG('f', "Copying file " << from << " of size " << fileLength << " to file " << to);
-    if (!kernel->fileSystem->Create(to, fileLength)) {  // Create Nachos file
+    if (!kernel->FileSys()->Create(to, fileLength)) {  // Create Nachos file
         printf("Copy: couldn't create output file %s\n", to);
         Close(fd);
         return;
     }
 
-    openFile = kernel->fileSystem->Open(to);
+    openFile = kernel->FileSys()->Open(to);
     ASSERT(openFile != NULL);
 
-    // Copy the data in TransferSize chunks
-    buffer = new char[TransferSize];
-    while ((amountRead = ReadPartial(fd, buffer, sizeof(char) * TransferSize)) > 0)
-        openFile->Write(buffer, amountRead);
+    // Copy the data in BulkTransferSize chunks
+    buffer = new char[BulkTransferSize];
+    for (position = 0; position < fileLength; position += filled) {
+        // fill a whole chunk, unless the file ends first, so every
+        // write but the last covers whole sectors
+        for (filled = 0; filled < BulkTransferSize; filled += amountRead) {
+            amountRead = ReadPartial(fd, buffer + filled, BulkTransferSize - filled);
+            if (amountRead <= 0)
+                break;
+        }
+        if (filled == 0)
+            break;  // the UNIX file got shorter
+        openFile->WriteAt(buffer, filled, position);
+    }
     delete[] buffer;
 
     // Close the UNIX and the Nachos files
@@ -113,6 +201,36 @@ static void Copy(char *from, char *to) {
     Close(fd);
 }
 
+//----------------------------------------------------------------------
+// CopyDirectory
+//      MP4: Copy every regular file in the UNIX directory "from" into
+//      the Nachos directory "to", which is made if it does not exist.
+//      Subdirectories are not copied, and files whose names are too
+//      long for a Nachos directory are skipped.
+//----------------------------------------------------------------------
+
+static void CopyDirectory(char *from, char *to) {
+    void *dir;
+    char name[256], unixPath[512], nachosPath[512];
+
+    if ((dir = OpenDirectory(from)) == NULL) {
+        printf("Copy: couldn't open input directory %s\n", from);
+        return;
+    }
+    kernel->FileSys()->CreateDirectory(to);  // fails if it is there
+    while (NextDirectoryFile(dir, from, name, sizeof(name))) {
+        if (strlen(name) > FileNameMaxLen ||
+            strlen(to) + strlen(name) + 2 > sizeof(nachosPath)) {
+            printf("Copy: skipping %s/%s, name too long\n", from, name);
+            continue;
+        }
+        sprintf(unixPath, "%s/%s", from, name);
+        sprintf(nachosPath, "%s/%s", to, name);
+        Copy(unixPath, nachosPath);
+    }
+    CloseDirectory(dir);
+}
+
 #endif  // FILESYS_STUB
 
 //----------------------------------------------------------------------
@@ -125,7 +243,7 @@ void Print(char *name) {
     int i, amountRead;
     char *buffer;
 
-    if ((openFile = kernel->fileSystem->Open(name)) == NULL) {
+    if ((openFile = kernel->FileSys()->Open(name)) == NULL) {
         printf("Print: unable to open file %s\n", name);
         return;
     }
@@ -147,9 +265,577 @@ void Print(char *name) {
 //----------------------------------------------------------------------
 static void CreateDirectory(char *name) {
     // MP4 Assignment
-    kernel->fileSystem->CreateDirectory(name);
+    kernel->FileSys()->CreateDirectory(name);
+}
+
+#ifndef FILESYS_STUB
+// MP4 start
+//----------------------------------------------------------------------
+// ReadScript
+//      Read all of the UNIX file "name", or standard input if it is
+//      "-", into a new null-terminated buffer.  Return NULL if the file
+//      can't be opened.
+//----------------------------------------------------------------------
+
+static char *ReadScript(char *name) {
+    int fd = (strcmp(name, "-") == 0) ? 0 : OpenForReadWrite(name, FALSE);
+    int size = 0, room = 1024, amountRead;
+    char *text, *bigger;
+
+    if (fd < 0)
+        return NULL;
+    text = new char[room];
+    while ((amountRead = ReadPartial(fd, text + size, room - 1 - size)) > 0) {
+        size += amountRead;
+        if (size == room - 1) {  // double the buffer
+            bigger = new char[2 * room];
+            memcpy(bigger, text, size);
+            delete[] text;
+            text = bigger;
+            room *= 2;
+        }
+    }
+    text[size] = '\0';
+    if (fd != 0)
+        Close(fd);
+    return text;
+}
+
+//----------------------------------------------------------------------
+// RunScript
+//      Run the file system commands in the UNIX file "name" ("-" for
+//      standard input), one per line, in this one session: the buffer
+//      cache stays warm from command to command, and the periodic Sync
+//      is held back so everything is flushed once, at the end.
+//
+//      The commands are those of the flags of the same name:
+//          cp <UNIX file> <Nachos file>
+//          cpdir <UNIX directory> <Nachos directory>
+//          mkdir <directory>     rm <name>     rr <name>
+//          l <directory>         lr <directory>
+//          p <name>              D [<name>]   (D <name> is -Dp)
+//      and some with no flag:
+//          clone <Nachos file> <Nachos file>   (see FileSystem::Clone)
+//          mv <Nachos name> <Nachos name>      (see FileSystem::Rename)
+//      Blank lines, and lines starting with '#', are ignored.
+//----------------------------------------------------------------------
+
+static void RunScript(char *name) {
+    char *text = ReadScript(name);
+    char *line, *next, *command, *arg1, *arg2;
+    int lineNumber = 0;
+
+    if (text == NULL) {
+        printf("Script: couldn't open %s\n", name);
+        return;
+    }
+    kernel->FileSys()->DeferSync(TRUE);
+    for (line = text; line != NULL; line = next) {
+        lineNumber++;
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        command = strtok(line, " \t\r");
+        if (command == NULL || command[0] == '#')
+            continue;
+        arg1 = strtok(NULL, " \t\r");
+        arg2 = strtok(NULL, " \t\r");
+
+        if (strcmp(command, "cp") == 0 && arg2 != NULL) {
+            Copy(arg1, arg2);
+        } else if (strcmp(command, "cpdir") == 0 && arg2 != NULL) {
+            CopyDirectory(arg1, arg2);
+        } else if (strcmp(command, "mv") == 0 && arg2 != NULL) {
+            if (!kernel->FileSys()->Rename(arg1, arg2))
+                printf("Script: couldn't move %s to %s\n", arg1, arg2);
+        } else if (strcmp(command, "clone") == 0 && arg2 != NULL) {
+            if (!kernel->FileSys()->Clone(arg1, arg2))
+                printf("Script: couldn't clone %s to %s\n", arg1, arg2);
+        } else if (strcmp(command, "mkdir") == 0 && arg1 != NULL) {
+            CreateDirectory(arg1);
+        } else if (strcmp(command, "rm") == 0 && arg1 != NULL) {
+            kernel->FileSys()->Remove(arg1);
+        } else if (strcmp(command, "rr") == 0 && arg1 != NULL) {
+            kernel->FileSys()->RecursiveRemove(arg1);
+        } else if (strcmp(command, "l") == 0 && arg1 != NULL) {
+            kernel->FileSys()->List(arg1);
+        } else if (strcmp(command, "lr") == 0 && arg1 != NULL) {
+            kernel->FileSys()->RecursiveList(arg1);
+        } else if (strcmp(command, "p") == 0 && arg1 != NULL) {
+            Print(arg1);
+        } else if (strcmp(command, "D") == 0) {
+            kernel->FileSys()->Print(arg1);  // MP4: all, or just arg1
+        } else {
+            printf("Script: %s, line %d: bad command \"%s\"\n",
+                   name, lineNumber, command);
+        }
+    }
+    kernel->FileSys()->DeferSync(FALSE);
+    delete[] text;
+}
+
+//----------------------------------------------------------------------
+// Constants used by the file system benchmarks
+//   BenchFiles -- files made and removed by the create/remove test
+//   BenchChunk -- bytes moved by each read or write of a file
+//   BenchDepth -- directories on the path of the lookup test
+//   BenchLookups -- opens done by the lookup test
+//   BenchFanout -- subdirectories and files in each directory of the
+//                  tree removed by the RecursiveRemove test
+//   BenchTreeDepth -- levels of directories in that tree
+//----------------------------------------------------------------------
+static const int BenchFiles = 64;
+static const int BenchChunk = 8 * SectorSize;
+static const int BenchDepth = 16;
+static const int BenchLookups = 64;
+static const int BenchFanout = 4;
+static const int BenchTreeDepth = 3;
+
+// What the counters stood at when a benchmark started.
+struct BenchStart {
+    int ticks;
+    int reads;
+    int writes;
+};
+
+//----------------------------------------------------------------------
+// BenchBegin
+//      Note where the tick and disk counters stand, as a benchmark
+//      starts.
+//----------------------------------------------------------------------
+
+static void BenchBegin(BenchStart *start) {
+    start->ticks = kernel->stats->totalTicks;
+    start->reads = kernel->stats->numDiskReads;
+    start->writes = kernel->stats->numDiskWrites;
+}
+
+//----------------------------------------------------------------------
+// BenchEnd
+//      Flush the buffer cache, so deferred writes are counted too, and
+//      print one line of results:
+//          fsbench,<test>,<bytes>,<ops>,<ticks>,<disk reads>,<disk writes>
+//
+//      "test" -- what was measured
+//      "bytes" -- the file size, or path depth, it was measured at;
+//                 0 if that does not apply
+//      "ops" -- the number of operations timed
+//----------------------------------------------------------------------
+
+static void BenchEnd(BenchStart *start, const char *test, int bytes, int ops) {
+    kernel->Disk()->Flush();
+    printf("fsbench,%s,%d,%d,%d,%d,%d\n", test, bytes, ops,
+           kernel->stats->totalTicks - start->ticks,
+           kernel->stats->numDiskReads - start->reads,
+           kernel->stats->numDiskWrites - start->writes);
+}
+
+//----------------------------------------------------------------------
+// BenchCreateRemove
+//      Time creating, then removing, BenchFiles empty files in one
+//      directory.
+//----------------------------------------------------------------------
+
+static void BenchCreateRemove() {
+    BenchStart start;
+    char name[32];
+    int i;
+
+    BenchBegin(&start);
+    for (i = 0; i < BenchFiles; i++) {
+        sprintf(name, "/fsbench/f%d", i);
+        ASSERT(kernel->FileSys()->Create(name, 0));
+    }
+    BenchEnd(&start, "create", 0, BenchFiles);
+
+    BenchBegin(&start);
+    for (i = 0; i < BenchFiles; i++) {
+        sprintf(name, "/fsbench/f%d", i);
+        ASSERT(kernel->FileSys()->Remove(name));
+    }
+    BenchEnd(&start, "remove", 0, BenchFiles);
+}
+
+//----------------------------------------------------------------------
+// BenchReadWrite
+//      Time sequential and random writes and reads, BenchChunk bytes
+//      at a time, of a file of "size" bytes.  The random tests move
+//      as many chunks as the sequential ones, at chunk-aligned offsets.
+//----------------------------------------------------------------------
+
+static void BenchReadWrite(int size) {
+    BenchStart start;
+    OpenFile *file;
+    char *buffer = new char[BenchChunk];
+    int chunks = divRoundUp(size, BenchChunk);
+    int i, offset;
+
+    ASSERT(kernel->FileSys()->Create("/fsbench/rw", size));
+    file = kernel->FileSys()->Open("/fsbench/rw");
+    ASSERT(file != NULL);
+    memset(buffer, 'x', BenchChunk);
+
+    BenchBegin(&start);
+    for (i = 0; i < chunks; i++)
+        file->WriteAt(buffer, min(BenchChunk, size - i * BenchChunk), i * BenchChunk);
+    BenchEnd(&start, "seqwrite", size, chunks);
+
+    BenchBegin(&start);
+    for (i = 0; i < chunks; i++)
+        file->ReadAt(buffer, BenchChunk, i * BenchChunk);
+    BenchEnd(&start, "seqread", size, chunks);
+
+    BenchBegin(&start);
+    for (i = 0; i < chunks; i++) {
+        offset = (RandomNumber() % chunks) * BenchChunk;
+        file->WriteAt(buffer, min(BenchChunk, size - offset), offset);
+    }
+    BenchEnd(&start, "randwrite", size, chunks);
+
+    BenchBegin(&start);
+    for (i = 0; i < chunks; i++)
+        file->ReadAt(buffer, BenchChunk, (RandomNumber() % chunks) * BenchChunk);
+    BenchEnd(&start, "randread", size, chunks);
+
+    delete file;
+    delete[] buffer;
+    ASSERT(kernel->FileSys()->Remove("/fsbench/rw"));
+}
+
+//----------------------------------------------------------------------
+// BenchLookup
+//      Time opening a file at the bottom of a chain of BenchDepth
+//      directories, BenchLookups times.
+//----------------------------------------------------------------------
+
+static void BenchLookup() {
+    BenchStart start;
+    char path[16 + 2 * BenchDepth];
+    OpenFile *file;
+    int i;
+
+    strcpy(path, "/fsbench");
+    for (i = 0; i < BenchDepth; i++) {
+        strcat(path, "/d");
+        ASSERT(kernel->FileSys()->CreateDirectory(path));
+    }
+    strcat(path, "/f");
+    ASSERT(kernel->FileSys()->Create(path, 0));
+
+    BenchBegin(&start);
+    for (i = 0; i < BenchLookups; i++) {
+        file = kernel->FileSys()->Open(path);
+        ASSERT(file != NULL);
+        delete file;
+    }
+    BenchEnd(&start, "lookup", BenchDepth, BenchLookups);
+
+    ASSERT(kernel->FileSys()->RecursiveRemove("/fsbench/d"));
+}
+
+//----------------------------------------------------------------------
+// BenchMakeTree
+//      Fill directory "path" with BenchFanout files and, unless
+//      "depth" is 0, BenchFanout subdirectories filled the same way.
+//      Return the number of files and directories made.
+//----------------------------------------------------------------------
+
+static int BenchMakeTree(char *path, int depth) {
+    int len = strlen(path);
+    int made = 0;
+
+    for (int i = 0; i < BenchFanout; i++) {
+        sprintf(path + len, "/f%d", i);
+        ASSERT(kernel->FileSys()->Create(path, SectorSize));
+        made++;
+        if (depth > 0) {
+            sprintf(path + len, "/d%d", i);
+            ASSERT(kernel->FileSys()->CreateDirectory(path));
+            made += 1 + BenchMakeTree(path, depth - 1);
+        }
+    }
+    path[len] = '\0';
+    return made;
+}
+
+//----------------------------------------------------------------------
+// BenchRecursiveRemove
+//      Time RecursiveRemove of a tree BenchTreeDepth directories deep.
+//----------------------------------------------------------------------
+
+static void BenchRecursiveRemove() {
+    BenchStart start;
+    char path[16 + 4 * (BenchTreeDepth + 1)];
+    int made;
+
+    strcpy(path, "/fsbench/t");
+    ASSERT(kernel->FileSys()->CreateDirectory(path));
+    made = BenchMakeTree(path, BenchTreeDepth);
+
+    BenchBegin(&start);
+    ASSERT(kernel->FileSys()->RecursiveRemove(path));
+    BenchEnd(&start, "rmtree", 0, made);
+}
+
+//----------------------------------------------------------------------
+// FileSystemBenchmark
+//      Run every file system benchmark in a scratch directory, and
+//      print the results as comma-separated lines that scripts can
+//      pick out of the output with "grep ^fsbench".  Reads and writes
+//      are timed at a size served by each level of the file header:
+//      direct, single, double and triple indirect.
+//----------------------------------------------------------------------
+
+static void FileSystemBenchmark() {
+    printf("fsbench,test,bytes,ops,ticks,diskreads,diskwrites\n");
+    ASSERT(kernel->FileSys()->CreateDirectory("/fsbench"));
+    BenchCreateRemove();
+    for (int level = 0; level < 4; level++) {
+        int size = (level == 0) ? MaxDirectBytes
+                                : min(2 * maxLevelBytes[level - 1], maxLevelBytes[level]);
+        BenchReadWrite(size);
+    }
+    BenchLookup();
+    BenchRecursiveRemove();
+    ASSERT(kernel->FileSys()->RecursiveRemove("/fsbench"));
+}
+
+//----------------------------------------------------------------------
+// Defragmenter, StartDefragmenter
+//      Run FileSystem::Defragment in a kernel thread of its own, so
+//      that the file system can be used meanwhile.
+//----------------------------------------------------------------------
+
+static void Defragmenter(void *unused) {
+    kernel->FileSys()->Defragment();
+}
+
+static void StartDefragmenter() {
+    Thread *defragmenter = new Thread("defragmenter", -1);
+
+    defragmenter->Fork((VoidFunctionPtr)Defragmenter, NULL);
 }
 
+//----------------------------------------------------------------------
+// Disk trace replay
+//   ReplayRecord -- one line of a trace taken with -dtrace
+//   ReplayStream -- the lines of one traced thread, replayed in order
+//                   by a thread of its own
+//   MaxReplayStreams -- traced threads replayed side by side; the lines
+//                   of any more go to the last stream
+//----------------------------------------------------------------------
+
+struct ReplayRecord {
+    int tick;
+    int thread;
+    char op;
+    int sector;
+    int numSectors;
+};
+
+struct ReplayStream {
+    int thread;              // the traced thread
+    ReplayRecord **records;  // its lines, in order
+    int numRecords;
+    int start;               // totalTicks when the replay began
+    int firstTick;           // tick of the first line of the trace
+    int speed;               // percent of the traced rate, 0 for flat out
+    Semaphore *done;         // signalled when the stream is replayed
+};
+
+#define MaxReplayStreams 16
+
+//----------------------------------------------------------------------
+// ReplayThread
+//      Make the requests of one stream of the trace, each at its
+//      traced time (scaled by the replay speed) if that is still to
+//      come, or at once if the disk has fallen behind.  Writes are of
+//      zeros; the sectors really are overwritten.
+//----------------------------------------------------------------------
+
+static void ReplayThread(ReplayStream *stream) {
+    SynchDisk *disk = kernel->Disk();
+
+    for (int i = 0; i < stream->numRecords; i++) {
+        ReplayRecord *record = stream->records[i];
+        int *sectors = new int[record->numSectors];
+        char *data = new char[record->numSectors * SectorSize];
+
+        if (stream->speed > 0) {
+            int due = stream->start +
+                      (int)((long long)(record->tick - stream->firstTick) * 100 / stream->speed);
+            kernel->alarm->WaitUntil(due - kernel->stats->totalTicks);
+        }
+        for (int j = 0; j < record->numSectors; j++)
+            sectors[j] = record->sector + j;
+        memset(data, 0, record->numSectors * SectorSize);
+        switch (record->op) {
+            case 'r':
+                disk->ReadSectors(sectors, record->numSectors, data);
+                break;
+            case 'w':
+                disk->WriteSectors(sectors, record->numSectors, data);
+                break;
+            case 'p':
+                disk->Prefetch(sectors, record->numSectors);
+                break;
+            case 'f':
+                disk->Fetch(sectors, record->numSectors);
+                break;
+        }
+        delete[] sectors;
+        delete[] data;
+    }
+    stream->done->V();
+}
+
+//----------------------------------------------------------------------
+// ReplayDiskTrace
+//      Replay the trace in the UNIX file "name", taken with -dtrace,
+//      against this run's buffer cache and disk policy, and print what
+//      it cost: the same workload can so be timed under, say, each -ds
+//      policy without running the programs that made it.  The requests
+//      of each traced thread come from a thread of their own, paced
+//      at "speed" percent of the traced rate (0 for no pacing).  Once
+//      they are all done the cache is flushed, so that the writes are
+//      counted too.
+//
+//      Replaying overwrites the sectors the trace writes: use a scratch
+//      disk, or one restored from a snapshot.
+//----------------------------------------------------------------------
+
+static void ReplayDiskTrace(char *name, int speed) {
+    char *text = ReadScript(name);
+    char *line, *next;
+    ReplayRecord *records;
+    ReplayStream streams[MaxReplayStreams];
+    int numRecords = 0, numStreams = 0, lines = 0, s;
+
+    if (text == NULL) {
+        printf("Replay: couldn't open %s\n", name);
+        return;
+    }
+    for (line = text; *line != '\0'; line++) {
+        if (*line == '\n')
+            lines++;
+    }
+    records = new ReplayRecord[lines + 1];
+    for (line = text; line != NULL; line = next) {
+        ReplayRecord *record = &records[numRecords];
+
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        if (line[0] == '#' ||
+            sscanf(line, "%d %d %c %d %d", &record->tick, &record->thread,
+                   &record->op, &record->sector, &record->numSectors) != 5)
+            continue;
+        if (record->sector < 0 || record->numSectors <= 0 ||
+            record->sector + record->numSectors > NumSectors)
+            continue;  // not a request for this disk
+        numRecords++;
+    }
+    delete[] text;
+
+    // sort the lines out by thread, keeping their order
+    for (int i = 0; i < numRecords; i++) {
+        for (s = 0; s < numStreams && streams[s].thread != records[i].thread; s++)
+            ;
+        if (s == numStreams && numStreams < MaxReplayStreams) {
+            streams[s].thread = records[i].thread;
+            streams[s].records = new ReplayRecord *[numRecords];
+            streams[s].numRecords = 0;
+            numStreams++;
+        }
+        s = min(s, MaxReplayStreams - 1);
+        streams[s].records[streams[s].numRecords++] = &records[i];
+    }
+
+    SynchDisk *disk = kernel->Disk();
+    int ticks = kernel->stats->totalTicks;
+    int reads = kernel->stats->numDiskReads, writes = kernel->stats->numDiskWrites;
+    int hits = kernel->stats->numCacheHits, misses = kernel->stats->numCacheMisses;
+    Semaphore *done = new Semaphore("replay", 0);
+
+    for (s = 0; s < numStreams; s++) {
+        Thread *replayer = new Thread("replay", -1);
+
+        streams[s].start = ticks;
+        streams[s].firstTick = records[0].tick;
+        streams[s].speed = speed;
+        streams[s].done = done;
+        replayer->Fork((VoidFunctionPtr)ReplayThread, (void *)&streams[s]);
+    }
+    for (s = 0; s < numStreams; s++) {
+        done->P();
+        delete[] streams[s].records;
+    }
+    disk->Flush();
+
+    printf("Replay: %d requests from %d threads in %d ticks\n",
+           numRecords, numStreams, kernel->stats->totalTicks - ticks);
+    printf("Replay: disk reads %d, writes %d, cache hits %d, misses %d\n",
+           kernel->stats->numDiskReads - reads, kernel->stats->numDiskWrites - writes,
+           kernel->stats->numCacheHits - hits, kernel->stats->numCacheMisses - misses);
+    delete done;
+    delete[] records;
+}
+// MP4 end
+#endif  // FILESYS_STUB
+
+// MP4 start
+#define MaxBenchPrograms 10  // programs -cpubench can be given
+#define MaxDumpPaths 10      // paths -Dp can be given
+
+//----------------------------------------------------------------------
+// CPUBenchmark
+//      Run each user program in turn, "runs[i]" times for program i,
+//      waiting for one run to exit before starting the next, and print
+//      what each run cost as a single line of JSON:
+//          {"cpubench":[{"program":..., "run":..., "wallNanos":...,
+//           "instructions":..., "ticks":..., "ips":...}, ...]}
+//      "instructions" is the user instructions the simulator executed,
+//      and "ips" that divided by the host time of the run, which
+//      includes the kernel code the program made Nachos run.
+//
+//      Every run is a process, and process ids are not reused, so at
+//      most MaxProcesses - 1 runs are made in all.
+//
+//      "programs" -- the user programs to run
+//      "runs" -- how many times to run each of them
+//      "numPrograms" -- the number of entries in both
+//----------------------------------------------------------------------
+
+static void CPUBenchmark(char **programs, int *runs, int numPrograms) {
+    const char *separator = "";
+
+    printf("{\"cpubench\":[");
+    for (int i = 0; i < numPrograms; i++) {
+        for (int run = 1; run <= runs[i]; run++) {
+            int instructions = kernel->stats->userTicks;
+            int ticks = kernel->stats->totalTicks;
+            long long nanos = HostNanoseconds();
+            int id = kernel->Exec(programs[i]);
+
+            if (id < 0) {
+                break;  // out of process ids
+            }
+            kernel->Join(id);
+            nanos = HostNanoseconds() - nanos;
+            instructions = kernel->stats->userTicks - instructions;
+            ticks = kernel->stats->totalTicks - ticks;
+            printf("%s{\"program\":\"%s\",\"run\":%d,\"wallNanos\":%lld,"
+                   "\"instructions\":%d,\"ticks\":%d,\"ips\":%.0f}",
+                   separator, programs[i], run, nanos, instructions, ticks,
+                   (nanos > 0) ? instructions * 1e9 / nanos : 0.0);
+            separator = ",";
+        }
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // main
 // 	Bootstrap the operating system kernel.
@@ -171,13 +857,20 @@ int main(int argc, char **argv) {
     bool threadTestFlag = false;
     bool consoleTestFlag = false;
     bool networkTestFlag = false;
+    char *benchPrograms[MaxBenchPrograms];  // MP4: for -cpubench
+    int benchRuns[MaxBenchPrograms];
+    int numBenchPrograms = 0;
 #ifndef FILESYS_STUB
     char *copyUnixFileName = NULL;    // UNIX file to be copied into Nachos
     char *copyNachosFileName = NULL;  // name of copied file in Nachos
+    bool copyDirectoryFlag = false;   // MP4: a whole UNIX directory
     char *printFileName = NULL;
     char *removeFileName = NULL;
     bool dirListFlag = false;
     bool dumpFlag = false;
+    bool dumpContents = true;         // MP4: -Dm leaves file data out
+    char *dumpPaths[MaxDumpPaths];    // MP4: for -Dp
+    int numDumpPaths = 0;
     // MP4 mod tag
     char *createDirectoryName = NULL;
     char *listDirectoryName = NULL;
@@ -186,6 +879,12 @@ int main(int argc, char **argv) {
     bool recursiveRemoveFlag = false;
     bool showHeaderSize = false;
     char *showHeaderFileName = NULL;
+    bool benchmarkFlag = false;  // MP4
+    char *scriptName = NULL;     // MP4: commands to run, for -script
+    char *snapshotName = NULL;   // MP4: where -snapshot saves the disk
+    bool defragFlag = false;     // MP4
+    char *replayName = NULL;     // MP4: disk trace to replay, for -dreplay
+    int replaySpeed = 100;
 #endif  // FILESYS_STUB
 
     // some command line arguments are handled here.
@@ -208,6 +907,12 @@ int main(int argc, char **argv) {
             consoleTestFlag = TRUE;
         } else if (strcmp(argv[i], "-N") == 0) {
             networkTestFlag = TRUE;
+        } else if (strcmp(argv[i], "-cpubench") == 0) {
+            // MP4: next arguments are a count and a user program
+            ASSERT(i + 2 < argc && numBenchPrograms < MaxBenchPrograms);
+            benchRuns[numBenchPrograms] = atoi(argv[i + 1]);
+            benchPrograms[numBenchPrograms++] = argv[i + 2];
+            i += 2;
         }
 #ifndef FILESYS_STUB
         else if (strcmp(argv[i], "-cp") == 0) {
@@ -215,6 +920,13 @@ int main(int argc, char **argv) {
             copyUnixFileName = argv[i + 1];
             copyNachosFileName = argv[i + 2];
             i += 2;
+        } else if (strcmp(argv[i], "-cpdir") == 0) {
+            // MP4
+            ASSERT(i + 2 < argc);
+            copyUnixFileName = argv[i + 1];
+            copyNachosFileName = argv[i + 2];
+            copyDirectoryFlag = true;
+            i += 2;
         } else if (strcmp(argv[i], "-p") == 0) {
             ASSERT(i + 1 < argc);
             printFileName = argv[i + 1];
@@ -251,20 +963,55 @@ int main(int argc, char **argv) {
             i++;
         } else if (strcmp(argv[i], "-D") == 0) {
             dumpFlag = true;
+        } else if (strcmp(argv[i], "-Dm") == 0) {
+            dumpFlag = true;  // MP4
+            dumpContents = false;
+        } else if (strcmp(argv[i], "-Dp") == 0) {
+            ASSERT(i + 1 < argc && numDumpPaths < MaxDumpPaths);
+            dumpFlag = true;  // MP4
+            dumpPaths[numDumpPaths++] = argv[i + 1];
+            i++;
         } else if (strcmp(argv[i], "-bonus2") == 0) {
             ASSERT(i + 1 < argc);
             showHeaderSize = true;
             showHeaderFileName = argv[i + 1];
+        } else if (strcmp(argv[i], "-fsbench") == 0) {
+            benchmarkFlag = true;  // MP4
+        } else if (strcmp(argv[i], "-snapshot") == 0) {
+            // MP4
+            ASSERT(i + 1 < argc);
+            snapshotName = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "-defrag") == 0) {
+            defragFlag = true;  // MP4
+        } else if (strcmp(argv[i], "-dreplay") == 0) {
+            // MP4: next arguments are a trace and a speed
+            ASSERT(i + 2 < argc);
+            replayName = argv[i + 1];
+            replaySpeed = atoi(argv[i + 2]);
+            i += 2;
+        } else if (strcmp(argv[i], "-script") == 0) {
+            // MP4
+            ASSERT(i + 1 < argc);
+            scriptName = argv[i + 1];
+            i++;
         }
 #endif  // FILESYS_STUB
         else if (strcmp(argv[i], "-u") == 0) {
             cout << "Partial usage: nachos [-z -d debugFlags]\n";
             cout << "Partial usage: nachos [-x programName]\n";
             cout << "Partial usage: nachos [-K] [-C] [-N]\n";
+            cout << "Partial usage: nachos [-cpubench runs programName]\n";
 #ifndef FILESYS_STUB
             cout << "Partial usage: nachos [-cp UnixFile NachosFile]\n";
+            cout << "Partial usage: nachos [-cpdir UnixDirectory NachosDirectory]\n";
             cout << "Partial usage: nachos [-p fileName] [-r fileName]\n";
             cout << "Partial usage: nachos [-l] [-D]\n";
+            cout << "Partial usage: nachos [-fsbench]\n";
+            cout << "Partial usage: nachos [-script fileName|-]\n";
+            cout << "Partial usage: nachos [-snapshot fileName]\n";
+            cout << "Partial usage: nachos [-defrag]\n";
+            cout << "Partial usage: nachos [-dreplay traceFile speed]\n";
 #endif  // FILESYS_STUB
         }
     }
@@ -293,21 +1040,27 @@ int main(int argc, char **argv) {
 #ifndef FILESYS_STUB
     if (removeFileName != NULL) {
         if (recursiveRemoveFlag)
-            kernel->fileSystem->RecursiveRemove(removeFileName);
+            kernel->FileSys()->RecursiveRemove(removeFileName);
         else
-            kernel->fileSystem->Remove(removeFileName);
+            kernel->FileSys()->Remove(removeFileName);
     }
     if (copyUnixFileName != NULL && copyNachosFileName != NULL) {
-        Copy(copyUnixFileName, copyNachosFileName);
+        if (copyDirectoryFlag)
+            CopyDirectory(copyUnixFileName, copyNachosFileName);  // MP4
+        else
+            Copy(copyUnixFileName, copyNachosFileName);
     }
     if (dumpFlag) {
-        kernel->fileSystem->Print();
+        if (numDumpPaths == 0)
+            kernel->FileSys()->Print(NULL, dumpContents);
+        for (i = 0; i < numDumpPaths; i++)
+            kernel->FileSys()->Print(dumpPaths[i], dumpContents);  // MP4
     }
     if (dirListFlag) {
         if (recursiveListFlag)
-            kernel->fileSystem->RecursiveList(listDirectoryName);
+            kernel->FileSys()->RecursiveList(listDirectoryName);
         else
-            kernel->fileSystem->List(listDirectoryName);
+            kernel->FileSys()->List(listDirectoryName);
     }
     if (mkdirFlag) {
         // MP4 mod tag
@@ -317,10 +1070,31 @@ int main(int argc, char **argv) {
         Print(printFileName);
     }
     if (showHeaderSize) {
-        kernel->fileSystem->PrintFileHdrSize(showHeaderFileName);
+        kernel->FileSys()->PrintFileHdrSize(showHeaderFileName);
+    }
+    if (scriptName != NULL) {
+        RunScript(scriptName);  // MP4
+    }
+    if (benchmarkFlag) {
+        FileSystemBenchmark();  // MP4
+    }
+    if (replayName != NULL) {
+        ReplayDiskTrace(replayName, replaySpeed);  // MP4
+    }
+    if (snapshotName != NULL) {
+        // MP4: save the disk as the commands above have left it
+        if (!kernel->FileSys()->Snapshot(snapshotName))
+            printf("Snapshot: couldn't save the disk to %s\n", snapshotName);
+    }
+    if (defragFlag) {
+        StartDefragmenter();  // MP4: runs once this thread waits or exits
     }
 #endif  // FILESYS_STUB
 
+    if (numBenchPrograms > 0) {
+        CPUBenchmark(benchPrograms, benchRuns, numBenchPrograms);  // MP4
+    }
+
     // finally, run an initial user program if requested to do so
 
     kernel->ExecAll();
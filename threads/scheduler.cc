@@ -11,8 +11,24 @@
 //	end up calling FindNextToRun(), and that would put us in an 
 //	infinite loop.
 //
-// 	Very simple implementation -- no priorities, straight FIFO.
-//	Might need to be improved in later assignments.
+// 	The default is the original straight FIFO.  MP4: with SchedMLFQ
+//	the ready threads are kept in a multi-level feedback queue --
+//	each level has its own quantum, a thread that uses up its quantum
+//	drops a level, a thread woken by a device goes back to the top,
+//	and threads that have been ready too long move up one level, so
+//	the CPU-bound ones at the bottom never starve.  With
+//	SchedPriority the most urgent ready thread runs first, by its
+//	priority including what it inherited through locks.
+//
+//	MP4: with several simulated CPUs (-ncpu), each CPU has ready
+//	queues of its own, and the one machine is handed to the CPUs in
+//	turn: each dispatch is the next CPU's, and runs a thread from its
+//	queues.  A thread that becomes ready goes back on the CPU it ran
+//	on; a CPU with nothing queued steals a thread from the one with
+//	the most.  The turns are taken in a fixed order, so a run is as
+//	repeatable as on one CPU, and Statistics reports how evenly the
+//	work was spread.  There is still a single host thread, so
+//	disabling interrupts stays enough for mutual exclusion.
 //
 // Copyright (c) 1992-1996 The Regents of the University of California.
 // All rights reserved.  See copyright.h for copyright notice and limitation 
@@ -23,16 +39,40 @@
 #include "scheduler.h"
 #include "main.h"
 
+// MP4: each policy's quantum, in SchedulerPolicy order.  Under FIFO
+// and Priority it is the timer period; MLFQ doubles it at each level
+// down, and checks it on every timer interrupt.
+static const int defaultQuantum[] = { TimerTicks, 200, TimerTicks };
+
 //----------------------------------------------------------------------
 // Scheduler::Scheduler
 // 	Initialize the list of ready but not running threads.
 //	Initially, no ready threads.
+//
+//	"policy" -- MP4: SchedFIFO, SchedMLFQ or SchedPriority
+//	"numCPUs" -- MP4: simulated CPUs, from 1 to MaxCPUs
+//	"quantum" -- MP4: ticks of CPU a thread gets before it yields,
+//		or 0 for the policy's default
 //----------------------------------------------------------------------
 
-Scheduler::Scheduler()
+Scheduler::Scheduler(SchedulerPolicy policy, int numCPUs, int quantum)
 { 
-    readyList = new List<Thread *>; 
+    ASSERT(numCPUs >= 1 && numCPUs <= MaxCPUs);
+    ASSERT(quantum >= 0);
+    this->policy = policy;
+    if (quantum == 0)
+	quantum = defaultQuantum[policy];
+    for (int i = 0; i < NumPriorityLevels; i++)
+	this->quantum[i] = quantum << i;
+    this->numCPUs = numCPUs;
+    for (int c = 0; c < numCPUs; c++) {
+	for (int i = 0; i < NumPriorityLevels; i++)
+	    queues[c][i] = new IntrusiveList<Thread>; 
+    }
+    cpu = 0;
+    readyList = queues[cpu];
     toBeDestroyed = NULL;
+    idleSince = 0;
 } 
 
 //----------------------------------------------------------------------
@@ -42,7 +82,10 @@ Scheduler::Scheduler()
 
 Scheduler::~Scheduler()
 { 
-    delete readyList; 
+    for (int c = 0; c < numCPUs; c++) {
+	for (int i = 0; i < NumPriorityLevels; i++)
+	    delete queues[c][i]; 
+    }
 } 
 
 //----------------------------------------------------------------------
@@ -51,16 +94,33 @@ Scheduler::~Scheduler()
 //	Put it on the ready list, for later scheduling onto the CPU.
 //
 //	"thread" is the thread to be put on the ready list.
+//	"ioCompleted" -- MP4: set when a device interrupt woke the
+//		thread; under MLFQ it goes back to the top level with
+//		a fresh quantum
 //----------------------------------------------------------------------
 
 void
-Scheduler::ReadyToRun (Thread *thread)
+Scheduler::ReadyToRun (Thread *thread, bool ioCompleted)
 {
+    int now = kernel->stats->totalTicks;
+
     ASSERT(kernel->interrupt->getLevel() == IntOff);
     DEBUG(dbgThread, "Putting thread on ready list: " << thread->getName());
 	//cout << "Putting thread on ready list: " << thread->getName() << endl ;
     thread->setStatus(READY);
-    readyList->Append(thread);
+    // MP4 start
+    if (policy == SchedMLFQ && ioCompleted) {
+	DEBUG(dbgThread, "I/O done, boosting " << thread->getName() << " from level " << thread->level);
+	thread->level = 0;
+	thread->sliceTicks = 0;
+    }
+    thread->readySince = thread->levelSince = now;
+    queues[thread->cpu][thread->level]->Append(thread);
+    // someone to time-slice against, so the timer is needed again;
+    // an idle machine dispatches the thread without it
+    if (kernel->interrupt->getStatus() != IdleMode)
+	kernel->alarm->Start();
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -69,6 +129,7 @@ Scheduler::ReadyToRun (Thread *thread)
 //	If there are no ready threads, return NULL.
 // Side effect:
 //	Thread is removed from the ready list.
+//	MP4: with several CPUs, the next CPU takes its turn first.
 //----------------------------------------------------------------------
 
 Thread *
@@ -76,11 +137,34 @@ Scheduler::FindNextToRun ()
 {
     ASSERT(kernel->interrupt->getLevel() == IntOff);
 
-    if (readyList->IsEmpty()) {
-		return NULL;
-    } else {
-    	return readyList->RemoveFront();
+    // MP4 start
+    if (numCPUs > 1) {
+	cpu = (cpu + 1) % numCPUs;
+	readyList = queues[cpu];
+	if (NumReady(cpu) == 0)
+	    Steal();
+    }
+    if (policy == SchedPriority && !readyList[0]->IsEmpty()) {
+	Thread *thread = readyList[0]->Front();
+	IntrusiveListIterator<Thread> iter(readyList[0]);
+
+	for (; !iter.IsDone(); iter.Next()) {	// first of the most urgent
+	    if (iter.Item()->getPriority() > thread->getPriority())
+		thread = iter.Item();
+	}
+	readyList[0]->Remove(thread);
+	return thread;
+    }
+
+    // the front of the highest non-empty level
+    if (policy == SchedMLFQ)
+	Age();
+    for (int level = 0; level < NumPriorityLevels; level++) {
+	if (!readyList[level]->IsEmpty())
+	    return readyList[level]->RemoveFront();
     }
+    return NULL;
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -112,14 +196,30 @@ Scheduler::Run (Thread *nextThread, bool finishing)
 	 toBeDestroyed = oldThread;
     }
     
-    if (oldThread->space != NULL) {	// if this thread is a user program,
-        oldThread->SaveUserState(); 	// save the user's CPU registers
-	oldThread->space->SaveState();
-    }
+    // MP4: a user program's registers stay in the machine, to be
+    // saved only if another user program runs (Thread::LoadUserState)
     
     oldThread->CheckOverflow();		    // check if the old thread
 					    // had an undetected stack overflow
 
+    // MP4: with no one else ready, the timer would only interrupt
+    // nextThread to give the CPU straight back to it; with others
+    // ready it has to run, even if they were all woken while the
+    // machine idled, when ReadyToRun leaves it alone
+    if (!AnyReady())
+	kernel->alarm->Stop();
+    else
+	kernel->alarm->Start();
+
+    // MP4: charge the old thread for its run, the new one for its wait
+    Charge(oldThread);
+    nextThread->waitTicks += kernel->stats->totalTicks - nextThread->readySince;
+    kernel->stats->threadWaitTicks += kernel->stats->totalTicks - nextThread->readySince;
+    kernel->stats->numContextSwitches++;
+    oldThread->contextSwitches++;
+    TRACE(TraceSwitch, oldThread->getID(), nextThread->getID());
+    nextThread->runSince = kernel->stats->totalTicks;
+
     kernel->currentThread = nextThread;  // switch to the next thread
     nextThread->setStatus(RUNNING);      // nextThread is now running
     
@@ -143,10 +243,9 @@ Scheduler::Run (Thread *nextThread, bool finishing)
 					// before this one has finished
 					// and needs to be cleaned up
     
-    if (oldThread->space != NULL) {	    // if there is an address space
-        oldThread->RestoreUserState();     // to restore, do it.
-	oldThread->space->RestoreState();
-    }
+    if (oldThread->space != NULL)	    // if there is an address space
+        oldThread->LoadUserState();	    // to restore, do it (MP4: if
+					    // someone else's is loaded)
 }
 
 //----------------------------------------------------------------------
@@ -166,6 +265,195 @@ Scheduler::CheckToBeDestroyed()
     }
 }
  
+// MP4 start
+//----------------------------------------------------------------------
+// Scheduler::ShouldPreempt
+// 	Called from the timer interrupt handler, to decide whether the
+//	running thread should yield when the handler returns.  FIFO
+//	always time-slices, as Nachos did originally.  Under MLFQ the
+//	thread yields if it has used up its quantum and someone at its
+//	new level (or above) is ready, or if a thread at a higher level
+//	than its own became ready meanwhile.  Under Priority it yields
+//	to a ready thread at least as urgent as itself.
+//----------------------------------------------------------------------
+
+bool
+Scheduler::ShouldPreempt()
+{
+    Thread *thread = kernel->currentThread;
+
+    if (policy == SchedFIFO)
+	return TRUE;
+    for (int c = 0; c < numCPUs; c++) {
+	if (c != cpu && NumReady(c) > 0)
+	    return TRUE;	// end this CPU's turn
+    }
+    if (policy == SchedPriority) {
+	IntrusiveListIterator<Thread> iter(readyList[0]);
+
+	Charge(thread);
+	for (; !iter.IsDone(); iter.Next()) {
+	    if (iter.Item()->getPriority() >= thread->getPriority())
+		return TRUE;
+	}
+	return FALSE;
+    }
+
+    Age();
+    Charge(thread);
+    if (thread->sliceTicks >= quantum[thread->level]) {
+	if (thread->level < NumPriorityLevels - 1)
+	    thread->level++;
+	thread->sliceTicks = 0;
+	DEBUG(dbgThread, thread->getName() << " used its quantum, now at level " << thread->level);
+	return ReadyAtOrAbove(thread->level);
+    }
+    return ReadyAtOrAbove(thread->level - 1);
+}
+
+//----------------------------------------------------------------------
+// Scheduler::AnyReady
+// 	Return TRUE if any simulated CPU has a thread waiting to run.
+//	While none does, the timer is stopped (tickless idle).
+//----------------------------------------------------------------------
+
+bool
+Scheduler::AnyReady()
+{
+    for (int c = 0; c < numCPUs; c++) {
+	if (NumReady(c) > 0)
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+//----------------------------------------------------------------------
+// Scheduler::TimerPeriod
+// 	Return how often the timer must interrupt.  FIFO and Priority
+//	reconsider the running thread on each interrupt, so the period
+//	is their quantum; MLFQ charges the thread and checks its quantum
+//	each time, so the usual TimerTicks will do unless its quantum is
+//	shorter.
+//----------------------------------------------------------------------
+
+int
+Scheduler::TimerPeriod()
+{
+    if (policy == SchedMLFQ)
+	return min(quantum[0], TimerTicks);
+    return quantum[0];
+}
+
+//----------------------------------------------------------------------
+// Scheduler::Charge
+// 	Account the CPU time "thread" has used since it was dispatched
+//	or last charged.  Idle time only passes while the running thread
+//	is asleep waiting for some other to become ready, so it is not
+//	counted.
+//----------------------------------------------------------------------
+
+void
+Scheduler::Charge(Thread *thread)
+{
+    int ticks = kernel->stats->totalTicks - thread->runSince
+		- (kernel->stats->idleTicks - idleSince);
+
+    thread->runTicks += ticks;
+    thread->sliceTicks += ticks;
+    kernel->stats->threadRunTicks += ticks;
+    kernel->stats->cpuBusyTicks[thread->cpu] += ticks;
+    thread->runSince = kernel->stats->totalTicks;
+    idleSince = kernel->stats->idleTicks;
+}
+
+//----------------------------------------------------------------------
+// Scheduler::Age
+// 	Move every thread that has sat at a lower level for AgingTicks
+//	up by one level.  Each level is in queueing order, so only the
+//	fronts need looking at.
+//----------------------------------------------------------------------
+
+void
+Scheduler::Age()
+{
+    int now = kernel->stats->totalTicks;
+
+    for (int level = 1; level < NumPriorityLevels; level++) {
+	while (!readyList[level]->IsEmpty()
+		&& now - readyList[level]->Front()->levelSince >= AgingTicks) {
+	    Thread *thread = readyList[level]->RemoveFront();
+	    DEBUG(dbgThread, "Aging " << thread->getName() << " to level " << level - 1);
+	    thread->level = level - 1;
+	    thread->sliceTicks = 0;
+	    thread->levelSince = now;
+	    readyList[level - 1]->Append(thread);
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+// Scheduler::ReadyAtOrAbove
+// 	Return TRUE if a thread is ready at "level" or any higher level.
+//----------------------------------------------------------------------
+
+bool
+Scheduler::ReadyAtOrAbove(int level)
+{
+    for (int i = 0; i <= level; i++) {
+	if (!readyList[i]->IsEmpty())
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+//----------------------------------------------------------------------
+// Scheduler::NumReady
+// 	Return the number of threads queued on CPU "which".
+//----------------------------------------------------------------------
+
+int
+Scheduler::NumReady(int which)
+{
+    int count = 0;
+
+    for (int level = 0; level < NumPriorityLevels; level++)
+	count += queues[which][level]->NumInList();
+    return count;
+}
+
+//----------------------------------------------------------------------
+// Scheduler::Steal
+// 	Move the first thread of the highest non-empty level of the CPU
+//	with the most threads queued (the lowest numbered, on a tie) over
+//	to the CPU whose turn it is, which has nothing to run.  Return
+//	FALSE if no other CPU has anything queued either.
+//----------------------------------------------------------------------
+
+bool
+Scheduler::Steal()
+{
+    int victim = -1;
+    Thread *thread = NULL;
+
+    for (int c = 0; c < numCPUs; c++) {
+	if (c != cpu && NumReady(c) > 0
+		&& (victim == -1 || NumReady(c) > NumReady(victim)))
+	    victim = c;
+    }
+    if (victim == -1)
+	return FALSE;
+    for (int level = 0; thread == NULL; level++) {
+	if (!queues[victim][level]->IsEmpty())
+	    thread = queues[victim][level]->RemoveFront();
+    }
+    DEBUG(dbgThread, "CPU " << cpu << " steals " << thread->getName() << " from CPU " << victim);
+    thread->cpu = cpu;
+    readyList[thread->level]->Append(thread);
+    kernel->stats->numSteals++;
+    return TRUE;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Scheduler::Print
 // 	Print the scheduler state -- in other words, the contents of
@@ -175,5 +463,13 @@ void
 Scheduler::Print()
 {
     cout << "Ready list contents:\n";
-    readyList->Apply(ThreadPrint);
+    for (int c = 0; c < numCPUs; c++) {
+	if (numCPUs > 1)
+	    cout << "CPU " << c << ":\n";
+	for (int level = 0; level < NumPriorityLevels; level++) {
+	    if (policy == SchedMLFQ)
+		cout << "level " << level << ": ";
+	    queues[c][level]->Apply(ThreadPrint);
+	}
+    }
 }
@@ -11,34 +11,71 @@
 
 #include "copyright.h"
 #include "list.h"
+#include "stats.h"
 #include "thread.h"
 
+// MP4: order in which ready threads get the CPU
+enum SchedulerPolicy { SchedFIFO, SchedMLFQ, SchedPriority };
+
+// MP4: the multi-level feedback queue.  Level 0 is the highest
+// priority; a thread that uses up its quantum at one level moves
+// down to the next, where the quantum is longer.
+#define NumPriorityLevels 3
+#define AgingTicks 2000		// ready this long: move up one level
+
 // The following class defines the scheduler/dispatcher abstraction -- 
 // the data structures and operations needed to keep track of which 
 // thread is running, and which threads are ready but not running.
 
 class Scheduler {
   public:
-    Scheduler();		// Initialize list of ready threads 
+    Scheduler(SchedulerPolicy policy = SchedFIFO, int numCPUs = 1,
+		int quantum = 0);
+    				// Initialize list of ready threads 
+				// MP4: one set per simulated CPU; a
+				// "quantum" of 0 is the policy's default
     ~Scheduler();		// De-allocate ready list
 
-    void ReadyToRun(Thread* thread);	
+    void ReadyToRun(Thread* thread, bool ioCompleted = FALSE);
     				// Thread can be dispatched.
+				// MP4: "ioCompleted" if it was woken by
+				// a device, which boosts it under MLFQ
     Thread* FindNextToRun();	// Dequeue first thread on the ready 
 				// list, if any, and return thread.
     void Run(Thread* nextThread, bool finishing);
     				// Cause nextThread to start running
     void CheckToBeDestroyed();// Check if thread that had been
     				// running needs to be deleted
+    bool ShouldPreempt();	// MP4: called on each timer interrupt;
+				// TRUE if the running thread should yield
     void Print();		// Print contents of ready list
+    bool AnyReady();		// MP4: is any thread waiting for a CPU?
+    int TimerPeriod();		// MP4: ticks between timer interrupts
+				// the quantum needs
     
     // SelfTest for scheduler is implemented in class Thread
     
   private:
-    List<Thread *> *readyList;  // queue of threads that are ready to run,
-				// but not running
+    SchedulerPolicy policy;	// MP4: FIFO and Priority use only level 0
+    int quantum[NumPriorityLevels];	// MP4: ticks a thread may run at
+				// each level before it drops a level
+    IntrusiveList<Thread> *queues[MaxCPUs][NumPriorityLevels];
+    				// queues of threads that are ready to run,
+				// but not running, one per MLFQ level,
+				// MP4: for each simulated CPU
+    IntrusiveList<Thread> **readyList;	// MP4: queues[cpu]
+    int numCPUs;		// MP4: simulated CPUs, taking turns
+    int cpu;			// the one whose turn it is
     Thread *toBeDestroyed;	// finishing thread to be destroyed
     				// by the next thread that runs
+
+    int idleSince;		// MP4: idle ticks at the last Charge
+    void Charge(Thread *thread);	// MP4: account its CPU time
+    void Age();			// MP4: move long-waiting threads up
+    bool ReadyAtOrAbove(int level);	// MP4: anyone ready at "level"
+				// or better?
+    int NumReady(int which);	// MP4: threads queued on CPU "which"
+    bool Steal();		// MP4: take one from the busiest CPU
 };
 
 #endif // SCHEDULER_H
@@ -48,7 +48,7 @@ Semaphore::Semaphore(char* debugName, int initialValue)
 {
     name = debugName;
     value = initialValue;
-    queue = new List<Thread *>;
+    queue = new IntrusiveList<Thread>;
 }
 
 //----------------------------------------------------------------------
@@ -91,29 +91,94 @@ Semaphore::P()
     (void) interrupt->SetLevel(oldLevel);	
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// YieldIfOutranked
+// 	A thread that was just woken goes ahead of the running thread if
+//	it is more urgent, rather than waiting for the next time slice:
+//	when the interrupt handler that woke it returns, or at once if
+//	interrupts were on.  If the caller had turned them off, it is in
+//	the middle of something atomic, and the switch waits until the
+//	running thread next gives up the CPU.
+//
+//	"woken" -- the thread just made ready, or NULL
+//	"level" -- the interrupt level the caller had
+//----------------------------------------------------------------------
+
+static void
+YieldIfOutranked(Thread *woken, IntStatus level)
+{
+    if (woken == NULL
+	    || woken->getPriority() <= kernel->currentThread->getPriority())
+	return;
+    if (kernel->interrupt->InHandler())
+	kernel->interrupt->YieldOnReturn();
+    else if (level == IntOn)
+	kernel->currentThread->Yield();
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Semaphore::V
 // 	Increment semaphore value, waking up a waiter if necessary.
 //	As with P(), this operation must be atomic, so we need to disable
 //	interrupts.  Scheduler::ReadyToRun() assumes that interrupts
 //	are disabled when it is called.
+//
+//	MP4: if the waiter woken outranks us, it runs first (see
+//	YieldIfOutranked).
+//
+//	"ioCompleted" -- MP4: passed on to the scheduler, which boosts
+//		threads woken by a finished I/O
 //----------------------------------------------------------------------
 
 void
-Semaphore::V()
+Semaphore::V(bool ioCompleted)
 {
     Interrupt *interrupt = kernel->interrupt;
+    Thread *woken = NULL;	// MP4
     
     // disable interrupts
     IntStatus oldLevel = interrupt->SetLevel(IntOff);	
     
     if (!queue->IsEmpty()) {  // make thread ready.
-	kernel->scheduler->ReadyToRun(queue->RemoveFront());
+	// MP4: the most urgent waiter, the first of them on a tie
+	Thread *thread = queue->Front();
+	IntrusiveListIterator<Thread> iter(queue);
+
+	for (; !iter.IsDone(); iter.Next()) {
+	    if (iter.Item()->getPriority() > thread->getPriority())
+		thread = iter.Item();
+	}
+	queue->Remove(thread);
+	kernel->scheduler->ReadyToRun(thread, ioCompleted);
+	woken = thread;
     }
     value++;
     
     // re-enable interrupts
     (void) interrupt->SetLevel(oldLevel);
+    YieldIfOutranked(woken, oldLevel);	// MP4
+}
+
+//----------------------------------------------------------------------
+// Semaphore::MaxWaiterPriority
+// 	MP4: return the priority of the most urgent thread waiting in
+//	P(), or MinPriority - 1 if no one is.  Called with interrupts
+//	off, so that the answer is still good when it is used.
+//----------------------------------------------------------------------
+
+int
+Semaphore::MaxWaiterPriority()
+{
+    int max = MinPriority - 1;
+    IntrusiveListIterator<Thread> iter(queue);
+
+    for (; !iter.IsDone(); iter.Next()) {
+	if (iter.Item()->getPriority() > max)
+	    max = iter.Item()->getPriority();
+    }
+    return max;
 }
 
 //----------------------------------------------------------------------
@@ -160,6 +225,7 @@ Lock::Lock(char* debugName)
     name = debugName;
     semaphore = new Semaphore("lock", 1);  // initially, unlocked
     lockHolder = NULL;
+    nextHeld = NULL;
 }
 
 //----------------------------------------------------------------------
@@ -176,12 +242,29 @@ Lock::~Lock()
 //	Atomically wait until the lock is free, then set it to busy.
 //	Equivalent to Semaphore::P(), with the semaphore value of 0
 //	equal to busy, and semaphore value of 1 equal to free.
+//
+//	MP4: if the lock is busy, we lend our priority to the holder
+//	first, so that a less urgent thread does not keep us waiting
+//	while it is itself kept off the CPU.
 //----------------------------------------------------------------------
 
 void Lock::Acquire()
 {
+    Thread *currentThread = kernel->currentThread;
+    IntStatus oldLevel = kernel->interrupt->SetLevel(IntOff);
+
+    if (lockHolder != NULL) {
+	currentThread->waitingOn = this;
+	Donate(currentThread->getPriority());
+    }
     semaphore->P();
-    lockHolder = kernel->currentThread;
+    currentThread->waitingOn = NULL;
+    lockHolder = currentThread;
+    nextHeld = currentThread->locksHeld;
+    currentThread->locksHeld = this;
+    currentThread->RefreshPriority();	// waiters who came after we
+					// overtook them in P() donate too
+    (void) kernel->interrupt->SetLevel(oldLevel);
 }
 
 //----------------------------------------------------------------------
@@ -193,15 +276,51 @@ void Lock::Acquire()
 //
 //	By convention, only the thread that acquired the lock
 // 	may release it.
+//
+//	MP4: we give back whatever priority the waiters on this lock
+//	lent us, keeping what waiters on our other locks lent; so the
+//	semaphore is only V'ed once interrupts are back as they were,
+//	for a waiter that now outranks us to take the CPU at once.
 //---------------------------------------------------------------------
 
 void Lock::Release()
 {
+    Thread *currentThread = kernel->currentThread;
+    IntStatus oldLevel = kernel->interrupt->SetLevel(IntOff);
+    Lock **link;
+
     ASSERT(IsHeldByCurrentThread());
+    for (link = &currentThread->locksHeld; *link != this; link = &(*link)->nextHeld)
+	ASSERT(*link != NULL);
+    *link = nextHeld;
+    nextHeld = NULL;
     lockHolder = NULL;
+    currentThread->RefreshPriority();
+    (void) kernel->interrupt->SetLevel(oldLevel);
     semaphore->V();
 }
 
+//----------------------------------------------------------------------
+// Lock::Donate
+// 	MP4: raise the holder of this lock to "priority", if it is less
+//	urgent, and follow the chain if the holder is itself waiting on
+//	another lock.  Called with interrupts off.
+//----------------------------------------------------------------------
+
+void Lock::Donate(int priority)
+{
+    Lock *lock = this;
+
+    ASSERT(kernel->interrupt->getLevel() == IntOff);
+    while (lock != NULL && lock->lockHolder != NULL
+	    && lock->lockHolder->priority < priority) {
+	DEBUG(dbgThread, lock->lockHolder->getName() << " inherits priority "
+		<< priority << " through " << lock->name);
+	lock->lockHolder->priority = priority;
+	lock = lock->lockHolder->waitingOn;
+    }
+}
+
 //----------------------------------------------------------------------
 // Condition::Condition
 // 	Initialize a condition variable, so that it can be 
@@ -238,19 +357,26 @@ Condition::~Condition()
 //	Note: we assume Mesa-style semantics, which means that the
 //	waiter must re-acquire the monitor lock when waking up.
 //
+//	MP4: interrupts stay off from queueing the semaphore until we
+//	sleep on it, so Signal always finds us waiting in it and can
+//	tell how urgent we are.
+//
 //	"conditionLock" -- lock protecting the use of this condition
 //----------------------------------------------------------------------
 
 void Condition::Wait(Lock* conditionLock) 
 {
      Semaphore *waiter;
+     IntStatus oldLevel;
     
      ASSERT(conditionLock->IsHeldByCurrentThread());
 
      waiter = new Semaphore("condition", 0);
+     oldLevel = kernel->interrupt->SetLevel(IntOff);
      waitQueue->Append(waiter);
      conditionLock->Release();
      waiter->P();
+     (void) kernel->interrupt->SetLevel(oldLevel);
      conditionLock->Acquire();
      delete waiter;
 }
@@ -277,7 +403,15 @@ void Condition::Signal(Lock* conditionLock)
     ASSERT(conditionLock->IsHeldByCurrentThread());
     
     if (!waitQueue->IsEmpty()) {
-        waiter = waitQueue->RemoveFront();
+	// MP4: the most urgent waiter, the first of them on a tie
+        waiter = waitQueue->Front();
+	ListIterator<Semaphore *> iter(waitQueue);
+
+	for (; !iter.IsDone(); iter.Next()) {
+	    if (iter.Item()->MaxWaiterPriority() > waiter->MaxWaiterPriority())
+		waiter = iter.Item();
+	}
+	waitQueue->Remove(waiter);
 	waiter->V();
     }
 }
@@ -295,3 +429,341 @@ void Condition::Broadcast(Lock* conditionLock)
         Signal(conditionLock);
     }
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// CriticalSection::CriticalSection
+// 	Turn interrupts off, remembering whether they were on.
+//----------------------------------------------------------------------
+
+CriticalSection::CriticalSection()
+{
+    oldLevel = kernel->interrupt->SetLevel(IntOff);
+}
+
+//----------------------------------------------------------------------
+// CriticalSection::~CriticalSection
+// 	Put interrupts back the way they were.
+//----------------------------------------------------------------------
+
+CriticalSection::~CriticalSection()
+{
+    (void) kernel->interrupt->SetLevel(oldLevel);
+}
+
+//----------------------------------------------------------------------
+// RWLock::RWLock
+// 	Initialize a reader/writer lock.  Initially, nobody holds it.
+//
+//	"debugName" is an arbitrary name, useful for debugging.
+//----------------------------------------------------------------------
+
+RWLock::RWLock(char* debugName)
+{
+    name = debugName;
+    lock = new Lock("rwlock");
+    readersOk = new Condition("rwlock readers");
+    writersOk = new Condition("rwlock writers");
+    readers = 0;
+    waitingReaders = 0;
+    waitingWriters = 0;
+    writer = NULL;
+}
+
+//----------------------------------------------------------------------
+// RWLock::~RWLock
+// 	Deallocate a reader/writer lock.  Nobody may be holding it.
+//----------------------------------------------------------------------
+
+RWLock::~RWLock()
+{
+    ASSERT(readers == 0 && writer == NULL);
+    delete readersOk;
+    delete writersOk;
+    delete lock;
+}
+
+//----------------------------------------------------------------------
+// RWLock::AcquireRead
+// 	Wait until no writer holds or is waiting for the lock, then
+//	share it with the other readers.
+//
+//	The fields are only ever changed with interrupts off, either in
+//	a CriticalSection or between the Lock and Condition calls (which
+//	are the only places a thread lets go of the CPU), so when nobody
+//	has to wait the CriticalSection alone is enough.
+//----------------------------------------------------------------------
+
+void RWLock::AcquireRead()
+{
+    {
+	CriticalSection cs;
+
+	if (writer == NULL && waitingWriters == 0) {
+	    readers++;
+	    return;
+	}
+    }
+    lock->Acquire();
+    ASSERT(writer != kernel->currentThread);
+    while (writer != NULL || waitingWriters > 0) {
+	waitingReaders++;
+	readersOk->Wait(lock);
+	waitingReaders--;
+    }
+    readers++;
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// RWLock::ReleaseRead
+// 	Drop our share of the lock; the last reader out lets a writer in.
+//----------------------------------------------------------------------
+
+void RWLock::ReleaseRead()
+{
+    {
+	CriticalSection cs;
+
+	ASSERT(readers > 0);
+	if (readers > 1 || waitingWriters == 0) {
+	    readers--;			// nobody to wake up
+	    return;
+	}
+    }
+    lock->Acquire();
+    ASSERT(readers > 0);
+    if (--readers == 0)
+	writersOk->Signal(lock);
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// RWLock::AcquireWrite
+// 	Wait until nobody holds the lock, then take it alone.
+//----------------------------------------------------------------------
+
+void RWLock::AcquireWrite()
+{
+    {
+	CriticalSection cs;
+
+	ASSERT(writer != kernel->currentThread);
+	if (writer == NULL && readers == 0 && waitingWriters == 0) {
+	    writer = kernel->currentThread;
+	    return;
+	}
+    }
+    lock->Acquire();
+    waitingWriters++;
+    while (writer != NULL || readers > 0)
+	writersOk->Wait(lock);
+    waitingWriters--;
+    writer = kernel->currentThread;
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// RWLock::ReleaseWrite
+// 	Give up the lock, to the next writer if one is waiting, or else
+//	to all the readers waiting.
+//----------------------------------------------------------------------
+
+void RWLock::ReleaseWrite()
+{
+    {
+	CriticalSection cs;
+
+	ASSERT(writer == kernel->currentThread);
+	if (waitingReaders == 0 && waitingWriters == 0) {
+	    writer = NULL;		// nobody to wake up
+	    return;
+	}
+    }
+    lock->Acquire();
+    ASSERT(writer == kernel->currentThread);
+    writer = NULL;
+    if (waitingWriters > 0)
+	writersOk->Signal(lock);
+    else
+	readersOk->Broadcast(lock);
+    lock->Release();
+}
+
+// The number of hash chains in a lock table.
+#define RWLockBuckets 64
+
+//----------------------------------------------------------------------
+// RWLockTable::RWLockTable
+// 	Initialize an empty table of reader/writer locks.
+//
+//	"debugName" is an arbitrary name, useful for debugging.
+//----------------------------------------------------------------------
+
+RWLockTable::RWLockTable(char* debugName)
+{
+    name = debugName;
+    buckets = new Entry *[RWLockBuckets];
+    for (int i = 0; i < RWLockBuckets; i++)
+	buckets[i] = NULL;
+}
+
+//----------------------------------------------------------------------
+// RWLockTable::~RWLockTable
+// 	Deallocate the table.  None of its locks may be in use.
+//----------------------------------------------------------------------
+
+RWLockTable::~RWLockTable()
+{
+    for (int i = 0; i < RWLockBuckets; i++)
+	ASSERT(buckets[i] == NULL);
+    delete [] buckets;
+}
+
+//----------------------------------------------------------------------
+// RWLockTable::Find
+// 	Return the entry for "key", or NULL if nobody wants that lock.
+//	Called in a CriticalSection.
+//----------------------------------------------------------------------
+
+RWLockTable::Entry *
+RWLockTable::Find(int key)
+{
+    Entry *e;
+
+    for (e = buckets[(unsigned) key % RWLockBuckets]; e != NULL; e = e->next)
+	if (e->key == key)
+	    return e;
+    return NULL;
+}
+
+//----------------------------------------------------------------------
+// RWLockTable::Acquire
+// 	Acquire the lock named "key", making it if nobody else wants it.
+//	The lookup is done in a CriticalSection, since it never sleeps;
+//	we wait for the lock itself after leaving it.
+//
+//	"key" -- the name of the lock
+//	"exclusive" -- take it as a writer, rather than as a reader
+//----------------------------------------------------------------------
+
+void RWLockTable::Acquire(int key, bool exclusive)
+{
+    Entry *e;
+
+    {
+	CriticalSection cs;
+
+	e = Find(key);
+	if (e == NULL) {
+	    Entry **chain = &buckets[(unsigned) key % RWLockBuckets];
+
+	    e = new Entry;
+	    e->key = key;
+	    e->users = 0;
+	    e->lock = new RWLock(name);
+	    e->next = *chain;
+	    *chain = e;
+	}
+	e->users++;		// keeps it from being deleted under us
+    }
+
+    if (exclusive)
+	e->lock->AcquireWrite();
+    else
+	e->lock->AcquireRead();
+}
+
+//----------------------------------------------------------------------
+// RWLockTable::Release
+// 	Release the lock named "key", deleting it if nobody else wants it.
+//
+//	"key" -- the name of the lock
+//	"exclusive" -- as passed to Acquire
+//----------------------------------------------------------------------
+
+void RWLockTable::Release(int key, bool exclusive)
+{
+    Entry *e, **link;
+
+    {
+	CriticalSection cs;
+
+	e = Find(key);
+	ASSERT(e != NULL && e->users > 0);
+    }
+
+    if (exclusive)		// may sleep, to wake up a waiter
+	e->lock->ReleaseWrite();
+    else
+	e->lock->ReleaseRead();
+
+    {
+	CriticalSection cs;
+
+	if (--e->users == 0) {
+	    link = &buckets[(unsigned) key % RWLockBuckets];
+	    while (*link != e)
+		link = &(*link)->next;
+	    *link = e->next;
+	    delete e->lock;
+	    delete e;
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+// Barrier::Barrier
+// 	Initialize a barrier for "parties" threads.  Nobody has arrived.
+//
+//	"debugName" is an arbitrary name, useful for debugging.
+//	"parties" -- the number of threads that meet at the barrier
+//----------------------------------------------------------------------
+
+Barrier::Barrier(char* debugName, int parties)
+{
+    ASSERT(parties > 0);
+    name = debugName;
+    this->parties = parties;
+    arrived = 0;
+    generation = 0;
+    lock = new Lock("barrier");
+    allHere = new Condition("barrier");
+}
+
+//----------------------------------------------------------------------
+// Barrier::~Barrier
+// 	Deallocate a barrier.  Nobody may be waiting at it.
+//----------------------------------------------------------------------
+
+Barrier::~Barrier()
+{
+    ASSERT(arrived == 0);
+    delete allHere;
+    delete lock;
+}
+
+//----------------------------------------------------------------------
+// Barrier::Wait
+// 	Wait until all the parties have called Wait, then let them all
+//	go.  A thread woken up checks that its own generation has met,
+//	so one that races ahead to the next round does not count twice.
+//----------------------------------------------------------------------
+
+void Barrier::Wait()
+{
+    int mine;
+
+    lock->Acquire();
+    mine = generation;
+    if (++arrived == parties) {
+	arrived = 0;
+	generation++;
+	allHere->Broadcast(lock);
+    } else {
+	while (generation == mine)
+	    allHere->Wait(lock);
+    }
+    lock->Release();
+}
+// MP4 end
@@ -44,14 +44,19 @@ class Semaphore {
     char* getName() { return name;}			// debugging assist
     
     void P();	 	// these are the only operations on a semaphore
-    void V();	 	// they are both *atomic*
+    void V(bool ioCompleted = FALSE);	// they are both *atomic*
+				// MP4: "ioCompleted" when a device
+				// interrupt handler is the caller
     void SelfTest();	// test routine for semaphore implementation
+    int MaxWaiterPriority();	// MP4: most urgent thread waiting in
+				// P(), or MinPriority - 1 if none
     
   private:
     char* name;        // useful for debugging
     int value;         // semaphore value, always >= 0
-    List<Thread *> *queue;     
+    IntrusiveList<Thread> *queue;
 		  	// threads waiting in P() for the value to be > 0
+			// MP4: V() wakes the most urgent, FIFO among equals
    };
 
 // The following class defines a "lock".  A lock can be BUSY or FREE.
@@ -79,6 +84,13 @@ class Lock {
     		return lockHolder == kernel->currentThread; }
     				// return true if the current thread 
 				// holds this lock.
+
+    // MP4: priority inheritance
+    void Donate(int priority);	// raise the holder, and whoever it
+				// waits on in turn, to "priority"
+    int MaxWaiterPriority() { return semaphore->MaxWaiterPriority(); }
+    Lock *NextHeld() { return nextHeld; }
+    				// next lock on the holder's locksHeld
     
     // Note: SelfTest routine provided by SynchList
     
@@ -86,6 +98,7 @@ class Lock {
     char *name;			// debugging assist
     Thread *lockHolder;		// thread currently holding lock
     Semaphore *semaphore;	// we use a semaphore to implement lock
+    Lock *nextHeld;		// MP4: link in lockHolder->locksHeld
 };
 
 // The following class defines a "condition variable".  A condition
@@ -140,5 +153,108 @@ class Condition {
   private:
     char* name;
     List<Semaphore *> *waitQueue;	// list of waiting threads
+					// MP4: one semaphore per waiter;
+					// Signal wakes the most urgent
+};
+
+// MP4 start
+// The following class defines a critical section for short pieces of
+// code that never sleep: interrupts are off from its construction to
+// the end of the enclosing scope, so on our uniprocessor nothing else
+// runs in between.  This is far cheaper than a Lock, which is a
+// Semaphore P and V, each turning interrupts off and on anyway.
+//
+//	{
+//	    CriticalSection cs;
+//	    ... update the shared data ...
+//	}
+
+class CriticalSection {
+  public:
+    CriticalSection();			// turn interrupts off
+    ~CriticalSection();			// and back to what they were
+
+  private:
+    IntStatus oldLevel;
+};
+
+// The following class defines a reader/writer lock: any number of
+// readers may hold it at once, or one writer alone.  A writer waiting
+// for the lock keeps new readers out, so writers are not starved by
+// a steady stream of readers.  Like a Lock, it is not recursive: a
+// thread must not acquire one it already holds.  When nobody has to
+// wait, the lock is taken and given back in a CriticalSection, without
+// touching the Lock and Conditions that waiters sleep on.
+
+class RWLock {
+  public:
+    RWLock(char* debugName);		// initialize lock to be FREE
+    ~RWLock();
+    char* getName() { return name; }
+
+    void AcquireRead();			// share the lock with other readers
+    void ReleaseRead();
+    void AcquireWrite();		// hold the lock alone
+    void ReleaseWrite();
+
+  private:
+    char *name;
+    Lock *lock;				// protects the fields below
+    Condition *readersOk;		// signalled when readers may go
+    Condition *writersOk;		// signalled when a writer may go
+    int readers;			// readers holding the lock
+    int waitingReaders;			// readers waiting for it
+    int waitingWriters;			// writers waiting for it
+    Thread *writer;			// writer holding it, or NULL
+};
+
+// The following class defines a table of reader/writer locks, named by
+// an integer (say, a disk sector).  A lock is made the first time its
+// name is acquired, and deleted when the last thread to want it lets
+// it go, so the table holds only the locks in use.
+
+class RWLockTable {
+  public:
+    RWLockTable(char* debugName);
+    ~RWLockTable();
+
+    void Acquire(int key, bool exclusive);  // lock "key", in write
+    void Release(int key, bool exclusive);  //  mode if "exclusive"
+
+  private:
+    struct Entry {
+	int key;
+	int users;			// threads holding or waiting for it
+	RWLock *lock;
+	Entry *next;
+    };
+
+    char *name;
+    Entry **buckets;			// chains, hashed by key; changed
+					//  in a CriticalSection
+    Entry *Find(int key);		// the entry for "key", or NULL
+};
+
+// The following class defines a barrier: a meeting point for a fixed
+// number of threads.  Each calls Wait, and none returns until all of
+// them have arrived.  The barrier can then be used again by the same
+// threads.
+
+class Barrier {
+  public:
+    Barrier(char* debugName, int parties);  // "parties" threads meet here
+    ~Barrier();
+    char* getName() { return name; }
+
+    void Wait();			// wait for the others
+
+  private:
+    char *name;
+    int parties;			// how many threads meet
+    int arrived;			// how many are waiting now
+    int generation;			// bumped each time they all meet
+    Lock *lock;				// protects the fields above
+    Condition *allHere;			// signalled when the last one comes
 };
+// MP4 end
 #endif // SYNCH_H
@@ -128,3 +128,257 @@ SynchList<T>::SelfTest(T val)
     }
     delete selfTestPing;
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// SynchQueue<T>::SynchQueue
+//	Allocate and initialize a bounded synchronized queue, empty to
+//	start with.  This is the only allocation it makes.
+//
+//	"capacity" is how many items it holds before Append waits.
+//----------------------------------------------------------------------
+
+template <class T>
+SynchQueue<T>::SynchQueue(int capacity)
+{
+    ASSERT(capacity > 0);
+    items = new T[capacity];
+    this->capacity = capacity;
+    first = count = 0;
+    lock = new Lock("queue lock");
+    notEmpty = new Condition("queue not empty cond");
+    notFull = new Condition("queue not full cond");
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::~SynchQueue
+//	De-allocate the queue, and any items still in it.
+//----------------------------------------------------------------------
+
+template <class T>
+SynchQueue<T>::~SynchQueue()
+{
+    delete notFull;
+    delete notEmpty;
+    delete lock;
+    delete [] items;
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::Append
+//      Append an "item" to the end of the queue, waiting until there
+//	is room for it.  Wake up anyone waiting for an item.
+//
+//	"item" is copied into the queue.
+//----------------------------------------------------------------------
+
+template <class T>
+void
+SynchQueue<T>::Append(const T &item)
+{
+    lock->Acquire();
+    while (count == capacity)
+	notFull->Wait(lock);		// wait until there is room
+    items[(first + count) % capacity] = item;
+    count++;
+    notEmpty->Signal(lock);		// wake up a waiter, if any
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::TryAppend
+//      Append an "item" to the end of the queue if there is room for
+//	it, without waiting: for producers, like interrupt-driven ones,
+//	that must not be held up.  Wake up anyone waiting for an item.
+//	Return FALSE, leaving the queue alone, if it is full.
+//
+//	"item" is copied into the queue.
+//----------------------------------------------------------------------
+
+template <class T>
+bool
+SynchQueue<T>::TryAppend(const T &item)
+{
+    lock->Acquire();
+    if (count == capacity) {
+	lock->Release();
+	return FALSE;
+    }
+    items[(first + count) % capacity] = item;
+    count++;
+    notEmpty->Signal(lock);		// wake up a waiter, if any
+    lock->Release();
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::IsFull
+//      Return TRUE if the queue has no room for another item.  Only
+//	meaningful to the one producer, since consumers only make room.
+//----------------------------------------------------------------------
+
+template <class T>
+bool
+SynchQueue<T>::IsFull()
+{
+    bool full;
+
+    lock->Acquire();
+    full = (count == capacity);
+    lock->Release();
+    return full;
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::AppendN
+//      Append "n" items to the end of the queue, in order.  As many go
+//	in at a time as there is room for; if that is not all of them,
+//	the consumers are woken to make more room.
+//
+//	"batch" -- the items to append
+//	"n" -- how many there are
+//----------------------------------------------------------------------
+
+template <class T>
+void
+SynchQueue<T>::AppendN(const T *batch, int n)
+{
+    lock->Acquire();
+    while (n > 0) {
+	while (count == capacity)
+	    notFull->Wait(lock);
+	for (; n > 0 && count < capacity; n--, count++)
+	    items[(first + count) % capacity] = *batch++;
+	notEmpty->Broadcast(lock);	// there may be several to take
+    }
+    lock->Release();
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::RemoveFront
+//      Remove an item from the front of the queue, waiting if it is
+//	empty.  Wake up anyone waiting for room.
+// Returns:
+//	The removed item.
+//----------------------------------------------------------------------
+
+template <class T>
+T
+SynchQueue<T>::RemoveFront()
+{
+    T item;
+
+    RemoveUpTo(&item, 1);
+    return item;
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::RemoveUpTo
+//      Remove as many items as are queued, but no more than "n", from
+//	the front of the queue, waiting until there is at least one.
+// Returns:
+//	How many were removed.
+//
+//	"batch" -- where to put them, in order
+//	"n" -- the most to remove
+//----------------------------------------------------------------------
+
+template <class T>
+int
+SynchQueue<T>::RemoveUpTo(T *batch, int n)
+{
+    int removed;
+
+    ASSERT(n > 0);
+    lock->Acquire();
+    while (count == 0)
+	notEmpty->Wait(lock);		// wait until there is an item
+    for (removed = 0; removed < n && count > 0; removed++, count--) {
+	batch[removed] = items[first];
+	first = (first + 1) % capacity;
+    }
+    if (removed == 1)
+	notFull->Signal(lock);		// room for one more
+    else
+	notFull->Broadcast(lock);
+    lock->Release();
+    return removed;
+}
+
+//----------------------------------------------------------------------
+// SynchQueue<T>::SelfTest, SelfTestProducer, SelfTestListProducer
+//	Test whether the SynchQueue implementation is working, by having
+//	a thread stream values through it, one at a time and in batches,
+//	to this one.  Then do the same through a SynchList, and print
+//	how long each took.
+//----------------------------------------------------------------------
+
+static const int SynchQueueTestItems = 1000;	// items each test moves
+static const int SynchQueueTestBatch = 8;	// and how many at a time
+
+template <class T>
+void
+SynchQueue<T>::SelfTestProducer(void* data)
+{
+    SynchQueue<T>* _this = (SynchQueue<T>*)data;
+    T batch[SynchQueueTestBatch];
+
+    for (int i = 0; i < SynchQueueTestBatch; i++)
+	batch[i] = _this->selfTestValue;
+    for (int i = 0; i < SynchQueueTestItems; i++)	// one at a time,
+	_this->Append(_this->selfTestValue);
+    for (int i = 0; i < SynchQueueTestItems; i += SynchQueueTestBatch)
+	_this->AppendN(batch, SynchQueueTestBatch);	// then in batches
+}
+
+template <class T>
+void
+SynchQueue<T>::SelfTestListProducer(void* data)
+{
+    SynchQueue<T>* _this = (SynchQueue<T>*)data;
+
+    for (int i = 0; i < SynchQueueTestItems; i++)
+	_this->selfTestList->Append(_this->selfTestValue);
+}
+
+template <class T>
+void
+SynchQueue<T>::SelfTest(T val)
+{
+    T batch[SynchQueueTestBatch];
+    int queueTicks, batchTicks, listTicks;
+    int start = kernel->stats->totalTicks;
+    Thread *helper = new Thread("producer", 1);
+
+    ASSERT(count == 0);
+    selfTestValue = val;
+    helper->Fork(SynchQueue<T>::SelfTestProducer, this);
+    for (int i = 0; i < SynchQueueTestItems; i++)
+	ASSERT(val == RemoveFront());
+    queueTicks = kernel->stats->totalTicks - start;
+
+    start = kernel->stats->totalTicks;
+    for (int i = 0; i < SynchQueueTestItems; ) {
+	int n = RemoveUpTo(batch, SynchQueueTestBatch);
+
+	for (int j = 0; j < n; j++)
+	    ASSERT(val == batch[j]);
+	i += n;
+    }
+    batchTicks = kernel->stats->totalTicks - start;
+    ASSERT(count == 0);
+
+    start = kernel->stats->totalTicks;
+    selfTestList = new SynchList<T>;
+    helper = new Thread("list producer", 1);
+    helper->Fork(SynchQueue<T>::SelfTestListProducer, this);
+    for (int i = 0; i < SynchQueueTestItems; i++)
+	ASSERT(val == selfTestList->RemoveFront());
+    listTicks = kernel->stats->totalTicks - start;
+    delete selfTestList;
+
+    cout << "SynchQueue: " << SynchQueueTestItems << " items in "
+	<< queueTicks << " ticks, " << batchTicks << " in batches of "
+	<< SynchQueueTestBatch << "; SynchList: " << listTicks << " ticks\n";
+}
+// MP4 end
@@ -46,6 +46,55 @@ class SynchList {
     static void SelfTestHelper(void* data);
 };
 
+// MP4 start
+// The following class defines a bounded "synchronized queue": like a
+// SynchList, but its items are kept by value in a fixed ring, so
+// nothing is allocated once it is made, and
+//	3. Threads trying to append to a full queue wait until there
+//	is room -- a fast producer is held back to the consumer's pace.
+// Batches of items can be moved in or out under one lock acquisition.
+
+template <class T>
+class SynchQueue {
+  public:
+    SynchQueue(int capacity);	// initialize a queue of "capacity" items
+    ~SynchQueue();		// de-allocate the queue
+
+    void Append(const T &item);	// append item to the end of the queue,
+				// waiting if it is full
+    bool TryAppend(const T &item);
+				// append it only if there is room;
+				// return FALSE, dropping it, if not
+    bool IsFull();		// is there no room for another item?
+    void AppendN(const T *batch, int n);
+				// append "n" items, in order, waiting
+				// for room as they go in
+    T RemoveFront();		// remove the first item, waiting if
+				// the queue is empty
+    int RemoveUpTo(T *batch, int n);
+				// remove up to "n" items, waiting for
+				// at least one; return how many
+
+    void SelfTest(T value);	// test the queue, and time it against
+				// a SynchList
+
+  private:
+    T *items;			// the ring of queued items
+    int capacity;		// its size
+    int first;			// where the oldest item is
+    int count;			// how many are queued
+    Lock *lock;			// enforce mutual exclusive access
+    Condition *notEmpty;	// wait in Remove if the queue is empty
+    Condition *notFull;		// wait in Append if it is full
+
+    // these are only to assist SelfTest()
+    T selfTestValue;
+    SynchList<T> *selfTestList;
+    static void SelfTestProducer(void* data);
+    static void SelfTestListProducer(void* data);
+};
+// MP4 end
+
 #include "synchlist.cc"
 
 #endif // SYNCHLIST_H
@@ -25,6 +25,18 @@
 // this is put at the top of the execution stack, for detecting stack overflows
 const int STACK_FENCEPOST = 0xdedbeef;
 
+// MP4: stacks and control blocks of finished threads, kept for reuse.
+// A pooled stack keeps its guard pages, so overflows are still caught.
+static int *freeStacks[ThreadPoolSize];
+static int numFreeStacks = 0;
+static void *freeThreads[ThreadPoolSize];
+static int numFreeThreads = 0;
+
+// MP4: the thread whose user registers and address space the machine
+// has loaded.  They stay there, not yet saved, while kernel-only
+// threads run; see Thread::LoadUserState.
+static Thread *userStateOwner = NULL;
+
 //----------------------------------------------------------------------
 // Thread::Thread
 // 	Initialize a thread control block, so that we can then call
@@ -46,6 +58,19 @@ Thread::Thread(char* threadName, int threadID)
 					// of machine registers
     }
     space = NULL;
+    userPreempted = FALSE;		// MP4
+    level = 0;				// MP4: new threads start at the top
+    sliceTicks = levelSince = readySince = runSince = 0;
+    waitTicks = runTicks = 0;
+    cpu = 0;				// MP4: idle CPUs steal it from there
+    basePriority = priority = DefaultPriority;	// MP4
+    waitingOn = locksHeld = NULL;
+    nextInList = NULL;			// MP4
+    ioFile = -1;
+    userTicks = systemTicks = 0;	// MP4: nothing used yet
+    diskReads = diskWrites = bytesRead = bytesWritten = 0;
+    contextSwitches = numFiles = 0;
+    pageFaults = 0;
 }
 
 //----------------------------------------------------------------------
@@ -63,11 +88,54 @@ Thread::Thread(char* threadName, int threadID)
 Thread::~Thread()
 {
     DEBUG(dbgThread, "Deleting thread: " << name);
+    DEBUG(dbgThread, name << " ran " << runTicks << " ticks, waited "
+	<< waitTicks << " ticks");	// MP4
     ASSERT(this != kernel->currentThread);
-    if (stack != NULL)
-	DeallocBoundedArray((char *) stack, StackSize * sizeof(int));
+    if (userStateOwner == this)
+	userStateOwner = NULL;		// MP4: nothing left to save
+    if (stack != NULL) {
+	CheckOverflow();		// MP4: don't pool a trampled stack
+	if (numFreeStacks < ThreadPoolSize)
+	    freeStacks[numFreeStacks++] = stack;
+	else
+	    DeallocBoundedArray((char *) stack, StackSize * sizeof(int));
+    }
+    if (space != NULL) {	// MP4: frees its frames and swap slots
+	DEBUG(dbgAddr, name << " paging: faults " << space->numPageFaults
+		<< ", evictions " << space->numPageEvictions
+		<< ", dirty write-backs " << space->numDirtyWriteBacks);
+	delete space;
+    }
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Thread::operator new, Thread::operator delete
+// 	Take a control block from the pool of finished threads, if there
+//	is one, instead of the heap; and put it back there, if there is
+//	room, once the thread has been destroyed.  Nothing here can
+//	re-enable interrupts, so the pool needs no further protection.
+//----------------------------------------------------------------------
+
+void *
+Thread::operator new(size_t size)
+{
+    ASSERT(size == sizeof(Thread));
+    if (numFreeThreads > 0)
+	return freeThreads[--numFreeThreads];
+    return ::operator new(size);
+}
+
+void
+Thread::operator delete(void *ptr)
+{
+    if (numFreeThreads < ThreadPoolSize)
+	freeThreads[numFreeThreads++] = ptr;
+    else
+	::operator delete(ptr);
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Thread::Fork
 // 	Invoke (*func)(arg), allowing caller and callee to execute 
@@ -131,6 +199,48 @@ Thread::CheckOverflow()
    }
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Thread::setPriority
+// 	Set the thread's base priority.  Donations from threads waiting
+//	on locks it holds still apply on top of it.
+//
+//	"newPriority" -- between MinPriority and MaxPriority
+//----------------------------------------------------------------------
+
+void
+Thread::setPriority(int newPriority)
+{
+    IntStatus oldLevel = kernel->interrupt->SetLevel(IntOff);
+
+    ASSERT(newPriority >= MinPriority && newPriority <= MaxPriority);
+    basePriority = newPriority;
+    RefreshPriority();
+    if (waitingOn != NULL)		// pass a raise on to the holder
+	waitingOn->Donate(priority);
+    (void) kernel->interrupt->SetLevel(oldLevel);
+}
+
+//----------------------------------------------------------------------
+// Thread::RefreshPriority
+// 	Recompute the effective priority: the base priority, raised to
+//	that of the most urgent thread waiting on any lock we hold.
+//	Called with interrupts off, when a lock is released or the base
+//	priority changes.
+//----------------------------------------------------------------------
+
+void
+Thread::RefreshPriority()
+{
+    ASSERT(kernel->interrupt->getLevel() == IntOff);
+    priority = basePriority;
+    for (Lock *lock = locksHeld; lock != NULL; lock = lock->NextHeld()) {
+	if (lock->MaxWaiterPriority() > priority)
+	    priority = lock->MaxWaiterPriority();
+    }
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // Thread::Begin
 // 	Called by ThreadRoot when a thread is about to begin
@@ -306,7 +416,10 @@ PLabelToAddr(void *plabel)
 void
 Thread::StackAllocate (VoidFunctionPtr func, void *arg)
 {
-    stack = (int *) AllocBoundedArray(StackSize * sizeof(int));
+    if (numFreeStacks > 0)		// MP4: no mmap/mprotect this time
+	stack = freeStacks[--numFreeStacks];
+    else
+	stack = (int *) AllocBoundedArray(StackSize * sizeof(int));
 
 #ifdef PARISC
     // HP stack works from low addresses to high addresses
@@ -396,6 +509,60 @@ Thread::RestoreUserState()
 	kernel->machine->WriteRegister(i, userRegisters[i]);
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// Thread::LoadUserState
+//	Give the machine this thread's user registers and address space,
+//	before it runs user code after a context switch.
+//
+//	Switching out of a user program leaves both in the machine: if
+//	only kernel threads (the flusher, say) run before it gets the
+//	CPU back, there's nothing to move.  Only when another user
+//	program takes the CPU are the owner's registers saved, and this
+//	thread's restored.
+//----------------------------------------------------------------------
+
+void
+Thread::LoadUserState()
+{
+    ASSERT(space != NULL);
+    if (userStateOwner == this)
+	return;				// still loaded
+    if (userStateOwner != NULL) {
+	userStateOwner->SaveUserState();
+	userStateOwner->space->SaveState();
+    }
+    RestoreUserState();
+    space->RestoreState();
+    userStateOwner = this;
+}
+
+//----------------------------------------------------------------------
+// Thread::GetUserRegisters, Thread::SetUserRegisters
+//	Copy out the user registers of a thread that is not running, from
+//	wherever they are (see LoadUserState); or set those it will run
+//	with next.
+//
+//	"registers" -- NumTotalRegs of them
+//----------------------------------------------------------------------
+
+void
+Thread::GetUserRegisters(int *registers)
+{
+    for (int i = 0; i < NumTotalRegs; i++)
+	registers[i] = (userStateOwner == this) ?
+		kernel->machine->ReadRegister(i) : userRegisters[i];
+}
+
+void
+Thread::SetUserRegisters(int *registers)
+{
+    ASSERT(userStateOwner != this);
+    for (int i = 0; i < NumTotalRegs; i++)
+	userRegisters[i] = registers[i];
+}
+// MP4 end
+
 
 //----------------------------------------------------------------------
 // SimpleThread
@@ -434,3 +601,96 @@ Thread::SelfTest()
     kernel->currentThread->Yield();
     SimpleThread(0);
 }
+
+// MP4 start
+//----------------------------------------------------------------------
+// Thread::ChargeOpen
+// 	Note that the file "fileName" is open as the descriptor "id", so
+//	that what is moved through "id" is charged to it.  A file opened
+//	again under the same name carries on its earlier counts.  Nothing
+//	happens if the open failed.
+//----------------------------------------------------------------------
+
+void
+Thread::ChargeOpen(char *fileName, int id)
+{
+    int i;
+
+    if (id < 0)
+	return;
+    for (i = 0; i < numFiles; i++) {
+	if (strncmp(files[i].name, fileName, UsageNameLength - 1) == 0
+		&& files[i].id < 0)
+	    break;
+    }
+    if (i == numFiles) {
+	if (numFiles == MaxUsageFiles)
+	    return;			// only counted in the totals
+	strncpy(files[i].name, fileName, UsageNameLength - 1);
+	files[i].name[UsageNameLength - 1] = '\0';
+	files[i].bytesRead = files[i].bytesWritten = 0;
+	numFiles++;
+    }
+    files[i].id = id;
+}
+
+//----------------------------------------------------------------------
+// Thread::ChargeClose
+// 	The descriptor "id" is being closed; its counts are kept for the
+//	report.
+//----------------------------------------------------------------------
+
+void
+Thread::ChargeClose(int id)
+{
+    for (int i = 0; i < numFiles; i++) {
+	if (files[i].id == id)
+	    files[i].id = -1;
+    }
+}
+
+//----------------------------------------------------------------------
+// Thread::ChargeTransfer
+// 	Charge "bytes" read from, or written to, the descriptor "id".
+//----------------------------------------------------------------------
+
+void
+Thread::ChargeTransfer(int id, int bytes, bool writing)
+{
+    if (writing)
+	bytesWritten += bytes;
+    else
+	bytesRead += bytes;
+    for (int i = 0; i < numFiles; i++) {
+	if (files[i].id == id) {
+	    if (writing)
+		files[i].bytesWritten += bytes;
+	    else
+		files[i].bytesRead += bytes;
+	    break;
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+// Thread::PrintUsage
+// 	Print what the thread has used, and what it moved to and from
+//	each file; called when a user program exits, however it exits,
+//	so that the one in a mix eating a resource stands out.
+//----------------------------------------------------------------------
+
+void
+Thread::PrintUsage()
+{
+    cout << "Usage of " << name << ": user " << userTicks
+	<< " ticks, system " << systemTicks << " ticks, context switches "
+	<< contextSwitches << "\n";
+    cout << "    disk reads " << diskReads << ", writes " << diskWrites
+	<< ", page faults " << pageFaults;
+    cout << ", bytes read " << bytesRead << ", written " << bytesWritten
+	<< "\n";
+    for (int i = 0; i < numFiles; i++)
+	cout << "    " << files[i].name << ": read " << files[i].bytesRead
+	    << ", written " << files[i].bytesWritten << "\n";
+}
+// MP4 end
@@ -57,6 +57,29 @@
 // WATCH OUT IF THIS ISN'T BIG ENOUGH!!!!!
 const int StackSize = (8 * 1024);	// in words
 
+// MP4: thread priorities; a larger number is more urgent
+const int MinPriority = 0;
+const int MaxPriority = 100;
+const int DefaultPriority = 50;
+
+class Lock;
+
+// MP4: finished threads hand their stack and control block back to a
+// pool of up to this many each, for the next Fork to reuse
+const int ThreadPoolSize = 16;
+
+// MP4: what a thread moved to and from one of the files it opened, for
+// its resource accounting; only the first MaxUsageFiles are told apart
+const int MaxUsageFiles = 8;
+const int UsageNameLength = 24;
+
+struct FileUsage {
+    char name[UsageNameLength];	// as given to Open, cut short
+    int id;			// descriptor it is open as, or -1
+    int bytesRead;
+    int bytesWritten;
+};
+
 
 // Thread state
 enum ThreadStatus { JUST_CREATED, RUNNING, READY, BLOCKED, ZOMBIE };
@@ -86,6 +109,8 @@ class Thread {
 					// NOTE -- thread being deleted
 					// must not be running when delete 
 					// is called
+    static void *operator new(size_t size);	// MP4: from the pool,
+    static void operator delete(void *ptr);	// and back to it
 
     // basic thread operations
 
@@ -129,8 +154,58 @@ class Thread {
   public:
     void SaveUserState();		// save user-level register state
     void RestoreUserState();		// restore user-level register state
+    void LoadUserState();		// MP4: restore it, unless the machine
+					// still has it
+    void GetUserRegisters(int *registers);	// MP4: for a checkpoint,
+    void SetUserRegisters(int *registers);	// and to resume from one
+    bool userPreempted;			// MP4: the timer switched it out
+					// between two user instructions
 
     AddrSpace *space;			// User code this thread is running.
+
+    // MP4: scheduling state and accounting, kept by the Scheduler
+    int level;				// MLFQ level, 0 is the highest
+    int sliceTicks;			// ticks of this level's quantum used
+    int levelSince;			// when it was queued at this level
+    int readySince;			// when it last became ready
+    int runSince;			// when it was last dispatched
+    int waitTicks;			// total ticks spent ready, not running
+    int runTicks;			// total ticks spent on the CPU
+    int cpu;				// simulated CPU whose queue it is
+					// on, or that it is running on
+
+    // MP4: priority, with inheritance through Lock
+    int getPriority() { return priority; }
+    void setPriority(int newPriority);	// set the base priority
+    void RefreshPriority();		// recompute from the base priority
+					// and the waiters on locksHeld
+    int basePriority;			// as set by setPriority
+    int priority;			// basePriority, or higher if a
+					// waiter on one of its locks donated
+    Lock *waitingOn;			// lock it is blocked in Acquire on
+    Lock *locksHeld;			// locks it holds, through nextHeld
+
+    Thread *nextInList;			// MP4: link on the ready list or a
+					// semaphore's queue (IntrusiveList)
+    int ioFile;				// MP4: header sector of the file this
+					// thread is reading or writing, or -1;
+					// disk requests are charged to it
+
+    // MP4: resource accounting, for GetStats and the report at exit
+    int userTicks;			// ticks spent in user code,
+    int systemTicks;			// and in the kernel
+    int diskReads;			// disk requests made while running it
+    int diskWrites;
+    int bytesRead;			// through the file system calls, to
+    int bytesWritten;			// every file
+    int contextSwitches;		// times it was switched out
+    int pageFaults;			// page faults it took
+    FileUsage files[MaxUsageFiles];	// the same by file,
+    int numFiles;			// for this many
+    void ChargeOpen(char *fileName, int id);	// "id" was opened, or -1
+    void ChargeClose(int id);
+    void ChargeTransfer(int id, int bytes, bool writing);
+    void PrintUsage();			// print all of it
 };
 
 // external function, dummy routine whose sole job is to call Thread::Print
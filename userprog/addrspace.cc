@@ -19,7 +19,17 @@
 #include "main.h"
 #include "addrspace.h"
 #include "machine.h"
-#include "noff.h"
+#include "synch.h"
+#include "bitmap.h"
+
+// MP4: the swap file, created the first time a dirty page is evicted
+#ifdef FILESYS_STUB
+static char swapFileName[] = "SWAP";
+#else
+static char swapFileName[] = "/swap";
+#endif
+
+static int nextAsid = 0;	// MP4: address space ids are never reused
 
 //----------------------------------------------------------------------
 // SwapHeader
@@ -60,44 +70,71 @@ SwapHeader (NoffHeader *noffH)
 //----------------------------------------------------------------------
 // AddrSpace::AddrSpace
 // 	Create an address space to run a user program.
-//	Set up the translation from program memory to physical 
-//	memory.  For now, this is really simple (1:1), since we are
-//	only uniprogramming, and we have a single unsegmented page table
+//	The page table is built by Load, once we know how big the
+//	program is; pages only get physical frames when they are first
+//	touched (see PageIn).
 //----------------------------------------------------------------------
 
 AddrSpace::AddrSpace()
 {
-    pageTable = new TranslationEntry[NumPhysPages];
-    for (int i = 0; i < NumPhysPages; i++) {
-	pageTable[i].virtualPage = i;	// for now, virt page # = phys page #
-	pageTable[i].physicalPage = i;
-	pageTable[i].valid = TRUE;
-	pageTable[i].use = FALSE;
-	pageTable[i].dirty = FALSE;
-	pageTable[i].readOnly = FALSE;  
-    }
-    
-    // zero out the entire address space
-    bzero(kernel->machine->mainMemory, MemorySize);
+    pageTable = NULL;		// MP4: no pages until Load
+    numPages = 0;
+    swapSlot = NULL;
+    copyOnWrite = NULL;
+    nextSharer = NULL;
+    mapBase = 0;
+    mappings = NULL;
+    execName = NULL;
+    textKey = -1;
+    executable = NULL;
+    numPageFaults = numPageEvictions = numDirtyWriteBacks = 0;
+    asid = nextAsid++;
+
+#ifndef FILESYS_STUB
+    files = new FileDescriptorTable();	// MP4: no files open yet
+#endif
 }
 
 //----------------------------------------------------------------------
 // AddrSpace::~AddrSpace
-// 	Dealloate an address space.
+// 	Dealloate an address space, handing its frames and swap slots
+//	back to the frame table.  MP4: this runs from
+//	Scheduler::CheckToBeDestroyed, with interrupts off, so it must not
+//	block: mapped and open files were already dealt with by CloseAll.
 //----------------------------------------------------------------------
 
 AddrSpace::~AddrSpace()
 {
-   delete pageTable;
+    // MP4 start
+    ASSERT(mappings == NULL && executable == NULL);
+    for (unsigned int i = 0; i < numPages; i++) {
+	int frame = pageTable[i].physicalPage;
+
+	// a frame shared with a Fork stays with the other sharers
+	if (pageTable[i].valid && !kernel->frameTable->Unshare(frame, this, i))
+	    kernel->frameTable->Release(frame);
+	if (swapSlot[i] != -1)
+	    kernel->frameTable->FreeSwap(swapSlot[i]);
+    }
+    delete [] pageTable;
+    delete [] swapSlot;
+    delete [] copyOnWrite;
+    delete [] nextSharer;
+    delete [] execName;
+    // MP4 end
+#ifndef FILESYS_STUB
+    ASSERT(files == NULL);	// MP4: closed by CloseAll
+#endif
 }
 
 
 //----------------------------------------------------------------------
 // AddrSpace::Load
-// 	Load a user program into memory from a file.
+// 	Prepare to run a user program from a file.
 //
-//	Assumes that the page table has been initialized, and that
-//	the object code file is in NOFF format.
+//	Only the NOFF header is read here: the page table starts out
+//	with every page invalid, and the executable is kept open so that
+//	PageIn can read each page from it when it is first touched.
 //
 //	"fileName" is the file containing the object code to load into memory
 //----------------------------------------------------------------------
@@ -105,10 +142,9 @@ AddrSpace::~AddrSpace()
 bool 
 AddrSpace::Load(char *fileName) 
 {
-    OpenFile *executable = kernel->fileSystem->Open(fileName);
-    NoffHeader noffH;
     unsigned int size;
 
+    executable = kernel->FileSys()->Open(fileName);
     if (executable == NULL) {
 	cerr << "Unable to open file " << fileName << "\n";
 	return FALSE;
@@ -119,6 +155,11 @@ AddrSpace::Load(char *fileName)
 		(WordToHost(noffH.noffMagic) == NOFFMAGIC))
     	SwapHeader(&noffH);
     ASSERT(noffH.noffMagic == NOFFMAGIC);
+    execName = new char[strlen(fileName) + 1];	// MP4
+    strcpy(execName, fileName);
+#ifndef FILESYS_STUB
+    textKey = executable->HeaderSector();	// MP4: share code pages
+#endif
 
 #ifdef RDATA
 // how big is address space?
@@ -135,44 +176,687 @@ AddrSpace::Load(char *fileName)
     numPages = divRoundUp(size, PageSize);
     size = numPages * PageSize;
 
-    ASSERT(numPages <= NumPhysPages);		// check we're not trying
-						// to run anything too big --
-						// at least until we have
-						// virtual memory
+    ASSERT(numPages <= NumSwapPages);		// MP4: the program need not
+						// fit in memory, but it has
+						// to fit in the swap file
 
     DEBUG(dbgAddr, "Initializing address space: " << numPages << ", " << size);
 
-// then, copy in the code and data segments into memory
-// Note: this code assumes that virtual address = physical address
-    if (noffH.code.size > 0) {
-        DEBUG(dbgAddr, "Initializing code segment.");
-	DEBUG(dbgAddr, noffH.code.virtualAddr << ", " << noffH.code.size);
-        executable->ReadAt(
-		&(kernel->machine->mainMemory[noffH.code.virtualAddr]), 
-			noffH.code.size, noffH.code.inFileAddr);
+    // MP4 start
+    mapBase = numPages;
+    numPages = 0;
+    Grow(mapBase);			// files are mapped above the stack
+    // MP4 end
+
+    return TRUE;			// success
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// AddrSpace::Fork
+// 	Make a copy of this address space for a child process.  Nothing
+//	is copied in memory: every resident page becomes read-only here
+//	and in the child, which shares its frame, and only the first
+//	write to it, by either one, makes a private copy (see
+//	CopyOnWrite).  Pages out in swap get a swap slot of their own in
+//	the child; pages never touched will be read from the executable.
+//
+//	The child gets no open files, and so no mapped files either.
+//	Return NULL if the executable cannot be opened again.
+//----------------------------------------------------------------------
+
+AddrSpace *
+AddrSpace::Fork()
+{
+    FrameTable *frames = kernel->frameTable;
+    AddrSpace *child = new AddrSpace();
+
+    child->executable = kernel->FileSys()->Open(execName);
+    if (child->executable == NULL) {
+	delete child;
+	return NULL;
     }
-    if (noffH.initData.size > 0) {
-        DEBUG(dbgAddr, "Initializing data segment.");
-	DEBUG(dbgAddr, noffH.initData.virtualAddr << ", " << noffH.initData.size);
-        executable->ReadAt(
-		&(kernel->machine->mainMemory[noffH.initData.virtualAddr]),
-			noffH.initData.size, noffH.initData.inFileAddr);
+    child->execName = new char[strlen(execName) + 1];
+    strcpy(child->execName, execName);
+    child->textKey = textKey;
+    child->noffH = noffH;
+    child->numPages = child->mapBase = mapBase;
+    child->pageTable = new TranslationEntry[mapBase];
+    child->swapSlot = new int[mapBase];
+    child->copyOnWrite = new bool[mapBase];
+    child->nextSharer = new FrameSharer[mapBase];
+
+    frames->lock->Acquire();
+    frames->SyncTLB();			// our dirty bits must be up to date
+    for (unsigned int i = 0; i < mapBase; i++) {
+	TranslationEntry *pte = &pageTable[i];
+	TranslationEntry *childPte = &child->pageTable[i];
+
+	*childPte = *pte;
+	child->swapSlot[i] = -1;
+	child->copyOnWrite[i] = FALSE;
+	child->nextSharer[i].space = NULL;
+	if (pte->valid) {
+	    // the TLB may still let us write it
+	    frames->InvalidateTLB(pte->physicalPage);
+	    // the child's backing store is the executable: unless the
+	    // frame is known to match it, the child must save it
+	    childPte->dirty = pte->dirty || swapSlot[i] != -1;
+	    childPte->use = FALSE;
+	    if (copyOnWrite[i] || !pte->readOnly)
+		copyOnWrite[i] = child->copyOnWrite[i] = TRUE;
+	    pte->readOnly = childPte->readOnly = TRUE;
+	    frames->Share(pte->physicalPage, child, i);
+	} else if (swapSlot[i] != -1)
+	    child->swapSlot[i] = frames->CopySwap(swapSlot[i]);
+    }
+    kernel->machine->InvalidateTranslation();
+    frames->lock->Release();
+    DEBUG(dbgAddr, "Forked address space " << asid << " as " << child->asid);
+    return child;
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::CopyOnWrite
+// 	Called before a write to virtual page "vpn" that is read-only:
+//	if the page is only read-only because its frame is shared after
+//	a Fork, give it a frame of its own with the same contents (or,
+//	if no one else uses the frame any more, just take it), and make
+//	it writable.
+//
+//	Return FALSE if the page is really read-only; otherwise the write
+//	can be retried -- though the page may have to be faulted in.
+//----------------------------------------------------------------------
+
+bool
+AddrSpace::CopyOnWrite(unsigned int vpn)
+{
+    FrameTable *frames = kernel->frameTable;
+    TranslationEntry *pte;
+    bool retry;
+
+    if (vpn >= numPages)
+	return FALSE;
+    pte = &pageTable[vpn];
+    frames->lock->Acquire();
+    if (pte->valid && copyOnWrite[vpn]) {
+	int frame = pte->physicalPage;
+
+	frames->InvalidateTLB(frame);	// the sharers' entries are read-only
+	if (frames->IsShared(frame)) {
+	    frames->Pin(frame);		// the source must stay while we wait
+	    int copy = frames->Allocate(this, vpn);
+
+	    DEBUG(dbgAddr, "Copy on write of page " << vpn << " to frame " << copy);
+	    bcopy(&(kernel->machine->mainMemory[frame * PageSize]),
+		  &(kernel->machine->mainMemory[copy * PageSize]), PageSize);
+	    frames->Unpin(frame);
+	    if (!frames->Unshare(frame, this, vpn))
+		frames->Release(frame);	// the others exited meanwhile
+	    pte->physicalPage = copy;
+	    pte->dirty = TRUE;
+	    frames->Unpin(copy);
+	    kernel->stats->numCopyOnWrites++;
+	}
+	pte->readOnly = FALSE;
+	copyOnWrite[vpn] = FALSE;
+	kernel->machine->InvalidateTranslation();
     }
+    retry = !(pte->valid && pte->readOnly);
+    frames->lock->Release();
+    return retry;
+}
+
+//----------------------------------------------------------------------
+// LoadSegment
+// 	Copy the part of segment "seg" that falls in the page starting at
+//	virtual address "vaddr" from the executable into "frame".
+//----------------------------------------------------------------------
+
+static int
+SegmentOverlap(Segment *seg, int vaddr)
+{
+    int start = max(seg->virtualAddr, vaddr);
+    int end = min(seg->virtualAddr + seg->size, vaddr + PageSize);
+
+    return (start < end) ? end - start : 0;
+}
+
+static void
+LoadSegment(OpenFile *executable, Segment *seg, int vaddr, char *frame)
+{
+    int start = max(seg->virtualAddr, vaddr);
+    int end = min(seg->virtualAddr + seg->size, vaddr + PageSize);
+
+    if (start < end)
+	executable->ReadAt(frame + (start - vaddr), end - start,
+			seg->inFileAddr + (start - seg->virtualAddr));
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::LoadPage
+// 	Fill a frame with the initial contents of virtual page "vpn":
+//	whatever code and data the executable has there, and zeros for
+//	the rest (uninitialized data and stack).  Pages of nothing but
+//	uninitialized data or stack are just zero-filled, without going
+//	to the executable; pages all code and data are not zeroed first.
+//----------------------------------------------------------------------
+
+void
+AddrSpace::LoadPage(unsigned int vpn, char *frame)
+{
+    int vaddr = vpn * PageSize;
+    int loaded = SegmentOverlap(&noffH.code, vaddr)
+		+ SegmentOverlap(&noffH.initData, vaddr);
 
 #ifdef RDATA
-    if (noffH.readonlyData.size > 0) {
-        DEBUG(dbgAddr, "Initializing read only data segment.");
-	DEBUG(dbgAddr, noffH.readonlyData.virtualAddr << ", " << noffH.readonlyData.size);
-        executable->ReadAt(
-		&(kernel->machine->mainMemory[noffH.readonlyData.virtualAddr]),
-			noffH.readonlyData.size, noffH.readonlyData.inFileAddr);
+    loaded += SegmentOverlap(&noffH.readonlyData, vaddr);
+#endif
+    if (loaded < PageSize)
+	bzero(frame, PageSize);
+    if (loaded == 0) {
+	kernel->stats->numZeroFillPages++;
+	return;
     }
+    LoadSegment(executable, &noffH.code, vaddr, frame);
+    LoadSegment(executable, &noffH.initData, vaddr, frame);
+#ifdef RDATA
+    LoadSegment(executable, &noffH.readonlyData, vaddr, frame);
 #endif
+}
 
-    delete executable;			// close file
-    return TRUE;			// success
+//----------------------------------------------------------------------
+// AddrSpace::IsText
+// 	Return TRUE if virtual page "vpn" lies wholly inside the code
+//	segment, so that it is never written and every process running
+//	this executable can map the same frame for it.
+//----------------------------------------------------------------------
+
+bool
+AddrSpace::IsText(unsigned int vpn)
+{
+    return (int)(vpn * PageSize) >= noffH.code.virtualAddr &&
+	   (int)((vpn + 1) * PageSize) <= noffH.code.virtualAddr + noffH.code.size;
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::InRange, MapOf
+// 	Return TRUE if virtual page "vpn" is part of the address space:
+//	one of the program's own, or of a mapped file -- the gaps that
+//	Unmap leaves are not.  Return the mapping a page belongs to, or
+//	NULL if it is one of the program's.
+//----------------------------------------------------------------------
+
+bool
+AddrSpace::InRange(unsigned int vpn)
+{
+    return vpn < mapBase || (vpn < numPages && MapOf(vpn) != NULL);
+}
+
+MappedFile *
+AddrSpace::MapOf(unsigned int vpn)
+{
+    for (MappedFile *map = mappings; map != NULL; map = map->next)
+	if (vpn >= map->firstPage && vpn < map->firstPage + map->numPages)
+	    return map;
+    return NULL;
+}
+
+//----------------------------------------------------------------------
+// MappedBytes
+// 	Return how many bytes of the file mapped by "map" fall in its
+//	virtual page "vpn" (fewer than a page only at the end), and store
+//	where in the file they are in "position".
+//----------------------------------------------------------------------
+
+static int
+MappedBytes(MappedFile *map, unsigned int vpn, int *position)
+{
+    int done = (vpn - map->firstPage) * PageSize;
+
+    *position = map->offset + done;
+    return min(PageSize, map->length - done);
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::WriteBack
+// 	Write virtual page "vpn", which is in memory and belongs to the
+//	mapping "map", back to the mapped file, through the disk cache.
+//	The page is clean afterwards.
+//----------------------------------------------------------------------
+
+void
+AddrSpace::WriteBack(MappedFile *map, unsigned int vpn)
+{
+    int frame = pageTable[vpn].physicalPage;
+    int position, bytes = MappedBytes(map, vpn, &position);
+
+    DEBUG(dbgAddr, "Write back mapped page " << vpn << " from frame " << frame);
+    map->file->WriteAt(&(kernel->machine->mainMemory[frame * PageSize]),
+			bytes, position);
+    pageTable[vpn].dirty = FALSE;
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::PageIn
+// 	Handle a page fault on virtual page "vpn": get a frame from the
+//	frame table and fill it from the swap file if the page has been
+//	written out before, or from the executable (or the mapped file)
+//	if not.  A code page
+//	that another process running the same executable already has in
+//	memory is just mapped to the same frame.
+//----------------------------------------------------------------------
+
+void
+AddrSpace::PageIn(unsigned int vpn)
+{
+    FrameTable *frames = kernel->frameTable;
+    TranslationEntry *pte = &pageTable[vpn];
+    int frame;
+
+    ASSERT(InRange(vpn));
+    frames->lock->Acquire();
+    if (!pte->valid && textKey != -1 && IsText(vpn)
+	    && (frame = frames->FindText(textKey, vpn)) != -1) {
+	DEBUG(dbgAddr, "Share code page " << vpn << " in frame " << frame);
+	frames->Share(frame, this, vpn);
+	pte->physicalPage = frame;
+	pte->use = FALSE;
+	pte->dirty = FALSE;
+	pte->valid = TRUE;
+	numPageFaults++;
+	kernel->currentThread->pageFaults++;
+	kernel->stats->numPageFaults++;
+	TRACE(TracePageFault, vpn, kernel->currentThread->getID());
+	kernel->stats->numSharedCodePages++;
+    }
+    if (!pte->valid) {
+	frame = frames->Allocate(this, vpn);
+	DEBUG(dbgAddr, "Page in " << vpn << " to frame " << frame);
+	if (swapSlot[vpn] != -1)
+	    frames->ReadSwap(swapSlot[vpn], frame);
+	else if (vpn >= mapBase) {
+	    MappedFile *map = MapOf(vpn);
+	    char *memory = &(kernel->machine->mainMemory[frame * PageSize]);
+	    int position, bytes = MappedBytes(map, vpn, &position);
+
+	    bzero(memory, PageSize);	// past the end of the file, too
+	    map->file->ReadAt(memory, bytes, position);
+	} else
+	    LoadPage(vpn, &(kernel->machine->mainMemory[frame * PageSize]));
+	if (textKey != -1 && IsText(vpn))
+	    frames->TagText(frame, textKey, vpn);
+	pte->physicalPage = frame;
+	pte->use = FALSE;
+	pte->dirty = FALSE;
+	pte->valid = TRUE;
+	frames->Unpin(frame);
+	numPageFaults++;
+	kernel->currentThread->pageFaults++;
+	kernel->stats->numPageFaults++;
+	TRACE(TracePageFault, vpn, kernel->currentThread->getID());
+    }
+    frames->lock->Release();
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::Evict
+// 	Give up the frame holding virtual page "vpn".  A modified page has
+//	to be written to its swap slot, which is returned; a clean one can
+//	just be dropped (-1 is returned), since its swap slot or the
+//	executable still has the same contents.  A modified page of a
+//	mapped file is written back to the file right here, and -1 is
+//	returned too.
+//
+//	The page table entry is invalidated here, and the frame table does
+//	the disk write afterwards, so the owner faults (and waits for the
+//	frame table) if it runs meanwhile.  A page shared copy-on-write
+//	comes back private.
+//----------------------------------------------------------------------
+
+int
+AddrSpace::Evict(unsigned int vpn)
+{
+    TranslationEntry *pte = &pageTable[vpn];
+
+    DEBUG(dbgAddr, "Evict page " << vpn << " from frame " << pte->physicalPage);
+    pte->valid = FALSE;
+    if (copyOnWrite[vpn]) {
+	copyOnWrite[vpn] = FALSE;
+	pte->readOnly = FALSE;
+    }
+    kernel->machine->InvalidateTranslation();
+    numPageEvictions++;
+    kernel->stats->numPageEvictions++;
+    if (!pte->dirty)
+	return -1;
+    numDirtyWriteBacks++;
+    kernel->stats->numDirtyWriteBacks++;
+    if (vpn >= mapBase) {
+	WriteBack(MapOf(vpn), vpn);
+	return -1;
+    }
+    if (swapSlot[vpn] == -1)
+	swapSlot[vpn] = kernel->frameTable->AllocateSwap();
+    return swapSlot[vpn];
+}
+//----------------------------------------------------------------------
+// AddrSpace::CanCheckpoint
+// 	Return TRUE if Checkpoint can save this address space: none of
+//	its pages is to be found only in the swap file, and it has no
+//	files open or mapped, which a resumed process would not have.
+//----------------------------------------------------------------------
+
+bool
+AddrSpace::CanCheckpoint()
+{
+#ifndef FILESYS_STUB
+    if (!files->IsEmpty())
+	return FALSE;
+#endif
+    if (mappings != NULL)
+	return FALSE;
+    for (unsigned int i = 0; i < numPages; i++) {
+	if (!pageTable[i].valid && swapSlot[i] != -1)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::Checkpoint
+// 	Write this address space to the UNIX file "fd": the executable's
+//	name, the number of pages, and the contents of each page that is
+//	in memory.  The rest will be read from the executable again.
+//
+//	Frames are not kept, nor is sharing: Resume gives each page a
+//	frame of its own.  A page is saved as dirty unless it is known
+//	to match the executable, as for a Fork.
+//----------------------------------------------------------------------
+
+void
+AddrSpace::Checkpoint(int fd)
+{
+    int header[3];
+
+    ASSERT(CanCheckpoint());
+    kernel->frameTable->SyncTLB();	// the dirty bits must be up to date
+    header[0] = strlen(execName);
+    header[1] = numPages;
+    header[2] = 0;
+    for (unsigned int i = 0; i < numPages; i++) {
+	if (pageTable[i].valid)
+	    header[2]++;
+    }
+    WriteFile(fd, (char *)header, sizeof(header));
+    WriteFile(fd, execName, header[0]);
+    for (unsigned int i = 0; i < numPages; i++) {
+	TranslationEntry *pte = &pageTable[i];
+	int page[2];
+
+	if (!pte->valid)
+	    continue;
+	page[0] = i;
+	page[1] = pte->dirty || swapSlot[i] != -1;
+	WriteFile(fd, (char *)page, sizeof(page));
+	WriteFile(fd, &(kernel->machine->mainMemory[pte->physicalPage * PageSize]),
+		PageSize);
+    }
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::Resume
+// 	Build this (new) address space from what Checkpoint wrote to the
+//	UNIX file "fd": Load the same executable, then put back each page
+//	that was in memory.  Return FALSE if the executable can't be
+//	opened.
+//----------------------------------------------------------------------
+
+bool
+AddrSpace::Resume(int fd)
+{
+    FrameTable *frames = kernel->frameTable;
+    int header[3];
+    char *name;
+    bool loaded;
+
+    Read(fd, (char *)header, sizeof(header));
+    name = new char[header[0] + 1];
+    Read(fd, name, header[0]);
+    name[header[0]] = '\0';
+    loaded = Load(name);		// copies the name
+    delete [] name;
+    if (!loaded)
+	return FALSE;
+    ASSERT((unsigned int)header[1] >= numPages);
+    if ((unsigned int)header[1] > numPages)
+	Grow(header[1] - numPages);
+
+    frames->lock->Acquire();
+    for (int i = 0; i < header[2]; i++) {
+	int page[2];
+	TranslationEntry *pte;
+	int frame;
+
+	Read(fd, (char *)page, sizeof(page));
+	ASSERT(InRange(page[0]));
+	pte = &pageTable[page[0]];
+	frame = frames->Allocate(this, page[0]);
+	Read(fd, &(kernel->machine->mainMemory[frame * PageSize]), PageSize);
+	if (textKey != -1 && IsText(page[0]))
+	    frames->TagText(frame, textKey, page[0]);
+	pte->physicalPage = frame;
+	pte->use = FALSE;
+	pte->dirty = page[1];
+	pte->valid = TRUE;
+	frames->Unpin(frame);
+    }
+    frames->lock->Release();
+    return TRUE;
 }
 
+//----------------------------------------------------------------------
+// AddrSpace::RefillTLB
+// 	Handle a TLB miss on virtual page "vpn": page it in if it is not
+//	in memory, then load its translation into the TLB, tagged with
+//	this address space's id.  Return FALSE if "vpn" is not part of
+//	the address space.
+//----------------------------------------------------------------------
+
+bool
+AddrSpace::RefillTLB(unsigned int vpn)
+{
+    if (!InRange(vpn))
+	return FALSE;
+    while (!pageTable[vpn].valid)
+	PageIn(vpn);
+    kernel->frameTable->LoadTLB(asid, &pageTable[vpn]);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::Grow
+// 	Add "pages" pages to the top of the address space, none of them
+//	in memory yet.  Called by Load with the program's size, and by
+//	Map when a mapping does not fit below the top; the frame table
+//	finds pages by number, so the tables can move.
+//----------------------------------------------------------------------
+
+void
+AddrSpace::Grow(unsigned int pages)
+{
+    unsigned int size = numPages + pages;
+    TranslationEntry *table = new TranslationEntry[size];
+    int *slots = new int[size];
+    bool *shared = new bool[size];
+    FrameSharer *sharers = new FrameSharer[size];
+
+    for (unsigned int i = 0; i < size; i++) {
+	if (i < numPages) {
+	    table[i] = pageTable[i];
+	    slots[i] = swapSlot[i];
+	    shared[i] = copyOnWrite[i];
+	    sharers[i] = nextSharer[i];
+	    continue;
+	}
+	table[i].virtualPage = i;
+	table[i].physicalPage = -1;
+	table[i].valid = FALSE;		// faulted in by PageIn
+	table[i].use = FALSE;
+	table[i].dirty = FALSE;
+	table[i].readOnly = IsText(i);	// code is shared
+	slots[i] = -1;
+	shared[i] = FALSE;
+	sharers[i].space = NULL;
+    }
+    delete [] pageTable;
+    delete [] swapSlot;
+    delete [] copyOnWrite;
+    delete [] nextSharer;
+    pageTable = table;
+    swapSlot = slots;
+    copyOnWrite = shared;
+    nextSharer = sharers;
+    numPages = size;
+    if (kernel->currentThread->space == this)
+	RestoreState();			// the machine may have the old table
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::Map
+// 	Map "length" bytes of "file", starting "offset" bytes into it, at
+//	the lowest free addresses above the program's stack, and return
+//	the virtual address of the first byte.  Nothing is read yet: each
+//	page is faulted in from the file when it is first touched.
+//	Return -1 if the arguments are bad or the space is full.
+//----------------------------------------------------------------------
+
+int
+AddrSpace::Map(OpenFile *file, int offset, int length)
+{
+    FrameTable *frames = kernel->frameTable;
+    MappedFile **link = &mappings;
+    unsigned int first = mapBase, pages;
+    MappedFile *map;
+
+    if (offset < 0 || length <= 0 || length > MaxMappedPages * PageSize)
+	return -1;
+    pages = divRoundUp(length, PageSize);
+    // first fit, in a gap left by Unmap or above every mapping
+    while (*link != NULL && (*link)->firstPage < first + pages) {
+	first = (*link)->firstPage + (*link)->numPages;
+	link = &(*link)->next;
+    }
+    if (first + pages - mapBase > MaxMappedPages)
+	return -1;
+
+    map = new MappedFile;
+    map->file = file;
+    map->offset = offset;
+    map->length = length;
+    map->firstPage = first;
+    map->numPages = pages;
+    frames->lock->Acquire();
+    if (first + pages > numPages)
+	Grow(first + pages - numPages);
+    map->next = *link;
+    *link = map;
+    frames->lock->Release();
+    DEBUG(dbgAddr, "Map " << length << " bytes at page " << first);
+    return first * PageSize;
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::Unmap, UnmapFile
+// 	Remove the mapping that starts at virtual address "vaddr", or
+//	every mapping of "file" (before it is closed), writing modified
+//	pages back to the file.  Unmap returns FALSE if no mapping starts
+//	at "vaddr".
+//----------------------------------------------------------------------
+
+bool
+AddrSpace::Unmap(int vaddr)
+{
+    for (MappedFile *map = mappings; map != NULL; map = map->next)
+	if ((int)(map->firstPage * PageSize) == vaddr) {
+	    Drop(map);
+	    return TRUE;
+	}
+    return FALSE;
+}
+
+void
+AddrSpace::UnmapFile(OpenFile *file)
+{
+    MappedFile *map = mappings;
+
+    while (map != NULL) {
+	if (map->file == file) {
+	    Drop(map);
+	    map = mappings;		// start over: the list has changed
+	} else
+	    map = map->next;
+    }
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::CloseAll
+// 	Write back and drop every mapping, then close the executable and
+//	every file still open.  Called by Kernel::ExitProcess, while the
+//	exiting thread can still wait for the disk and for locks, which
+//	the destructor may not.
+//----------------------------------------------------------------------
+
+void
+AddrSpace::CloseAll()
+{
+    while (mappings != NULL)
+	Drop(mappings);		// written back while the files are open
+    if (executable != NULL) {
+	delete executable;
+	executable = NULL;
+    }
+#ifndef FILESYS_STUB
+    delete files;		// closes whatever is still open
+    files = NULL;
+#endif
+}
+
+//----------------------------------------------------------------------
+// AddrSpace::Drop
+// 	Remove the mapping "map": write its modified pages back to the
+//	file and free their frames.  Pages already evicted were written
+//	back then.  The addresses are left for a later Map to reuse.
+//----------------------------------------------------------------------
+
+void
+AddrSpace::Drop(MappedFile *map)
+{
+    FrameTable *frames = kernel->frameTable;
+    MappedFile **link = &mappings;
+
+    frames->lock->Acquire();
+    frames->SyncTLB();			// the dirty bits must be up to date
+    for (unsigned int vpn = map->firstPage;
+		vpn < map->firstPage + map->numPages; vpn++) {
+	TranslationEntry *pte = &pageTable[vpn];
+
+	if (!pte->valid)
+	    continue;
+	if (pte->dirty)
+	    WriteBack(map, vpn);
+	pte->valid = FALSE;
+	frames->Release(pte->physicalPage);
+    }
+    while (*link != map)
+	link = &(*link)->next;
+    *link = map->next;
+    frames->lock->Release();
+    DEBUG(dbgAddr, "Unmap page " << map->firstPage);
+    delete map;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // AddrSpace::Execute
 // 	Run a user program using the current thread
@@ -187,6 +871,8 @@ AddrSpace::Execute(char* fileName)
 {
 
     kernel->currentThread->space = this;
+    kernel->currentThread->LoadUserState();	// MP4: take the machine from
+					// the user program that has it
 
     this->InitRegisters();		// set the initial register values
     this->RestoreState();		// load page table register
@@ -252,10 +938,17 @@ void AddrSpace::SaveState()
 //	this address space can run.
 //
 //      For now, tell the machine where to find the page table.
+//	With a TLB, just switch the address space id: entries of other
+//	spaces stay in the TLB but no longer match (MP4).
 //----------------------------------------------------------------------
 
 void AddrSpace::RestoreState() 
 {
+    kernel->machine->InvalidateTranslation();	// MP4
+    if (kernel->machine->tlb != NULL) {
+	kernel->machine->asid = asid;
+	return;
+    }
     kernel->machine->pageTable = pageTable;
     kernel->machine->pageTableSize = numPages;
 }
@@ -277,12 +970,21 @@ AddrSpace::Translate(unsigned int vaddr, unsigned int *paddr, int isReadWrite)
     unsigned int      vpn    = vaddr / PageSize;
     unsigned int      offset = vaddr % PageSize;
 
-    if(vpn >= numPages) {
+    if(!InRange(vpn)) {		// MP4: gaps between mapped files too
         return AddressErrorException;
     }
 
     pte = &pageTable[vpn];
 
+    // MP4: bring the page in, and copy it before writing to it if its
+    // frame is shared copy-on-write
+    while (!pte->valid || (isReadWrite && copyOnWrite[vpn])) {
+        if (!pte->valid)
+            PageIn(vpn);
+        else
+            CopyOnWrite(vpn);
+    }
+
     if(isReadWrite && pte->readOnly) {
         return ReadOnlyException;
     }
@@ -311,6 +1013,469 @@ AddrSpace::Translate(unsigned int vaddr, unsigned int *paddr, int isReadWrite)
     return NoException;
 }
 
+// MP4 start
+//----------------------------------------------------------------------
+// FrameTable::FrameTable
+// 	Initialize the table of physical page frames; every frame is free.
+//
+//	"policy" -- how to choose a frame to evict when none is free
+//----------------------------------------------------------------------
+
+FrameTable::FrameTable(ReplacementPolicy policy)
+{
+    for (int i = 0; i < NumPhysPages; i++) {
+	owner[i] = NULL;
+	page[i] = 0;
+	pinned[i] = 0;
+	textKey[i] = -1;
+	age[i] = 0;
+	lastUse[i] = 0;
+	loadedAt[i] = 0;
+    }
+    for (int i = 0; i < TLBSets; i++)
+	tlbNext[i] = 0;
+    this->policy = policy;
+    hand = 0;
+    numLoads = 0;
+    frameMap = new Bitmap(NumPhysPages);
+    swapMap = new Bitmap(NumSwapPages);
+    swapFile = NULL;
+    lock = new Lock("frame table");
+}
+
+//----------------------------------------------------------------------
+// FrameTable::~FrameTable
+// 	De-allocate the frame table and close the swap file.
+//----------------------------------------------------------------------
+
+FrameTable::~FrameTable()
+{
+    delete frameMap;
+    delete swapMap;
+    if (swapFile != NULL)
+	delete swapFile;
+    delete lock;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::Allocate
+// 	Find a frame to hold page "vpn" of "space".  If every frame is in
+//	use, a victim is evicted from its owner.  The frame is returned
+//	pinned, so it stays put while the caller fills it.
+//
+//	A shared victim is taken from all its sharers.  Their page tables
+//	are all updated before any of them is written to swap, so no
+//	sharer is looked at once we may have blocked (and it may have
+//	exited).
+//
+//	The caller must hold the frame table lock.
+//----------------------------------------------------------------------
+
+int
+FrameTable::Allocate(AddrSpace *space, unsigned int vpn)
+{
+    AddrSpace *victim = NULL;
+    unsigned int victimPage = 0;
+    List<int> writes;			// swap slots the victim goes to
+    int frame;
+
+    ASSERT(lock->IsHeldByCurrentThread());
+    frame = frameMap->FindAndSet();
+    if (frame == -1) {
+	frame = FindVictim();
+	victim = owner[frame];
+	victimPage = page[frame];
+	InvalidateTLB(frame);		// its dirty bit may be in there
+    }
+
+    // claim the frame before blocking on the disk to evict the victim
+    textKey[frame] = -1;
+    owner[frame] = space;
+    page[frame] = vpn;
+    pinned[frame]++;
+    age[frame] = 0;
+    lastUse[frame] = kernel->stats->totalTicks;
+    loadedAt[frame] = ++numLoads;
+    // whatever fills it, the decode cache must not run the old page
+    kernel->machine->MemoryChanged(frame * PageSize, PageSize);
+    while (victim != NULL) {
+	FrameSharer *link = victim->NextSharer(victimPage);
+	AddrSpace *next = link->space;
+	unsigned int nextPage = link->vpn;
+	int slot;
+
+	link->space = NULL;
+	slot = victim->Evict(victimPage);
+	if (slot != -1)
+	    writes.Append(slot);
+	victim = next;
+	victimPage = nextPage;
+    }
+    while (!writes.IsEmpty())
+	WriteSwap(writes.RemoveFront(), frame);
+    return frame;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::Release
+// 	Mark a frame free, when its owner goes away.
+//----------------------------------------------------------------------
 
+void
+FrameTable::Release(int frame)
+{
+    ASSERT(pinned[frame] == 0);
+    InvalidateTLB(frame);
+    kernel->machine->InvalidateTranslation();
+    owner[frame] = NULL;
+    textKey[frame] = -1;
+    frameMap->Clear(frame);
+}
 
+//----------------------------------------------------------------------
+// FrameTable::FindText
+// 	Return the frame holding code page "vpn" of the executable whose
+//	header is at sector "key", or -1 if it is not in memory.
+//----------------------------------------------------------------------
 
+int
+FrameTable::FindText(int key, unsigned int vpn)
+{
+    for (int frame = 0; frame < NumPhysPages; frame++)
+	if (textKey[frame] == key && textPage[frame] == vpn)
+	    return frame;
+    return -1;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::Share
+// 	Add page "vpn" of "space" to the sharers of "frame", at the head
+//	of the chain, so that it becomes the recorded owner.
+//----------------------------------------------------------------------
+
+void
+FrameTable::Share(int frame, AddrSpace *space, unsigned int vpn)
+{
+    FrameSharer *link = space->NextSharer(vpn);
+
+    ASSERT(owner[frame] != NULL && link->space == NULL);
+    link->space = owner[frame];
+    link->vpn = page[frame];
+    owner[frame] = space;
+    page[frame] = vpn;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::Unshare
+// 	Take page "vpn" of "space" off the sharers of "frame".  Return
+//	FALSE if it was the only one; the frame is then left to the
+//	caller, to keep or to Release.
+//----------------------------------------------------------------------
+
+bool
+FrameTable::Unshare(int frame, AddrSpace *space, unsigned int vpn)
+{
+    FrameSharer *next = space->NextSharer(vpn);
+    FrameSharer *link;
+
+    if (owner[frame] == space && page[frame] == vpn) {
+	if (next->space == NULL)
+	    return FALSE;
+	owner[frame] = next->space;
+	page[frame] = next->vpn;
+    } else {
+	link = owner[frame]->NextSharer(page[frame]);
+	while (link->space != space || link->vpn != vpn) {
+	    ASSERT(link->space != NULL);	// it was not a sharer
+	    link = link->space->NextSharer(link->vpn);
+	}
+	*link = *next;
+    }
+    next->space = NULL;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::FindVictim
+// 	Choose a frame to evict, according to the replacement policy.
+//	Pinned frames are never chosen.
+//----------------------------------------------------------------------
+
+int
+FrameTable::FindVictim()
+{
+    SyncTLB();				// the policies look at the use bits
+    switch (policy) {
+      case ReplaceLRU:
+	return FindLRU();
+      case ReplaceClock:
+	return FindClock();
+      case ReplaceWorkingSet:
+	return FindWorkingSet();
+      default:
+	return FindFIFO();
+    }
+}
+
+//----------------------------------------------------------------------
+// FrameTable::FindFIFO
+// 	Evict the page that was brought in first.  Frames are filled in
+//	no particular order once pages have been released, so each one
+//	is stamped with when it was filled, and the oldest stamp goes.
+//----------------------------------------------------------------------
+
+int
+FrameTable::FindFIFO()
+{
+    int victim = -1;
+
+    for (int frame = 0; frame < NumPhysPages; frame++) {
+	if (pinned[frame] > 0)
+	    continue;
+	if (victim == -1 || loadedAt[frame] < loadedAt[victim])
+	    victim = frame;
+    }
+    ASSERT(victim != -1);		// every frame is pinned
+    return victim;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::FindLRU
+// 	Approximate least recently used with aging: on every eviction
+//	each frame's history is shifted right and its use bit shifted in
+//	at the top, and the frame with the smallest history goes.  Among
+//	equally old pages a clean one is preferred, since it costs no
+//	write to swap.
+//----------------------------------------------------------------------
+
+int
+FrameTable::FindLRU()
+{
+    int victim = -1;
+
+    for (int frame = 0; frame < NumPhysPages; frame++) {
+	TranslationEntry *pte = Entry(frame);
+
+	age[frame] = (age[frame] >> 1) | (pte->use ? 0x80 : 0);
+	pte->use = FALSE;
+	if (pinned[frame] > 0)
+	    continue;
+	if (victim == -1 || age[frame] < age[victim] ||
+		(age[frame] == age[victim] && !pte->dirty &&
+		 Entry(victim)->dirty))
+	    victim = frame;
+    }
+    ASSERT(victim != -1);		// every frame is pinned
+    return victim;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::FindClock
+// 	Second chance: the hand sweeps the frames, clearing use bits,
+//	and stops at the first page that has not been used since the
+//	hand last passed it.
+//----------------------------------------------------------------------
+
+int
+FrameTable::FindClock()
+{
+    for (int i = 0; i < 2 * NumPhysPages; i++) {
+	int frame = hand;
+	hand = (hand + 1) % NumPhysPages;
+	if (pinned[frame] > 0)
+	    continue;
+	if (!Entry(frame)->use)
+	    return frame;
+	Entry(frame)->use = FALSE;
+    }
+    ASSERTNOTREACHED();			// every frame is pinned
+    return -1;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::FindWorkingSet
+// 	Evict a page that has fallen out of its process's working set,
+//	that is, that has not been used for WorkingSetWindow ticks.  The
+//	hand sweeps the frames noting when each was last seen used; if
+//	every page is still in a working set, the oldest one goes.
+//----------------------------------------------------------------------
+
+int
+FrameTable::FindWorkingSet()
+{
+    int now = kernel->stats->totalTicks;
+    int oldest = -1;
+
+    for (int i = 0; i < NumPhysPages; i++) {
+	int frame = hand;
+	hand = (hand + 1) % NumPhysPages;
+	if (pinned[frame] > 0)
+	    continue;
+	if (Entry(frame)->use) {
+	    Entry(frame)->use = FALSE;
+	    lastUse[frame] = now;
+	} else if (now - lastUse[frame] > WorkingSetWindow)
+	    return frame;
+	if (oldest == -1 || lastUse[frame] < lastUse[oldest])
+	    oldest = frame;
+    }
+    ASSERT(oldest != -1);		// every frame is pinned
+    return oldest;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::AllocateSwap, FreeSwap
+// 	Reserve and return a slot in the swap file.
+//----------------------------------------------------------------------
+
+int
+FrameTable::AllocateSwap()
+{
+    int slot = swapMap->FindAndSet();
+
+    ASSERT(slot != -1);			// out of swap space
+    return slot;
+}
+
+void
+FrameTable::FreeSwap(int slot)
+{
+    swapMap->Clear(slot);
+}
+
+//----------------------------------------------------------------------
+// FrameTable::ReadSwap, WriteSwap
+// 	Move one page between swap slot "slot" and frame "frame".  The
+//	swap file is created the first time a page is written out; it is
+//	sparse, so only slots that get used take up disk space.
+//----------------------------------------------------------------------
+
+void
+FrameTable::ReadSwap(int slot, int frame)
+{
+    ASSERT(swapFile != NULL);
+    swapFile->ReadAt(&(kernel->machine->mainMemory[frame * PageSize]),
+			PageSize, slot * PageSize);
+}
+
+void
+FrameTable::WriteSwap(int slot, int frame)
+{
+    if (swapFile == NULL) {
+#ifdef FILESYS_STUB
+	kernel->FileSys()->Create(swapFileName);
+#else
+	kernel->FileSys()->Create(swapFileName, NumSwapPages * PageSize);
+#endif
+	swapFile = kernel->FileSys()->Open(swapFileName);
+	ASSERT(swapFile != NULL);
+    }
+    swapFile->WriteAt(&(kernel->machine->mainMemory[frame * PageSize]),
+			PageSize, slot * PageSize);
+}
+
+//----------------------------------------------------------------------
+// FrameTable::CopySwap
+// 	Return a new swap slot holding the same page as "slot", for a
+//	Fork.
+//----------------------------------------------------------------------
+
+int
+FrameTable::CopySwap(int slot)
+{
+    char buffer[PageSize];
+    int copy = AllocateSwap();
+
+    ASSERT(swapFile != NULL);
+    swapFile->ReadAt(buffer, PageSize, slot * PageSize);
+    swapFile->WriteAt(buffer, PageSize, copy * PageSize);
+    return copy;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::LoadTLB
+// 	Put the translation "pte" of address space "asid" in the TLB set
+//	its page maps to, in an unused entry if the set has one, and
+//	otherwise in place of the set's entries in turn.  The replaced
+//	entry's use and dirty bits are saved in its page table first.
+//----------------------------------------------------------------------
+
+void
+FrameTable::LoadTLB(int asid, TranslationEntry *pte)
+{
+    int set = pte->virtualPage % TLBSets;
+    TranslationEntry *entry = NULL;
+
+    for (int i = 0; i < TLBWays; i++) {
+	entry = &(kernel->machine->tlb[set * TLBWays + i]);
+	if (!entry->valid)
+	    break;
+    }
+    if (entry->valid) {
+	entry = &(kernel->machine->tlb[set * TLBWays + tlbNext[set]]);
+	tlbNext[set] = (tlbNext[set] + 1) % TLBWays;
+	SaveTLBEntry(entry);
+    }
+    kernel->machine->InvalidateTranslation();	// "entry" may be cached
+    *entry = *pte;
+    entry->use = FALSE;		// the bits collect what happens from now on
+    entry->dirty = FALSE;
+    entry->asid = asid;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::SaveTLBEntry
+// 	The TLB, not the page table, records references made through a
+//	TLB entry.  OR them into the page table entry of the frame's owner
+//	and start the TLB entry afresh.  Valid TLB entries always refer to
+//	owned frames: entries are invalidated before a frame changes hands.
+//----------------------------------------------------------------------
+
+void
+FrameTable::SaveTLBEntry(TranslationEntry *entry)
+{
+    TranslationEntry *pte = Entry(entry->physicalPage);
+
+    pte->use = pte->use || entry->use;
+    pte->dirty = pte->dirty || entry->dirty;
+    entry->use = entry->dirty = FALSE;
+}
+
+//----------------------------------------------------------------------
+// FrameTable::InvalidateTLB
+// 	Remove any TLB entry for "frame", keeping its use and dirty bits.
+//----------------------------------------------------------------------
+
+void
+FrameTable::InvalidateTLB(int frame)
+{
+    TranslationEntry *tlb = kernel->machine->tlb;
+
+    if (tlb == NULL)
+	return;
+    for (int i = 0; i < TLBSize; i++)
+	if (tlb[i].valid && tlb[i].physicalPage == frame) {
+	    SaveTLBEntry(&tlb[i]);
+	    tlb[i].valid = FALSE;
+	    kernel->machine->InvalidateTranslation();
+	}
+}
+
+//----------------------------------------------------------------------
+// FrameTable::SyncTLB
+// 	Bring the use and dirty bits of every page table up to date with
+//	the TLB.
+//----------------------------------------------------------------------
+
+void
+FrameTable::SyncTLB()
+{
+    TranslationEntry *tlb = kernel->machine->tlb;
+
+    if (tlb == NULL)
+	return;
+    for (int i = 0; i < TLBSize; i++)
+	if (tlb[i].valid)
+	    SaveTLBEntry(&tlb[i]);
+}
+// MP4 end
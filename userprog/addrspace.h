@@ -14,10 +14,53 @@
 #define ADDRSPACE_H
 
 #include "copyright.h"
+#include "debug.h"
 #include "filesys.h"
+#include "noff.h"
 
 #define UserStackSize		1024 	// increase this as necessary!
 
+// MP4 start
+#define NumSwapPages		1024	// pages the swap file can hold
+#define MaxMappedPages		1024	// pages of files a process can map
+#define WorkingSetWindow	10000	// ticks a page stays in the working
+					// set after its last use
+
+// How FrameTable chooses a frame to evict when memory is full: oldest
+// loaded first, least recently used (approximated by aging the use
+// bits), second chance (CLOCK), or a page outside its working set
+enum ReplacementPolicy { ReplaceFIFO,
+                         ReplaceLRU,
+                         ReplaceClock,
+                         ReplaceWorkingSet,
+                         NumReplacementPolicies };
+
+class Lock;
+class Bitmap;
+class AddrSpace;
+
+// The sharers of a frame shared copy-on-write are chained through
+// these: one per page of each address space, naming the next address
+// space (and its page) in the same chain, or NULL at the end
+struct FrameSharer {
+    AddrSpace *space;
+    unsigned int vpn;
+};
+
+// A file mapped into an address space by Mmap.  Its pages have the file,
+// not the swap file, as their backing store: they are read from it
+// (through the disk cache) when first touched, and written back to it
+// when they are evicted dirty, or unmapped
+struct MappedFile {
+    OpenFile *file;			// the file, as it was opened
+    int offset;				// where the mapping starts in it
+    int length;				// and how many bytes it covers
+    unsigned int firstPage;		// first virtual page it is mapped at
+    unsigned int numPages;		// and how many follow
+    MappedFile *next;			// next mapping up, or NULL
+};
+// MP4 end
+
 class AddrSpace {
   public:
     AddrSpace();			// Create an address space.
@@ -39,15 +82,178 @@ class AddrSpace {
     // is 0 for Read, 1 for Write.
     ExceptionType Translate(unsigned int vaddr, unsigned int *paddr, int mode);
 
+    // MP4 start
+    AddrSpace *Fork();			// A copy of this address space that
+					// shares its frames copy-on-write;
+					// NULL if it cannot be made
+    void PageIn(unsigned int vpn);	// Bring virtual page _vpn_ into a
+					// frame, from swap or the executable
+    int Evict(unsigned int vpn);	// Give up the frame holding _vpn_;
+					// returns the swap slot it has to
+					// be written to, or -1 if clean
+    bool CopyOnWrite(unsigned int vpn);	// Make _vpn_ private before a
+					// write; FALSE if it is really
+					// read-only
+    bool RefillTLB(unsigned int vpn);	// Load the TLB with _vpn_ after a
+					// miss; FALSE if it is out of range
+    bool InRange(unsigned int vpn);	// Page _vpn_ is part of the space
+    int Map(OpenFile *file, int offset, int length);
+					// Map _length_ bytes of _file_, from
+					// _offset_ on, at unused addresses;
+					// returns where, or -1
+    bool Unmap(int vaddr);		// Write back and drop the mapping
+					// that starts at _vaddr_
+    void UnmapFile(OpenFile *file);	// ... every mapping of _file_
+    void CloseAll();			// ... of every file, and close the
+					// executable and the open files; the
+					// process is exiting
+    bool CanCheckpoint();		// Every page is in memory or still
+					// in the executable, and no file is
+					// open or mapped
+    void Checkpoint(int fd);		// Write the pages in memory to the
+					// UNIX file _fd_
+    bool Resume(int fd);		// Load the executable and those pages
+					// back from it; FALSE if it can't be
+    TranslationEntry *PageEntry(unsigned int vpn) { return &pageTable[vpn]; }
+    FrameSharer *NextSharer(unsigned int vpn) { return &nextSharer[vpn]; }
+
+    int numPageFaults;			// Paging statistics for this process
+    int numPageEvictions;
+    int numDirtyWriteBacks;
+    // MP4 end
+
+#ifndef FILESYS_STUB
+    FileDescriptorTable *files;		// MP4: this process's open files
+#endif
+
   private:
     TranslationEntry *pageTable;	// Assume linear page table translation
 					// for now!
     unsigned int numPages;		// Number of pages in the virtual 
 					// address space
 
+    // MP4 start
+    int asid;				// Tags this space's TLB entries
+    char *execName;			// Its name, to open it for a Fork
+    int textKey;			// Its header sector, under which
+					// its code pages are shared; -1 if
+					// they cannot be
+    OpenFile *executable;		// Kept open to load pages on demand
+    NoffHeader noffH;			// Where the segments are in it
+    int *swapSlot;			// Swap slot of each page, or -1 if
+					// it has never been written out
+    bool *copyOnWrite;			// Page is read-only only because its
+					// frame is shared with a Fork
+    FrameSharer *nextSharer;		// Chains of pages sharing a frame
+    unsigned int mapBase;		// First page past the program's own;
+					// files are mapped from here up
+    MappedFile *mappings;		// Mapped files, in address order
+
+    void LoadPage(unsigned int vpn, char *frame);
+					// Fill a frame from the executable
+    bool IsText(unsigned int vpn);	// Page holds nothing but code
+    MappedFile *MapOf(unsigned int vpn);// Mapping holding it, or NULL
+    void WriteBack(MappedFile *map, unsigned int vpn);
+					// Write a mapped page to its file
+    void Grow(unsigned int pages);	// Add pages at the top, invalid
+    void Drop(MappedFile *map);		// Remove a mapping, writing it back
+    // MP4 end
+
     void InitRegisters();		// Initialize user-level CPU registers,
 					// before jumping to user code
 
 };
 
+// MP4 start
+// The following class keeps track of who owns each physical page frame.
+// Frames are handed out to address spaces as their pages are touched;
+// when memory is full a victim frame, chosen by the replacement policy,
+// is taken from its owner, whose page is written to the swap file first
+// if it has been modified.
+//
+// Frames can be pinned while the kernel moves data in or out of them,
+// so that they are not taken away while a thread waits on the disk.
+//
+// After a Fork, a frame can belong to several address spaces at once,
+// read-only in all of them; the owner recorded here is the first of
+// its chain of sharers, and evicting the frame takes it from them all.
+// Frames holding code are also tagged with the executable's header
+// sector, so that every process running the same binary shares them.
+
+class FrameTable {
+  public:
+    FrameTable(ReplacementPolicy policy = ReplaceFIFO);
+					// Every frame starts out free
+    ~FrameTable();
+
+    int Allocate(AddrSpace *space, unsigned int vpn);
+					// Find a frame for page _vpn_ of
+					// _space_, evicting one if none is
+					// free; it is returned pinned
+    void Release(int frame);		// Frame is free again
+
+    void Share(int frame, AddrSpace *space, unsigned int vpn);
+					// Page _vpn_ of _space_ maps _frame_
+					// as well as its current owners
+    bool Unshare(int frame, AddrSpace *space, unsigned int vpn);
+					// It no longer does; FALSE if it was
+					// the last, and _frame_ is unused
+    bool IsShared(int frame)
+	{ return owner[frame]->NextSharer(page[frame])->space != NULL; }
+
+    void LoadTLB(int asid, TranslationEntry *pte);
+					// Put a translation in the TLB
+    void InvalidateTLB(int frame);	// Drop TLB entries for a frame
+    void SyncTLB();			// Fold TLB use/dirty bits back
+					// into the page tables
+
+    void Pin(int frame) { pinned[frame]++; }
+    void Unpin(int frame) { ASSERT(pinned[frame] > 0); pinned[frame]--; }
+
+    int AllocateSwap();			// Reserve a slot in the swap file
+    void FreeSwap(int slot);
+    void ReadSwap(int slot, int frame);	// Move a page between the swap
+    void WriteSwap(int slot, int frame);// file and a frame
+    int CopySwap(int slot);		// A new slot holding the same page
+
+    int FindText(int key, unsigned int vpn);
+					// Frame holding code page _vpn_ of
+					// the executable _key_, or -1
+    void TagText(int frame, int key, unsigned int vpn)
+	{ textKey[frame] = key; textPage[frame] = vpn; }
+					// _frame_ now holds that page
+
+    Lock *lock;				// Serializes page faults
+
+  private:
+    AddrSpace *owner[NumPhysPages];	// Who holds each frame, or NULL;
+    unsigned int page[NumPhysPages];	// which of its pages is there --
+					// the first sharer, if it is shared
+    int pinned[NumPhysPages];		// Frame cannot be evicted if > 0
+    int textKey[NumPhysPages];		// Executable whose code is in the
+    unsigned int textPage[NumPhysPages];// frame (-1 if none), and which page
+    ReplacementPolicy policy;		// How victims are chosen
+    int hand;				// Next frame to consider evicting
+    unsigned char age[NumPhysPages];	// LRU: use bits, newest on top
+    int lastUse[NumPhysPages];		// Working set: when last seen used
+    int loadedAt[NumPhysPages];		// FIFO: when filled, in Allocates
+    int numLoads;			// Allocates so far
+    int tlbNext[TLBSets];		// Next entry to replace in each set
+
+    Bitmap *frameMap;			// Frames in use
+    Bitmap *swapMap;			// Slots in use in the swap file
+    OpenFile *swapFile;			// Created on the first write
+
+    int FindVictim();			// Choose a frame to evict
+    int FindFIFO();			// ... under each policy
+    int FindLRU();
+    int FindClock();
+    int FindWorkingSet();
+    TranslationEntry *Entry(int frame)
+	{ return owner[frame]->PageEntry(page[frame]); }
+    void SaveTLBEntry(TranslationEntry *entry);
+					// Fold one entry's bits back
+};
+// MP4 end
+
 #endif // ADDRSPACE_H
@@ -25,6 +25,35 @@
 #include "ksyscall.h"
 #include "main.h"
 #include "syscall.h"
+
+// MP4: The following class times one trip through ExceptionHandler
+// for a system call, in simulated ticks and host time, and adds it
+// to the statistics when it goes out of scope -- whichever of the
+// handler's returns is taken.  Calls that never return (Halt, Exit)
+// are not counted.
+
+class SyscallTimer {
+  public:
+    SyscallTimer(int code) {
+	this->code = code;
+	if (code >= 0) {
+	    startTicks = kernel->stats->totalTicks;
+	    startNanos = HostNanoseconds();
+	}
+    }
+    ~SyscallTimer() {
+	if (code >= 0)
+	    kernel->stats->RecordSyscall(code,
+		kernel->stats->totalTicks - startTicks,
+		HostNanoseconds() - startNanos);
+    }
+
+  private:
+    int code;			// the system call, or -1 if not timing
+    int startTicks;		// totalTicks at the trap
+    long long startNanos;	// and the host clock
+};
+
 //----------------------------------------------------------------------
 // ExceptionHandler
 // 	Entry point into the Nachos kernel.  Called when a user program
@@ -52,9 +81,11 @@ void ExceptionHandler(ExceptionType which) {
     int type = kernel->machine->ReadRegister(2);
     int val;
     int status, exit, threadID, programID;
+    SyscallTimer timer((which == SyscallException) ? type : -1);	// MP4
     DEBUG(dbgSys, "Received Exception " << which << " type: " << type << "\n");
     switch (which) {
         case SyscallException:
+            TRACE(TraceSyscall, type, kernel->currentThread->getID());
             switch (type) {
                 case SC_Halt:
                     DEBUG(dbgSys, "Shutdown, initiated by user program.\n");
@@ -66,7 +97,8 @@ void ExceptionHandler(ExceptionType which) {
                     DEBUG(dbgSys, "Message received.\n");
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *msg = &(kernel->machine->mainMemory[val]);
+                        char msg[256];
+                        CopyStringFromUser(val, msg, sizeof(msg));  // MP4
                         cout << msg << endl;
                     }
                     SysHalt();
@@ -77,9 +109,12 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Create:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *filename = &(kernel->machine->mainMemory[val]);
-                        // cout << filename << endl;
-                        status = SysCreate(filename);
+                        char filename[256];
+                        // MP4: 0 (failure) for a bad or overlong name
+                        if (CopyStringFromUser(val, filename, sizeof(filename)) < 0)
+                            status = 0;
+                        else
+                            status = SysCreate(filename);
                         kernel->machine->WriteRegister(2, (int)status);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -92,9 +127,10 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Open:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *filename = &(kernel->machine->mainMemory[val]);
-                        // cout << filename << endl;
-                        int fd = SysOpen(filename);
+                        char filename[256];
+                        int fd = -1;  // MP4: for a bad or overlong name
+                        if (CopyStringFromUser(val, filename, sizeof(filename)) >= 0)
+                            fd = SysOpen(filename);
                         kernel->machine->WriteRegister(2, (int)fd);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -106,8 +142,8 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Write:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *buffer = &(kernel->machine->mainMemory[val]);
-                        status = SysWrite(buffer, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
+                        // MP4: the buffer is passed as a virtual address
+                        status = SysWrite(val, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
                         kernel->machine->WriteRegister(2, (int)status);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -119,8 +155,8 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Read:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *buffer = &(kernel->machine->mainMemory[val]);
-                        status = SysRead(buffer, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
+                        // MP4: the buffer is passed as a virtual address
+                        status = SysRead(val, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
                         kernel->machine->WriteRegister(2, (int)status);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -147,10 +183,13 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Create:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *filename = &(kernel->machine->mainMemory[val]);
+                        char filename[256];
                         int size = kernel->machine->ReadRegister(5);
-                        // cout << filename << endl;
-                        status = SysCreate(filename, size);
+                        // MP4: 0 (failure) for a bad or overlong name
+                        if (CopyStringFromUser(val, filename, sizeof(filename)) < 0)
+                            status = 0;
+                        else
+                            status = SysCreate(filename, size);
                         kernel->machine->WriteRegister(2, (int)status);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -162,9 +201,10 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Open:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *filename = &(kernel->machine->mainMemory[val]);
-                        // cout << filename << endl;
-                        int fd = SysOpen(filename);
+                        char filename[256];
+                        int fd = -1;  // MP4: for a bad or overlong name
+                        if (CopyStringFromUser(val, filename, sizeof(filename)) >= 0)
+                            fd = SysOpen(filename);
                         kernel->machine->WriteRegister(2, (int)fd);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -176,8 +216,8 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Write:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *buffer = &(kernel->machine->mainMemory[val]);
-                        status = SysWrite(buffer, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
+                        // MP4: the buffer is passed as a virtual address
+                        status = SysWrite(val, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
                         kernel->machine->WriteRegister(2, (int)status);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -189,8 +229,8 @@ void ExceptionHandler(ExceptionType which) {
                 case SC_Read:
                     val = kernel->machine->ReadRegister(4);
                     {
-                        char *buffer = &(kernel->machine->mainMemory[val]);
-                        status = SysRead(buffer, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
+                        // MP4: the buffer is passed as a virtual address
+                        status = SysRead(val, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
                         kernel->machine->WriteRegister(2, (int)status);
                     }
                     kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
@@ -211,8 +251,158 @@ void ExceptionHandler(ExceptionType which) {
                     return;
                     ASSERTNOTREACHED();
                     break;
+                case SC_Mmap:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysMmap(val, kernel->machine->ReadRegister(5),
+                                     kernel->machine->ReadRegister(6));
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Munmap:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysMunmap(val);
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Sync:
+                    status = SysSync();
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Fsync:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysFsync(val);
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_ReadDir:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysReadDir(val, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Clone:
+                    val = kernel->machine->ReadRegister(4);
+                    {
+                        char from[256], to[256];
+                        // 0 (failure) for a bad or overlong name
+                        if (CopyStringFromUser(val, from, sizeof(from)) < 0 ||
+                            CopyStringFromUser(kernel->machine->ReadRegister(5), to, sizeof(to)) < 0)
+                            status = 0;
+                        else
+                            status = SysClone(from, to);
+                        kernel->machine->WriteRegister(2, (int)status);
+                    }
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Rename:
+                    val = kernel->machine->ReadRegister(4);
+                    {
+                        char from[256], to[256];
+                        // 0 (failure) for a bad or overlong name
+                        if (CopyStringFromUser(val, from, sizeof(from)) < 0 ||
+                            CopyStringFromUser(kernel->machine->ReadRegister(5), to, sizeof(to)) < 0)
+                            status = 0;
+                        else
+                            status = SysRename(from, to);
+                        kernel->machine->WriteRegister(2, (int)status);
+                    }
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Submit:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysSubmit(val);
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
                     // MP4 end
 #endif
+                // MP4 start
+                case SC_Seek:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysSeek(val, kernel->machine->ReadRegister(5));
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_PWrite:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysPWrite(val, kernel->machine->ReadRegister(5),
+                                       kernel->machine->ReadRegister(6), kernel->machine->ReadRegister(7));
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_PRead:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysPRead(val, kernel->machine->ReadRegister(5),
+                                      kernel->machine->ReadRegister(6), kernel->machine->ReadRegister(7));
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_WriteV:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysWriteV(val, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_ReadV:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysReadV(val, kernel->machine->ReadRegister(5), kernel->machine->ReadRegister(6));
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                    // MP4 end
                 case SC_Add:
                     DEBUG(dbgSys, "Add " << kernel->machine->ReadRegister(4) << " + " << kernel->machine->ReadRegister(5) << "\n");
                     /* Process SysAdd Systemcall*/
@@ -241,16 +431,88 @@ void ExceptionHandler(ExceptionType which) {
                     DEBUG(dbgAddr, "Program exit\n");
                     val = kernel->machine->ReadRegister(4);
                     cout << "return value:" << val << endl;
-                    kernel->currentThread->Finish();
+                    SysExit(val);  // MP4: tells anyone in Join
                     break;
+                // MP4 start
+                case SC_Exec:
+                    val = kernel->machine->ReadRegister(4);
+                    {
+                        char filename[256];
+                        if (CopyStringFromUser(val, filename, sizeof(filename)) < 0)
+                            status = -1;
+                        else
+                            status = SysExec(filename);
+                        kernel->machine->WriteRegister(2, (int)status);
+                    }
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Fork:
+                    // the child resumes from our registers, so it has to
+                    // see the pc already past the syscall
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    status = SysFork();
+                    kernel->machine->WriteRegister(2, (int)status);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_Join:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysJoin(val);
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                case SC_GetStats:
+                    val = kernel->machine->ReadRegister(4);
+                    status = SysGetStats(val);
+                    kernel->machine->WriteRegister(2, (int)status);
+                    kernel->machine->WriteRegister(PrevPCReg, kernel->machine->ReadRegister(PCReg));
+                    kernel->machine->WriteRegister(PCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    kernel->machine->WriteRegister(NextPCReg, kernel->machine->ReadRegister(PCReg) + 4);
+                    return;
+                    ASSERTNOTREACHED();
+                    break;
+                    // MP4 end
                 default:
                     cerr << "Unexpected system call " << type << "\n";
                     break;
             }
             break;
+        // MP4 start
+        case PageFaultException:
+            val = kernel->machine->ReadRegister(BadVAddrReg);
+            DEBUG(dbgAddr, "Page fault at " << val << "\n");
+            if (kernel->machine->tlb == NULL
+                    ? !kernel->currentThread->space->InRange((unsigned int)val / PageSize)
+                    : !kernel->currentThread->space->RefillTLB((unsigned int)val / PageSize)) {
+                cerr << "Address error at " << val << "\n";
+                break;  // outside the address space, or between mapped files
+            }
+            if (kernel->machine->tlb == NULL)
+                kernel->currentThread->space->PageIn((unsigned int)val / PageSize);
+            return;  // the faulting instruction is retried
+        case ReadOnlyException:
+            val = kernel->machine->ReadRegister(BadVAddrReg);
+            DEBUG(dbgAddr, "Write to read-only page at " << val << "\n");
+            if (kernel->currentThread->space->CopyOnWrite((unsigned int)val / PageSize))
+                return;  // retried on a private copy of the page
+            cerr << "Write to read-only page at " << val << "\n";
+            break;
+            // MP4 end
         default:
             cerr << "Unexpected user mode exception " << (int)which << "\n";
             break;
     }
+    // MP4: the program can't go on; it exits, as if it had called Exit(-1)
+    SysExit(-1);
     ASSERTNOTREACHED();
 }
@@ -13,6 +13,9 @@
 
 #include "kernel.h"
 #include "synchconsole.h"
+#include "directory.h"  // MP4: for ReadDir
+#include "synchdisk.h"  // MP4: for Submit
+#include "syscall.h"    // MP4: DirEntry
 
 void SysHalt() {
     kernel->interrupt->Halt();
@@ -36,23 +39,19 @@ int SysCreate(char *filename) {
     // return value
     // 1: success
     // 0: failed
-    return kernel->fileSystem->Create(filename);
+    return kernel->FileSys()->Create(filename);
 }
 
 OpenFileId SysOpen(char *name) {
-    return kernel->fileSystem->OpenAFile(name);
-}
-
-int SysWrite(char *buffer, int size, OpenFileId id) {
-    return kernel->fileSystem->WriteFile(buffer, size, id);
-}
+    OpenFileId id = kernel->FileSys()->OpenAFile(name);
 
-int SysRead(char *buffer, int size, OpenFileId id) {
-    return kernel->fileSystem->ReadFile(buffer, size, id);
+    kernel->currentThread->ChargeOpen(name, id);  // MP4
+    return id;
 }
 
 int SysClose(OpenFileId id) {
-    return kernel->fileSystem->CloseFile(id);
+    kernel->currentThread->ChargeClose(id);  // MP4
+    return kernel->FileSys()->CloseFile(id);
 }
 // MP1 end
 #else
@@ -61,24 +60,470 @@ int SysCreate(char *filename, int size) {
     // 1: success
     // 0: failed
     // return kernel->interrupt->CreateFile(filename);
-    return kernel->fileSystem->Create(filename, size);
+    return kernel->FileSys()->Create(filename, size);
 }
 
 OpenFileId SysOpen(char *filename) {
-    return kernel->fileSystem->OpenAFile(filename);
+    OpenFileId id = kernel->FileSys()->OpenAFile(filename);
+
+    kernel->currentThread->ChargeOpen(filename, id);  // MP4
+    return id;
 }
 
-int SysWrite(char *buffer, int size, OpenFileId id) {
-    return kernel->fileSystem->WriteFile(buffer, size, id);
+int SysClose(OpenFileId id) {
+    OpenFile *file = kernel->currentThread->space->files->Get(id);
+
+    kernel->currentThread->ChargeClose(id);  // MP4
+
+    // MP4: its mappings are written back while it is still open
+    if (file != NULL)
+        kernel->currentThread->space->UnmapFile(file);
+    return kernel->FileSys()->CloseFile(id);
 }
 
-int SysRead(char *buffer, int size, OpenFileId id) {
-    return kernel->fileSystem->ReadFile(buffer, size, id);
+// MP4 start
+int SysMmap(OpenFileId id, int offset, int length) {
+    AddrSpace *space = kernel->currentThread->space;
+    OpenFile *file = space->files->Get(id);
+
+    if (file == NULL)
+        return -1;
+    return space->Map(file, offset, length);
 }
 
-int SysClose(OpenFileId id) {
-    return kernel->fileSystem->CloseFile(id);
+int SysMunmap(int address) {
+    return kernel->currentThread->space->Unmap(address) ? 1 : -1;
+}
+
+int SysSync() {
+    kernel->FileSys()->Sync();
+    return 1;
 }
+
+int SysFsync(OpenFileId id) {
+    return kernel->FileSys()->SyncFile(id);
+}
+// MP4 end
 #endif
 
+// MP4 start
+// Translate the first run of physically contiguous pages in the
+// "size"-byte user buffer at virtual address "vaddr", for a read of
+// user memory or a write to it ("writing").  Each page is translated
+// (and faulted in) once, and pinned, so that faulting in the next one
+// cannot page it out again.  Store the run's start in "paddr" and
+// return its length, or 0 if "vaddr" itself is a bad address.
+static int PinUserRun(int vaddr, int size, bool writing, unsigned int *paddr) {
+    AddrSpace *space = kernel->currentThread->space;
+    unsigned int next;
+    int length;
+
+    if (space->Translate(vaddr, paddr, writing) != NoException)
+        return 0;
+    kernel->frameTable->Pin(*paddr / PageSize);
+    length = min(PageSize - vaddr % PageSize, size);
+    while (length < size &&
+           space->Translate(vaddr + length, &next, writing) == NoException &&
+           next == *paddr + length) {
+        kernel->frameTable->Pin(next / PageSize);
+        length += min(PageSize, size - length);
+    }
+    return length;
+}
+
+// Unpin the pages of a run returned by PinUserRun.
+static void UnpinUserRun(unsigned int paddr, int length) {
+    for (unsigned int frame = paddr / PageSize; frame <= (paddr + length - 1) / PageSize; frame++)
+        kernel->frameTable->Unpin(frame);
+}
+
+// Copy "size" bytes from the user buffer at virtual address "vaddr"
+// into "buffer", a run of pages at a time.  Return the number of
+// bytes copied, which is short only at a bad address.
+int CopyFromUser(int vaddr, char *buffer, int size) {
+    unsigned int paddr;
+    int done = 0, length;
+
+    while (done < size) {
+        length = PinUserRun(vaddr + done, size - done, FALSE, &paddr);
+        if (length == 0)
+            break;
+        memcpy(buffer + done, &(kernel->machine->mainMemory[paddr]), length);
+        UnpinUserRun(paddr, length);
+        done += length;
+    }
+    return done;
+}
+
+// Copy "size" bytes from "buffer" to the user buffer at virtual
+// address "vaddr"; the result is as for CopyFromUser.
+int CopyToUser(char *buffer, int vaddr, int size) {
+    unsigned int paddr;
+    int done = 0, length;
+
+    while (done < size) {
+        length = PinUserRun(vaddr + done, size - done, TRUE, &paddr);
+        if (length == 0)
+            break;
+        memcpy(&(kernel->machine->mainMemory[paddr]), buffer + done, length);
+        kernel->machine->MemoryChanged(paddr, length);
+        UnpinUserRun(paddr, length);
+        done += length;
+    }
+    return done;
+}
+
+// Copy the null-terminated string at virtual address "vaddr" into
+// "buffer", which holds "size" bytes, looking for the end of the
+// string a page at a time.  Return its length, or -1 if it runs into
+// a bad address or does not fit; "buffer" is null-terminated either way.
+int CopyStringFromUser(int vaddr, char *buffer, int size) {
+    AddrSpace *space = kernel->currentThread->space;
+    unsigned int paddr;
+    int done = 0, length;
+    char *end;
+
+    while (done < size - 1) {
+        if (space->Translate(vaddr + done, &paddr, FALSE) != NoException)
+            break;
+        length = min(PageSize - (vaddr + done) % PageSize, size - 1 - done);
+        end = (char *)memchr(&(kernel->machine->mainMemory[paddr]), '\0', length);
+        if (end != NULL)
+            length = end - &(kernel->machine->mainMemory[paddr]);
+        memcpy(buffer + done, &(kernel->machine->mainMemory[paddr]), length);
+        done += length;
+        if (end != NULL) {
+            buffer[done] = '\0';
+            return done;
+        }
+    }
+    buffer[done] = '\0';
+    return -1;
+}
+
+// Move "size" bytes between the file "id" and the user buffer at
+// virtual address "buffer", at the file's seek position, or at byte
+// "position" if that is not negative.  Each run of physically
+// contiguous pages from PinUserRun is handed to the file system as one
+// piece of main memory, so the data goes straight between the user's
+// pages and the disk cache, with no kernel copy; the pages stay pinned
+// while the file system blocks on the disk.  What was moved is charged
+// to the calling thread.  Writes to SysConsoleOutput go to the display,
+// each run with one PutBuffer.
+// Return the number of bytes moved, or -1 if nothing could be.
+int SysTransfer(int buffer, int size, OpenFileId id, bool writing, int position = -1) {
+    unsigned int paddr;
+    int done = 0, length, moved;
+
+    if (id == SysConsoleOutput && (!writing || position >= 0))
+        return -1;  // the display can only be written, in order
+    while (done < size) {
+        // a read from the file writes the user's memory, and vice versa
+        length = PinUserRun(buffer + done, size - done, !writing, &paddr);
+        if (length == 0)
+            return (done > 0) ? done : -1;  // bad address
+
+        char *memory = &(kernel->machine->mainMemory[paddr]);
+        if (id == SysConsoleOutput) {
+            kernel->ConsoleOut()->PutBuffer(memory, length);
+            UnpinUserRun(paddr, length);
+            done += length;
+            continue;
+        }
+        if (position >= 0 && writing)
+            moved = kernel->FileSys()->WriteFileAt(memory, length, position + done, id);
+        else if (position >= 0)
+            moved = kernel->FileSys()->ReadFileAt(memory, length, position + done, id);
+        else if (writing)
+            moved = kernel->FileSys()->WriteFile(memory, length, id);
+        else
+            moved = kernel->FileSys()->ReadFile(memory, length, id);
+        if (!writing && moved > 0)
+            kernel->machine->MemoryChanged(paddr, moved);
+        UnpinUserRun(paddr, length);
+        if (moved < 0)
+            return (done > 0) ? done : -1;
+        kernel->currentThread->ChargeTransfer(id, moved, writing);
+        done += moved;
+        if (moved < length)
+            break;  // end of file, or the disk is full
+    }
+    return done;
+}
+
+int SysWrite(int buffer, int size, OpenFileId id) {
+    return SysTransfer(buffer, size, id, TRUE);
+}
+
+int SysRead(int buffer, int size, OpenFileId id) {
+    return SysTransfer(buffer, size, id, FALSE);
+}
+
+int SysPWrite(int buffer, int size, int position, OpenFileId id) {
+    if (position < 0)
+        return -1;
+    return SysTransfer(buffer, size, id, TRUE, position);
+}
+
+int SysPRead(int buffer, int size, int position, OpenFileId id) {
+    if (position < 0)
+        return -1;
+    return SysTransfer(buffer, size, id, FALSE, position);
+}
+
+// Move data between the file "id", at its seek position, and each of
+// the "count" user buffers described by the IoVec array at virtual
+// address "vector", in order, all in one system call.  Stop early at
+// the end of the file, or at a bad address.  Return the number of
+// bytes moved, or -1 if nothing could be.
+int SysTransferV(int vector, int count, OpenFileId id, bool writing) {
+    int done = 0, moved;
+    unsigned int entry[2];  // the buffer's address and its size
+
+    for (int i = 0; i < count; i++) {
+        if (CopyFromUser(vector + i * sizeof(entry), (char *)entry, sizeof(entry)) < (int)sizeof(entry))
+            return (done > 0) ? done : -1;
+        int buffer = WordToHost(entry[0]), size = WordToHost(entry[1]);
+        if (size <= 0)
+            continue;
+        moved = SysTransfer(buffer, size, id, writing);
+        if (moved < 0)
+            return (done > 0) ? done : -1;
+        done += moved;
+        if (moved < size)
+            break;
+    }
+    return done;
+}
+
+int SysWriteV(int vector, int count, OpenFileId id) {
+    return SysTransferV(vector, count, id, TRUE);
+}
+
+int SysReadV(int vector, int count, OpenFileId id) {
+    return SysTransferV(vector, count, id, FALSE);
+}
+
+int SysSeek(int position, OpenFileId id) {
+    return kernel->FileSys()->SeekFile(position, id);
+}
+
+#ifndef FILESYS_STUB
+// Fill in the "count" DirEntry records at virtual address "buffer"
+// from the directory "id", a batch of entries at a time, each batch
+// copied out to the user with one CopyToUser.  Return the number of
+// records filled in, or -1 if none could be.
+#define ReadDirBatch 32  // directory entries read per batch
+
+int SysReadDir(int buffer, int count, OpenFileId id) {
+    DirectoryEntry entries[ReadDirBatch];
+    DirEntry records[ReadDirBatch];
+    int done = 0, wanted, found, bytes;
+
+    if (count < 0)
+        return -1;
+    while (done < count) {
+        wanted = min(count - done, ReadDirBatch);
+        found = kernel->FileSys()->ReadDirectory(entries, wanted, id);
+        if (found < 0)
+            return (done > 0) ? done : -1;
+
+        memset(records, 0, sizeof(records));
+        for (int i = 0; i < found; i++) {
+            records[i].isDir = WordToMachine(entries[i].isDir ? 1 : 0);
+            strncpy(records[i].name, entries[i].name, FileNameMaxLen);
+        }
+        bytes = found * sizeof(DirEntry);
+        if (CopyToUser((char *)records, buffer + done * sizeof(DirEntry), bytes) < bytes)
+            return (done > 0) ? done : -1;  // bad address
+        done += found;
+        if (found < wanted)
+            break;  // the end of the directory
+    }
+    return done;
+}
+
+int SysClone(char *from, char *to) {
+    // 1: success, 0: failed
+    return kernel->FileSys()->Clone(from, to);
+}
+
+int SysRename(char *from, char *to) {
+    // 1: success, 0: failed
+    return kernel->FileSys()->Rename(from, to);
+}
+
+// An IoRing, as the kernel sees it: the four counters come first, then
+// the submission slots, then the completion slots, all of them words.
+// (The user's IoRequest holds a pointer, so its size here is no guide.)
+#define IoRequestWords 6
+#define IoCompletionWords 2
+#define IoRequestBytes (IoRequestWords * 4)
+#define IoCompletionBytes (IoCompletionWords * 4)
+#define IoRingSq (4 * 4)
+#define IoRingCq (IoRingSq + IoRingEntries * IoRequestBytes)
+
+// Store in "sectors" (MaxFetch of them) the disk sectors the reads
+// among the "count" requests will need, working out where the plain
+// IoReads start from the seek positions at the time of the call and
+// the sizes of the requests before them.  A file closed by the batch
+// is not followed past the close.  Return the number of sectors.
+static int SubmitSectors(unsigned int request[][IoRequestWords], int count, int *sectors) {
+    int ids[IoRingEntries], seek[IoRingEntries];
+    int numIds = 0, found = 0, k, position;
+
+    for (int i = 0; i < count && found < MaxFetch; i++) {
+        int opcode = request[i][0], id = request[i][1];
+        int size = request[i][3];
+
+        if (opcode == IoOpen)
+            continue;
+        for (k = 0; k < numIds && ids[k] != id; k++)
+            ;
+        if (k == numIds && opcode != IoPRead && opcode != IoPWrite) {
+            ids[numIds] = id;
+            seek[numIds++] = kernel->FileSys()->TellFile(id);
+        }
+        if (opcode == IoClose) {
+            if (k < numIds)
+                seek[k] = -1;
+            continue;
+        }
+        if (opcode == IoRead || opcode == IoWrite) {
+            position = seek[k];
+            if (position >= 0 && size > 0)
+                seek[k] += size;
+        } else {
+            position = request[i][4];
+        }
+        if ((opcode == IoRead || opcode == IoPRead) && position >= 0 && size > 0)
+            found += kernel->FileSys()->MapFileAt(&sectors[found], MaxFetch - found,
+                                                   size, position, id);
+    }
+    return found;
+}
+
+// Take the requests queued on the IoRing at virtual address "ring",
+// up to the room left in its completion queue.  The sectors their
+// reads need are fetched first, all queued on the disk at once; each
+// request is then carried out in order, as its own system call would
+// be, and mostly served from the cache.  A completion is posted for
+// each, then the ring's sqHead and cqTail are moved past them.
+// Return the number of requests taken, or -1 for a bad ring.
+int SysSubmit(int ring) {
+    unsigned int counters[4];  // sqHead, sqTail, cqHead, cqTail
+    unsigned int request[IoRingEntries][IoRequestWords];
+    unsigned int completion[IoCompletionWords];
+    int sectors[MaxFetch];
+    char name[256];
+    int sqHead, cqTail, count, room, numSectors, result, i;
+
+    if (CopyFromUser(ring, (char *)counters, sizeof(counters)) < (int)sizeof(counters))
+        return -1;
+    for (i = 0; i < 4; i++)
+        counters[i] = WordToHost(counters[i]);
+    sqHead = counters[0];
+    cqTail = counters[3];
+    count = (int)(counters[1] - counters[0]);
+    room = IoRingEntries - (int)(counters[3] - counters[2]);
+    if (count < 0 || count > IoRingEntries || room < 0 || room > IoRingEntries)
+        return -1;
+    count = min(count, room);
+
+    for (i = 0; i < count; i++) {
+        int slot = (unsigned int)(sqHead + i) % IoRingEntries;
+        if (CopyFromUser(ring + IoRingSq + slot * IoRequestBytes, (char *)request[i],
+                         IoRequestBytes) < IoRequestBytes)
+            return -1;
+        for (int j = 0; j < IoRequestWords; j++)
+            request[i][j] = WordToHost(request[i][j]);
+    }
+
+    numSectors = SubmitSectors(request, count, sectors);
+    if (numSectors > 0)
+        kernel->Disk()->Fetch(sectors, numSectors);
+
+    for (i = 0; i < count; i++) {
+        int opcode = request[i][0], id = request[i][1];
+        int buffer = request[i][2], size = request[i][3], position = request[i][4];
+
+        switch (opcode) {
+            case IoOpen:
+                result = -1;  // for a bad or overlong name
+                if (CopyStringFromUser(buffer, name, sizeof(name)) >= 0)
+                    result = SysOpen(name);
+                break;
+            case IoClose:
+                result = SysClose(id);
+                break;
+            case IoRead:
+            case IoWrite:
+                result = SysTransfer(buffer, size, id, opcode == IoWrite);
+                break;
+            case IoPRead:
+            case IoPWrite:
+                result = (position < 0) ? -1 : SysTransfer(buffer, size, id, opcode == IoPWrite, position);
+                break;
+            default:
+                result = -1;
+                break;
+        }
+        int slot = (unsigned int)(cqTail + i) % IoRingEntries;
+        completion[0] = WordToMachine(request[i][5]);
+        completion[1] = WordToMachine(result);
+        if (CopyToUser((char *)completion, ring + IoRingCq + slot * IoCompletionBytes,
+                       IoCompletionBytes) < IoCompletionBytes)
+            break;  // the ring went bad under us: stop, and don't count this one
+    }
+    count = i;
+
+    counters[0] = WordToMachine(sqHead + count);
+    counters[3] = WordToMachine(cqTail + count);
+    CopyToUser((char *)&counters[0], ring, 4);
+    CopyToUser((char *)&counters[3], ring + 3 * 4, 4);
+    return count;
+}
+#endif
+
+// Process creation: the thread keeps the name, so it gets a copy
+int SysExec(char *name) {
+    char *copy = new char[strlen(name) + 1];
+
+    strcpy(copy, name);
+    return kernel->Exec(copy);
+}
+
+int SysFork() {
+    return kernel->Fork();
+}
+
+int SysJoin(int id) {
+    return kernel->Join(id);
+}
+
+// Copy the calling thread's resource accounting out to the
+// ProcessStats at virtual address "buffer"; 1, or -1 for a bad address.
+int SysGetStats(int buffer) {
+    Thread *thread = kernel->currentThread;
+    int stats[8];
+
+    stats[0] = WordToMachine(thread->userTicks);
+    stats[1] = WordToMachine(thread->systemTicks);
+    stats[2] = WordToMachine(thread->diskReads);
+    stats[3] = WordToMachine(thread->diskWrites);
+    stats[4] = WordToMachine(thread->bytesRead);
+    stats[5] = WordToMachine(thread->bytesWritten);
+    stats[6] = WordToMachine(thread->pageFaults);
+    stats[7] = WordToMachine(thread->contextSwitches);
+    if (CopyToUser((char *)stats, buffer, sizeof(stats)) < (int)sizeof(stats))
+        return -1;
+    return 1;
+}
+
+void SysExit(int status) {
+    kernel->ExitProcess(status);
+    kernel->currentThread->Finish();
+}
+// MP4 end
+
 #endif /* ! __USERPROG_KSYSCALL_H__ */
@@ -8,6 +8,7 @@
 
 #include "copyright.h"
 #include "synchconsole.h"
+#include "main.h"
 
 //----------------------------------------------------------------------
 // SynchConsoleInput::SynchConsoleInput
@@ -22,6 +23,8 @@ SynchConsoleInput::SynchConsoleInput(char *inputFile)
     consoleInput = new ConsoleInput(inputFile, this);
     lock = new Lock("console in");
     waitFor = new Semaphore("console in", 0);
+    head = count = 0;			// MP4
+    stalled = atEnd = waiting = FALSE;
 }
 
 //----------------------------------------------------------------------
@@ -46,23 +49,147 @@ SynchConsoleInput::GetChar()
 {
     char ch;
 
+    if (ReadBuffer(&ch, 1) == 0)	// MP4
+	return EOF;
+    return ch;
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// SynchConsoleInput::ReadBuffer
+//      Read up to "size" characters typed at the keyboard.  Keystrokes
+//	are collected into the kernel ring buffer as they arrive, so this
+//	only waits if none have been typed ahead; otherwise it returns
+//	at once with as many as are buffered.
+//
+//	Returns the number of characters read, 0 at end of input.
+//----------------------------------------------------------------------
+
+int
+SynchConsoleInput::ReadBuffer(char *data, int size)
+{
+    IntStatus oldLevel;
+    int n;
+
     lock->Acquire();
-    waitFor->P();	// wait for EOF or a char to be available.
-    ch = consoleInput->GetChar();
+    oldLevel = kernel->interrupt->SetLevel(IntOff);  // the handler shares "ring"
+    while (count == 0 && !atEnd) {
+	waiting = TRUE;
+	waitFor->P();
+    }
+    n = Take(data, size);
+    (void) kernel->interrupt->SetLevel(oldLevel);
     lock->Release();
-    return ch;
+    return n;
+}
+
+//----------------------------------------------------------------------
+// SynchConsoleInput::GetLine
+//      Read characters up to and including a newline, or until "size"-1
+//	characters or the end of input, and null-terminate them.  Whatever
+//	was typed ahead is taken in one step, so the reader waits once per
+//	burst of keystrokes rather than once per character.
+//
+//	Returns the length of the line.
+//----------------------------------------------------------------------
+
+int
+SynchConsoleInput::GetLine(char *data, int size)
+{
+    IntStatus oldLevel;
+    int done = 0;
+
+    ASSERT(size > 0);
+    lock->Acquire();
+    oldLevel = kernel->interrupt->SetLevel(IntOff);
+    while (done < size - 1 && (done == 0 || data[done - 1] != '\n')) {
+	if (count == 0) {
+	    if (atEnd)
+		break;
+	    waiting = TRUE;
+	    waitFor->P();
+	    continue;
+	}
+	// take the buffered keystrokes up to the first newline
+	while (count > 0 && done < size - 1) {
+	    Take(&data[done], 1);
+	    if (data[done++] == '\n')
+		break;
+	}
+    }
+    data[done] = '\0';
+    (void) kernel->interrupt->SetLevel(oldLevel);
+    lock->Release();
+    return done;
 }
 
+//----------------------------------------------------------------------
+// SynchConsoleInput::Take
+//      Move up to "size" buffered keystrokes into "data", then pick up
+//	the keystroke held in the device if the ring had been full.
+//	Called with interrupts disabled.  Returns how many were moved.
+//----------------------------------------------------------------------
+
+int
+SynchConsoleInput::Take(char *data, int size)
+{
+    int n = 0;
+
+    while (n < size && count > 0) {
+	data[n++] = ring[head];
+	head = (head + 1) % ConsoleBufferSize;
+	count--;
+    }
+    if (stalled && count < ConsoleBufferSize) {
+	stalled = FALSE;
+	Fill();
+    }
+    return n;
+}
+
+//----------------------------------------------------------------------
+// SynchConsoleInput::Fill
+//      Move the device's pending keystroke into the ring.  The device
+//	only starts polling for the next one once this one is taken.
+//	Called with interrupts disabled, and only when there is room.
+//----------------------------------------------------------------------
+
+void
+SynchConsoleInput::Fill()
+{
+    char ch = consoleInput->GetChar();
+
+    ASSERT(count < ConsoleBufferSize);
+    if (ch == EOF) {
+	atEnd = TRUE;		// the device stops polling
+	return;
+    }
+    ring[(head + count) % ConsoleBufferSize] = ch;
+    count++;
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // SynchConsoleInput::CallBack
 //      Interrupt handler called when keystroke is hit; wake up
-//	anyone waiting.
+//	anyone waiting.  MP4: buffer the keystroke right away, unless
+//	the ring is full, in which case it waits in the device until
+//	the reader makes room.
 //----------------------------------------------------------------------
 
 void
 SynchConsoleInput::CallBack()
 {
-    waitFor->V();
+    // MP4 start
+    if (count == ConsoleBufferSize)
+	stalled = TRUE;
+    else
+	Fill();
+    if (waiting) {
+	waiting = FALSE;
+	waitFor->V(TRUE);	// I/O done
+    }
+    // MP4 end
 }
 
 //----------------------------------------------------------------------
@@ -78,6 +205,8 @@ SynchConsoleOutput::SynchConsoleOutput(char *outputFile)
     consoleOutput = new ConsoleOutput(outputFile, this);
     lock = new Lock("console out");
     waitFor = new Semaphore("console out", 0);
+    head = count = inFlight = 0;	// MP4
+    waiting = FALSE;
 }
 
 //----------------------------------------------------------------------
@@ -100,20 +229,89 @@ SynchConsoleOutput::~SynchConsoleOutput()
 void
 SynchConsoleOutput::PutChar(char ch)
 {
+    PutBuffer(&ch, 1);		// MP4
+}
+
+// MP4 start
+//----------------------------------------------------------------------
+// SynchConsoleOutput::PutBuffer
+//      Write "size" characters to the console display, waiting until
+//	they have all been displayed.
+//
+//	The characters are copied into the kernel ring buffer, which the
+//	interrupt handler drains to the display a contiguous chunk at
+//	a time.  The writer only blocks when the ring is full, and once
+//	at the end for the last chunk, so a line of output costs one
+//	wait instead of one per character.
+//----------------------------------------------------------------------
+
+void
+SynchConsoleOutput::PutBuffer(char *data, int size)
+{
+    IntStatus oldLevel;
+    int n, tail;
+
     lock->Acquire();
-    consoleOutput->PutChar(ch);
-    waitFor->P();
+    oldLevel = kernel->interrupt->SetLevel(IntOff);  // the handler shares "ring"
+    while (size > 0) {
+	while (count == ConsoleBufferSize) {
+	    waiting = TRUE;
+	    waitFor->P();
+	}
+	tail = (head + count) % ConsoleBufferSize;
+	n = min(size, ConsoleBufferSize - count);
+	n = min(n, ConsoleBufferSize - tail);	// up to the wrap point
+	bcopy(data, &ring[tail], n);
+	count += n;
+	data += n;
+	size -= n;
+	if (inFlight == 0)
+	    Drain();
+    }
+    while (count > 0) {
+	waiting = TRUE;
+	waitFor->P();
+    }
+    (void) kernel->interrupt->SetLevel(oldLevel);
     lock->Release();
 }
 
+//----------------------------------------------------------------------
+// SynchConsoleOutput::Drain
+//      Start the display on everything buffered from "head" up to the
+//	end of the ring.  Called with interrupts disabled, and only when
+//	the display is idle.
+//----------------------------------------------------------------------
+
+void
+SynchConsoleOutput::Drain()
+{
+    ASSERT(inFlight == 0 && count > 0);
+    inFlight = min(count, ConsoleBufferSize - head);
+    consoleOutput->PutBuffer(&ring[head], inFlight);
+}
+// MP4 end
+
 //----------------------------------------------------------------------
 // SynchConsoleOutput::CallBack
 //      Interrupt handler called when it's safe to send the next 
-//	character can be sent to the display.
+//	character can be sent to the display.  MP4: retire the chunk
+//	just written, start the next one, and wake the writer if it
+//	is waiting for room or for the ring to empty.
 //----------------------------------------------------------------------
 
 void
 SynchConsoleOutput::CallBack()
 {
-    waitFor->V();
+    // MP4 start
+    head = (head + inFlight) % ConsoleBufferSize;
+    count -= inFlight;
+    inFlight = 0;
+    if (count > 0)
+	Drain();
+    if (waiting) {
+	waiting = FALSE;
+	waitFor->V(TRUE);	// I/O done
+    }
+    // MP4 end
 }
@@ -20,6 +20,9 @@
 // The following two classes define synchronized input and output to
 // a console device
 
+// MP4: size of the kernel ring buffers between the console and its users
+#define ConsoleBufferSize 128
+
 class SynchConsoleInput : public CallBackObj {
   public:
     SynchConsoleInput(char *inputFile); // Initialize the console device
@@ -28,12 +31,28 @@ class SynchConsoleInput : public CallBackObj {
 	void Disable() { consoleInput->Disable(); }// 2015.11.25
 
     char GetChar();		// Read a character, waiting if necessary
+    int ReadBuffer(char *data, int size); // MP4: read whatever is typed
+				// ahead, waiting only if nothing is
+    int GetLine(char *data, int size); // MP4: read up to a newline
     
   private:
     ConsoleInput *consoleInput;	// the hardware keyboard
     Lock *lock;			// only one reader at a time
     Semaphore *waitFor;		// wait for callBack
 
+    // MP4 start
+    char ring[ConsoleBufferSize]; // keystrokes not yet read
+    int head;			// oldest keystroke in "ring"
+    int count;			// keystrokes in "ring"
+    bool stalled;		// is a keystroke held in the device because
+				// "ring" was full?
+    bool atEnd;			// has the input reached end of file?
+    bool waiting;		// is the reader blocked on "waitFor"?
+
+    void Fill();		// move the device's keystroke into "ring"
+    int Take(char *data, int size); // move keystrokes out of "ring"
+    // MP4 end
+
     void CallBack();		// called when a keystroke is available
 };
 
@@ -43,12 +62,24 @@ class SynchConsoleOutput : public CallBackObj {
     ~SynchConsoleOutput();
 
     void PutChar(char ch);	// Write a character, waiting if necessary
+    void PutBuffer(char *data, int size); // MP4: write "size" characters,
+				// waiting until they are all displayed
    
   private:
     ConsoleOutput *consoleOutput;// the hardware display
     Lock *lock;			// only one writer at a time
     Semaphore *waitFor;		// wait for callBack
 
+    // MP4 start
+    char ring[ConsoleBufferSize]; // characters not yet displayed
+    int head;			// oldest character in "ring"
+    int count;			// characters in "ring"
+    int inFlight;		// of those, how many the display is writing
+    bool waiting;		// is the writer blocked on "waitFor"?
+
+    void Drain();		// hand the next chunk of "ring" to the display
+    // MP4 end
+
     void CallBack();		// called when more data can be written
 };
 
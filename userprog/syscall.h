@@ -34,6 +34,20 @@
 #define SC_ExecV 13
 #define SC_ThreadExit 14
 #define SC_ThreadJoin 15
+#define SC_Fork 16
+#define SC_Mmap 17
+#define SC_Munmap 18
+#define SC_PRead 19
+#define SC_PWrite 20
+#define SC_ReadV 21
+#define SC_WriteV 22
+#define SC_Sync 23
+#define SC_Fsync 24
+#define SC_ReadDir 25
+#define SC_Clone 26
+#define SC_Rename 27
+#define SC_Submit 28
+#define SC_GetStats 29
 #define SC_Add 42
 #define SC_MSG 100
 
@@ -89,6 +103,31 @@ SpaceId ExecV(int argc, char *argv[]);
  */
 int Join(SpaceId id);
 
+/* Make a copy of this user program, which starts running as though it
+ * had just returned from Fork too.  Return the copy's identifier to the
+ * program and 0 to the copy, or -1 if no copy could be made.  The two
+ * share their memory until either one writes to it.
+ */
+SpaceId Fork();
+
+/* What the calling program has used so far, as GetStats reports it. */
+typedef struct {
+    int userTicks;        /* running its own instructions */
+    int systemTicks;      /* in the kernel, on its behalf */
+    int diskReads;        /* disk requests made for it */
+    int diskWrites;
+    int bytesRead;        /* through Read, PRead, ReadV and Submit */
+    int bytesWritten;
+    int pageFaults;       /* of its address space */
+    int contextSwitches;  /* times it gave up the CPU, or lost it */
+} ProcessStats;
+
+/* Fill in "stats" for the calling program.  The same figures, and what
+ * it moved to and from each file it opened, are printed when it exits.
+ * Return 1 on success, -1 if "stats" is a bad address.
+ */
+int GetStats(ProcessStats *stats);
+
 /* File system operations: Create, Remove, Open, Read, Write, Close
  * These functions are patterned after UNIX -- files represent
  * both files *and* hardware I/O devices.
@@ -141,14 +180,135 @@ int Read(char *buffer, int size, OpenFileId id);
 
 /* Set the seek position of the open file "id"
  * to the byte "position".
+ * Return 1 on success, negative error code on failure
  */
 int Seek(int position, OpenFileId id);
 
+/* Like Write and Read, but at the byte "position" of the file, whatever
+ * its seek position is; that is left unchanged.
+ */
+int PWrite(char *buffer, int size, int position, OpenFileId id);
+int PRead(char *buffer, int size, int position, OpenFileId id);
+
+/* One buffer of a WriteV or ReadV. */
+typedef struct {
+    char *buffer;
+    int size;
+} IoVec;
+
+/* Like Write and Read, but with each of the "count" buffers in "vector"
+ * in turn, in a single system call.  Return the total number of bytes
+ * written or read, which is short, as for Read, at the end of the file.
+ */
+int WriteV(IoVec *vector, int count, OpenFileId id);
+int ReadV(IoVec *vector, int count, OpenFileId id);
+
+/* Writes only reach the disk cache, which is written back to the disk
+ * in the background.  Sync returns once everything written so far is
+ * on the disk; Fsync once what was written to the open file "id" is.
+ * Return 1 on success, negative error code on failure
+ */
+int Sync();
+int Fsync(OpenFileId id);
+
+/* One file of a directory, as returned by ReadDir. */
+typedef struct {
+    int isDir;      /* 1 for a directory, 0 for a file */
+    char name[12];  /* null-terminated; at most 9 characters */
+} DirEntry;
+
+/* Read the files of the directory open as "id", from its seek position
+ * on, into the "count" DirEntry records at "buffer", in a single system
+ * call; the next ReadDir carries on where this one stopped.
+ * Return the number of records filled in, 0 at the end of the
+ * directory, or a negative error code if "id" is not a directory.
+ */
+int ReadDir(DirEntry *buffer, int count, OpenFileId id);
+
+/* Create the file "to" as a copy of the file "from", without copying
+ * any data: the two share their disk sectors, and a sector is only
+ * copied when one of them writes to it.
+ * Return 1 on success, 0 on failure
+ */
+int Clone(char *from, char *to);
+
+/* Give the file or directory "from" the new name "to", which may be in
+ * another directory; an existing file "to" is replaced.  No data moves,
+ * and after a crash the file has one of the two names, never neither.
+ * Return 1 on success, 0 on failure
+ */
+int Rename(char *from, char *to);
+
+/* Operations that can be queued on an IoRing; each does what the system
+ * call of the same name would, and its result is what that would return.
+ */
+#define IoOpen 0    /* "buffer" is the name of the file */
+#define IoClose 1
+#define IoRead 2
+#define IoWrite 3
+#define IoPRead 4   /* at "position", like PRead */
+#define IoPWrite 5  /* at "position", like PWrite */
+
+#define IoRingEntries 32  /* slots in each queue of an IoRing */
+
+/* One queued operation. */
+typedef struct {
+    int opcode;    /* one of the Io operations above */
+    int id;        /* the open file, except for IoOpen */
+    char *buffer;  /* the data, or the name for IoOpen */
+    int size;      /* bytes to read or write */
+    int position;  /* for IoPRead and IoPWrite */
+    int tag;       /* anything; handed back in the completion */
+} IoRequest;
+
+/* The outcome of one operation. */
+typedef struct {
+    int tag;     /* the request's tag */
+    int result;  /* what the system call would have returned */
+} IoCompletion;
+
+/* A submission queue of requests the program fills in, and a completion
+ * queue the kernel fills in.  The four counters only ever grow; entry
+ * "n" of a queue lives in slot n % IoRingEntries.  The program adds
+ * requests at sqTail and takes completions from cqHead; the kernel
+ * advances sqHead and cqTail.
+ */
+typedef struct {
+    int sqHead;
+    int sqTail;
+    int cqHead;
+    int cqTail;
+    IoRequest sq[IoRingEntries];
+    IoCompletion cq[IoRingEntries];
+} IoRing;
+
+/* Carry out the requests queued on "ring", in order, in a single system
+ * call, posting a completion for each; stop early if the completion
+ * queue fills up.  The data the reads need is fetched from the disk
+ * together before any request runs.
+ * Return the number of requests taken, or -1 if "ring" is a bad address
+ * or its counters make no sense.
+ */
+int Submit(IoRing *ring);
+
 /* Close the file, we're done reading and writing to it.
  * Return 1 on success, negative error code on failure
  */
 int Close(OpenFileId id);
 
+/* Map "length" bytes of the open file "id", starting at byte "offset",
+ * into this program's memory, and return the address of the first byte.
+ * The file is read a page at a time as the memory is touched; what the
+ * program writes there goes back to the file at the latest when it is
+ * unmapped, or the file is closed.  Return -1 on failure.
+ */
+int Mmap(OpenFileId id, int offset, int length);
+
+/* Unmap the memory Mmap returned "address" for, writing it back to the
+ * file.  Return 1 on success, -1 if nothing is mapped there.
+ */
+int Munmap(int address);
+
 /* User-level thread operations: Fork and Yield.  To allow multiple
  * threads to run within a user program.
  *